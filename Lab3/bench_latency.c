@@ -0,0 +1,643 @@
+/*
+ * bench_latency.c
+ *
+ * Generador de carga y benchmark de latencia para los tres brokers.
+ * - Abre P publishers y S subscribers contra broker_tcp, broker_udp o
+ *   broker_quic. El subscriber i se suscribe al tema "bench<i % T>" y cada
+ *   publisher reparte sus mensajes entre los T temas.
+ * - Todo viaja con el protocolo binario: el payload empieza con el instante
+ *   de publicación (CLOCK_MONOTONIC en ns), el id del publisher y su número
+ *   de secuencia, y se rellena hasta el tamaño pedido.
+ * - Al recibir, cada subscriber calcula la latencia de extremo a extremo y
+ *   la registra en un histograma (histogram.h). Al final se reportan el
+ *   throughput, la pérdida y los percentiles p50/p99/p99.9.
+ * - Con un ritmo fijo (--rate, total de publicaciones por segundo) el
+ *   instante que viaja en el payload es el que le tocaba al mensaje según el
+ *   calendario, no el del send(): si el publisher se atrasa porque el broker
+ *   lo frena, esa espera también cuenta como latencia (sin "coordinated
+ *   omission"). Con --rate 0 publica sin límite.
+ * - Publishers y subscribers corren en la misma máquina que el broker, así
+ *   que los relojes coinciden.
+ * - El relleno del payload es texto con forma de update de un partido
+ *   (campos repetidos, valores que cambian), no un solo byte repetido, para
+ *   que medir con --codec lz4 (broker_tcp con --compress) sea realista.
+ *   Se reportan los bytes recibidos por entrega, el CPU del hilo receptor
+ *   (que descomprime) y, con --broker-pid, el CPU del broker por mensaje.
+ *
+ * Compilar (dentro de Lab3, QUIC solo si MsQuic está instalado):
+ *   gcc -O2 bench_latency.c protocol.c histogram.c lz_codec.c -o bench_latency -lpthread
+ *   gcc -O2 -DHAVE_MSQUIC bench_latency.c protocol.c histogram.c lz_codec.c -o bench_latency -lmsquic -lpthread
+ * Ejecutar (con el broker corriendo y su salida redirigida a /dev/null):
+ *   ./bench_latency <tcp|udp|quic> <broker_ip> <broker_port> [--pubs N] [--subs N]
+ *                   [--topics N] [--bytes N] [--rate N] [--seconds N]
+ *                   [--codec none|lz4] [--broker-pid PID]
+ * Ejemplo:
+ *   ./broker_tcp > /dev/null &
+ *   ./bench_latency tcp 127.0.0.1 5000 --pubs 2 --subs 8 --topics 4 --bytes 128 --rate 20000
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#ifdef HAVE_MSQUIC
+#include <msquic.h>
+#endif
+#include "protocol.h"
+#include "histogram.h"
+#include "lz_codec.h"
+
+#define MAX_PUBS 64
+#define MAX_SUBS 1024
+#define MAX_TOPICS 1024
+#define MAX_PAYLOAD 8192
+#define RCVBUF (4 * 1024 * 1024)
+#define RX_SIZE (2 * PROTO_MAX_FRAME)
+#define HEARTBEAT_NS (5 * 1000000000ull)
+#define UPDATE_VARIANTS 256
+
+/* Lo que cada mensaje lleva al comienzo del payload (orden del host: el
+   benchmark se lee a sí mismo) */
+typedef struct {
+    uint64_t stamp_ns;
+    uint32_t publisher;
+    uint32_t seq;
+} Stamp;
+
+typedef enum { TRANSPORT_TCP, TRANSPORT_UDP, TRANSPORT_QUIC } Transport;
+
+typedef struct {
+    int fd;                /* TCP/UDP */
+    char *rx;              /* frames TCP/QUIC incompletos */
+    size_t rx_len;
+    Histogram hist;        /* solo lo toca el hilo (o stream) que recibe */
+    unsigned long long received;
+    unsigned long long wire_bytes;  /* todo lo recibido, con cabeceras */
+    char *dict;            /* diccionario del tema (--codec lz4) */
+    uint32_t dict_len;
+#ifdef HAVE_MSQUIC
+    HQUIC conn;
+    HQUIC stream;
+#endif
+} Sub;
+
+typedef struct {
+    uint32_t id;
+    unsigned long long sent;
+    unsigned long long per_topic[MAX_TOPICS];
+} Pub;
+
+static Transport transport;
+static struct sockaddr_in broker;
+static const char *broker_host;
+static volatile int running = 1;      /* los publishers siguen publicando */
+static volatile int receiving = 1;    /* el hilo receptor sigue leyendo */
+static double seconds = 5;
+static int num_pubs = 1, num_subs = 4, num_topics = 1;
+static int payload_size = 64;
+static double rate;            /* total de publicaciones por segundo, 0 = sin límite */
+static int lz4;                /* los subscribers piden compresión */
+static int broker_pid;         /* 0 = no se mide el CPU del broker */
+static uint64_t recv_cpu_ns;   /* CPU del hilo receptor (TCP/UDP) */
+static char updates[UPDATE_VARIANTS][MAX_PAYLOAD];
+static uint64_t run_start;     /* lo publicado antes (retenido por el broker) no se mide */
+static Sub subs[MAX_SUBS];
+static Pub pubs[MAX_PUBS];
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Relleno de texto: eventos de un partido con campos fijos y valores al azar */
+static void build_updates(void) {
+    static const char *events[] = { "gol", "tiro de esquina", "tarjeta amarilla", "cambio", "falta",
+                                    "fuera de juego", "tiro libre", "atajada" };
+    static const char *roles[] = { "delantero", "lateral", "volante", "defensor" };
+    unsigned seed = 1;
+    for (int v = 0; v < UPDATE_VARIANTS; v++) {
+        char *p = updates[v];
+        size_t len = 0;
+        while (len < MAX_PAYLOAD) {
+            int n = snprintf(p + len, MAX_PAYLOAD - len,
+                             "{\"minuto\":%u,\"evento\":\"%s\",\"equipo\":\"%s\",\"jugador\":\"dorsal %u\","
+                             "\"marcador\":\"%u-%u\",\"posesion\":%u,\"comentario\":\"el %s llega por la "
+                             "banda y el arquero controla\"}\n",
+                             rand_r(&seed) % 90, events[rand_r(&seed) % 8], rand_r(&seed) % 2 ? "local" : "visitante",
+                             1 + rand_r(&seed) % 23, rand_r(&seed) % 5, rand_r(&seed) % 5, 30 + rand_r(&seed) % 40,
+                             roles[rand_r(&seed) % 4]);
+            if (n < 0 || (size_t)n >= MAX_PAYLOAD - len) break;
+            len += (size_t)n;
+        }
+        memset(p + len, ' ', MAX_PAYLOAD - len);
+    }
+}
+
+/* utime + stime de un proceso, en ns (campos 14 y 15 de /proc/PID/stat) */
+static uint64_t process_cpu_ns(int pid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    /* El nombre del proceso va entre paréntesis y puede tener espacios */
+    char *p = strrchr(buf, ')');
+    unsigned long long utime, stime;
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+        return 0;
+    return (utime + stime) * (1000000000ull / (uint64_t)sysconf(_SC_CLK_TCK));
+}
+
+static void sleep_until(uint64_t due) {
+    struct timespec ts = { (time_t)(due / 1000000000ull), (long)(due % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {}
+}
+
+/* Arma "PUBLISH bench<t>" binario con el nombre del tema; devuelve el largo */
+static size_t build_publish(char *out, int topic, uint64_t stamp, uint32_t pub, uint32_t seq) {
+    char name[32];
+    int name_len = snprintf(name, sizeof(name), "bench%d", topic);
+    proto_write_bin_header(out, BIN_OP_PUBLISH, 0, (uint32_t)name_len, (uint32_t)payload_size);
+    memcpy(out + PROTO_BIN_HEADER, name, (size_t)name_len);
+    Stamp s = { stamp, pub, seq };
+    char *payload = out + PROTO_BIN_HEADER + name_len;
+    memcpy(payload, &s, sizeof(s));
+    memcpy(payload + sizeof(s), updates[seq % UPDATE_VARIANTS], (size_t)payload_size - sizeof(s));
+    return PROTO_BIN_HEADER + (size_t)name_len + (size_t)payload_size;
+}
+
+static size_t build_subscribe(char *out, int topic) {
+    char name[32];
+    int name_len = snprintf(name, sizeof(name), "bench%d", topic);
+    proto_write_bin_header(out, BIN_OP_SUBSCRIBE, lz4 ? BIN_FLAG_LZ4 : 0, (uint32_t)name_len, 0);
+    memcpy(out + PROTO_BIN_HEADER, name, (size_t)name_len);
+    return PROTO_BIN_HEADER + (size_t)name_len;
+}
+
+/* Registra la latencia de un BIN_OP_MESSAGE (descomprimido si hace falta);
+   de los demás frames solo importa el diccionario */
+static void on_frame(Sub *sub, const Frame *frame, uint64_t now) {
+    static __thread char raw[PROTO_MAX_FRAME];
+    if (frame->kind != FRAME_BINARY) return;
+    const char *payload = frame->body.data + frame->body.len - frame->header.length;
+    size_t len = frame->header.length;
+    if (frame->header.opcode == BIN_OP_DICT) {
+        char *dict = malloc(len ? len : 1);
+        if (dict == NULL) return;
+        memcpy(dict, payload, len);
+        free(sub->dict);
+        sub->dict = dict;
+        sub->dict_len = (uint32_t)len;
+        return;
+    }
+    if (frame->header.opcode != BIN_OP_MESSAGE) return;
+    if (frame->header.flags & BIN_FLAG_LZ4) {
+        if (len < PROTO_LZ4_LEN) return;
+        int n = lz_decompress(sub->dict, sub->dict_len, payload + PROTO_LZ4_LEN, len - PROTO_LZ4_LEN,
+                              raw, sizeof(raw));
+        if (n < 0) return;
+        payload = raw;
+        len = (size_t)n;
+    }
+    if (len < sizeof(Stamp)) return;
+    Stamp s;
+    memcpy(&s, payload, sizeof(s));
+    if (s.stamp_ns < run_start) return;
+    hist_record(&sub->hist, now > s.stamp_ns ? now - s.stamp_ns : 0);
+    sub->received++;
+}
+
+/* Agrega bytes de un stream (TCP o QUIC) y procesa los frames completos */
+static int on_stream_bytes(Sub *sub, const char *data, size_t len) {
+    uint64_t now = now_ns();
+    while (len > 0) {
+        size_t copy = RX_SIZE - sub->rx_len;
+        if (copy > len) copy = len;
+        memcpy(sub->rx + sub->rx_len, data, copy);
+        sub->rx_len += copy;
+        data += copy;
+        len -= copy;
+
+        size_t off = 0, used;
+        Frame frame;
+        int r;
+        while ((r = proto_next_frame(sub->rx + off, sub->rx_len - off, &frame, &used)) == 1) {
+            on_frame(sub, &frame, now);
+            off += used;
+        }
+        if (r < 0) return -1;
+        memmove(sub->rx, sub->rx + off, sub->rx_len - off);
+        sub->rx_len -= off;
+    }
+    return 0;
+}
+
+/* --- TCP / UDP --- */
+
+static int open_socket(void) {
+    int fd = socket(AF_INET, transport == TRANSPORT_TCP ? SOCK_STREAM : SOCK_DGRAM, 0);
+    if (fd < 0) return -1;
+    if (transport == TRANSPORT_TCP) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    int size = RCVBUF;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (connect(fd, (struct sockaddr *)&broker, sizeof(broker)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            /* UDP: el kernel descartó el datagrama, cuenta como pérdida */
+            if (transport == TRANSPORT_UDP && (errno == ENOBUFS || errno == ECONNREFUSED)) return 0;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int sub_open_socket(Sub *sub, int topic) {
+    char frame[64];
+    sub->fd = open_socket();
+    if (sub->fd < 0) return -1;
+    size_t len = 0;
+    if (transport == TRANSPORT_TCP) {
+        /* HELLO y SUBSCRIBE van juntos: el broker los procesa en orden */
+        proto_write_bin_header(frame, BIN_OP_HELLO, 0, 0, 0);
+        len = PROTO_BIN_HEADER;
+    }
+    len += build_subscribe(frame + len, topic);
+    return send_all(sub->fd, frame, len);
+}
+
+/* Recibe en todos los subscribers hasta que se acabe el tiempo */
+static void *receiver_main(void *arg) {
+    (void)arg;
+    static struct pollfd pfds[MAX_SUBS];
+    static char dgram[PROTO_MAX_FRAME];
+    for (int i = 0; i < num_subs; i++) {
+        pfds[i].fd = subs[i].fd;
+        pfds[i].events = POLLIN;
+    }
+    uint64_t next_heartbeat = now_ns() + HEARTBEAT_NS;
+    struct timespec cpu0, cpu1;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu0);
+    while (receiving) {
+        /* UDP: sin señales el broker da de baja al subscriber (--sub-ttl) */
+        if (transport == TRANSPORT_UDP && now_ns() >= next_heartbeat) {
+            char hb[PROTO_BIN_HEADER];
+            proto_write_bin_header(hb, BIN_OP_HEARTBEAT, 0, 0, 0);
+            for (int i = 0; i < num_subs; i++) send_all(subs[i].fd, hb, sizeof(hb));
+            next_heartbeat += HEARTBEAT_NS;
+        }
+        if (poll(pfds, (nfds_t)num_subs, 100) <= 0) continue;
+        for (int i = 0; i < num_subs; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            Sub *sub = &subs[i];
+            if (transport == TRANSPORT_UDP) {
+                ssize_t n;
+                while ((n = recv(sub->fd, dgram, sizeof(dgram), MSG_DONTWAIT)) > 0) {
+                    Frame frame;
+                    sub->wire_bytes += (unsigned long long)n;
+                    if (proto_datagram_frame(dgram, (size_t)n, &frame) == 0)
+                        on_frame(sub, &frame, now_ns());
+                }
+            } else {
+                ssize_t n = recv(sub->fd, dgram, sizeof(dgram), MSG_DONTWAIT);
+                if (n > 0) sub->wire_bytes += (unsigned long long)n;
+                if (n == 0 || (n > 0 && on_stream_bytes(sub, dgram, (size_t)n) < 0)) {
+                    fprintf(stderr, "Subscriber %d: el broker cerró la conexión\n", i);
+                    pfds[i].fd = -1;
+                }
+            }
+        }
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu1);
+    recv_cpu_ns = (uint64_t)(cpu1.tv_sec - cpu0.tv_sec) * 1000000000ull + (uint64_t)cpu1.tv_nsec - (uint64_t)cpu0.tv_nsec;
+    return NULL;
+}
+
+/* --- QUIC --- */
+
+#ifdef HAVE_MSQUIC
+static const QUIC_API_TABLE *MsQuic = NULL;
+static HQUIC Registration = NULL;
+static HQUIC Configuration = NULL;
+
+/* Los envíos de QUIC se liberan en SEND_COMPLETE */
+typedef struct {
+    QUIC_BUFFER buf;
+    char data[];
+} QuicSend;
+
+static QUIC_STATUS QUIC_API SubStreamCallback(HQUIC Stream, void *Context, QUIC_STREAM_EVENT *Event) {
+    (void)Stream;
+    Sub *sub = Context;
+    switch (Event->Type) {
+        case QUIC_STREAM_EVENT_RECEIVE:
+            for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; i++) {
+                sub->wire_bytes += Event->RECEIVE.Buffers[i].Length;
+                on_stream_bytes(sub, (const char *)Event->RECEIVE.Buffers[i].Buffer, Event->RECEIVE.Buffers[i].Length);
+            }
+            return QUIC_STATUS_SUCCESS;
+        case QUIC_STREAM_EVENT_SEND_COMPLETE:
+            free(Event->SEND_COMPLETE.ClientContext);
+            return QUIC_STATUS_SUCCESS;
+        default:
+            return QUIC_STATUS_SUCCESS;
+    }
+}
+
+static QUIC_STATUS QUIC_API PubStreamCallback(HQUIC Stream, void *Context, QUIC_STREAM_EVENT *Event) {
+    (void)Stream;
+    (void)Context;
+    if (Event->Type == QUIC_STREAM_EVENT_SEND_COMPLETE) free(Event->SEND_COMPLETE.ClientContext);
+    return QUIC_STATUS_SUCCESS;
+}
+
+static QUIC_STATUS QUIC_API ConnectionCallback(HQUIC Connection, void *Context, QUIC_CONNECTION_EVENT *Event) {
+    (void)Connection;
+    (void)Context;
+    (void)Event;
+    return QUIC_STATUS_SUCCESS;
+}
+
+static int quic_init(void) {
+    if (MsQuicOpen2(&MsQuic) != QUIC_STATUS_SUCCESS) return -1;
+    QUIC_REGISTRATION_CONFIG regConfig = { "bench-latency", QUIC_EXECUTION_PROFILE_LOW_LATENCY };
+    if (MsQuic->RegistrationOpen(&regConfig, &Registration) != QUIC_STATUS_SUCCESS) return -1;
+
+    const char *alpn = "pubsub";
+    QUIC_BUFFER alpnBuffer = { (uint32_t)strlen(alpn), (uint8_t *)alpn };
+    QUIC_SETTINGS settings; memset(&settings, 0, sizeof(settings));
+    if (MsQuic->ConfigurationOpen(Registration, &alpnBuffer, 1, &settings, sizeof(settings), NULL, &Configuration) != QUIC_STATUS_SUCCESS) return -1;
+
+    QUIC_CREDENTIAL_CONFIG cred = {0};
+    cred.Type = QUIC_CREDENTIAL_TYPE_NONE;
+    cred.Flags = QUIC_CREDENTIAL_FLAG_CLIENT | QUIC_CREDENTIAL_FLAG_NO_CERTIFICATE_VALIDATION;
+    if (MsQuic->ConfigurationLoadCredential(Configuration, &cred) != QUIC_STATUS_SUCCESS) return -1;
+    return 0;
+}
+
+static HQUIC quic_open_stream(HQUIC *conn, void *handler, void *ctx) {
+    HQUIC stream = NULL;
+    uint16_t port = ntohs(broker.sin_port);
+    if (MsQuic->ConnectionOpen(Registration, ConnectionCallback, NULL, conn) != QUIC_STATUS_SUCCESS) return NULL;
+    if (MsQuic->ConnectionStart(*conn, Configuration, QUIC_ADDRESS_FAMILY_UNSPEC, broker_host, port) != QUIC_STATUS_SUCCESS) return NULL;
+    if (MsQuic->StreamOpen(*conn, QUIC_STREAM_OPEN_FLAG_NONE, handler, ctx, &stream) != QUIC_STATUS_SUCCESS) return NULL;
+    if (MsQuic->StreamStart(stream, QUIC_STREAM_START_FLAG_IMMEDIATE) != QUIC_STATUS_SUCCESS) return NULL;
+    return stream;
+}
+
+/* Copia el frame a memoria propia: MsQuic lo usa hasta SEND_COMPLETE */
+static int quic_send(HQUIC stream, const char *data, size_t len) {
+    QuicSend *qs = malloc(sizeof(QuicSend) + len);
+    if (qs == NULL) return -1;
+    memcpy(qs->data, data, len);
+    qs->buf.Buffer = (uint8_t *)qs->data;
+    qs->buf.Length = (uint32_t)len;
+    if (QUIC_FAILED(MsQuic->StreamSend(stream, &qs->buf, 1, QUIC_SEND_FLAG_NONE, qs))) {
+        free(qs);
+        return -1;
+    }
+    return 0;
+}
+
+static int sub_open_quic(Sub *sub, int topic) {
+    char frame[64];
+    sub->stream = quic_open_stream(&sub->conn, (void *)SubStreamCallback, sub);
+    if (sub->stream == NULL) return -1;
+    proto_write_bin_header(frame, BIN_OP_HELLO, 0, 0, 0);
+    size_t len = PROTO_BIN_HEADER + build_subscribe(frame + PROTO_BIN_HEADER, topic);
+    return quic_send(sub->stream, frame, len);
+}
+#endif
+
+/* --- Publishers --- */
+
+static void *publisher_main(void *arg) {
+    Pub *pub = arg;
+    int fd = -1;
+#ifdef HAVE_MSQUIC
+    HQUIC conn = NULL, stream = NULL;
+    if (transport == TRANSPORT_QUIC) {
+        stream = quic_open_stream(&conn, (void *)PubStreamCallback, NULL);
+        if (stream == NULL) {
+            fprintf(stderr, "Publisher %u: no se pudo abrir el stream QUIC\n", pub->id);
+            return NULL;
+        }
+    } else
+#endif
+    {
+        fd = open_socket();
+        if (fd < 0) {
+            perror("publisher");
+            return NULL;
+        }
+    }
+
+    static __thread char frame[PROTO_BIN_HEADER + 32 + MAX_PAYLOAD];
+    double pub_rate = rate / num_pubs;
+    uint64_t start = now_ns();
+    for (uint32_t seq = 0; running; seq++) {
+        uint64_t stamp;
+        if (pub_rate > 0) {
+            stamp = start + (uint64_t)((double)seq * 1e9 / pub_rate);
+            sleep_until(stamp);
+        } else {
+            stamp = now_ns();
+        }
+        int topic = (int)((seq + pub->id) % (uint32_t)num_topics);
+        size_t len = build_publish(frame, topic, stamp, pub->id, seq);
+
+        int r;
+#ifdef HAVE_MSQUIC
+        if (transport == TRANSPORT_QUIC) r = quic_send(stream, frame, len);
+        else
+#endif
+        r = send_all(fd, frame, len);
+        if (r < 0) {
+            perror("send");
+            break;
+        }
+        pub->sent++;
+        pub->per_topic[topic]++;
+    }
+
+#ifdef HAVE_MSQUIC
+    if (transport == TRANSPORT_QUIC) {
+        MsQuic->StreamShutdown(stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+        return NULL;
+    }
+#endif
+    close(fd);
+    return NULL;
+}
+
+static int parse_args(int argc, char *argv[]) {
+    if (argc < 4) return -1;
+    if (strcmp(argv[1], "tcp") == 0) transport = TRANSPORT_TCP;
+    else if (strcmp(argv[1], "udp") == 0) transport = TRANSPORT_UDP;
+    else if (strcmp(argv[1], "quic") == 0) transport = TRANSPORT_QUIC;
+    else return -1;
+
+    broker_host = argv[2];
+    memset(&broker, 0, sizeof(broker));
+    broker.sin_family = AF_INET;
+    broker.sin_port = htons((uint16_t)atoi(argv[3]));
+    if (inet_pton(AF_INET, argv[2], &broker.sin_addr) <= 0) {
+        fprintf(stderr, "IP inválida: %s\n", argv[2]);
+        return -1;
+    }
+
+    for (int i = 4; i < argc; i++) {
+        if (i + 1 >= argc) return -1;
+        const char *opt = argv[i], *val = argv[++i];
+        if (strcmp(opt, "--pubs") == 0) num_pubs = atoi(val);
+        else if (strcmp(opt, "--subs") == 0) num_subs = atoi(val);
+        else if (strcmp(opt, "--topics") == 0) num_topics = atoi(val);
+        else if (strcmp(opt, "--bytes") == 0) payload_size = atoi(val);
+        else if (strcmp(opt, "--rate") == 0) rate = atof(val);
+        else if (strcmp(opt, "--seconds") == 0) seconds = atof(val);
+        else if (strcmp(opt, "--codec") == 0 && strcmp(val, "lz4") == 0) lz4 = 1;
+        else if (strcmp(opt, "--codec") == 0 && strcmp(val, "none") == 0) lz4 = 0;
+        else if (strcmp(opt, "--broker-pid") == 0) broker_pid = atoi(val);
+        else return -1;
+    }
+    if (num_pubs < 1 || num_pubs > MAX_PUBS || num_subs < 1 || num_subs > MAX_SUBS ||
+        num_topics < 1 || num_topics > MAX_TOPICS || payload_size < (int)sizeof(Stamp) ||
+        payload_size > MAX_PAYLOAD || rate < 0 || seconds <= 0) {
+        fprintf(stderr, "Parámetros fuera de rango (1-%d pubs, 1-%d subs, 1-%d temas, %zu-%d bytes)\n",
+                MAX_PUBS, MAX_SUBS, MAX_TOPICS, sizeof(Stamp), MAX_PAYLOAD);
+        return -1;
+    }
+#ifndef HAVE_MSQUIC
+    if (transport == TRANSPORT_QUIC) {
+        fprintf(stderr, "Compilado sin MsQuic: QUIC no está disponible\n");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (parse_args(argc, argv) < 0) {
+        fprintf(stderr, "Uso: %s <tcp|udp|quic> <broker_ip> <broker_port> [--pubs N] [--subs N] "
+                        "[--topics N] [--bytes N] [--rate N] [--seconds N] [--codec none|lz4] "
+                        "[--broker-pid PID]\n", argv[0]);
+        return 1;
+    }
+
+#ifdef HAVE_MSQUIC
+    if (transport == TRANSPORT_QUIC && quic_init() < 0) {
+        fprintf(stderr, "No se pudo inicializar MsQuic\n");
+        return 1;
+    }
+#endif
+
+    build_updates();
+    run_start = now_ns();
+    for (int i = 0; i < num_subs; i++) {
+        Sub *sub = &subs[i];
+        hist_init(&sub->hist);
+        sub->rx = malloc(RX_SIZE);
+        int r = sub->rx == NULL ? -1 :
+#ifdef HAVE_MSQUIC
+            transport == TRANSPORT_QUIC ? sub_open_quic(sub, i % num_topics) :
+#endif
+            sub_open_socket(sub, i % num_topics);
+        if (r < 0) {
+            fprintf(stderr, "Subscriber %d: no se pudo conectar\n", i);
+            return 1;
+        }
+    }
+    /* Damos tiempo a que el broker registre las suscripciones */
+    usleep(300000);
+
+    pthread_t receiver, threads[MAX_PUBS];
+    uint64_t broker_cpu = broker_pid ? process_cpu_ns(broker_pid) : 0;
+    if (transport != TRANSPORT_QUIC) pthread_create(&receiver, NULL, receiver_main, NULL);
+    for (int i = 0; i < num_pubs; i++) {
+        pubs[i].id = (uint32_t)i;
+        pthread_create(&threads[i], NULL, publisher_main, &pubs[i]);
+    }
+
+    usleep((useconds_t)(seconds * 1e6));
+    running = 0;
+    for (int i = 0; i < num_pubs; i++) pthread_join(threads[i], NULL);
+
+    /* Un rato más para vaciar las colas del broker */
+    usleep(500000);
+    receiving = 0;
+    if (transport != TRANSPORT_QUIC) pthread_join(receiver, NULL);
+    if (broker_pid) broker_cpu = process_cpu_ns(broker_pid) - broker_cpu;
+
+    unsigned long long sent = 0, expected = 0, received = 0, wire = 0;
+    for (int p = 0; p < num_pubs; p++) {
+        sent += pubs[p].sent;
+        for (int s = 0; s < num_subs; s++) expected += pubs[p].per_topic[s % num_topics];
+    }
+    Histogram all;
+    hist_init(&all);
+    for (int s = 0; s < num_subs; s++) {
+        received += subs[s].received;
+        wire += subs[s].wire_bytes;
+        hist_merge(&all, &subs[s].hist);
+    }
+
+    printf("Transporte:  %s, %d publishers, %d subscribers, %d temas, %d bytes%s\n",
+           argv[1], num_pubs, num_subs, num_topics, payload_size, lz4 ? ", lz4" : "");
+    printf("Publicados:  %llu (%.0f msg/s)\n", sent, sent / seconds);
+    printf("Entregados:  %llu de %llu (%.0f msg/s, %.1f MB/s de payload)\n",
+           received, expected, received / seconds, received * (double)payload_size / seconds / 1e6);
+    printf("Pérdida:     %.2f%%\n", expected ? 100.0 * (double)(expected - (received < expected ? received : expected)) / (double)expected : 0.0);
+    if (all.count > 0) {
+        printf("Latencia (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f  media %.1f\n",
+               all.min / 1e3, hist_percentile(&all, 50) / 1e3, hist_percentile(&all, 90) / 1e3,
+               hist_percentile(&all, 99) / 1e3, hist_percentile(&all, 99.9) / 1e3, all.max / 1e3,
+               (double)all.sum / (double)all.count / 1e3);
+    }
+    if (received > 0) {
+        printf("Cable:       %.1f bytes recibidos por entrega (payload de %d)\n",
+               (double)wire / (double)received, payload_size);
+        if (transport != TRANSPORT_QUIC)
+            printf("CPU:         %.2f us por entrega en los subscribers", recv_cpu_ns / 1e3 / (double)received);
+        if (broker_pid && sent > 0)
+            printf("%s%.2f us por entrega en el broker (%.2f por publicación)",
+                   transport != TRANSPORT_QUIC ? ", " : "CPU:         ",
+                   broker_cpu / 1e3 / (double)received, broker_cpu / 1e3 / (double)sent);
+        if (transport != TRANSPORT_QUIC || broker_pid) printf("\n");
+    }
+
+    for (int i = 0; i < num_subs; i++) {
+#ifdef HAVE_MSQUIC
+        if (transport == TRANSPORT_QUIC) {
+            MsQuic->StreamShutdown(subs[i].stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+            continue;
+        }
+#endif
+        close(subs[i].fd);
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * bench_tcp_conns.c
+ *
+ * Benchmark de escalado por número de conexiones para broker_tcp.
+ * - Abre conexiones ociosas contra el broker en escalones (por defecto
+ *   100, 1000, 10000 y 50000) y en cada escalón mide la latencia de ida y
+ *   vuelta de un PUBLISH hasta el subscriber "caliente".
+ * - Si el broker despacha en O(activos), la latencia por evento debe
+ *   mantenerse plana aunque crezca la cantidad de conexiones ociosas.
+ *
+ * Compilar:
+ *   gcc -O2 bench_tcp_conns.c -o bench_tcp_conns
+ * Ejecutar (con el broker corriendo y su salida redirigida a /dev/null):
+ *   ./bench_tcp_conns <broker_ip> <broker_port> [muestras] [escalones...]
+ * Ejemplo:
+ *   ./bench_tcp_conns 127.0.0.1 8080 2000 100 1000 10000 50000
+ *
+ * Nota: cada conexión local consume dos descriptores (cliente y broker), así
+ * que para 50k conexiones hace falta `ulimit -n` alto en ambos procesos. Por
+ * encima de ~28k conexiones se rotan IPs de origen 127.0.0.x para no agotar
+ * los puertos efímeros.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#define BUFFER_SIZE 1024
+#define CONNS_PER_SOURCE_IP 25000
+#define DEFAULT_SAMPLES 2000
+
+static const int default_steps[] = { 100, 1000, 10000, 50000 };
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/*Conecta un socket bloqueante al broker; si es ocioso, rota la IP de origen*/
+static int connect_broker(const struct sockaddr_in *broker, int index) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (index >= 0 && ntohl(broker->sin_addr.s_addr) >> 24 == 127) {
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(0x7F000001 + index / CONNS_PER_SOURCE_IP);
+        local.sin_port = 0;
+        bind(fd, (struct sockaddr *)&local, sizeof(local));
+    }
+
+    if (connect(fd, (const struct sockaddr *)broker, sizeof(*broker)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Uso: %s <broker_ip> <broker_port> [muestras] [escalones...]\n", argv[0]);
+        return 1;
+    }
+
+    struct sockaddr_in broker;
+    memset(&broker, 0, sizeof(broker));
+    broker.sin_family = AF_INET;
+    broker.sin_port = htons(atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &broker.sin_addr) != 1) {
+        fprintf(stderr, "IP inválida: %s\n", argv[1]);
+        return 1;
+    }
+
+    int samples = argc > 3 ? atoi(argv[3]) : DEFAULT_SAMPLES;
+    int num_steps = argc > 4 ? argc - 4 : (int)(sizeof(default_steps) / sizeof(default_steps[0]));
+    int *steps = malloc(sizeof(int) * num_steps);
+    for (int i = 0; i < num_steps; i++)
+        steps[i] = argc > 4 ? atoi(argv[4 + i]) : default_steps[i];
+
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    /*Par caliente: un subscriber al tema "bench" y un publisher*/
+    int sub_fd = connect_broker(&broker, -1);
+    int pub_fd = connect_broker(&broker, -1);
+    if (sub_fd < 0 || pub_fd < 0) {
+        perror("connect()");
+        return 1;
+    }
+    const char *subscribe = "SUBSCRIBE bench\n";
+    send(sub_fd, subscribe, strlen(subscribe), 0);
+    usleep(100000);
+
+    int max_idle = 0;
+    for (int i = 0; i < num_steps; i++)
+        if (steps[i] > max_idle) max_idle = steps[i];
+    int *idle = malloc(sizeof(int) * max_idle);
+    int num_idle = 0;
+    double *lat = malloc(sizeof(double) * samples);
+    char out[BUFFER_SIZE], in[BUFFER_SIZE];
+
+    printf("%10s %10s %10s %10s %10s\n", "conexiones", "prom(us)", "p50(us)", "p99(us)", "max(us)");
+    for (int s = 0; s < num_steps; s++) {
+        while (num_idle < steps[s]) {
+            int fd = connect_broker(&broker, num_idle);
+            if (fd < 0) {
+                fprintf(stderr, "No se pudo abrir la conexión %d: %s\n", num_idle, strerror(errno));
+                goto done;
+            }
+            idle[num_idle++] = fd;
+        }
+        usleep(200000);
+
+        double total = 0;
+        for (int i = 0; i < samples; i++) {
+            int n = snprintf(out, sizeof(out), "PUBLISH bench %d\n", i);
+            double t0 = now_us();
+            send(pub_fd, out, (size_t)n, 0);
+            if (recv(sub_fd, in, sizeof(in), 0) <= 0) {
+                fprintf(stderr, "El broker cerró la conexión\n");
+                goto done;
+            }
+            lat[i] = now_us() - t0;
+            total += lat[i];
+        }
+
+        qsort(lat, samples, sizeof(double), cmp_double);
+        printf("%10d %10.1f %10.1f %10.1f %10.1f\n", num_idle, total / samples,
+               lat[samples / 2], lat[(int)(samples * 0.99)], lat[samples - 1]);
+        fflush(stdout);
+    }
+
+done:
+    for (int i = 0; i < num_idle; i++) close(idle[i]);
+    close(sub_fd);
+    close(pub_fd);
+    free(idle);
+    free(lat);
+    free(steps);
+    return 0;
+}
@@ -0,0 +1,179 @@
+/*
+ * bench_udp_pps.c
+ *
+ * Benchmark de paquetes por segundo para broker_udp.
+ * - Suscribe S sockets al tema "bench" y después inunda al broker con
+ *   PUBLISH durante unos segundos (usando sendmmsg para que el generador no
+ *   sea el cuello de botella).
+ * - Cuenta los datagramas que llegan a los subscribers y reporta los
+ *   paquetes/s entrantes al broker, los entregados y la pérdida.
+ * - Con un ritmo fijo (pps) el generador no le roba CPU al broker en
+ *   máquinas con pocos núcleos; con 0 publica sin límite.
+ * - Para comparar el bucle clásico con el de lotes se corre dos veces, una
+ *   contra `./broker_udp --batch 1` y otra contra `./broker_udp --batch 32`.
+ * - Con `./broker_udp --workers N` hay que publicar desde varios sockets:
+ *   SO_REUSEPORT reparte por dirección de origen, así que un solo socket
+ *   siempre cae en el mismo worker.
+ *
+ * Compilar:
+ *   gcc -O2 bench_udp_pps.c -o bench_udp_pps -lpthread
+ * Ejecutar (con el broker corriendo y su salida redirigida a /dev/null):
+ *   ./bench_udp_pps <broker_ip> <broker_port> [segundos] [subscribers] [bytes] [pps] [sockets]
+ * Ejemplo:
+ *   ./broker_udp --batch 1 > /dev/null &
+ *   ./bench_udp_pps 127.0.0.1 8081 5 4 64 50000
+ *   ./broker_udp --workers 4 > /dev/null &
+ *   ./bench_udp_pps 127.0.0.1 8081 5 4 64 0 16
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define BATCH 64
+#define MAX_SUBS 64
+#define MAX_SOCKETS 256
+#define RCVBUF (4 * 1024 * 1024)
+
+static struct sockaddr_in broker;
+static volatile int running = 1;
+static double seconds = 5;
+static int payload_size = 64;
+static double rate;            /* publicaciones por segundo, 0 = sin límite */
+static int num_sockets = 1;    /* sockets de publicación (puertos de origen) */
+static unsigned long long sent;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*Publica (al ritmo pedido o sin límite) hasta que se acabe el tiempo*/
+static void *publisher(void *arg) {
+    (void)arg;
+    int fds[MAX_SOCKETS];
+    for (int i = 0; i < num_sockets; i++) {
+        fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fds[i] < 0 || connect(fds[i], (struct sockaddr *)&broker, sizeof(broker)) < 0) {
+            perror("publisher");
+            return NULL;
+        }
+    }
+
+    char *msg = malloc(16 + payload_size);
+    int len = snprintf(msg, 16, "PUBLISH bench ");
+    memset(msg + len, 'x', payload_size);
+    len += payload_size;
+
+    struct iovec iov = { msg, (size_t)len };
+    struct mmsghdr msgs[BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++) {
+        msgs[i].msg_hdr.msg_iov = &iov;
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    double start = now_s();
+    for (int next = 0; running; next = (next + 1) % num_sockets) {
+        /*Con ritmo fijo esperamos hasta que toque el próximo lote*/
+        if (rate > 0) {
+            double due = start + (double)sent / rate;
+            double wait = due - now_s();
+            if (wait > 0) usleep((useconds_t)(wait * 1e6));
+        }
+        int n = sendmmsg(fds[next], msgs, BATCH, 0);
+        if (n > 0) sent += (unsigned long long)n;
+        else if (n < 0 && errno != EINTR && errno != ENOBUFS && errno != ECONNREFUSED) {
+            perror("sendmmsg");
+            break;
+        }
+    }
+    free(msg);
+    for (int i = 0; i < num_sockets; i++) close(fds[i]);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Uso: %s <broker_ip> <broker_port> [segundos] [subscribers] [bytes] [pps] [sockets]\n", argv[0]);
+        return 1;
+    }
+    memset(&broker, 0, sizeof(broker));
+    broker.sin_family = AF_INET;
+    broker.sin_port = htons((uint16_t)atoi(argv[2]));
+    if (inet_pton(AF_INET, argv[1], &broker.sin_addr) <= 0) {
+        fprintf(stderr, "IP inválida: %s\n", argv[1]);
+        return 1;
+    }
+    if (argc > 3) seconds = atof(argv[3]);
+    int nsubs = argc > 4 ? atoi(argv[4]) : 4;
+    if (argc > 5) payload_size = atoi(argv[5]);
+    if (argc > 6) rate = atof(argv[6]);
+    if (argc > 7) num_sockets = atoi(argv[7]);
+    if (nsubs < 1 || nsubs > MAX_SUBS || payload_size < 1 || payload_size > 8192 || seconds <= 0 || rate < 0 ||
+        num_sockets < 1 || num_sockets > MAX_SOCKETS) {
+        fprintf(stderr, "Parámetros fuera de rango (1-%d subscribers, 1-8192 bytes, 1-%d sockets)\n",
+                MAX_SUBS, MAX_SOCKETS);
+        return 1;
+    }
+
+    /*Subscribers: cada uno con buffer grande para medir al broker, no al kernel*/
+    struct pollfd pfds[MAX_SUBS];
+    for (int i = 0; i < nsubs; i++) {
+        int fd = socket(AF_INET, SOCK_DGRAM, 0);
+        int size = RCVBUF;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        connect(fd, (struct sockaddr *)&broker, sizeof(broker));
+        send(fd, "SUBSCRIBE bench", 15, 0);
+        pfds[i].fd = fd;
+        pfds[i].events = POLLIN;
+    }
+    usleep(200000);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, publisher, NULL);
+
+    static char bufs[BATCH][2048];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iov[BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < BATCH; i++) {
+        iov[i] = (struct iovec){ bufs[i], sizeof(bufs[i]) };
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    /*Recibimos mientras publica y un rato más para vaciar las colas*/
+    unsigned long long received = 0;
+    double start = now_s(), end = start + seconds;
+    while (1) {
+        double t = now_s();
+        if (running && t >= end) running = 0;
+        if (!running && t >= end + 0.5) break;
+        if (poll(pfds, (nfds_t)nsubs, 100) <= 0) continue;
+        for (int i = 0; i < nsubs; i++) {
+            if (!(pfds[i].revents & POLLIN)) continue;
+            int n = recvmmsg(pfds[i].fd, msgs, BATCH, MSG_DONTWAIT, NULL);
+            if (n > 0) received += (unsigned long long)n;
+        }
+    }
+    pthread_join(tid, NULL);
+
+    unsigned long long expected = sent * (unsigned long long)nsubs;
+    printf("Publicados:  %llu (%.0f paquetes/s hacia el broker)\n", sent, sent / seconds);
+    printf("Entregados:  %llu de %llu (%.0f paquetes/s hacia los subscribers)\n",
+           received, expected, received / seconds);
+    printf("Pérdida:     %.2f%%\n", expected ? 100.0 * (double)(expected - received) / (double)expected : 0.0);
+
+    for (int i = 0; i < nsubs; i++) close(pfds[i].fd);
+    return 0;
+}
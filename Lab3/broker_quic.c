@@ -3,111 +3,576 @@
 #include <string.h>
 #include <inttypes.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
 #include <msquic.h>
+#include "topic_registry.h"
+#include "protocol.h"
+#include "epoch.h"
+#include "metrics.h"
+#include "log.h"
+#include "topic_trie.h"
+#include "retained.h"
 
-#define MAX_CLIENTS 64
-#define MAX_TOPICS 64
 #define BUFFER_SIZE 2048
 
-typedef struct {
-    char topic[64];
-    HQUIC subscribers[MAX_CLIENTS];
-    int num_subscribers;
-} Topic;
-
 static const QUIC_API_TABLE *MsQuic = NULL;
 static HQUIC Registration = NULL;
 static HQUIC Configuration = NULL;
 static HQUIC Listener = NULL;
 
-static Topic topics[MAX_TOPICS];
-static int num_topics = 0;
+/*
+ * Registro de temas para varios hilos.
+ * MsQuic llama a los callbacks desde varios workers a la vez, así que:
+ * - Las escrituras (crear un tema, suscribir, desuscribir) se hacen con
+ *   registry_lock tomado. El TopicRegistry compartido sigue siendo el dueño
+ *   de los nombres y de los ids.
+ * - Las lecturas (cada PUBLISH) no toman ningún lock: buscan en índices de
+ *   solo-publicación (slots que se llenan con un store atómico y nunca se
+ *   vacían) y recorren una lista de suscriptores inmutable. Suscribir o
+ *   desuscribir arma una lista nueva y la publica con un puntero atómico.
+ * - Lo que se reemplaza (listas viejas, índices que crecieron, streams
+ *   cerrados) se libera con reclamación por épocas (epoch.c), cuando ningún
+ *   publish que pudiera estar usándolo sigue en curso.
+ * - Los patrones con comodines (topic_trie.h) también se tocan con
+ *   registry_lock. Se aplican al crear un tema o al llegar el patrón, así
+ *   que un PUBLISH sigue leyendo solo la lista del tema.
+ * - Cada tema retiene sus últimos --retain mensajes (retained.h) para los
+ *   subscribers nuevos. Los publishers guardan sin lock; el SendBuf que se
+ *   pisa se suelta con epoch_retire, así que el que se suscribe puede leer
+ *   el anillo desde una sección de lectura. Un PUBLISH a un tema desconocido
+ *   lo crea solo mientras el registro tenga menos de --max-topics temas.
+ */
+static TopicRegistry registry;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static TopicTrie patterns;                 /* owner: StreamCtx */
+static _Atomic uint32_t patterns_active;   /* copia de patterns.patterns para leer sin lock */
+static uint32_t retain = 1;                /* mensajes retenidos por tema; 0 = ninguno */
+static uint32_t max_topics = 65536;        /* temas que un PUBLISH puede crear; 0 = sin límite */
 
-static void subscribe_to_topic(const char *topic, HQUIC stream) {
-    for (int i = 0; i < num_topics; i++) {
-        if (strcmp(topics[i].topic, topic) == 0) {
-            if (topics[i].num_subscribers < MAX_CLIENTS) {
-                topics[i].subscribers[topics[i].num_subscribers++] = stream;
-            }
+typedef struct StreamCtx StreamCtx;
+
+/* Lista de suscriptores inmutable: se reemplaza entera */
+typedef struct {
+    uint32_t count;
+    StreamCtx *subs[];
+} SubList;
+
+/* Lo que el broker guarda en topic->user */
+typedef struct {
+    _Atomic(SubList *) subs;
+    Retained *retained;    /* NULL con --retain 0 */
+} TopicSubs;
+
+/* Índice por nombre: sondeo lineal, sin borrados */
+typedef struct {
+    uint32_t mask;
+    uint32_t used;         /* solo lo toca el escritor */
+    _Atomic(Topic *) slots[];
+} NameIndex;
+
+/* Índice por id */
+typedef struct {
+    uint32_t cap;
+    _Atomic(Topic *) topics[];
+} IdIndex;
+
+static _Atomic(NameIndex *) name_index;
+static _Atomic(IdIndex *) id_index;
+
+/* Temas a los que está suscrito un stream, para limpiar al cerrarse */
+typedef struct TopicLink {
+    Topic *topic;
+    struct TopicLink *next;
+} TopicLink;
+
+/* Patrones del stream, para sacarlos del trie al cerrarse */
+typedef struct PatternLink {
+    struct PatternLink *next;
+    size_t len;
+    char name[];
+} PatternLink;
+
+struct StreamCtx {
+    HQUIC stream;
+    char *buffer;          /* bytes recibidos que todavía no forman un frame completo */
+    size_t length;
+    size_t capacity;
+    int binary;            /* negoció el protocolo binario con BIN_OP_HELLO (lo leen otros hilos) */
+    int closed;            /* ya no acepta envíos (lo leen otros hilos) */
+    int sending;           /* hilos dentro de StreamSend con este stream */
+    TopicLink *topics;     /* protegido por registry_lock */
+    PatternLink *patterns; /* protegido por registry_lock */
+};
+
+/* MsQuic usa el buffer hasta SEND_COMPLETE, así que cada mensaje se copia una
+   vez a memoria propia, compartida por todos los subscribers del fan-out.
+   data = cabecera binaria + payload + '\n': los clientes binarios reciben
+   los primeros bytes y los de texto el payload con su salto de línea. */
+typedef struct {
+    int refs;
+    QUIC_BUFFER bin;
+    QUIC_BUFFER text;
+    char data[];
+} SendBuf;
+
+static void send_buf_release(SendBuf *sb) {
+    if (__atomic_sub_fetch(&sb->refs, 1, __ATOMIC_ACQ_REL) == 0) free(sb);
+}
+
+/* Para epoch_retire: la referencia del anillo de retenidos */
+static void send_buf_unretain(void *sb) {
+    send_buf_release(sb);
+}
+
+static SendBuf *send_buf_new(uint8_t opcode, uint32_t topic_id, const char *payload, uint32_t len) {
+    SendBuf *sb = malloc(sizeof(SendBuf) + PROTO_BIN_HEADER + len + 1);
+    if (sb == NULL) return NULL;
+    sb->refs = 1;
+    proto_write_bin_header(sb->data, opcode, BIN_FLAG_TOPIC_ID, topic_id, len);
+    if (len > 0) memcpy(sb->data + PROTO_BIN_HEADER, payload, len);
+    sb->data[PROTO_BIN_HEADER + len] = '\n';
+    sb->bin.Buffer = (uint8_t *)sb->data;
+    sb->bin.Length = PROTO_BIN_HEADER + len;
+    sb->text.Buffer = (uint8_t *)sb->data + PROTO_BIN_HEADER;
+    sb->text.Length = len + 1;
+    return sb;
+}
+
+/* sending se anuncia antes de mirar closed: o este hilo ve el stream
+   cerrado, o stream_close lo ve adentro y espera a que salga */
+static void send_to(StreamCtx *ctx, SendBuf *sb) {
+    __atomic_add_fetch(&ctx->sending, 1, __ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&ctx->closed, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&sb->refs, 1, __ATOMIC_RELAXED);
+        QUIC_BUFFER *buf = __atomic_load_n(&ctx->binary, __ATOMIC_RELAXED) ? &sb->bin : &sb->text;
+        QUIC_STATUS status = MsQuic->StreamSend(ctx->stream, buf, 1, QUIC_SEND_FLAG_NONE, sb);
+        if (QUIC_FAILED(status)) {
+            log_limited(LOG_LVL_WARN, 10, "StreamSend failed: 0x%x", (unsigned)status);
+            send_buf_release(sb);
+            metrics_add(metrics_local(), MET_DROPS, 1);
+        } else {
+            /* El byte count no vuelve en SEND_COMPLETE: el gauge cuenta envíos */
+            metrics_gauge(metrics_local(), MET_QUEUED_MSGS, 1);
+        }
+    }
+    __atomic_sub_fetch(&ctx->sending, 1, __ATOMIC_RELEASE);
+}
+
+/* --- Lecturas sin lock (dentro de epoch_enter/epoch_exit) --- */
+
+static Topic *index_find(const char *name, size_t len) {
+    NameIndex *idx = atomic_load_explicit(&name_index, memory_order_acquire);
+    if (idx == NULL) return NULL;
+    uint32_t hash = registry_hash(name, len);
+    for (uint32_t i = hash & idx->mask;; i = (i + 1) & idx->mask) {
+        Topic *t = atomic_load_explicit(&idx->slots[i], memory_order_acquire);
+        if (t == NULL) return NULL;
+        if (t->hash == hash && t->len == len && memcmp(t->name, name, len) == 0) return t;
+    }
+}
+
+static Topic *index_by_id(uint32_t id) {
+    IdIndex *idx = atomic_load_explicit(&id_index, memory_order_acquire);
+    if (idx == NULL || id >= idx->cap) return NULL;
+    return atomic_load_explicit(&idx->topics[id], memory_order_acquire);
+}
+
+/* --- Escrituras (con registry_lock tomado) --- */
+
+static void name_index_put(NameIndex *idx, Topic *t) {
+    uint32_t i = t->hash & idx->mask;
+    while (atomic_load_explicit(&idx->slots[i], memory_order_relaxed) != NULL)
+        i = (i + 1) & idx->mask;
+    atomic_store_explicit(&idx->slots[i], t, memory_order_release);
+    idx->used++;
+}
+
+/* Publica un tema recién creado en los dos índices. Si un índice se llena
+   se arma uno más grande, se publica y el viejo se retira. */
+static int index_publish(Topic *t) {
+    NameIndex *idx = atomic_load_explicit(&name_index, memory_order_relaxed);
+    if (idx == NULL || (idx->used + 1) * 2 > idx->mask + 1) {
+        uint32_t cap = idx ? (idx->mask + 1) * 2 : 64;
+        NameIndex *grown = calloc(1, sizeof(NameIndex) + cap * sizeof(grown->slots[0]));
+        if (grown == NULL) return -1;
+        grown->mask = cap - 1;
+        for (uint32_t i = 0; idx && i <= idx->mask; i++) {
+            Topic *old = atomic_load_explicit(&idx->slots[i], memory_order_relaxed);
+            if (old != NULL) name_index_put(grown, old);
+        }
+        atomic_store_explicit(&name_index, grown, memory_order_release);
+        if (idx != NULL) epoch_retire(idx, free);
+        idx = grown;
+    }
+
+    IdIndex *ids = atomic_load_explicit(&id_index, memory_order_relaxed);
+    if (ids == NULL || t->id >= ids->cap) {
+        uint32_t cap = ids ? ids->cap * 2 : 64;
+        while (cap <= t->id) cap *= 2;
+        IdIndex *grown = calloc(1, sizeof(IdIndex) + cap * sizeof(grown->topics[0]));
+        if (grown == NULL) return -1;
+        grown->cap = cap;
+        for (uint32_t i = 0; ids && i < ids->cap; i++)
+            atomic_store_explicit(&grown->topics[i],
+                                  atomic_load_explicit(&ids->topics[i], memory_order_relaxed),
+                                  memory_order_relaxed);
+        atomic_store_explicit(&id_index, grown, memory_order_release);
+        if (ids != NULL) epoch_retire(ids, free);
+        ids = grown;
+    }
+
+    name_index_put(idx, t);
+    atomic_store_explicit(&ids->topics[t->id], t, memory_order_release);
+    return 0;
+}
+
+static void attach_match(void *owner, void *arg);
+
+/* Busca o crea el tema; los temas nuevos se publican para los lectores y
+   reciben a los streams cuyos patrones calzan */
+static Topic *topic_intern(const char *name, size_t len) {
+    Topic *t = registry_intern(&registry, name, len);
+    if (t == NULL || t->user != NULL) return t;
+    TopicSubs *ts = calloc(1, sizeof(TopicSubs));
+    if (ts == NULL) return NULL;
+    if (retain > 0 && (ts->retained = retained_new(retain)) == NULL) {
+        free(ts);
+        return NULL;
+    }
+    t->user = ts;
+    if (index_publish(t) < 0) {
+        t->user = NULL;
+        free(ts->retained);
+        free(ts);
+        return NULL;
+    }
+    trie_match(&patterns, name, len, attach_match, t);
+    return t;
+}
+
+/* Reemplaza la lista de suscriptores del tema agregando o quitando ctx */
+static int sublist_update(Topic *t, StreamCtx *ctx, int add) {
+    TopicSubs *ts = t->user;
+    SubList *old = atomic_load_explicit(&ts->subs, memory_order_relaxed);
+    uint32_t count = old ? old->count : 0;
+    SubList *list = malloc(sizeof(SubList) + (count + 1) * sizeof(StreamCtx *));
+    if (list == NULL) return -1;
+
+    list->count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (old->subs[i] != ctx) list->subs[list->count++] = old->subs[i];
+    }
+    if (add) list->subs[list->count++] = ctx;
+
+    atomic_store_explicit(&ts->subs, list, memory_order_release);
+    t->num_subs = list->count;
+    if (old != NULL) epoch_retire(old, free);
+    return 0;
+}
+
+static void send_topic_id(StreamCtx *ctx, const Topic *t) {
+    SendBuf *sb = send_buf_new(BIN_OP_TOPIC_ID, t->id, t->name, t->len);
+    if (sb == NULL) return;
+    send_to(ctx, sb);
+    send_buf_release(sb);
+}
+
+/* Suscribe ctx al tema si no lo estaba. Retorna 1 si lo agregó, 0 si ya
+   estaba (un stream suscrito dos veces recibiría todo duplicado) y -1 sin
+   memoria. Con registry_lock tomado. */
+static int stream_add_topic(StreamCtx *ctx, Topic *t) {
+    for (TopicLink *l = ctx->topics; l != NULL; l = l->next) {
+        if (l->topic == t) return 0;
+    }
+    TopicLink *link = malloc(sizeof(TopicLink));
+    if (link == NULL || sublist_update(t, ctx, 1) < 0) {
+        free(link);
+        return -1;
+    }
+    link->topic = t;
+    link->next = ctx->topics;
+    ctx->topics = link;
+    return 1;
+}
+
+/* Un patrón de ctx calza con el tema t (registry_lock tomado) */
+static void attach_match(void *owner, void *arg) {
+    StreamCtx *ctx = owner;
+    Topic *t = arg;
+    if (stream_add_topic(ctx, t) > 0 && __atomic_load_n(&ctx->binary, __ATOMIC_RELAXED))
+        send_topic_id(ctx, t);
+}
+
+/* SUBSCRIBE con comodines: queda en el trie para los temas que aparezcan y
+   se suscribe ya a los que existen */
+static void subscribe_to_pattern(const Command *cmd, StreamCtx *ctx) {
+    const char *name = cmd->topic.data;
+    size_t len = cmd->topic.len;
+    if (!topic_pattern_valid(name, len)) {
+        log_limited(LOG_LVL_WARN, 10, "Invalid pattern: %.*s", (int)len, name);
+        return;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    for (PatternLink *p = ctx->patterns; p != NULL; p = p->next) {
+        if (p->len == len && memcmp(p->name, name, len) == 0) {
+            pthread_mutex_unlock(&registry_lock);
             return;
         }
     }
-    if (num_topics < MAX_TOPICS) {
-        memset(&topics[num_topics], 0, sizeof(Topic));
-        strncpy(topics[num_topics].topic, topic, sizeof(topics[num_topics].topic) - 1);
-        topics[num_topics].subscribers[0] = stream;
-        topics[num_topics].num_subscribers = 1;
-        num_topics++;
-    }
-}
-
-static void publish_to_topic(const char *topic, const char *message) {
-    for (int i = 0; i < num_topics; i++) {
-        if (strcmp(topics[i].topic, topic) == 0) {
-            for (int j = 0; j < topics[i].num_subscribers; j++) {
-                HQUIC s = topics[i].subscribers[j];
-                if (s != NULL) {
-                    QUIC_BUFFER buf;
-                    buf.Length = (uint32_t)strlen(message);
-                    buf.Buffer = (uint8_t *)message;
-                    MsQuic->StreamSend(s, &buf, 1, 0, NULL);
-                }
+    PatternLink *link = malloc(sizeof(PatternLink) + len);
+    if (link == NULL || trie_insert(&patterns, name, len, ctx) < 0) {
+        free(link);
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    link->len = len;
+    memcpy(link->name, name, len);
+    link->next = ctx->patterns;
+    ctx->patterns = link;
+    atomic_store_explicit(&patterns_active, patterns.patterns, memory_order_relaxed);
+
+    for (uint32_t id = 0; id < registry.count; id++) {
+        Topic *t = registry_by_id(&registry, id);
+        if (t->user != NULL && topic_matches(name, len, t->name, t->len)) attach_match(ctx, t);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    metrics_add(metrics_local(), MET_SUBSCRIBES, 1);
+    log_limited(LOG_LVL_INFO, 100, "New pattern subscriber pattern=%.*s", (int)len, name);
+}
+
+static void subscribe_to_topic(const Command *cmd, StreamCtx *ctx) {
+    if (!cmd->has_topic_id && topic_is_pattern(cmd->topic.data, cmd->topic.len)) {
+        subscribe_to_pattern(cmd, ctx);
+        return;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    Topic *t = cmd->has_topic_id ? registry_by_id(&registry, cmd->topic_id) : NULL;
+    if (!cmd->has_topic_id && cmd->topic.len > 0)
+        t = topic_intern(cmd->topic.data, cmd->topic.len);
+    if (t == NULL || t->user == NULL || stream_add_topic(ctx, t) <= 0) {
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    pthread_mutex_unlock(&registry_lock);
+    metrics_add(metrics_local(), MET_SUBSCRIBES, 1);
+    log_limited(LOG_LVL_INFO, 100, "New subscriber topic=%s", t->name);
+
+    /* Al cliente binario le contamos el id con el que le llegarán los mensajes.
+       El nombre y el id de un tema no cambian nunca: se leen sin el lock */
+    if (ctx->binary) send_topic_id(ctx, t);
+
+    /* Lo retenido, del más viejo al más nuevo. Un PUBLISH concurrente puede
+       llegar por los dos lados (lista y anillo) y verse dos veces */
+    TopicSubs *ts = t->user;
+    if (ts->retained == NULL) return;
+    SendBuf *kept[RETAIN_MAX];
+    epoch_enter();
+    uint32_t n = retained_snapshot(ts->retained, (void **)kept);
+    for (uint32_t i = 0; i < n; i++) send_to(ctx, kept[i]);
+    epoch_exit();
+}
+
+/* El stream deja de recibir: se saca de todas sus listas. Se puede llamar
+   más de una vez. */
+static void stream_detach(StreamCtx *ctx) {
+    __atomic_store_n(&ctx->closed, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&registry_lock);
+    while (ctx->topics != NULL) {
+        TopicLink *link = ctx->topics;
+        ctx->topics = link->next;
+        sublist_update(link->topic, ctx, 0);
+        free(link);
+    }
+    while (ctx->patterns != NULL) {
+        PatternLink *link = ctx->patterns;
+        ctx->patterns = link->next;
+        trie_remove(&patterns, link->name, link->len, ctx);
+        free(link);
+    }
+    atomic_store_explicit(&patterns_active, patterns.patterns, memory_order_relaxed);
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/* Cierra el handle desde el worker dueño del stream (StreamClose bloquea
+   si se llama desde otro worker). Con closed ya en 1 no entra ningún envío
+   nuevo: solo falta que terminen los StreamSend en curso, que no esperan
+   a este worker. */
+static void stream_close(StreamCtx *ctx) {
+    while (__atomic_load_n(&ctx->sending, __ATOMIC_SEQ_CST) != 0) sched_yield();
+    MsQuic->StreamClose(ctx->stream);
+}
+
+/* Se llama recién cuando ningún publish puede seguir leyendo el contexto;
+   el handle ya está cerrado, acá solo se libera memoria */
+static void stream_ctx_free(void *arg) {
+    StreamCtx *ctx = arg;
+    free(ctx->buffer);
+    free(ctx);
+}
+
+static void count_match(void *owner, void *arg) {
+    (void)owner;
+    (*(int *)arg)++;
+}
+
+static void publish_to_topic(const Command *cmd) {
+    Metrics *m = metrics_local();
+    metrics_add(m, MET_MSGS_IN, 1);
+    metrics_add(m, MET_BYTES_IN, cmd->payload.len);
+    log_sampled(LOG_LVL_DEBUG, 1000, "PUBLISH topic=%.*s id=%d bytes=%zu (1 in 1000)",
+                (int)cmd->topic.len, cmd->topic.data, cmd->has_topic_id ? (int)cmd->topic_id : -1,
+                cmd->payload.len);
+
+    epoch_enter();
+    Topic *t = cmd->has_topic_id ? index_by_id(cmd->topic_id)
+                                 : index_find(cmd->topic.data, cmd->topic.len);
+    if (t == NULL && !cmd->has_topic_id && cmd->topic.len > 0 &&
+        (retain > 0 || atomic_load_explicit(&patterns_active, memory_order_relaxed) > 0) &&
+        !topic_is_pattern(cmd->topic.data, cmd->topic.len)) {
+        /* Tema que nadie nombró todavía: se crea para retener lo publicado o,
+           sin retenidos, solo si calza con algún patrón. Nunca con el nombre
+           vacío ni pasado --max-topics, así un cliente no agranda el registro
+           sin límite */
+        pthread_mutex_lock(&registry_lock);
+        int matches = 0;
+        if (retain == 0) trie_match(&patterns, cmd->topic.data, cmd->topic.len, count_match, &matches);
+        if ((retain > 0 || matches > 0) && (max_topics == 0 || registry.count < max_topics))
+            t = topic_intern(cmd->topic.data, cmd->topic.len);
+        pthread_mutex_unlock(&registry_lock);
+    }
+    TopicSubs *ts = t ? t->user : NULL;
+    SendBuf *sb = NULL;
+    if (ts != NULL && ts->retained != NULL) {
+        /* El anillo se queda con su propia referencia */
+        sb = send_buf_new(BIN_OP_MESSAGE, t->id, cmd->payload.data, (uint32_t)cmd->payload.len);
+        if (sb != NULL) {
+            __atomic_add_fetch(&sb->refs, 1, __ATOMIC_RELAXED);
+            SendBuf *old = retained_store(ts->retained, sb);
+            if (old != NULL) epoch_retire(old, send_buf_unretain);
+        }
+    }
+    SubList *list = ts ? atomic_load_explicit(&ts->subs, memory_order_acquire) : NULL;
+    if (list != NULL && list->count > 0) {
+        uint64_t start = metrics_now_ns();
+        if (sb == NULL)
+            sb = send_buf_new(BIN_OP_MESSAGE, t->id, cmd->payload.data, (uint32_t)cmd->payload.len);
+        if (sb != NULL) {
+            for (uint32_t j = 0; j < list->count; j++) {
+                send_to(list->subs[j], sb);
             }
+            send_buf_release(sb);
+            hist_record(&m->fanout_ns, metrics_now_ns() - start);
+            metrics_add(m, MET_MSGS_OUT, list->count);
+            metrics_add(m, MET_BYTES_OUT, (uint64_t)list->count * cmd->payload.len);
+            metrics_topic(m, t->name, list->count, (uint64_t)list->count * cmd->payload.len);
+        }
+    } else {
+        if (sb != NULL) send_buf_release(sb);
+        metrics_add(m, MET_NO_SUBS, 1);
+    }
+    epoch_exit();
+}
+
+static void process_frame(const Frame *frame, StreamCtx *ctx) {
+    Command cmd;
+    if (proto_parse_frame(frame, &cmd) < 0) return;
+
+    switch (cmd.op) {
+        case BIN_OP_HELLO: {
+            __atomic_store_n(&ctx->binary, 1, __ATOMIC_RELAXED);
+            SendBuf *sb = send_buf_new(BIN_OP_HELLO, 0, NULL, 0);
+            if (sb == NULL) return;
+            send_to(ctx, sb);
+            send_buf_release(sb);
+            return;
+        }
+        case BIN_OP_SUBSCRIBE:
+            subscribe_to_topic(&cmd, ctx);
+            return;
+        case BIN_OP_PUBLISH:
+            publish_to_topic(&cmd);
+            return;
+        case BIN_OP_TOPIC_ID: {
+            if (cmd.topic.len == 0 || topic_is_pattern(cmd.topic.data, cmd.topic.len)) return;
+            pthread_mutex_lock(&registry_lock);
+            Topic *t = topic_intern(cmd.topic.data, cmd.topic.len);
+            pthread_mutex_unlock(&registry_lock);
+            if (t != NULL) send_topic_id(ctx, t);
             return;
         }
+        default:
+            return;
     }
 }
 
-typedef struct {
-    char buffer[BUFFER_SIZE];
-    size_t length;
-} StreamCtx;
+/* Agrega los bytes recibidos al buffer del stream y procesa los frames completos */
+static int stream_receive(StreamCtx *ctx, const QUIC_BUFFER *b) {
+    if (ctx->length + b->Length > ctx->capacity) {
+        size_t cap = ctx->capacity ? ctx->capacity : BUFFER_SIZE;
+        while (cap < ctx->length + b->Length) cap *= 2;
+        if (cap > PROTO_MAX_FRAME + BUFFER_SIZE) return -1;
+        char *buffer = realloc(ctx->buffer, cap);
+        if (buffer == NULL) return -1;
+        ctx->buffer = buffer;
+        ctx->capacity = cap;
+    }
+    memcpy(ctx->buffer + ctx->length, b->Buffer, b->Length);
+    ctx->length += b->Length;
 
+    size_t off = 0, used;
+    Frame frame;
+    int r;
+    while ((r = proto_next_frame(ctx->buffer + off, ctx->length - off, &frame, &used)) == 1) {
+        process_frame(&frame, ctx);
+        off += used;
+    }
+    memmove(ctx->buffer, ctx->buffer + off, ctx->length - off);
+    ctx->length -= off;
+    return r < 0 ? -1 : 0;
+}
+
+/* El contexto del stream se crea al abrirse (ConnectionCallback). En
+   SHUTDOWN_COMPLETE se cierra el handle en este mismo worker y la memoria se
+   libera vía epoch_retire: otro worker puede estar en medio de un publish
+   que todavía lo tiene en su lista de suscriptores. */
 static QUIC_STATUS QUIC_API StreamCallback(HQUIC Stream, void *Context, QUIC_STREAM_EVENT *Event) {
-    (void)Context;
+    StreamCtx *ctx = (StreamCtx *)Context;
     switch (Event->Type) {
-        case QUIC_STREAM_EVENT_RECEIVE: {
-            StreamCtx *ctx = (StreamCtx *)MsQuic->GetContext(Stream);
-            if (!ctx) {
-                ctx = (StreamCtx *)calloc(1, sizeof(StreamCtx));
-                MsQuic->SetContext(Stream, ctx);
-            }
+        case QUIC_STREAM_EVENT_RECEIVE:
             for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; i++) {
-                QUIC_BUFFER *b = &Event->RECEIVE.Buffers[i];
-                size_t copy = b->Length;
-                if (ctx->length + copy >= sizeof(ctx->buffer)) copy = sizeof(ctx->buffer) - ctx->length - 1;
-                memcpy(ctx->buffer + ctx->length, b->Buffer, copy);
-                ctx->length += copy;
-                ctx->buffer[ctx->length] = '\0';
-                char *newline;
-                while ((newline = strchr(ctx->buffer, '\n')) != NULL) {
-                    *newline = '\0';
-                    char command[16] = {0};
-                    char topic[64] = {0};
-                    char content[BUFFER_SIZE] = {0};
-                    sscanf(ctx->buffer, "%15s %63s %[^\n]", command, topic, content);
-                    if (strcmp(command, "SUBSCRIBE") == 0) {
-                        subscribe_to_topic(topic, Stream);
-                    } else if (strcmp(command, "PUBLISH") == 0) {
-                        publish_to_topic(topic, content);
-                    }
-                    size_t remaining = ctx->length - (size_t)(newline - ctx->buffer + 1);
-                    memmove(ctx->buffer, newline + 1, remaining);
-                    ctx->length = remaining;
-                    ctx->buffer[ctx->length] = '\0';
+                if (stream_receive(ctx, &Event->RECEIVE.Buffers[i]) < 0) {
+                    log_limited(LOG_LVL_WARN, 10, "Invalid or oversized frame, aborting stream");
+                    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+                    break;
                 }
             }
             return QUIC_STATUS_SUCCESS;
-        }
-        case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+        case QUIC_STREAM_EVENT_SEND_COMPLETE:
+            if (Event->SEND_COMPLETE.ClientContext) {
+                send_buf_release((SendBuf *)Event->SEND_COMPLETE.ClientContext);
+                metrics_gauge(metrics_local(), MET_QUEUED_MSGS, -1);
+            }
+            return QUIC_STATUS_SUCCESS;
         case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
-        case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
-            StreamCtx *ctx = (StreamCtx *)MsQuic->GetContext(Stream);
-            if (ctx) free(ctx);
-            MsQuic->SetContext(Stream, NULL);
-            MsQuic->StreamClose(Stream);
+            /* El cliente terminó de enviar: cerramos nuestro lado también */
+            stream_detach(ctx);
+            MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
+            return QUIC_STATUS_SUCCESS;
+        case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
+            stream_detach(ctx);
+            MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+            return QUIC_STATUS_SUCCESS;
+        case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+            metrics_add(metrics_local(), MET_DISCONNECTS, 1);
+            log_limited(LOG_LVL_INFO, 100, "Stream closed");
+            stream_detach(ctx);
+            stream_close(ctx);
+            epoch_retire(ctx, stream_ctx_free);
             return QUIC_STATUS_SUCCESS;
-        }
         default:
             return QUIC_STATUS_SUCCESS;
     }
@@ -118,9 +583,16 @@ static QUIC_STATUS QUIC_API ConnectionCallback(HQUIC Connection, void *Context,
     switch (Event->Type) {
         case QUIC_CONNECTION_EVENT_CONNECTED:
             return QUIC_STATUS_SUCCESS;
-        case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED:
-            MsQuic->SetCallbackHandler(Event->PEER_STREAM_STARTED.Stream, (void *)StreamCallback, NULL);
+        case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED: {
+            HQUIC stream = Event->PEER_STREAM_STARTED.Stream;
+            StreamCtx *ctx = calloc(1, sizeof(StreamCtx));
+            if (ctx == NULL) return QUIC_STATUS_OUT_OF_MEMORY;   /* MsQuic cierra el stream */
+            ctx->stream = stream;
+            MsQuic->SetCallbackHandler(stream, (void *)StreamCallback, ctx);
+            metrics_add(metrics_local(), MET_CONNECTS, 1);
+            log_limited(LOG_LVL_INFO, 100, "New stream");
             return QUIC_STATUS_SUCCESS;
+        }
         case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
             MsQuic->ConnectionClose(Connection);
             return QUIC_STATUS_SUCCESS;
@@ -142,17 +614,51 @@ static QUIC_STATUS QUIC_API ListenerCallback(HQUIC ListenerHandle, void *Context
     }
 }
 
+static int usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [bind_ip port] [--stats-port PORT] [--stats-interval SECONDS] "
+                    "[--log-level error|warn|info|debug] [--retain N] [--max-topics N]\n", prog);
+    return 1;
+}
+
 int main(int argc, char **argv) {
-    const char *bind_ip;
-    uint16_t port;
-    if (argc != 3) {
-        fprintf(stderr, "[broker_quic] Using defaults: 0.0.0.0 8080\n");
-        bind_ip = "0.0.0.0";
-        port = 8080;
-    } else {
-        bind_ip = argv[1];
-        port = (uint16_t)atoi(argv[2]);
+    const char *bind_ip = "0.0.0.0";
+    uint16_t port = 8080;
+    int stats_port = 0;
+    double stats_interval = 0;
+    int log_level_arg = LOG_LVL_INFO;
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+            stats_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level_arg = log_level_parse(argv[++i]);
+            if (log_level_arg < 0) return usage(argv[0]);
+        } else if (strcmp(argv[i], "--retain") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0 || n > RETAIN_MAX) return usage(argv[0]);
+            retain = (uint32_t)n;
+        } else if (strcmp(argv[i], "--max-topics") == 0 && i + 1 < argc) {
+            max_topics = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (positional == 0) {
+            bind_ip = argv[i];
+            positional++;
+        } else if (positional == 1) {
+            port = (uint16_t)atoi(argv[i]);
+            positional++;
+        } else {
+            return usage(argv[0]);
+        }
     }
+    if (positional != 2)
+        fprintf(stderr, "[broker_quic] Using defaults: %s %u\n", bind_ip, (unsigned)port);
+    if (log_start(log_level_arg) < 0) {
+        fprintf(stderr, "[broker_quic] could not start the logger\n");
+        return 1;
+    }
+
+    registry_init(&registry);
 
     if (MsQuicOpen2(&MsQuic) != QUIC_STATUS_SUCCESS) return 1;
     QUIC_REGISTRATION_CONFIG regConfig = { "broker-quic", QUIC_EXECUTION_PROFILE_LOW_LATENCY };
@@ -180,7 +686,9 @@ int main(int argc, char **argv) {
 
     QUIC_BUFFER alpnBuffer2 = { (uint32_t)strlen(alpn), (uint8_t *)alpn };
     if (MsQuic->ListenerStart(Listener, &alpnBuffer2, 1, &addr) != QUIC_STATUS_SUCCESS) return 1;
-    printf("Broker QUIC listening on %s:%u\n", bind_ip, (unsigned)port);
+    log_info("Broker QUIC listening on %s:%u", bind_ip, (unsigned)port);
+    if (metrics_start("broker_quic", stats_port, stats_interval) < 0)
+        log_error("stats socket unavailable on port %d", stats_port);
     getchar();
 
     MsQuic->ListenerClose(Listener);
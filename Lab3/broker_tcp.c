@@ -6,191 +6,2511 @@
  * - Formato de mensaje esperado:
  *      SUBSCRIBE <TOPIC>
  *      PUBLISH <TOPIC> <mensaje>
+ * - Usa epoll en modo edge-triggered con sockets no bloqueantes: cada wakeup
+ *   solo entrega los sockets con actividad, sin límite fijo de clientes.
+ * - Los temas viven en el registro compartido (topic_registry.c): búsqueda
+ *   por hash y sin límite de temas ni de suscriptores por tema.
+ * - Cada comando es un frame (ver protocol.h): un read() puede traer muchos
+ *   PUBLISH seguidos o solo la mitad de uno, y ambos casos se reensamblan.
+ * - Además del texto acepta el protocolo binario: un cliente que manda
+ *   BIN_OP_HELLO recibe los mensajes como frames BIN_OP_MESSAGE.
+ * - El fan-out nunca bloquea: si el socket de un subscriber está lleno, el
+ *   mensaje queda en su cola de salida (write_queue.c) y se vacía con
+ *   EPOLLOUT. Pasado el high-water mark se aplica la política de desborde.
+ * - Las colas no copian el mensaje: un solo MsgBuffer (msg_buffer.c) con
+ *   contador de referencias se comparte entre todos los subscribers que lo
+ *   tengan pendiente, y se crea solo si alguno no pudo recibirlo directo.
+ * - Multi-núcleo (--threads N): cada shard es un hilo con su propio epoll y
+ *   su propio socket de escucha (SO_REUSEPORT reparte las conexiones). Una
+ *   conexión vive siempre en su shard. Cada tema tiene un shard dueño (por
+ *   hash del nombre) que ordena sus publicaciones y las reparte a los shards
+ *   que tienen subscribers; entre shards solo viajan mensajes por colas SPSC
+ *   sin locks (spsc_queue.h), así que el orden por tema se mantiene y nunca
+ *   se toma un mutex para publicar.
+ * - Métricas (metrics.h): cada shard cuenta mensajes, bytes, descartes,
+ *   bytes encolados y el tiempo de cada fan-out en contadores propios, sin
+ *   printf por mensaje. Se consultan con --stats-port (JSON) o se vuelcan
+ *   cada --stats-interval segundos.
+ * - Temas jerárquicos con comodines (topic_trie.h): SUBSCRIBE liga/+/goles o
+ *   liga/#. Cada shard guarda los patrones de sus clientes en un trie y, al
+ *   aparecer un tema que calza, suscribe a esos clientes en su vector de
+ *   subscribers: publicar no busca patrones. Los dueños de cada tema saben
+ *   qué shards tienen patrones que calzan por un trie global (un mutex, solo
+ *   al cambiar los patrones o al ver un tema por primera vez).
+ * - Mensajes retenidos (retained.h, --retain N): el shard dueño de cada tema
+ *   guarda sus últimos N mensajes, y un SUBSCRIBE por nombre los recibe
+ *   enseguida. Si el cliente vive en otro shard, se suscribe recién cuando
+ *   vuelve la respuesta del dueño, que viaja por la misma cola que las
+ *   publicaciones: no se pierde ni se repite nada entre lo retenido y lo nuevo.
+ *   Un PUBLISH a un tema desconocido lo crea solo mientras el directorio
+ *   tenga menos de --max-topics temas; pasado eso se descarta.
+ * - Log persistente (topic_log.h, --store DIR): el dueño agrega cada
+ *   publicación al log del tema, que sobrevive a un reinicio. REPLAY <TOPIC>
+ *   <offset> suscribe y antes manda lo guardado desde ese offset: en binario
+ *   los registros ya son frames y salen del archivo con sendfile.
+ * - Ventana de coalescencia (--coalesce-us, --coalesce-bytes): en lugar de un
+ *   write por mensaje y por subscriber, lo publicado se junta en la cola de
+ *   cada subscriber y sale en un solo writev cuando vence la ventana del
+ *   shard (un timerfd) o cuando el subscriber juntó N bytes. Se cambian
+ *   microsegundos de latencia por muchas menos syscalls y segmentos.
+ * - Compresión (--compress, lz_codec.h): un subscriber binario la pide en
+ *   su SUBSCRIBE. El dueño de cada tema entrena un diccionario con las
+ *   primeras publicaciones y desde ahí comprime cada mensaje una sola vez;
+ *   la versión comprimida viaja colgada del MsgBuffer y la comparten todos
+ *   los subscribers que la negociaron, en cualquier shard.
+ * - Backend io_uring (--io uring, io_ring.h): cada shard cambia epoll por un
+ *   anillo con accept y recv multishot (los recv toman buffers de un anillo
+ *   provisto, así que un cliente callado no ocupa memoria) y los envíos del
+ *   fan-out se preparan como SQE durante toda la vuelta y salen juntos en el
+ *   mismo io_uring_enter que espera lo siguiente: una syscall por vuelta en
+ *   lugar de una por mensaje y por subscriber. Si el kernel no lo soporta
+ *   (hace falta 6.1) se sigue con epoll.
+ * - Admisión de conexiones (--backlog, --max-conns, --max-per-ip): cada
+ *   wakeup acepta toda la cola de listen(); lo que no entra recibe una línea
+ *   "BUSY <motivo>" y se cierra enseguida. Un descriptor de reserva permite
+ *   aceptar y rechazar aunque el proceso llegue a su límite (EMFILE), así
+ *   que una tormenta de reconexiones nunca queda trabada en la cola.
+ * - Log asíncrono (log.h) con --log-level: los eventos por conexión o por
+ *   mensaje pasan por un límite de líneas por segundo, así que ni una ráfaga
+ *   de errores ni una terminal lenta frenan el event loop.
  *
  * Compilar:
- *   gcc broker_tcp.c -o broker_tcp
+ *   gcc broker_tcp.c topic_registry.c protocol.c write_queue.c msg_buffer.c spsc_queue.c metrics.c histogram.c log.c topic_trie.c retained.c topic_log.c lz_codec.c io_ring.c -o broker_tcp -lpthread
  * Ejecutar:
- *   ./broker_tcp
+ *   ./broker_tcp [--hwm BYTES] [--overflow drop-oldest|drop-newest|disconnect] [--threads N]
+ *                [--stats-port PORT] [--stats-interval SEGUNDOS] [--log-level error|warn|info|debug]
+ *                [--retain N] [--max-topics N] [--store DIR] [--store-sync-ms MS]
+ *                [--coalesce-us US] [--coalesce-bytes N] [--compress] [--io epoll|uring]
+ *                [--backlog N] [--max-conns N] [--max-per-ip N]
  */
 
+ #define _GNU_SOURCE
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
  #include <unistd.h>
  #include <errno.h>
+ #include <fcntl.h>
+ #include <signal.h>
+ #include <pthread.h>
+ #include <sched.h>
  #include <arpa/inet.h>
  #include <sys/socket.h>
  #include <sys/types.h>
- #include <sys/select.h>
- 
+ #include <sys/epoll.h>
+ #include <sys/eventfd.h>
+ #include <sys/timerfd.h>
+ #include <sys/resource.h>
+ #include <sys/uio.h>
+ #include <sys/sendfile.h>
+ #include <poll.h>
+ #include "topic_registry.h"
+ #include "protocol.h"
+ #include "write_queue.h"
+ #include "msg_buffer.h"
+ #include "spsc_queue.h"
+ #include "metrics.h"
+ #include "log.h"
+ #include "topic_trie.h"
+ #include "retained.h"
+ #include "topic_log.h"
+ #include "lz_codec.h"
+ #include "io_ring.h"
+
  #define PORT 8080
- #define MAX_CLIENTS 50
- #define BUFFER_SIZE 1024
- #define MAX_TOPICS 50
- 
- /*Creamos una estructura para los topics*/
+ #define BUFFER_SIZE PROTO_MAX_FRAME
+ #define MAX_EVENTS 256
+ #define DEFAULT_HWM (1024 * 1024)
+ #define MAX_SHARDS 64
+ #define SHARD_QUEUE_CAP 1024
+ #define DEFAULT_MAX_TOPICS 65536
+ #define GROW_MAX (UINT32_MAX / 2 + 1) /* índice máximo (excluido) de los arreglos por id */
+ #define REPLAY_IOV 64
+ #define DEFAULT_STORE_SYNC_MS 10
+ #define DEFAULT_COALESCE_US 200
+ #define DEFAULT_COALESCE_BYTES (16 * 1024)
+ #define COMPRESS_MIN 64        /* payloads más cortos salen siempre crudos */
+ #define DICT_TRAIN_MSGS 128    /* publicaciones que se miran para armar el diccionario */
+ #define RING_ENTRIES 4096      /* SQE por vuelta antes de tener que mandar a mitad de camino */
+ #define RING_BUFS 256          /* buffers provistos para los recv multishot del shard */
+ #define RING_BUF_SIZE (16 * 1024)
+ #define RING_BGID 0
+ #define RING_IOV 1024          /* mensajes por SQE de envío (IOV_MAX) */
+ #define RING_CHAIN 4           /* SQE de envío encadenadas por cliente */
+ #define RING_FLUSH_BYTES (64 * 1024) /* fan-out acumulado que se manda sin esperar el fin de la vuelta */
+ #define IP_SLOTS 1024          /* cubetas de la tabla de conexiones por IP */
+
+ /*Operación de cada SQE, en los bits bajos del user_data. RING_SOURCE son
+   los sockets del shard que no son clientes (escucha, eventfd, timerfd)*/
+ enum { RING_RECV, RING_SEND, RING_POLL, RING_SOURCE, RING_OP_MASK = 3 };
+
+ /*Qué hacer cuando la cola de un subscriber lento pasa el high-water mark*/
+ typedef enum {
+     OVERFLOW_DROP_OLDEST,  /* descarta los mensajes más viejos de la cola */
+     OVERFLOW_DROP_NEWEST,  /* descarta el mensaje nuevo */
+     OVERFLOW_DISCONNECT    /* cierra la conexión del subscriber */
+ } OverflowPolicy;
+
+ typedef enum {
+     IO_EPOLL,              /* readiness con epoll y una syscall por operación */
+     IO_URING               /* completaciones con io_uring (ver io_ring.h) */
+ } IoBackend;
+
+ static struct {
+     size_t hwm;
+     OverflowPolicy overflow;
+     int threads;
+     int stats_port;        /* 0 = sin socket de métricas */
+     double stats_interval; /* 0 = sin volcado periódico */
+     int log_level;
+     uint32_t retain;       /* mensajes retenidos por tema; 0 = ninguno */
+     uint32_t max_topics;   /* temas que un PUBLISH puede llegar a crear; 0 = sin límite */
+     const char *store_dir; /* NULL = sin log persistente */
+     int store_sync_ms;     /* cada cuánto se sincroniza el log a disco */
+     long coalesce_us;      /* ventana de coalescencia; 0 = cada mensaje sale enseguida */
+     size_t coalesce_bytes; /* con esto pendiente el subscriber sale sin esperar la ventana */
+     int compress;          /* se acepta BIN_FLAG_LZ4 en los SUBSCRIBE */
+     IoBackend io;
+     int backlog;           /* cola de listen(); el kernel la corta en net.core.somaxconn */
+     long max_conns;        /* conexiones abiertas en total; 0 = sin límite */
+     uint32_t max_per_ip;   /* conexiones abiertas por IP de origen; 0 = sin límite */
+ } config = { DEFAULT_HWM, OVERFLOW_DROP_OLDEST, 1, 0, 0, LOG_LVL_INFO, 1, DEFAULT_MAX_TOPICS, NULL,
+              DEFAULT_STORE_SYNC_MS, 0, DEFAULT_COALESCE_BYTES, 0, IO_EPOLL, SOMAXCONN, 0, 0 };
+
+ /*Mensajes entre shards. El arg es siempre el id global del tema*/
+ typedef enum {
+     SHARD_SUB_ADD = 1,     /* el shard origen tiene su primer subscriber del tema */
+     SHARD_SUB_DEL,         /* el shard origen ya no tiene subscribers del tema */
+     SHARD_PUBLISH,         /* publicación para el shard dueño (ptr: MsgBuffer) */
+     SHARD_DELIVER,         /* publicación ya ordenada para el fan-out local (ptr: MsgBuffer) */
+     SHARD_RETAIN_REQ,      /* un cliente del origen se suscribe: pide lo retenido o el fin del log (ptr: RetainWait) */
+     SHARD_RETAIN_REPLY     /* respuesta del dueño (ptr: RetainWait) */
+ } ShardOp;
+
+ typedef struct Shard Shard;
+
+ /*Patrón con comodines de un cliente*/
+ typedef struct PatternSub {
+     struct PatternSub *next;
+     uint32_t len;
+     char name[];
+ } PatternSub;
+
+ typedef struct Client Client;
+
+ /*REPLAY en curso. Lo que el cliente tenía en su cola al empezar sale
+   primero (before), después el aviso binario, después el log y recién al
+   final la cola del cliente, donde se juntó lo publicado mientras tanto*/
  typedef struct {
-     char topic[50];
-     int subscribers[MAX_CLIENTS];
-     int num_subscribers;
- } Topic;
- 
- Topic topics[MAX_TOPICS];
- int num_topics = 0;
- 
- void process_message(char *message, int sender_fd);
- void subscribe_to_topic(char *topic, int fd);
- void publish_to_topic(char *topic, char *message);
- 
- /* --- Función principal --- */
- int main() {
-     int server_fd, new_socket, client_sockets[MAX_CLIENTS];
+     TlogCursor cursor;
+     WriteQueue before;
+     char preamble[PROTO_BIN_HEADER + 16];
+     uint32_t pre_len;
+     uint32_t pre_off;
+     uint32_t partial;      /* texto: bytes ya escritos del registro actual */
+ } Replay;
+
+ /*SUBSCRIBE a un tema de otro shard esperando los mensajes retenidos. El
+   dueño llena msgs (con una referencia cada uno) y la devuelve. Un REPLAY
+   usa la misma espera, pero el dueño contesta hasta dónde llega el log*/
+ typedef struct RetainWait {
+     Client *client;        /* NULL si el cliente se cerró mientras tanto */
+     Topic *topic;          /* tema local del shard del cliente */
+     struct RetainWait *next;
+     int replay;
+     uint64_t replay_from;
+     uint64_t replay_end;   /* lo llena el dueño */
+     uint32_t count;
+     MsgBuffer *msgs[];
+ } RetainWait;
+
+ /*Estado de cada conexión: se guarda en el data.ptr del evento de epoll*/
+ struct Client {
+     int fd;
+     struct sockaddr_in addr;
+     Shard *shard;          /* el hilo dueño de la conexión: solo él la toca */
+     Subscription *subs;    /* temas a los que está suscrito, para limpiar al cerrar */
+     PatternSub *patterns;  /* patrones con comodines (los temas que calzan están en subs) */
+     RetainWait *waits;     /* suscripciones esperando lo retenido del dueño */
+     char *pending;         /* frame incompleto del último read(), si lo hay */
+     uint32_t pending_len;
+     int binary;            /* negoció el protocolo binario con BIN_OP_HELLO */
+     int lz4;               /* negoció compresión en un SUBSCRIBE */
+     WriteQueue out;        /* mensajes que el socket todavía no aceptó */
+     Replay *replay;        /* REPLAY en curso: sale antes que out */
+     uint64_t dropped;      /* mensajes descartados por desborde */
+     int closing;           /* se cierra al terminar la vuelta del event loop */
+     struct Client *next_closing;
+     struct Client *next_dirty;   /* en la ventana de coalescencia del shard */
+     struct Client **dirty_pprev; /* NULL si no está en la ventana */
+     struct Client *next_send;    /* io_uring: su envío sale al final de la vuelta */
+     struct Client **send_pprev;  /* NULL si no está anotado */
+     struct RingTx *tx;     /* io_uring: envío en curso (NULL hasta el primero) */
+     uint32_t ring_ops;     /* SQE en curso: el Client no se libera hasta que vuelvan */
+     int ring_wait;         /* esperando POLLOUT para seguir el REPLAY */
+ };
+
+ /*Envío asíncrono de un cliente: los mensajes salen de la cola con su
+   referencia y quedan acá hasta que vuelve la completación. Van en SQE de
+   RING_IOV mensajes encadenadas (IOSQE_IO_LINK) y con MSG_WAITALL: el
+   kernel las hace en orden y cada una sale entera o falla. Hay una sola
+   cadena en curso por cliente*/
+ typedef struct RingTx {
+     struct msghdr hdr[RING_CHAIN];
+     struct iovec *iov;
+     MsgBuffer **msgs;
+     uint32_t cap;          /* crece con lo que el cliente llega a juntar */
+     uint32_t count;        /* mensajes en la cadena */
+     uint32_t next;         /* SQE de la cadena que vuelve ahora */
+     int failed;
+ } RingTx;
+
+ /*Datos del broker para cada tema del registro local de un shard*/
+ typedef struct {
+     uint32_t gid;          /* id global del tema (el que ven los clientes binarios) */
+     uint32_t waiting;      /* RetainWait en camino: el dueño ya nos cuenta como interesados */
+     MsgBuffer *dict;       /* diccionario ya anunciado a los clientes con compresión */
+ } TopicInfo;
+
+ /*Compresión de un tema propio: el diccionario se entrena con las primeras
+   publicaciones y queda fijo cuando se llena o tras DICT_TRAIN_MSGS*/
+ typedef struct {
+     LzDict dict;
+     uint32_t samples;
+     int ready;
+ } Packer;
+
+ /*Shards con patrones que calzan con un tema propio, calculado con la
+   versión gen de los patrones globales*/
+ typedef struct {
+     uint64_t mask;
+     uint32_t gen;
+ } WildCache;
+
+ /*Mensajes que no entraron en la cola hacia otro shard; se reintentan en
+   orden al final de cada vuelta*/
+ typedef struct Overflow {
+     SpscItem item;
+     struct Overflow *next;
+ } Overflow;
+
+ struct Shard {
+     int index;
+     int epoll_fd;          /* -1 con --io uring */
+     IoRing *ring;          /* NULL con --io epoll */
+     IoBufRing bufs;        /* buffers de los recv multishot */
+     Client *sendq;         /* io_uring: clientes con algo para mandar en esta vuelta */
+     size_t ring_queued;    /* bytes encolados por el fan-out desde el último envío */
+     struct io_uring_cqe *backlog; /* recv ya completados, en orden, esperando turno */
+     uint32_t backlog_pos;
+     uint32_t backlog_len;
+     uint32_t backlog_cap;
+     pthread_t thread;
+     Client listener;
+     int spare_fd;          /* descriptor de reserva para rechazar con EMFILE */
+     Client waker;          /* eventfd: otro shard dejó algo en nuestras colas */
+     Client coalesce;       /* timerfd: venció la ventana de coalescencia */
+     Client *dirty;         /* clientes con mensajes esperando la ventana */
+     TopicRegistry local;   /* temas con subscribers de este shard (y caché de ids) */
+     Topic **by_gid;        /* temas locales por id global */
+     uint32_t by_gid_cap;
+     uint64_t *interest;    /* temas propios: máscara de shards con subscribers */
+     uint32_t interest_cap;
+     TopicTrie patterns;    /* patrones de los clientes de este shard (owner: Client) */
+     WildCache *wild;       /* temas propios: caché de shards con patrones que calzan */
+     uint32_t wild_cap;
+     Retained **retained;   /* temas propios: últimos mensajes publicados */
+     uint32_t retained_cap;
+     TopicLog **logs;       /* temas propios: log persistente, abierto al primer uso */
+     uint32_t logs_cap;
+     Packer **packers;      /* temas propios: compresión (--compress) */
+     uint32_t packers_cap;
+     LzState lz;            /* tabla de hashes del compresor, reusada entre mensajes */
+     uint64_t notify;       /* shards a los que hay que despertar al final de la vuelta */
+     Overflow *overflow_head[MAX_SHARDS];
+     Overflow *overflow_tail[MAX_SHARDS];
+     int overflowed;
+     Client *closing_list;
+     Metrics *metrics;      /* contadores de este shard (solo él los escribe) */
+     /*Buffer de lectura del shard: todos sus clientes leen aquí y los frames
+       completos se procesan en el lugar; solo el resto incompleto se guarda
+       en el cliente hasta el próximo read()*/
+     char rx_buffer[BUFFER_SIZE];
+     char pack_buffer[BUFFER_SIZE];
+ };
+
+ /*Directorio de nombres: asigna los ids globales. Hay uno por shard dueño y
+   solo se consulta al suscribirse o al pedir un id, nunca al publicar. Los
+   ids se intercalan (id local * shards + dueño) para que el dueño de un
+   tema se deduzca del id sin buscar nada*/
+ static struct {
+     pthread_mutex_t lock;
+     TopicRegistry names;
+ } directory[MAX_SHARDS];
+ static _Atomic uint32_t directory_topics;   /* temas en todo el directorio */
+
+ /*Patrones de todos los shards: cada shard figura una vez por patrón (owner:
+   Shard) mientras algún cliente suyo lo tenga. Lo consultan los dueños para
+   mandar un tema a shards que todavía no lo conocen*/
+ static struct {
+     pthread_mutex_t lock;
+     TopicTrie trie;
+     _Atomic uint32_t gen;     /* cambia con cada alta o baja; 0 nunca es válido */
+     _Atomic uint32_t active;  /* entradas en el trie; 0 = no hay que mirar */
+ } wildcards = { .lock = PTHREAD_MUTEX_INITIALIZER, .gen = 1 };
+
+ /*Clientes con compresión en todos los shards: sin ninguno no se comprime*/
+ static _Atomic uint32_t lz4_clients;
+
+ /*Conexiones abiertas, para --max-conns y --max-per-ip. Por IP hay una
+   tabla con un lock por cubeta; solo se toca con --max-per-ip*/
+ typedef struct IpConns {
+     in_addr_t ip;
+     uint32_t conns;
+     struct IpConns *next;
+ } IpConns;
+
+ static _Atomic long open_conns;
+ static struct {
+     pthread_mutex_t lock;
+     IpConns *head;
+ } ip_conns[IP_SLOTS];
+
+ static Shard *shards;
+ static SpscQueue *queues;  /* queues[origen * threads + destino] */
+
+ void process_message(const Frame *frame, Client *sender);
+ void subscribe_to_topic(const Command *cmd, Client *client);
+ void publish_to_topic(Shard *shard, const Command *cmd);
+ void replay_topic(const Command *cmd, Client *client);
+ static void accept_clients(Shard *shard);
+ static void handle_client(Client *client);
+ static void flush_client(Client *client);
+ static void coalesce(Client *client);
+ static void schedule_close(Client *client);
+ static void close_pending_clients(Shard *shard);
+ static void close_client(Client *client);
+ static void patterns_attach(Shard *shard, Topic *topic);
+ static void wildcards_change(Shard *shard, const char *name, size_t len, int on);
+ static int replay_flush(Client *client);
+ static void replay_free(Client *client);
+
+ /* --- Utilidades --- */
+ static int set_nonblocking(int fd) {
+     int flags = fcntl(fd, F_GETFL, 0);
+     if (flags < 0) return -1;
+     return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+ }
+
+ /*Subimos el límite de descriptores al máximo permitido para no quedarnos cortos*/
+ static void raise_fd_limit(void) {
+     struct rlimit rl;
+     if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+         rl.rlim_cur = rl.rlim_max;
+         setrlimit(RLIMIT_NOFILE, &rl);
+     }
+ }
+
+ static void usage(const char *prog) {
+     fprintf(stderr, "Uso: %s [--hwm BYTES] [--overflow drop-oldest|drop-newest|disconnect] [--threads N] "
+                     "[--stats-port PORT] [--stats-interval SEGUNDOS] [--log-level error|warn|info|debug] "
+                     "[--retain N] [--max-topics N] [--store DIR] [--store-sync-ms MS] "
+                     "[--coalesce-us US] [--coalesce-bytes N] [--compress] [--io epoll|uring] "
+                     "[--backlog N] [--max-conns N] [--max-per-ip N]\n", prog);
+     exit(EXIT_FAILURE);
+ }
+
+ static void parse_args(int argc, char *argv[]) {
+     for (int i = 1; i < argc; i++) {
+         if (strcmp(argv[i], "--hwm") == 0 && i + 1 < argc) {
+             config.hwm = strtoull(argv[++i], NULL, 10);
+         } else if (strcmp(argv[i], "--overflow") == 0 && i + 1 < argc) {
+             const char *policy = argv[++i];
+             if (strcmp(policy, "drop-oldest") == 0) config.overflow = OVERFLOW_DROP_OLDEST;
+             else if (strcmp(policy, "drop-newest") == 0) config.overflow = OVERFLOW_DROP_NEWEST;
+             else if (strcmp(policy, "disconnect") == 0) config.overflow = OVERFLOW_DISCONNECT;
+             else usage(argv[0]);
+         } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+             config.threads = atoi(argv[++i]);
+             if (config.threads < 1 || config.threads > MAX_SHARDS) {
+                 fprintf(stderr, "--threads debe estar entre 1 y %d\n", MAX_SHARDS);
+                 exit(EXIT_FAILURE);
+             }
+         } else if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+             config.stats_port = atoi(argv[++i]);
+         } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+             config.stats_interval = atof(argv[++i]);
+         } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+             config.log_level = log_level_parse(argv[++i]);
+             if (config.log_level < 0) usage(argv[0]);
+         } else if (strcmp(argv[i], "--retain") == 0 && i + 1 < argc) {
+             int retain = atoi(argv[++i]);
+             if (retain < 0 || retain > RETAIN_MAX) {
+                 fprintf(stderr, "--retain debe estar entre 0 y %d\n", RETAIN_MAX);
+                 exit(EXIT_FAILURE);
+             }
+             config.retain = (uint32_t)retain;
+         } else if (strcmp(argv[i], "--max-topics") == 0 && i + 1 < argc) {
+             config.max_topics = (uint32_t)strtoul(argv[++i], NULL, 10);
+         } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+             config.store_dir = argv[++i];
+         } else if (strcmp(argv[i], "--store-sync-ms") == 0 && i + 1 < argc) {
+             config.store_sync_ms = atoi(argv[++i]);
+             if (config.store_sync_ms < 1) usage(argv[0]);
+         } else if (strcmp(argv[i], "--coalesce-us") == 0 && i + 1 < argc) {
+             config.coalesce_us = atol(argv[++i]);
+             if (config.coalesce_us < 0 || config.coalesce_us >= 1000000) {
+                 fprintf(stderr, "--coalesce-us debe estar entre 0 y 999999\n");
+                 exit(EXIT_FAILURE);
+             }
+         } else if (strcmp(argv[i], "--coalesce-bytes") == 0 && i + 1 < argc) {
+             long long bytes = atoll(argv[++i]);
+             if (bytes < 1) usage(argv[0]);
+             config.coalesce_bytes = (size_t)bytes;
+             /*Solo el límite de bytes: la ventana acota cuánto puede esperar un mensaje*/
+             if (config.coalesce_us == 0) config.coalesce_us = DEFAULT_COALESCE_US;
+         } else if (strcmp(argv[i], "--compress") == 0) {
+             config.compress = 1;
+         } else if (strcmp(argv[i], "--io") == 0 && i + 1 < argc) {
+             const char *io = argv[++i];
+             if (strcmp(io, "epoll") == 0) config.io = IO_EPOLL;
+             else if (strcmp(io, "uring") == 0) config.io = IO_URING;
+             else usage(argv[0]);
+         } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+             config.backlog = atoi(argv[++i]);
+             if (config.backlog < 1) usage(argv[0]);
+         } else if (strcmp(argv[i], "--max-conns") == 0 && i + 1 < argc) {
+             config.max_conns = atol(argv[++i]);
+             if (config.max_conns < 0) usage(argv[0]);
+         } else if (strcmp(argv[i], "--max-per-ip") == 0 && i + 1 < argc) {
+             int per_ip = atoi(argv[++i]);
+             if (per_ip < 0) usage(argv[0]);
+             config.max_per_ip = (uint32_t)per_ip;
+         } else {
+             usage(argv[0]);
+         }
+     }
+ }
+
+ /* --- Directorio de temas y shard dueño --- */
+
+ /*El dueño sale del hash del nombre, mezclado otra vez porque los bits bajos
+   ya los usa la tabla del registro*/
+ static uint32_t owner_of_name(const char *name, size_t len) {
+     uint32_t h = registry_hash(name, len);
+     h = (h ^ (h >> 16)) * 0x9E3779B1u;
+     return (h >> 16) % (uint32_t)config.threads;
+ }
+
+ static uint32_t owner_of_id(uint32_t gid) {
+     return gid % (uint32_t)config.threads;
+ }
+
+ /*Busca (o crea, si create) el tema en el directorio. Los Topic del
+   directorio nunca se liberan: el nombre sigue válido sin el lock*/
+ static const Topic *directory_lookup(const char *name, size_t len, int create, uint32_t *gid) {
+     uint32_t owner = owner_of_name(name, len);
+     pthread_mutex_lock(&directory[owner].lock);
+     uint32_t before = directory[owner].names.count;
+     Topic *t = create ? registry_intern(&directory[owner].names, name, len)
+                       : registry_find(&directory[owner].names, name, len);
+     if (directory[owner].names.count != before)
+         atomic_fetch_add_explicit(&directory_topics, 1, memory_order_relaxed);
+     pthread_mutex_unlock(&directory[owner].lock);
+     if (t != NULL) *gid = t->id * (uint32_t)config.threads + owner;
+     return t;
+ }
+
+ static const Topic *directory_by_id(uint32_t gid) {
+     uint32_t owner = owner_of_id(gid);
+     pthread_mutex_lock(&directory[owner].lock);
+     Topic *t = registry_by_id(&directory[owner].names, gid / (uint32_t)config.threads);
+     pthread_mutex_unlock(&directory[owner].lock);
+     return t;
+ }
+
+ /*Diccionario de compresión de un tema (un BIN_OP_DICT ya armado) en el
+   user del directorio. Lo fija el dueño una sola vez, antes de mandar el
+   primer mensaje comprimido, y no se libera: los shards lo usan sin
+   referencia propia*/
+ static void directory_set_dict(uint32_t gid, MsgBuffer *dict) {
+     uint32_t owner = owner_of_id(gid);
+     pthread_mutex_lock(&directory[owner].lock);
+     Topic *t = registry_by_id(&directory[owner].names, gid / (uint32_t)config.threads);
+     if (t != NULL) t->user = dict;
+     pthread_mutex_unlock(&directory[owner].lock);
+ }
+
+ static MsgBuffer *directory_dict(uint32_t gid) {
+     uint32_t owner = owner_of_id(gid);
+     pthread_mutex_lock(&directory[owner].lock);
+     Topic *t = registry_by_id(&directory[owner].names, gid / (uint32_t)config.threads);
+     MsgBuffer *dict = t ? t->user : NULL;
+     pthread_mutex_unlock(&directory[owner].lock);
+     return dict;
+ }
+
+ /*Agranda un arreglo de punteros o máscaras dejando en cero lo nuevo. Pasado
+   GROW_MAX el doble ya no entra en 32 bits: -1 en lugar de dar la vuelta*/
+ static int grow_array(void **array, uint32_t *cap, uint32_t need, size_t elem) {
+     if (need < *cap) return 0;
+     if (need >= GROW_MAX) return -1;
+     uint32_t new_cap = *cap ? *cap : 64;
+     while (new_cap <= need) new_cap *= 2;
+     char *grown = realloc(*array, new_cap * elem);
+     if (grown == NULL) return -1;
+     memset(grown + (size_t)*cap * elem, 0, (size_t)(new_cap - *cap) * elem);
+     *array = grown;
+     *cap = new_cap;
+     return 0;
+ }
+
+ static uint32_t topic_gid(const Topic *t) {
+     return ((const TopicInfo *)t->user)->gid;
+ }
+
+ /*Tema del registro local del shard, con su id global anotado*/
+ static Topic *local_topic(Shard *shard, const char *name, size_t len, uint32_t gid) {
+     Topic *t = registry_intern(&shard->local, name, len);
+     if (t == NULL) return NULL;
+     if (t->user == NULL) {
+         if (grow_array((void **)&shard->by_gid, &shard->by_gid_cap, gid, sizeof(Topic *)) < 0)
+             return NULL;
+         TopicInfo *info = malloc(sizeof(TopicInfo));
+         if (info == NULL) return NULL;
+         info->gid = gid;
+         info->waiting = 0;
+         info->dict = NULL;
+         t->user = info;
+         shard->by_gid[gid] = t;
+         /*Tema nuevo para el shard: se suscriben los clientes con patrones que calzan*/
+         if (shard->patterns.patterns > 0) patterns_attach(shard, t);
+     }
+     return t;
+ }
+
+ /* --- Comunicación entre shards --- */
+
+ /*Manda un mensaje a otro shard sin bloquear: si la cola está llena (o ya
+   hay mensajes esperando, para no desordenarlos) se guarda aparte*/
+ static void shard_send(Shard *shard, uint32_t to, uint32_t op, uint32_t gid, void *ptr) {
+     SpscItem item = { op, gid, ptr };
+     shard->notify |= 1ull << to;
+     if (shard->overflow_head[to] == NULL &&
+         spsc_push(&queues[shard->index * config.threads + to], item) == 0)
+         return;
+
+     Overflow *node = malloc(sizeof(Overflow));
+     if (node == NULL) {
+         /*Sin memoria se pierde el mensaje, pero no la referencia*/
+         if (ptr != NULL && (op == SHARD_PUBLISH || op == SHARD_DELIVER)) msg_release(ptr);
+         return;
+     }
+     node->item = item;
+     node->next = NULL;
+     if (shard->overflow_tail[to]) shard->overflow_tail[to]->next = node;
+     else shard->overflow_head[to] = node;
+     shard->overflow_tail[to] = node;
+     shard->overflowed = 1;
+ }
+
+ /*Fin de la vuelta: reintentamos lo que no entró y despertamos una sola vez
+   a cada shard que recibió algo*/
+ static void shard_flush(Shard *shard) {
+     if (shard->overflowed) {
+         shard->overflowed = 0;
+         for (int to = 0; to < config.threads; to++) {
+             SpscQueue *q = &queues[shard->index * config.threads + to];
+             while (shard->overflow_head[to] != NULL && spsc_push(q, shard->overflow_head[to]->item) == 0) {
+                 Overflow *node = shard->overflow_head[to];
+                 shard->overflow_head[to] = node->next;
+                 shard->notify |= 1ull << to;
+                 free(node);
+             }
+             if (shard->overflow_head[to] == NULL) shard->overflow_tail[to] = NULL;
+             else shard->overflowed = 1;
+         }
+     }
+
+     static const uint64_t one = 1;
+     while (shard->notify) {
+         int to = __builtin_ctzll(shard->notify);
+         shard->notify &= shard->notify - 1;
+         /*Con io_uring el aviso sale junto con el resto de la vuelta*/
+         struct io_uring_sqe *sqe = shard->ring != NULL ? ioring_sqe(shard->ring) : NULL;
+         if (sqe != NULL) {
+             sqe->opcode = IORING_OP_WRITE;
+             sqe->fd = shards[to].waker.fd;
+             sqe->addr = (uint64_t)(uintptr_t)&one;
+             sqe->len = sizeof(one);
+             sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+             continue;
+         }
+         if (write(shards[to].waker.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+             log_limited(LOG_LVL_ERROR, 10, "eventfd: %s", strerror(errno));
+     }
+ }
+
+ /*Cambio de subscribers de un tema en este shard: se avisa al dueño solo
+   cuando pasa de 0 a 1 o de 1 a 0*/
+ static void set_interest(Shard *owner, uint32_t gid, uint32_t from, int on) {
+     uint32_t slot = gid / (uint32_t)config.threads;
+     if (grow_array((void **)&owner->interest, &owner->interest_cap, slot, sizeof(uint64_t)) < 0)
+         return;
+     if (on) owner->interest[slot] |= 1ull << from;
+     else owner->interest[slot] &= ~(1ull << from);
+ }
+
+ static void interest_changed(Shard *shard, uint32_t gid, int on) {
+     uint32_t owner = owner_of_id(gid);
+     if (owner == (uint32_t)shard->index)
+         set_interest(shard, gid, owner, on);
+     else
+         shard_send(shard, owner, on ? SHARD_SUB_ADD : SHARD_SUB_DEL, gid, NULL);
+ }
+
+ /*El shard ya no necesita el tema: sin subscribers ni respuestas en camino*/
+ static void topic_idle_check(Shard *shard, Topic *topic) {
+     const TopicInfo *info = topic->user;
+     if (topic->num_subs == 0 && info->waiting == 0) interest_changed(shard, info->gid, 0);
+ }
+
+ /*Mensaje saliente de un fan-out. Se escribe directo desde los slices del
+   frame recibido; el MsgBuffer compartido se arma recién cuando el primer
+   subscriber necesita encolarlo (o hay que pasarlo a otro shard) y lo
+   reusan todos los demás*/
+ typedef struct {
+     uint8_t opcode;
+     uint8_t flags;
+     uint32_t topic;
+     Slice payload;
+     int control;           /* respuestas del broker: siempre en binario */
+     char header[PROTO_BIN_HEADER];
+     MsgBuffer *shared;
+     MsgBuffer *packed;     /* versión comprimida, si el dueño la armó */
+ } Outgoing;
+
+ static void outgoing_init(Outgoing *out, uint8_t opcode, uint8_t flags, uint32_t topic,
+                           const char *payload, size_t len) {
+     out->opcode = opcode;
+     out->flags = flags;
+     out->topic = topic;
+     out->payload.data = payload;
+     out->payload.len = len;
+     out->control = 0;
+     out->shared = NULL;
+     out->packed = NULL;
+     proto_write_bin_header(out->header, opcode, flags, topic, (uint32_t)len);
+ }
+
+ /*Mensaje que llegó de otro shard: nos quedamos con su referencia*/
+ static void outgoing_adopt(Outgoing *out, MsgBuffer *msg) {
+     out->opcode = BIN_OP_MESSAGE;
+     out->flags = BIN_FLAG_TOPIC_ID;
+     memcpy(out->header, msg->data, PROTO_BIN_HEADER);
+     out->payload.data = msg->data + PROTO_BIN_HEADER;
+     out->payload.len = msg->payload_len;
+     out->control = 0;
+     out->shared = msg;
+     out->packed = msg->packed;
+     if (out->packed != NULL) msg_ref(out->packed);
+ }
+
+ /*La versión comprimida viaja colgada del mensaje compartido*/
+ static void attach_packed(Outgoing *out) {
+     if (out->shared == NULL || out->packed == NULL || out->shared->packed != NULL) return;
+     msg_ref(out->packed);
+     out->shared->packed = out->packed;
+ }
+
+ static MsgBuffer *outgoing_share(Outgoing *out) {
+     if (out->shared == NULL) {
+         out->shared = msg_new(out->opcode, out->flags, out->topic,
+                               out->payload.data, (uint32_t)out->payload.len);
+         attach_packed(out);
+     }
+     return out->shared;
+ }
+
+ /*Suelta las referencias del creador; las colas conservan las suyas*/
+ static void outgoing_done(Outgoing *out) {
+     if (out->shared != NULL) msg_release(out->shared);
+     if (out->packed != NULL) msg_release(out->packed);
+ }
+
+ /* --- Event loop de cada shard --- */
+
+ static void shard_drain(Shard *shard);
+ static void coalesce_expired(Shard *shard);
+ static void ring_main(Shard *shard);
+
+ static void *shard_main(void *arg) {
+     Shard *shard = arg;
+     struct epoll_event events[MAX_EVENTS];
+     shard->metrics = metrics_local();
+
+     /*Cada shard en su CPU: sus clientes, colas y buffers quedan en su caché*/
+     if (config.threads > 1) {
+         long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         CPU_SET(shard->index % (cpus > 0 ? cpus : 1), &set);
+         pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+     }
+     if (config.io == IO_URING) {
+         ring_main(shard);
+         return NULL;
+     }
+
+     /*Bucle principal del shard: solo recorremos los sockets que tienen actividad*/
+     while (1) {
+         /*Si quedaron mensajes sin entrar en otra cola, volvemos pronto a reintentar*/
+         int n = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, shard->overflowed ? 1 : -1);
+         if (n < 0) {
+             if (errno != EINTR) log_limited(LOG_LVL_ERROR, 10, "epoll_wait: %s", strerror(errno));
+             continue;
+         }
+
+         for (int i = 0; i < n; i++) {
+             Client *client = events[i].data.ptr;
+             if (client == &shard->listener) {
+                 accept_clients(shard);
+                 continue;
+             }
+             if (client == &shard->waker) {
+                 shard_drain(shard);
+                 continue;
+             }
+             if (client == &shard->coalesce) {
+                 coalesce_expired(shard);
+                 continue;
+             }
+             if (!client->closing && (events[i].events & EPOLLOUT))
+                 flush_client(client);
+             if (!client->closing && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                 handle_client(client);
+         }
+
+         /*Los cierres se hacen al final para no liberar clientes que todavía
+           aparecen en esta tanda de eventos o en un fan-out en curso*/
+         close_pending_clients(shard);
+         shard_flush(shard);
+     }
+     return NULL;
+ }
+
+ /*Abre el socket de escucha y el epoll de un shard*/
+ static void shard_open(Shard *shard) {
      struct sockaddr_in address;
-     int addrlen = sizeof(address);
-     fd_set readfds;
- 
+     struct epoll_event ev;
+
      /*Creamos el socket*/
-     server_fd = socket(AF_INET, SOCK_STREAM, 0);
+     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
      if (server_fd < 0) {
          perror("socket failed");
          exit(EXIT_FAILURE);
      }
- 
+
      int opt = 1;
      setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
- 
+     /*Con varios shards cada uno escucha en el mismo puerto y el kernel
+       reparte las conexiones nuevas*/
+     if (config.threads > 1 && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+         perror("SO_REUSEPORT");
+         exit(EXIT_FAILURE);
+     }
+
+     memset(&address, 0, sizeof(address));
      address.sin_family = AF_INET;
      address.sin_addr.s_addr = INADDR_ANY;
      address.sin_port = htons(PORT);
- 
+
      if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
          perror("bind failed");
          exit(EXIT_FAILURE);
      }
- 
-     if (listen(server_fd, 5) < 0) {
+
+     if (listen(server_fd, config.backlog) < 0) {
          perror("listen");
          exit(EXIT_FAILURE);
      }
- 
-     printf("Broker TCP escuchando en puerto %d...\n", PORT);
- 
-     /*Inicializamos la lista de clientes*/
-     for (int i = 0; i < MAX_CLIENTS; i++) client_sockets[i] = 0;
- 
-     char buffer[BUFFER_SIZE];
- 
-     /*Bucle principal del broker*/
+     set_nonblocking(server_fd);
+
+     lz_state_init(&shard->lz);
+     shard->listener.fd = server_fd;
+     shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+     shard->waker.fd = eventfd(0, EFD_NONBLOCK);
+     if (shard->spare_fd < 0 || shard->waker.fd < 0) {
+         perror("eventfd/open");
+         exit(EXIT_FAILURE);
+     }
+     if (config.coalesce_us > 0) {
+         shard->coalesce.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+         if (shard->coalesce.fd < 0) {
+             perror("timerfd");
+             exit(EXIT_FAILURE);
+         }
+     }
+
+     /*Con io_uring el anillo lo arma el hilo del shard (ver ring_main)*/
+     shard->epoll_fd = -1;
+     if (config.io == IO_URING) return;
+     shard->epoll_fd = epoll_create1(0);
+     if (shard->epoll_fd < 0) {
+         perror("epoll_create1");
+         exit(EXIT_FAILURE);
+     }
+     ev.events = EPOLLIN | EPOLLET;
+     ev.data.ptr = &shard->listener;
+     if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) < 0) {
+         perror("epoll_ctl");
+         exit(EXIT_FAILURE);
+     }
+     ev.events = EPOLLIN;
+     ev.data.ptr = &shard->waker;
+     if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->waker.fd, &ev) < 0) {
+         perror("epoll_ctl");
+         exit(EXIT_FAILURE);
+     }
+
+     if (config.coalesce_us > 0) {
+         ev.events = EPOLLIN;
+         ev.data.ptr = &shard->coalesce;
+         if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->coalesce.fd, &ev) < 0) {
+             perror("epoll_ctl");
+             exit(EXIT_FAILURE);
+         }
+     }
+ }
+
+ /* --- Función principal --- */
+ int main(int argc, char *argv[]) {
+     parse_args(argc, argv);
+     if (log_start(config.log_level) < 0) {
+         fprintf(stderr, "No se pudo iniciar el log\n");
+         exit(EXIT_FAILURE);
+     }
+     raise_fd_limit();
+     if (config.store_dir != NULL && tlog_start(config.store_dir, config.store_sync_ms) < 0) {
+         fprintf(stderr, "No se pudo abrir el log en %s: %s\n", config.store_dir, strerror(errno));
+         exit(EXIT_FAILURE);
+     }
+
+     /*Un subscriber que se cae no debe matar al broker con SIGPIPE*/
+     signal(SIGPIPE, SIG_IGN);
+
+     if (config.io == IO_URING && ioring_probe() < 0) {
+         log_warn("io_uring no disponible (%s): se usa epoll", strerror(errno));
+         config.io = IO_EPOLL;
+     }
+
+     int n = config.threads;
+     shards = calloc((size_t)n, sizeof(Shard));
+     queues = aligned_alloc(SPSC_CACHE_LINE, (size_t)n * n * sizeof(SpscQueue));
+     if (shards == NULL || queues == NULL) {
+         perror("calloc");
+         exit(EXIT_FAILURE);
+     }
+     for (int i = 0; i < n * n; i++) {
+         if (spsc_init(&queues[i], SHARD_QUEUE_CAP) < 0) {
+             perror("spsc_init");
+             exit(EXIT_FAILURE);
+         }
+     }
+     for (int i = 0; i < n; i++) {
+         pthread_mutex_init(&directory[i].lock, NULL);
+         registry_init(&directory[i].names);
+         shards[i].index = i;
+         registry_init(&shards[i].local);
+         trie_init(&shards[i].patterns);
+         shard_open(&shards[i]);
+     }
+     for (int i = 0; i < IP_SLOTS; i++)
+         pthread_mutex_init(&ip_conns[i].lock, NULL);
+
+     log_info("Broker TCP escuchando en puerto %d (%d hilo%s, %s)", PORT, n, n == 1 ? "" : "s",
+              config.io == IO_URING ? "io_uring" : "epoll");
+     if (metrics_start("broker_tcp", config.stats_port, config.stats_interval) < 0)
+         exit(EXIT_FAILURE);
+
+     for (int i = 1; i < n; i++) {
+         if (pthread_create(&shards[i].thread, NULL, shard_main, &shards[i]) != 0) {
+             perror("pthread_create");
+             exit(EXIT_FAILURE);
+         }
+     }
+     shard_main(&shards[0]);
+     return 0;
+ }
+
+ /* --- Admisión de conexiones --- */
+
+ static IpConns **ip_find(IpConns **link, in_addr_t ip) {
+     while (*link != NULL && (*link)->ip != ip) link = &(*link)->next;
+     return link;
+ }
+
+ static uint32_t ip_slot(in_addr_t ip) {
+     return ((uint32_t)ip * 2654435761u) >> 22;  /* 10 bits: IP_SLOTS */
+ }
+
+ /*Reserva el lugar de una conexión nueva. NULL si entra; si no, el motivo
+   que se le manda en el BUSY*/
+ static const char *admit(const struct sockaddr_in *addr) {
+     long open_now = atomic_fetch_add_explicit(&open_conns, 1, memory_order_relaxed);
+     if (config.max_conns > 0 && open_now >= config.max_conns) {
+         atomic_fetch_sub_explicit(&open_conns, 1, memory_order_relaxed);
+         return "max-conns";
+     }
+     if (config.max_per_ip == 0) return NULL;
+
+     in_addr_t ip = addr->sin_addr.s_addr;
+     uint32_t slot = ip_slot(ip);
+     const char *busy = NULL;
+     pthread_mutex_lock(&ip_conns[slot].lock);
+     IpConns *entry = *ip_find(&ip_conns[slot].head, ip);
+     if (entry == NULL && (entry = calloc(1, sizeof(IpConns))) != NULL) {
+         entry->ip = ip;
+         entry->next = ip_conns[slot].head;
+         ip_conns[slot].head = entry;
+     }
+     if (entry == NULL) busy = "sin-memoria";
+     else if (entry->conns >= config.max_per_ip) busy = "max-per-ip";
+     else entry->conns++;
+     pthread_mutex_unlock(&ip_conns[slot].lock);
+     if (busy != NULL) atomic_fetch_sub_explicit(&open_conns, 1, memory_order_relaxed);
+     return busy;
+ }
+
+ /*Devuelve el lugar de una conexión admitida que se cierra*/
+ static void admit_release(const struct sockaddr_in *addr) {
+     atomic_fetch_sub_explicit(&open_conns, 1, memory_order_relaxed);
+     if (config.max_per_ip == 0) return;
+
+     in_addr_t ip = addr->sin_addr.s_addr;
+     uint32_t slot = ip_slot(ip);
+     pthread_mutex_lock(&ip_conns[slot].lock);
+     IpConns **link = ip_find(&ip_conns[slot].head, ip);
+     if (*link != NULL && --(*link)->conns == 0) {
+         IpConns *entry = *link;
+         *link = entry->next;
+         free(entry);
+     }
+     pthread_mutex_unlock(&ip_conns[slot].lock);
+ }
+
+ /*Conexión que no entra: recibe una línea BUSY (texto, porque todavía no
+   negoció nada) y se cierra. Antes se lee lo que el cliente ya mandó: con
+   datos sin leer el close sale como RST y el cliente pierde el aviso*/
+ static void reject_conn(Shard *shard, int fd, const char *reason) {
+     char line[64];
+     int n = snprintf(line, sizeof(line), PROTO_BUSY " %s\n", reason);
+     send(fd, line, (size_t)n, MSG_DONTWAIT | MSG_NOSIGNAL);
+     for (int i = 0; i < 4 && recv(fd, shard->rx_buffer, BUFFER_SIZE, MSG_DONTWAIT) > 0; i++) {}
+     close(fd);
+     metrics_add(shard->metrics, MET_REJECTS, 1);
+     log_limited(LOG_LVL_WARN, 10, "Conexión rechazada: %s", reason);
+ }
+
+ /*Sin descriptores libres (EMFILE) accept falla y la conexión sigue en la
+   cola; con edge-triggered o con el accept multishot nadie vuelve a avisar.
+   Se suelta el descriptor de reserva y con ese lugar se vacía la cola
+   rechazando todo*/
+ static void shed_backlog(Shard *shard) {
+     if (shard->spare_fd >= 0) close(shard->spare_fd);
+     int fd;
+     while ((fd = accept4(shard->listener.fd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+         reject_conn(shard, fd, "sin-descriptores");
+     shard->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+     if (shard->spare_fd < 0)
+         log_limited(LOG_LVL_ERROR, 10, "Sin descriptor de reserva en el shard %d", shard->index);
+ }
+
+ /*Estado inicial de una conexión recién aceptada. NULL si no hay memoria*/
+ static Client *client_new(Shard *shard, int fd, const struct sockaddr_in *address) {
+     Client *client = malloc(sizeof(Client));
+     if (client == NULL) return NULL;
+     client->fd = fd;
+     client->addr = *address;
+     client->shard = shard;
+     client->subs = NULL;
+     client->patterns = NULL;
+     client->waits = NULL;
+     client->pending = NULL;
+     client->pending_len = 0;
+     client->binary = 0;
+     client->lz4 = 0;
+     wq_init(&client->out);
+     client->replay = NULL;
+     client->dropped = 0;
+     client->closing = 0;
+     client->next_closing = NULL;
+     client->next_dirty = NULL;
+     client->dirty_pprev = NULL;
+     client->next_send = NULL;
+     client->send_pprev = NULL;
+     client->tx = NULL;
+     client->ring_ops = 0;
+     client->ring_wait = 0;
+     return client;
+ }
+
+ static void client_connected(Client *client) {
+     metrics_add(client->shard->metrics, MET_CONNECTS, 1);
+     log_limited(LOG_LVL_INFO, 100, "Nueva conexión fd=%d ip=%s puerto=%d",
+                 client->fd, inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port));
+ }
+
+ /*Nuevas conexiones: con edge-triggered hay que aceptar hasta vaciar la cola*/
+ static void accept_clients(Shard *shard) {
      while (1) {
-         FD_ZERO(&readfds);
-         FD_SET(server_fd, &readfds);
-         int max_sd = server_fd;
- 
-         for (int i = 0; i < MAX_CLIENTS; i++) {
-             int sd = client_sockets[i];
-             if (sd > 0) FD_SET(sd, &readfds);
-             if (sd > max_sd) max_sd = sd;
-         }
- 
-         int activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-         if (activity < 0 && errno != EINTR) {
-             perror("select error");
-         }
- 
-         /*Nueva conexión*/
-         if (FD_ISSET(server_fd, &readfds)) {
-             new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-             if (new_socket < 0) {
-                 perror("accept");
-                 continue;
+         struct sockaddr_in address;
+         socklen_t addrlen = sizeof(address);
+         int new_socket = accept4(shard->listener.fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK);
+         if (new_socket < 0) {
+             if (errno == EINTR) continue;
+             if (errno == EMFILE || errno == ENFILE) shed_backlog(shard);
+             else if (errno != EAGAIN && errno != EWOULDBLOCK)
+                 log_limited(LOG_LVL_ERROR, 10, "accept: %s", strerror(errno));
+             return;
+         }
+
+         const char *busy = admit(&address);
+         if (busy != NULL) {
+             reject_conn(shard, new_socket, busy);
+             continue;
+         }
+         Client *client = client_new(shard, new_socket, &address);
+         if (client == NULL) {
+             admit_release(&address);
+             close(new_socket);
+             continue;
+         }
+
+         /*EPOLLOUT en edge-triggered solo avisa cuando el socket vuelve a tener
+           espacio, así que registrarlo desde el principio no cuesta nada*/
+         struct epoll_event ev;
+         ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+         ev.data.ptr = client;
+         if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, new_socket, &ev) < 0) {
+             log_limited(LOG_LVL_ERROR, 10, "epoll_ctl: %s", strerror(errno));
+             admit_release(&address);
+             close(new_socket);
+             free(client);
+             continue;
+         }
+         client_connected(client);
+     }
+ }
+
+ /*Procesa todos los frames completos de buf[0..len) y deja el resto al
+   principio. Retorna los bytes sobrantes o -1 si el frame es inválido*/
+ static ssize_t dispatch_frames(Client *client, char *buf, size_t len) {
+     size_t off = 0, used;
+     Frame frame;
+     int r;
+
+     while (!client->closing && (r = proto_next_frame(buf + off, len - off, &frame, &used)) == 1) {
+         process_message(&frame, client);
+         off += used;
+     }
+     if (client->closing) return 0;
+     if (r < 0) return -1;
+
+     memmove(buf, buf + off, len - off);
+     return (ssize_t)(len - off);
+ }
+
+ /*Guarda (o libera) el frame incompleto del cliente, que está al principio de buf*/
+ static int save_pending(Client *client, const char *buf, size_t len) {
+     if (len == 0) {
+         free(client->pending);
+         client->pending = NULL;
+         client->pending_len = 0;
+         return 0;
+     }
+     char *pending = realloc(client->pending, len);
+     if (pending == NULL) return -1;
+     memmove(pending, buf, len);
+     client->pending = pending;
+     client->pending_len = (uint32_t)len;
+     return 0;
+ }
+
+ /*Fin de conexión: un último comando sin '\n' también se procesa*/
+ static void process_last(Client *client, char *buf, size_t len) {
+     if (len > 0 && (unsigned char)buf[0] != PROTO_BIN_MAGIC && (unsigned char)buf[0] != PROTO_LEN_MAGIC) {
+         Frame last = { .kind = FRAME_TEXT, .body = { buf, len } };
+         process_message(&last, client);
+     }
+ }
+
+ /*Mensajes de clientes existentes: leemos hasta EAGAIN (edge-triggered)*/
+ static void handle_client(Client *client) {
+     char *rx_buffer = client->shard->rx_buffer;
+     size_t len = client->pending_len;
+     if (len > 0) memcpy(rx_buffer, client->pending, len);
+
+     while (1) {
+         ssize_t valread = read(client->fd, rx_buffer + len, BUFFER_SIZE - len);
+         if (valread > 0) {
+             ssize_t rest = dispatch_frames(client, rx_buffer, len + (size_t)valread);
+             if (rest < 0) {
+                 log_limited(LOG_LVL_WARN, 10, "Frame inválido o demasiado grande, cerrando fd=%d", client->fd);
+                 break;
              }
- 
-             printf("Nueva conexión: fd=%d, ip=%s, puerto=%d\n",
-                    new_socket, inet_ntoa(address.sin_addr), ntohs(address.sin_port));
- 
-             for (int i = 0; i < MAX_CLIENTS; i++) {
-                 if (client_sockets[i] == 0) {
-                     client_sockets[i] = new_socket;
-                     break;
-                 }
+             len = (size_t)rest;
+             continue;
+         }
+         if (valread < 0 && errno == EINTR) continue;
+         if (valread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+             if (save_pending(client, rx_buffer, len) == 0) return;
+             break;
+         }
+         if (valread == 0) process_last(client, rx_buffer, len);
+         break;
+     }
+
+     schedule_close(client);
+ }
+
+ /*Gauges de las colas de salida: se suma lo que cambió la cola del cliente*/
+ static void queue_changed(Client *client, size_t bytes_before, uint32_t count_before) {
+     Metrics *m = client->shard->metrics;
+     metrics_gauge(m, MET_QUEUED_BYTES, (int64_t)client->out.bytes - (int64_t)bytes_before);
+     metrics_gauge(m, MET_QUEUED_MSGS, (int64_t)client->out.count - (int64_t)count_before);
+ }
+
+ static void send_queue(Client *client);
+
+ /*El socket volvió a tener espacio: mandamos lo que quedó en la cola. Con
+   io_uring el cliente solo se anota y su envío sale al final de la vuelta,
+   junto con el de todos los demás (ver ring_send)*/
+ static void flush_client(Client *client) {
+     if (config.io == IO_URING) {
+         send_queue(client);
+         return;
+     }
+     if (client->replay != NULL) {
+         int r = replay_flush(client);
+         if (r < 0) schedule_close(client);
+         if (r != 0) return;
+     }
+     size_t bytes = client->out.bytes;
+     uint32_t count = client->out.count;
+     if (wq_flush(&client->out, client->fd) < 0) schedule_close(client);
+     queue_changed(client, bytes, count);
+ }
+
+ /*Entrega un mensaje sin bloquear: se intenta escribir directo y lo que el
+   socket no acepta se encola respetando el high-water mark*/
+ static void deliver(Client *client, Outgoing *out) {
+     size_t written = 0;
+     if (client->closing) return;
+
+     /*Texto: cada mensaje sale como una línea para que el subscriber pueda separarlos.
+       Binario: cabecera fija con el id del tema y el largo del payload*/
+     int binary = client->binary || out->control;
+     /*Con compresión negociada sale la versión comprimida por el dueño, si la hay*/
+     MsgBuffer *packed = client->lz4 ? out->packed : NULL;
+     struct iovec iov[2];
+     if (packed != NULL) {
+         iov[0] = (struct iovec){ packed->data, msg_bin_len(packed) };
+         iov[1] = (struct iovec){ NULL, 0 };
+         metrics_add(client->shard->metrics, MET_BYTES_SAVED, out->payload.len - packed->payload_len);
+     } else if (binary) {
+         iov[0] = (struct iovec){ out->header, PROTO_BIN_HEADER };
+         iov[1] = (struct iovec){ (void *)out->payload.data, out->payload.len };
+     } else {
+         iov[0] = (struct iovec){ (void *)out->payload.data, out->payload.len };
+         iov[1] = (struct iovec){ "\n", 1 };
+     }
+     size_t total = iov[0].iov_len + iov[1].iov_len;
+
+     /*Durante un REPLAY todo lo nuevo espera detrás del log. Con ventana de
+       coalescencia tampoco se escribe directo: se junta en la cola. Con
+       io_uring nunca: la cola sale en el envío de fin de vuelta*/
+     if (wq_empty(&client->out) && client->replay == NULL && config.coalesce_us == 0 &&
+         config.io == IO_EPOLL) {
+         ssize_t w = writev(client->fd, iov, 2);
+         if (w < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+             schedule_close(client);
+             return;
+         }
+         written = w > 0 ? (size_t)w : 0;
+         if (written == total) return;
+     }
+
+     /*Un frame escrito a medias se termina siempre; si no, aplicamos la política*/
+     Metrics *m = client->shard->metrics;
+     size_t bytes = client->out.bytes;
+     uint32_t count = client->out.count;
+     if (written == 0 && client->out.bytes + total > config.hwm) {
+         switch (config.overflow) {
+         case OVERFLOW_DROP_NEWEST:
+             client->dropped++;
+             metrics_add(m, MET_DROPS, 1);
+             return;
+         case OVERFLOW_DROP_OLDEST:
+             while (client->out.bytes + total > config.hwm && wq_drop_oldest(&client->out) > 0) {
+                 client->dropped++;
+                 metrics_add(m, MET_DROPS, 1);
              }
+             break;
+         case OVERFLOW_DISCONNECT:
+             log_limited(LOG_LVL_WARN, 10, "Subscriber lento, desconectando fd=%d", client->fd);
+             schedule_close(client);
+             return;
          }
- 
-         // Mensajes de clientes existentes
-         for (int i = 0; i < MAX_CLIENTS; i++) {
-             int sd = client_sockets[i];
-             if (sd > 0 && FD_ISSET(sd, &readfds)) {
-                 int valread = read(sd, buffer, BUFFER_SIZE - 1);
-                 if (valread <= 0) {
-                     getpeername(sd, (struct sockaddr *)&address, (socklen_t *)&addrlen);
-                     printf("Cliente desconectado: %s:%d\n",
-                            inet_ntoa(address.sin_addr), ntohs(address.sin_port));
-                     close(sd);
-                     client_sockets[i] = 0;
-                 } else {
-                     buffer[valread] = '\0';
-                     printf("Mensaje recibido: %s\n", buffer);
-                     process_message(buffer, sd);
-                 }
+     }
+
+     MsgBuffer *msg = packed ? packed : outgoing_share(out);
+     if (msg == NULL) {
+         queue_changed(client, bytes, count);
+         schedule_close(client);
+         return;
+     }
+     int r = binary
+         ? wq_push(&client->out, msg, 0, msg_bin_len(msg), written)
+         : wq_push(&client->out, msg, MSG_TEXT_OFFSET, msg_text_len(msg), written);
+     queue_changed(client, bytes, count);
+     if (r < 0) schedule_close(client);
+     else if (config.coalesce_us > 0) coalesce(client);
+     else if (config.io == IO_URING) {
+         client->shard->ring_queued += total - written;
+         flush_client(client);
+     }
+ }
+
+ /* --- Ventana de coalescencia --- */
+
+ static void dirty_remove(Client *client) {
+     if (client->dirty_pprev == NULL) return;
+     *client->dirty_pprev = client->next_dirty;
+     if (client->next_dirty != NULL) client->next_dirty->dirty_pprev = client->dirty_pprev;
+     client->dirty_pprev = NULL;
+ }
+
+ /*El cliente tiene mensajes nuevos en la cola. Con coalesce_bytes pendientes
+   sale ya; si no, espera a que venza la ventana del shard, que se arma con
+   el primer cliente y vale para todos los que se sumen mientras tanto: ningún
+   mensaje espera más de coalesce_us*/
+ static void coalesce(Client *client) {
+     Shard *shard = client->shard;
+     if (client->out.bytes >= config.coalesce_bytes) {
+         dirty_remove(client);
+         flush_client(client);
+         return;
+     }
+     if (client->dirty_pprev != NULL) return;
+     if (shard->dirty == NULL) {
+         struct itimerspec its = { { 0, 0 }, { 0, config.coalesce_us * 1000 } };
+         if (timerfd_settime(shard->coalesce.fd, 0, &its, NULL) < 0)
+             log_limited(LOG_LVL_ERROR, 10, "timerfd_settime: %s", strerror(errno));
+     }
+     client->next_dirty = shard->dirty;
+     if (shard->dirty != NULL) shard->dirty->dirty_pprev = &client->next_dirty;
+     client->dirty_pprev = &shard->dirty;
+     shard->dirty = client;
+ }
+
+ /*Venció la ventana: cada cliente pendiente sale con un solo writev*/
+ static void coalesce_expired(Shard *shard) {
+     uint64_t expirations;
+     if (read(shard->coalesce.fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+         log_limited(LOG_LVL_ERROR, 10, "timerfd: %s", strerror(errno));
+     while (shard->dirty != NULL) {
+         Client *client = shard->dirty;
+         dirty_remove(client);
+         if (!client->closing) flush_client(client);
+     }
+ }
+
+ static void schedule_close(Client *client) {
+     if (client->closing) return;
+     client->closing = 1;
+     client->next_closing = client->shard->closing_list;
+     client->shard->closing_list = client;
+ }
+
+ static void close_pending_clients(Shard *shard) {
+     while (shard->closing_list != NULL) {
+         Client *client = shard->closing_list;
+         shard->closing_list = client->next_closing;
+         close_client(client);
+     }
+ }
+
+ static void ring_tx_release(RingTx *tx);
+
+ static void send_remove(Client *client) {
+     if (client->send_pprev == NULL) return;
+     *client->send_pprev = client->next_send;
+     if (client->next_send != NULL) client->next_send->send_pprev = client->send_pprev;
+     client->send_pprev = NULL;
+ }
+
+ /*Lo que queda de un cliente cerrado cuando ya no tiene SQE en curso*/
+ static void client_free(Client *client) {
+     wq_free(&client->out);
+     if (client->tx != NULL) {
+         ring_tx_release(client->tx);
+         free(client->tx->iov);
+         free(client->tx->msgs);
+         free(client->tx);
+     }
+     free(client->pending);
+     free(client);
+ }
+
+ /*Cerrar el descriptor lo saca automáticamente del conjunto de epoll;
+   las suscripciones se quitan una por una en O(1)*/
+ static void close_client(Client *client) {
+     metrics_add(client->shard->metrics, MET_DISCONNECTS, 1);
+     metrics_gauge(client->shard->metrics, MET_QUEUED_BYTES, -(int64_t)client->out.bytes);
+     metrics_gauge(client->shard->metrics, MET_QUEUED_MSGS, -(int64_t)client->out.count);
+     log_limited(LOG_LVL_INFO, 100, "Cliente desconectado ip=%s puerto=%d descartados=%llu",
+                 inet_ntoa(client->addr.sin_addr), ntohs(client->addr.sin_port),
+                 (unsigned long long)client->dropped);
+     while (client->subs != NULL) {
+         Subscription *next = client->subs->next;
+         Topic *topic = client->subs->topic;
+         registry_unsubscribe(client->subs);
+         topic_idle_check(client->shard, topic);
+         client->subs = next;
+     }
+     /*Las respuestas en camino se descartan al llegar*/
+     for (RetainWait *w = client->waits; w != NULL; w = w->next)
+         w->client = NULL;
+     while (client->patterns != NULL) {
+         PatternSub *p = client->patterns;
+         client->patterns = p->next;
+         if (trie_remove(&client->shard->patterns, p->name, p->len, client) == 0)
+             wildcards_change(client->shard, p->name, p->len, 0);
+         free(p);
+     }
+     if (client->replay != NULL) replay_free(client);
+     if (client->lz4) atomic_fetch_sub_explicit(&lz4_clients, 1, memory_order_relaxed);
+     dirty_remove(client);
+     send_remove(client);
+     admit_release(&client->addr);
+     /*Con io_uring el recv multishot y el envío en curso todavía apuntan al
+       cliente: shutdown los termina y se libera cuando vuelve el último*/
+     if (client->ring_ops > 0) shutdown(client->fd, SHUT_RDWR);
+     close(client->fd);
+     client->fd = -1;
+     if (client->ring_ops == 0) client_free(client);
+ }
+
+ /* --- Backend io_uring --- */
+
+ static struct io_uring_sqe *ring_sqe(Client *client, uint8_t opcode, int op) {
+     struct io_uring_sqe *sqe = ioring_sqe(client->shard->ring);
+     if (sqe == NULL) {
+         log_limited(LOG_LVL_ERROR, 10, "io_uring: SQ lleno, cerrando fd=%d", client->fd);
+         schedule_close(client);
+         return NULL;
+     }
+     sqe->opcode = opcode;
+     sqe->fd = client->fd;
+     sqe->user_data = (uint64_t)(uintptr_t)client | (uint64_t)op;
+     client->ring_ops++;
+     return sqe;
+ }
+
+ /*Un solo recv por cliente para toda la conexión: cada vez que llegan datos
+   el kernel elige un buffer del anillo y deja una completación*/
+ static void ring_recv_arm(Client *client) {
+     struct io_uring_sqe *sqe = ring_sqe(client, IORING_OP_RECV, RING_RECV);
+     if (sqe == NULL) return;
+     sqe->ioprio = IORING_RECV_MULTISHOT;
+     sqe->flags = IOSQE_BUFFER_SELECT;
+     sqe->buf_group = RING_BGID;
+ }
+
+ /*Sockets del shard que no son clientes (escucha, eventfd, timerfd)*/
+ static void ring_arm(Shard *shard, Client *source) {
+     struct io_uring_sqe *sqe = ioring_sqe(shard->ring);
+     if (sqe == NULL) {
+         log_error("io_uring: no se pudo armar fd=%d", source->fd);
+         exit(EXIT_FAILURE);
+     }
+     sqe->fd = source->fd;
+     sqe->user_data = (uint64_t)(uintptr_t)source | RING_SOURCE;
+     if (source == &shard->listener) {
+         sqe->opcode = IORING_OP_ACCEPT;
+         sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+         sqe->accept_flags = SOCK_NONBLOCK;
+     } else {
+         sqe->opcode = IORING_OP_POLL_ADD;
+         sqe->poll32_events = POLLIN;
+         sqe->len = IORING_POLL_ADD_MULTI;
+     }
+ }
+
+ static void send_queue(Client *client) {
+     Shard *shard = client->shard;
+     if (client->send_pprev != NULL || client->closing) return;
+     client->next_send = shard->sendq;
+     if (shard->sendq != NULL) shard->sendq->send_pprev = &client->next_send;
+     client->send_pprev = &shard->sendq;
+     shard->sendq = client;
+ }
+
+ static void ring_tx_release(RingTx *tx) {
+     for (uint32_t i = tx->next * RING_IOV; i < tx->count; i++) msg_release(tx->msgs[i]);
+     tx->count = 0;
+     tx->next = 0;
+ }
+
+ /*Envío de fin de vuelta de un cliente: toda su cola sale en una cadena de
+   SQE. Un REPLAY sigue escribiendo directo (el socket es no bloqueante) y,
+   si el socket se llena, se espera POLLOUT*/
+ static void ring_send(Client *client) {
+     if (client->closing || client->ring_wait || (client->tx != NULL && client->tx->count > 0)) return;
+     if (client->replay != NULL) {
+         int r = replay_flush(client);
+         if (r < 0) {
+             schedule_close(client);
+             return;
+         }
+         if (r == 1) {
+             struct io_uring_sqe *sqe = ring_sqe(client, IORING_OP_POLL_ADD, RING_POLL);
+             if (sqe == NULL) return;
+             sqe->poll32_events = POLLOUT;
+             client->ring_wait = 1;
+             return;
+         }
+     }
+     if (wq_empty(&client->out)) return;
+     if (client->tx == NULL) {
+         client->tx = calloc(1, sizeof(RingTx));
+         if (client->tx == NULL) {
+             schedule_close(client);
+             return;
+         }
+     }
+
+     RingTx *tx = client->tx;
+     uint32_t need = client->out.count < RING_CHAIN * RING_IOV ? client->out.count : RING_CHAIN * RING_IOV;
+     if (need > tx->cap) {
+         uint32_t cap = tx->cap * 2 > need ? tx->cap * 2 : need;
+         if (cap > RING_CHAIN * RING_IOV) cap = RING_CHAIN * RING_IOV;
+         struct iovec *iov = realloc(tx->iov, cap * sizeof(*iov));
+         if (iov != NULL) tx->iov = iov;
+         MsgBuffer **msgs = iov != NULL ? realloc(tx->msgs, cap * sizeof(*msgs)) : NULL;
+         if (msgs == NULL) {
+             schedule_close(client);
+             return;
+         }
+         tx->msgs = msgs;
+         tx->cap = cap;
+     }
+
+     size_t bytes = client->out.bytes;
+     uint32_t count = client->out.count;
+     tx->count = (uint32_t)wq_take(&client->out, tx->iov, tx->msgs, (int)tx->cap);
+     tx->next = 0;
+     tx->failed = 0;
+     queue_changed(client, bytes, count);
+
+     for (uint32_t first = 0, k = 0; first < tx->count; first += RING_IOV, k++) {
+         struct io_uring_sqe *sqe = ring_sqe(client, IORING_OP_SENDMSG, RING_SEND);
+         if (sqe == NULL) {
+             /*Las que ya se prepararon vuelven y sueltan lo suyo; el resto se suelta acá*/
+             for (uint32_t i = first; i < tx->count; i++) msg_release(tx->msgs[i]);
+             tx->count = first;
+             return;
+         }
+         memset(&tx->hdr[k], 0, sizeof(tx->hdr[k]));
+         tx->hdr[k].msg_iov = tx->iov + first;
+         tx->hdr[k].msg_iovlen = tx->count - first < RING_IOV ? tx->count - first : RING_IOV;
+         sqe->addr = (uint64_t)(uintptr_t)&tx->hdr[k];
+         sqe->msg_flags = MSG_WAITALL;
+         if (first + RING_IOV < tx->count) sqe->flags = IOSQE_IO_LINK;
+     }
+ }
+
+ /*Volvió una SQE de la cadena (en orden). Si una falla, las que siguen
+   vuelven canceladas y el cliente se cierra cuando vuelve la última*/
+ static void ring_sent(Client *client, int res) {
+     RingTx *tx = client->tx;
+     uint32_t first = tx->next * RING_IOV;
+     uint32_t end = first + RING_IOV < tx->count ? first + RING_IOV : tx->count;
+     size_t expected = 0;
+     for (uint32_t i = first; i < end; i++) {
+         expected += tx->iov[i].iov_len;
+         msg_release(tx->msgs[i]);
+     }
+     tx->next++;
+     if (res < 0 || (size_t)res < expected) tx->failed = 1;
+     if (end < tx->count) return;
+
+     tx->count = 0;
+     tx->next = 0;
+     if (tx->failed) schedule_close(client);
+     else if (!wq_empty(&client->out) || client->replay != NULL) flush_client(client);
+ }
+
+ /*Prepara el envío de todos los clientes anotados*/
+ static void ring_send_all(Shard *shard) {
+     while (shard->sendq != NULL) {
+         Client *client = shard->sendq;
+         send_remove(client);
+         ring_send(client);
+     }
+     shard->ring_queued = 0;
+ }
+
+ /*Llegaron datos en un buffer del anillo. Sin frame pendiente se procesan
+   ahí mismo; si no, se juntan con lo pendiente en rx_buffer*/
+ static void ring_received(Client *client, char *data, size_t n) {
+     char *buf = data;
+     ssize_t rest;
+     if (client->pending_len == 0) {
+         rest = dispatch_frames(client, data, n);
+     } else {
+         char *rx_buffer = client->shard->rx_buffer;
+         size_t len = client->pending_len;
+         memcpy(rx_buffer, client->pending, len);
+         buf = rx_buffer;
+         rest = (ssize_t)len;
+         while (n > 0 && rest >= 0) {
+             size_t take = n < BUFFER_SIZE - (size_t)rest ? n : BUFFER_SIZE - (size_t)rest;
+             memcpy(rx_buffer + rest, data, take);
+             data += take;
+             n -= take;
+             rest = dispatch_frames(client, rx_buffer, (size_t)rest + take);
+         }
+     }
+     if (client->closing) return;
+     if (rest < 0) {
+         log_limited(LOG_LVL_WARN, 10, "Frame inválido o demasiado grande, cerrando fd=%d", client->fd);
+         schedule_close(client);
+     } else if (save_pending(client, buf, (size_t)rest) < 0) {
+         schedule_close(client);
+     }
+ }
+
+ static void ring_recv(Client *client, const struct io_uring_cqe *cqe) {
+     Shard *shard = client->shard;
+     if (cqe->flags & IORING_CQE_F_BUFFER) {
+         unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+         if (cqe->res > 0 && !client->closing)
+             ring_received(client, ioring_buf(&shard->bufs, bid), (size_t)cqe->res);
+         ioring_buf_recycle(&shard->bufs, bid);
+     }
+     if ((cqe->flags & IORING_CQE_F_MORE) || client->closing) return;
+
+     /*Se cortó el multishot: sin buffers libres (o CQ lleno) se vuelve a armar*/
+     if (cqe->res > 0 || cqe->res == -ENOBUFS) {
+         ring_recv_arm(client);
+         return;
+     }
+     if (cqe->res == 0 && client->pending_len > 0) {
+         memcpy(shard->rx_buffer, client->pending, client->pending_len);
+         process_last(client, shard->rx_buffer, client->pending_len);
+     }
+     schedule_close(client);
+ }
+
+ static void ring_accepted(Shard *shard, const struct io_uring_cqe *cqe) {
+     if (!(cqe->flags & IORING_CQE_F_MORE)) ring_arm(shard, &shard->listener);
+     if (cqe->res == -EMFILE || cqe->res == -ENFILE) {
+         shed_backlog(shard);
+         return;
+     }
+     if (cqe->res < 0) {
+         log_limited(LOG_LVL_ERROR, 10, "accept: %s", strerror(-cqe->res));
+         return;
+     }
+
+     /*El accept multishot no trae la dirección: se pide aparte*/
+     struct sockaddr_in address;
+     socklen_t addrlen = sizeof(address);
+     if (getpeername(cqe->res, (struct sockaddr *)&address, &addrlen) < 0)
+         memset(&address, 0, sizeof(address));
+     const char *busy = admit(&address);
+     if (busy != NULL) {
+         reject_conn(shard, cqe->res, busy);
+         return;
+     }
+     Client *client = client_new(shard, cqe->res, &address);
+     if (client == NULL) {
+         admit_release(&address);
+         close(cqe->res);
+         return;
+     }
+     client_connected(client);
+     ring_recv_arm(client);
+ }
+
+ static void ring_complete(Shard *shard, const struct io_uring_cqe *cqe) {
+     if (cqe->user_data == 0) {
+         /*Los avisos a otros shards solo dejan completación si fallan*/
+         log_limited(LOG_LVL_ERROR, 10, "eventfd: %s", strerror(-cqe->res));
+         return;
+     }
+     Client *client = (Client *)(uintptr_t)(cqe->user_data & ~(uint64_t)RING_OP_MASK);
+     if ((cqe->user_data & RING_OP_MASK) == RING_SOURCE) {
+         if (client == &shard->listener) {
+             ring_accepted(shard, cqe);
+             return;
+         }
+         if (!(cqe->flags & IORING_CQE_F_MORE)) ring_arm(shard, client);
+         if (client == &shard->waker) shard_drain(shard);
+         else coalesce_expired(shard);
+         return;
+     }
+
+     if (!(cqe->flags & IORING_CQE_F_MORE)) client->ring_ops--;
+     switch (cqe->user_data & RING_OP_MASK) {
+     case RING_RECV:
+         ring_recv(client, cqe);
+         break;
+     case RING_SEND:
+         ring_sent(client, cqe->res);
+         break;
+     case RING_POLL:
+         client->ring_wait = 0;
+         if (!client->closing) flush_client(client);
+         break;
+     }
+     /*Ya cerrado: se libera con la última completación*/
+     if (client->fd < 0 && client->ring_ops == 0) client_free(client);
+ }
+
+ /*Completaciones nuevas. Los recv esperan su turno en el backlog, en
+   orden; lo demás se atiende ya. Así un envío terminado libera la cola de su
+   cliente aunque haya llegado detrás de una ráfaga de recv*/
+ static void ring_reap(Shard *shard) {
+     struct io_uring_cqe *cqe;
+     while ((cqe = ioring_cqe(shard->ring)) != NULL) {
+         struct io_uring_cqe c = *cqe;
+         ioring_cqe_seen(shard->ring);
+         if (c.user_data == 0 || (c.user_data & RING_OP_MASK) != RING_RECV) {
+             ring_complete(shard, &c);
+             continue;
+         }
+         if (shard->backlog_len == shard->backlog_cap &&
+             grow_array((void **)&shard->backlog, &shard->backlog_cap, shard->backlog_len,
+                        sizeof(struct io_uring_cqe)) < 0) {
+             ring_complete(shard, &c);
+             continue;
+         }
+         shard->backlog[shard->backlog_len++] = c;
+     }
+ }
+
+ /*Event loop con io_uring: todo lo que la vuelta preparó (envíos, recv,
+   avisos a otros shards) sale en el mismo io_uring_enter que espera las
+   completaciones siguientes*/
+ static void ring_main(Shard *shard) {
+     IoRing ring;
+     if (ioring_init(&ring, RING_ENTRIES) < 0 ||
+         ioring_bufs_init(&ring, &shard->bufs, RING_BGID, RING_BUFS, RING_BUF_SIZE) < 0) {
+         log_error("io_uring en el shard %d: %s", shard->index, strerror(errno));
+         exit(EXIT_FAILURE);
+     }
+     shard->ring = &ring;
+     ring_arm(shard, &shard->listener);
+     ring_arm(shard, &shard->waker);
+     if (config.coalesce_us > 0) ring_arm(shard, &shard->coalesce);
+
+     while (1) {
+         ring_send_all(shard);
+         close_pending_clients(shard);
+         shard_flush(shard);
+
+         int r = ioring_enter(&ring, 1, shard->overflowed ? 1 : -1);
+         if (r < 0 && r != -EINTR && r != -ETIME && r != -EBUSY)
+             log_limited(LOG_LVL_ERROR, 10, "io_uring_enter: %s", strerror(-r));
+         ring_reap(shard);
+
+         while (shard->backlog_pos < shard->backlog_len) {
+             /*Copia: atenderlo puede agrandar el backlog*/
+             struct io_uring_cqe c = shard->backlog[shard->backlog_pos++];
+             ring_complete(shard, &c);
+             /*Una ráfaga grande no espera al final de la vuelta: así las colas
+               no pasan el high-water mark solo por el tamaño de la tanda*/
+             if (shard->ring_queued >= RING_FLUSH_BYTES) {
+                 ring_send_all(shard);
+                 ioring_enter(&ring, 0, 0);
+                 ring_reap(shard);
              }
          }
+         shard->backlog_pos = shard->backlog_len = 0;
+     }
+ }
+
+ /*Envía un frame binario corto (cabecera + payload) a un cliente*/
+ static void send_bin(Client *client, uint8_t opcode, uint8_t flags, uint32_t topic,
+                      const char *payload, uint32_t len) {
+     Outgoing out;
+     outgoing_init(&out, opcode, flags, topic, payload, len);
+     out.control = 1;
+     deliver(client, &out);
+     outgoing_done(&out);
+ }
+
+ /* --- Compresión --- */
+
+ static void send_dict(Client *client, MsgBuffer *dict) {
+     Outgoing out;
+     msg_ref(dict);
+     outgoing_adopt(&out, dict);
+     out.control = 1;
+     deliver(client, &out);
+     outgoing_done(&out);
+ }
+
+ /*Antes del primer mensaje comprimido de un tema, el shard les manda el
+   diccionario a sus clientes con compresión. Los que se suscriban después
+   lo reciben al suscribirse (ver add_subscription)*/
+ static void announce_dict(Topic *topic) {
+     TopicInfo *info = topic->user;
+     if (info->dict != NULL) return;
+     info->dict = directory_dict(info->gid);
+     if (info->dict == NULL) return;
+     for (uint32_t j = 0; j < topic->num_subs; j++) {
+         Client *client = topic->subs[j];
+         if (client->lz4) send_dict(client, info->dict);
+     }
+ }
+
+ /*Un SUBSCRIBE (o REPLAY) binario con BIN_FLAG_LZ4 pide compresión para
+   toda la conexión. Lo que ya recibía pasa a llegar comprimido también*/
+ static void negotiate_lz4(const Command *cmd, Client *client) {
+     if (!config.compress || client->lz4 || !client->binary || !(cmd->flags & BIN_FLAG_LZ4)) return;
+     client->lz4 = 1;
+     atomic_fetch_add_explicit(&lz4_clients, 1, memory_order_relaxed);
+     for (Subscription *s = client->subs; s != NULL; s = s->next) {
+         TopicInfo *info = s->topic->user;
+         if (info->dict != NULL) send_dict(client, info->dict);
+     }
+ }
+
+ /*Procesar mensajes entrantes: los slices apuntan dentro del rx_buffer del shard*/
+ void process_message(const Frame *frame, Client *sender) {
+     Command cmd;
+
+     if (proto_parse_frame(frame, &cmd) < 0) return;
+
+     switch (cmd.op) {
+     case BIN_OP_HELLO:
+         /*Negociación: respondemos con la versión que hablamos*/
+         sender->binary = 1;
+         send_bin(sender, BIN_OP_HELLO, 0, 0, NULL, 0);
+         break;
+     case BIN_OP_SUBSCRIBE:
+         negotiate_lz4(&cmd, sender);
+         subscribe_to_topic(&cmd, sender);
+         break;
+     case BIN_OP_PUBLISH:
+         publish_to_topic(sender->shard, &cmd);
+         break;
+     case BIN_OP_REPLAY:
+         negotiate_lz4(&cmd, sender);
+         replay_topic(&cmd, sender);
+         break;
+     case BIN_OP_TOPIC_ID: {
+         /*El cliente pide el id de un tema para publicar sin mandar el nombre*/
+         uint32_t gid;
+         const Topic *t = cmd.topic.len && !topic_is_pattern(cmd.topic.data, cmd.topic.len)
+             ? directory_lookup(cmd.topic.data, cmd.topic.len, 1, &gid) : NULL;
+         if (t != NULL) send_bin(sender, BIN_OP_TOPIC_ID, BIN_FLAG_TOPIC_ID, gid, t->name, t->len);
+         break;
+     }
+     default:
+         log_limited(LOG_LVL_WARN, 10, "Comando desconocido o formato inválido: %.*s",
+                     (int)cmd.command.len, cmd.command.data);
+     }
+ }
+
+ /* --- Suscribirse a un tema --- */
+
+ static int has_topic(const Client *client, const Topic *topic) {
+     for (const Subscription *s = client->subs; s != NULL; s = s->next)
+         if (s->topic == topic) return 1;
+     return 0;
+ }
+
+ /*Agrega al cliente a los subscribers del tema local (sea por nombre exacto
+   o porque calza con un patrón suyo)*/
+ static int add_subscription(Client *client, Topic *topic) {
+     Shard *shard = client->shard;
+     Subscription *sub = registry_subscribe(&shard->local, topic->name, topic->len, client);
+     if (sub == NULL) return -1;
+     sub->next = client->subs;
+     client->subs = sub;
+
+     /*Primer subscriber del tema en este shard: el dueño tiene que empezar a mandarnos*/
+     uint32_t gid = topic_gid(topic);
+     if (topic->num_subs == 1) interest_changed(shard, gid, 1);
+
+     /*Al cliente binario le contamos el id con el que le llegarán los mensajes
+       (y, con el flag, que llegan comprimidos)*/
+     if (client->binary)
+         send_bin(client, BIN_OP_TOPIC_ID, BIN_FLAG_TOPIC_ID | (client->lz4 ? BIN_FLAG_LZ4 : 0), gid,
+                  topic->name, topic->len);
+     if (client->lz4) {
+         TopicInfo *info = topic->user;
+         if (info->dict != NULL) send_dict(client, info->dict);
+         else announce_dict(topic);
+     }
+     return 0;
+ }
+
+ static void attach_match(void *owner, void *arg) {
+     Client *client = owner;
+     Topic *topic = arg;
+     /*Dos patrones del mismo cliente pueden calzar: se suscribe una sola vez*/
+     if (client->closing || has_topic(client, topic)) return;
+     if (add_subscription(client, topic) < 0)
+         log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %s", topic->name);
+ }
+
+ static void patterns_attach(Shard *shard, Topic *topic) {
+     trie_match(&shard->patterns, topic->name, topic->len, attach_match, topic);
+ }
+
+ static void wildcards_change(Shard *shard, const char *name, size_t len, int on) {
+     pthread_mutex_lock(&wildcards.lock);
+     int r = on ? trie_insert(&wildcards.trie, name, len, shard)
+                : trie_remove(&wildcards.trie, name, len, shard);
+     if (r >= 0) {
+         atomic_store_explicit(&wildcards.active, wildcards.trie.patterns, memory_order_relaxed);
+         uint32_t gen = atomic_load_explicit(&wildcards.gen, memory_order_relaxed) + 1;
+         atomic_store_explicit(&wildcards.gen, gen ? gen : 1, memory_order_release);
+     }
+     pthread_mutex_unlock(&wildcards.lock);
+ }
+
+ /*SUBSCRIBE con comodines: el patrón queda en el trie del shard para los
+   temas que aparezcan, y se suscribe ya a los que el shard conoce*/
+ static void subscribe_pattern(Client *client, const char *name, size_t len) {
+     Shard *shard = client->shard;
+     if (!topic_pattern_valid(name, len)) {
+         log_limited(LOG_LVL_WARN, 10, "Patrón inválido fd=%d: %.*s", client->fd, (int)len, name);
+         return;
+     }
+     for (PatternSub *p = client->patterns; p != NULL; p = p->next)
+         if (p->len == len && memcmp(p->name, name, len) == 0) return;
+
+     PatternSub *p = malloc(sizeof(PatternSub) + len);
+     int owners = p ? trie_insert(&shard->patterns, name, len, client) : -1;
+     if (owners < 0) {
+         free(p);
+         log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al patrón %.*s", (int)len, name);
+         return;
+     }
+     p->len = (uint32_t)len;
+     memcpy(p->name, name, len);
+     p->next = client->patterns;
+     client->patterns = p;
+     if (owners == 1) wildcards_change(shard, name, len, 1);
+     metrics_add(shard->metrics, MET_SUBSCRIBES, 1);
+
+     /*Temas que el shard ya conoce*/
+     for (uint32_t id = 0; id < shard->local.count; id++) {
+         Topic *t = registry_by_id(&shard->local, id);
+         if (topic_matches(name, len, t->name, t->len)) attach_match(client, t);
+     }
+     log_limited(LOG_LVL_INFO, 100, "Nuevo patrón fd=%d patrón=%.*s", client->fd, (int)len, name);
+ }
+
+ /*Manda al cliente lo retenido, del más viejo al más nuevo. Cada mensaje
+   trae una referencia que se suelta acá*/
+ static void deliver_retained(Client *client, MsgBuffer **msgs, uint32_t count) {
+     for (uint32_t i = 0; i < count; i++) {
+         Outgoing out;
+         outgoing_adopt(&out, msgs[i]);
+         deliver(client, &out);
+         outgoing_done(&out);
+     }
+ }
+
+ /*Anillo de retenidos de un tema propio; se crea con la primera publicación*/
+ static Retained *owner_retained(Shard *shard, uint32_t gid, int create) {
+     uint32_t slot = gid / (uint32_t)config.threads;
+     if (slot >= shard->retained_cap || shard->retained[slot] == NULL) {
+         if (!create ||
+             grow_array((void **)&shard->retained, &shard->retained_cap, slot, sizeof(Retained *)) < 0)
+             return NULL;
+         shard->retained[slot] = retained_new(config.retain);
+     }
+     return shard->retained[slot];
+ }
+
+ /*Log persistente de un tema propio; se abre (o se crea) al primer uso*/
+ static TopicLog *owner_log(Shard *shard, uint32_t gid) {
+     uint32_t slot = gid / (uint32_t)config.threads;
+     if (slot < shard->logs_cap && shard->logs[slot] != NULL) return shard->logs[slot];
+     const Topic *t = directory_by_id(gid);
+     if (t == NULL || grow_array((void **)&shard->logs, &shard->logs_cap, slot, sizeof(TopicLog *)) < 0)
+         return NULL;
+     shard->logs[slot] = tlog_open(t->name, t->len);
+     return shard->logs[slot];
+ }
+
+ static Packer *owner_packer(Shard *shard, uint32_t gid) {
+     uint32_t slot = gid / (uint32_t)config.threads;
+     if (slot >= shard->packers_cap || shard->packers[slot] == NULL) {
+         /*Nada se reserva para un id que el directorio no conoce*/
+         if (directory_by_id(gid) == NULL ||
+             grow_array((void **)&shard->packers, &shard->packers_cap, slot, sizeof(Packer *)) < 0)
+             return NULL;
+         Packer *p = malloc(sizeof(Packer));
+         if (p == NULL) return NULL;
+         lz_dict_init(&p->dict);
+         p->samples = 0;
+         p->ready = 0;
+         shard->packers[slot] = p;
+     }
+     return shard->packers[slot];
+ }
+
+ /*Comprime el mensaje una sola vez para todos los clientes con compresión.
+   Mientras se entrena el diccionario (y si comprimido no es más chico) el
+   mensaje sale crudo para todos*/
+ static void owner_pack(Shard *shard, uint32_t gid, Outgoing *out) {
+     size_t len = out->payload.len;
+     if (len < COMPRESS_MIN) return;
+     Packer *p = owner_packer(shard, gid);
+     if (p == NULL) return;
+     if (!p->ready) {
+         lz_dict_train(&p->dict, &shard->lz, out->payload.data, len);
+         if (++p->samples < DICT_TRAIN_MSGS && p->dict.len < LZ_DICT_SIZE) return;
+         /*Queda fijo: se publica antes de mandar nada comprimido con él*/
+         MsgBuffer *dict = msg_new(BIN_OP_DICT, BIN_FLAG_TOPIC_ID, gid, p->dict.data, p->dict.len);
+         if (dict == NULL) return;
+         directory_set_dict(gid, dict);
+         p->ready = 1;
+         log_limited(LOG_LVL_INFO, 100, "Diccionario listo tema id=%u bytes=%u muestras=%u", gid,
+                     (unsigned)p->dict.len, (unsigned)p->samples);
+         return;
+     }
+     if (atomic_load_explicit(&lz4_clients, memory_order_relaxed) == 0) return;
+
+     char *block = shard->pack_buffer + PROTO_LZ4_LEN;
+     size_t n = lz_compress(&shard->lz, &p->dict, out->payload.data, len, block, len - PROTO_LZ4_LEN - 1);
+     if (n == 0) return;
+     uint32_t raw = htonl((uint32_t)len);
+     memcpy(shard->pack_buffer, &raw, PROTO_LZ4_LEN);
+     out->packed = msg_new(BIN_OP_MESSAGE, BIN_FLAG_TOPIC_ID | BIN_FLAG_LZ4, gid,
+                           shard->pack_buffer, (uint32_t)(PROTO_LZ4_LEN + n));
+     attach_packed(out);
+ }
+
+ /*Foto de lo retenido con una referencia por mensaje*/
+ static uint32_t retained_refs(Shard *shard, uint32_t gid, MsgBuffer **msgs) {
+     Retained *r = owner_retained(shard, gid, 0);
+     uint32_t n = r ? retained_snapshot(r, (void **)msgs) : 0;
+     for (uint32_t i = 0; i < n; i++) msg_ref(msgs[i]);
+     return n;
+ }
+
+ static int waiting_for(const Client *client, const Topic *topic) {
+     for (const RetainWait *w = client->waits; w != NULL; w = w->next)
+         if (w->topic == topic) return 1;
+     return 0;
+ }
+
+ /*El cliente ya está suscrito: desde acá lo nuevo se encola detrás del
+   log [from, end) del tema*/
+ static int start_replay(Client *client, Topic *topic, uint64_t from, uint64_t end) {
+     Replay *r = malloc(sizeof(Replay));
+     if (r == NULL) return -1;
+     if (from > end) from = end;
+     if (tlog_cursor_open(&r->cursor, topic->name, topic->len, from, end) < 0) {
+         log_limited(LOG_LVL_WARN, 10, "No se pudo leer el log del tema %s", topic->name);
+         free(r);
+         return -1;
+     }
+     r->before = client->out;
+     wq_init(&client->out);
+     r->pre_len = 0;
+     r->pre_off = 0;
+     r->partial = 0;
+     if (client->binary) {
+         /*Aviso con el rango: lo que siga con offset >= end ya es en vivo*/
+         char *p = r->preamble + PROTO_BIN_HEADER;
+         for (int i = 0; i < 8; i++) {
+             p[i] = (char)(from >> (56 - 8 * i));
+             p[8 + i] = (char)(end >> (56 - 8 * i));
+         }
+         proto_write_bin_header(r->preamble, BIN_OP_REPLAY, BIN_FLAG_TOPIC_ID, topic_gid(topic), 16);
+         r->pre_len = sizeof(r->preamble);
      }
- 
-     close(server_fd);
+     client->replay = r;
+     log_limited(LOG_LVL_INFO, 100, "REPLAY fd=%d tema=%s desde=%llu hasta=%llu", client->fd,
+                 topic->name, (unsigned long long)from, (unsigned long long)end);
+     flush_client(client);
+     return 0;
+ }
+
+ /*Tema de otro shard: se le piden los retenidos al dueño y la suscripción
+   se completa con la respuesta (ver retain_reply)*/
+ static int request_retained(Client *client, Topic *topic, int replay, uint64_t from) {
+     Shard *shard = client->shard;
+     RetainWait *w = malloc(sizeof(RetainWait) + (replay ? 0 : config.retain) * sizeof(MsgBuffer *));
+     if (w == NULL) return -1;
+     w->client = client;
+     w->topic = topic;
+     w->replay = replay;
+     w->replay_from = from;
+     w->replay_end = from;
+     w->count = 0;
+     w->next = client->waits;
+     client->waits = w;
+     TopicInfo *info = topic->user;
+     info->waiting++;
+     shard_send(shard, owner_of_id(info->gid), SHARD_RETAIN_REQ, info->gid, w);
      return 0;
  }
- 
-    /*Procesar mensajes entrantes*/
- void process_message(char *message, int sender_fd) {
-     char command[20], topic[50], content[BUFFER_SIZE];
-     memset(command, 0, sizeof(command));
-     memset(topic, 0, sizeof(topic));
-     memset(content, 0, sizeof(content));
- 
-     sscanf(message, "%s %s %[^\n]", command, topic, content);
- 
-     if (strcmp(command, "SUBSCRIBE") == 0) {
-         subscribe_to_topic(topic, sender_fd);
-     } else if (strcmp(command, "PUBLISH") == 0) {
-         publish_to_topic(topic, content);
+
+ /*Volvió la respuesta del dueño. Todo lo que publique después viene detrás
+   en la misma cola, así que recién ahora el cliente entra al fan-out*/
+ static void retain_reply(Shard *shard, RetainWait *w) {
+     Client *client = w->client;
+     TopicInfo *info = w->topic->user;
+     info->waiting--;
+     if (client != NULL) {
+         RetainWait **link = &client->waits;
+         while (*link != w) link = &(*link)->next;
+         *link = w->next;
+     }
+     if (client != NULL && !client->closing && !has_topic(client, w->topic) &&
+         add_subscription(client, w->topic) == 0) {
+         if (w->replay) start_replay(client, w->topic, w->replay_from, w->replay_end);
+         else deliver_retained(client, w->msgs, w->count);
      } else {
-         printf("Comando desconocido o formato inválido: %s\n", command);
+         for (uint32_t i = 0; i < w->count; i++) msg_release(w->msgs[i]);
      }
+     topic_idle_check(shard, w->topic);
+     free(w);
  }
- 
- /* --- Suscribirse a un tema --- */
- void subscribe_to_topic(char *topic, int fd) {
-     for (int i = 0; i < num_topics; i++) {
-         if (strcmp(topics[i].topic, topic) == 0) {
-             topics[i].subscribers[topics[i].num_subscribers++] = fd;
-             printf("Nuevo suscriptor al tema %s\n", topic);
-             return;
+
+ void subscribe_to_topic(const Command *cmd, Client *client) {
+     Shard *shard = client->shard;
+     const Topic *named = cmd->has_topic_id ? directory_by_id(cmd->topic_id) : NULL;
+     const char *name = named ? named->name : cmd->topic.data;
+     size_t len = named ? named->len : cmd->topic.len;
+     if (len == 0) return;
+     if (named == NULL && topic_is_pattern(name, len)) {
+         subscribe_pattern(client, name, len);
+         return;
+     }
+
+     uint32_t gid;
+     Topic *topic = directory_lookup(name, len, 1, &gid) ? local_topic(shard, name, len, gid) : NULL;
+     if (topic == NULL) {
+         log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %.*s", (int)len, name);
+         return;
+     }
+     /*Un cliente suscrito dos veces al mismo tema (o que ya lo recibe por un
+       patrón) recibiría todo duplicado*/
+     if (has_topic(client, topic) || waiting_for(client, topic)) return;
+
+     int r;
+     if (config.retain > 0 && owner_of_id(gid) != (uint32_t)shard->index) {
+         r = request_retained(client, topic, 0, 0);
+     } else {
+         r = add_subscription(client, topic);
+         if (r == 0 && config.retain > 0) {
+             MsgBuffer *msgs[RETAIN_MAX];
+             deliver_retained(client, msgs, retained_refs(shard, gid, msgs));
          }
      }
- 
-     // Si no existe, crear nuevo tema
-     strcpy(topics[num_topics].topic, topic);
-     topics[num_topics].subscribers[0] = fd;
-     topics[num_topics].num_subscribers = 1;
-     num_topics++;
- 
-     printf("Tema creado y suscriptor agregado: %s\n", topic);
+     if (r < 0) {
+         log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %.*s", (int)len, name);
+         return;
+     }
+     metrics_add(shard->metrics, MET_SUBSCRIBES, 1);
+     log_limited(LOG_LVL_INFO, 100, "Nuevo suscriptor fd=%d tema=%s suscriptores=%u",
+                 client->fd, topic->name, (unsigned)topic->num_subs);
  }
- 
- /* --- Publicar mensaje a un tema --- */
- void publish_to_topic(char *topic, char *message) {
-     for (int i = 0; i < num_topics; i++) {
-         if (strcmp(topics[i].topic, topic) == 0) {
-             for (int j = 0; j < topics[i].num_subscribers; j++) {
-                 int sub_fd = topics[i].subscribers[j];
-                 send(sub_fd, message, strlen(message), 0);
+
+ /* --- REPLAY desde el log --- */
+
+ /*Offset pedido: u64 en binario, decimal en texto*/
+ static int replay_offset(const Command *cmd, uint64_t *from) {
+     if (cmd->binary) {
+         if (cmd->payload.len != 8) return -1;
+         *from = 0;
+         for (int i = 0; i < 8; i++) *from = (*from << 8) | (unsigned char)cmd->payload.data[i];
+         return 0;
+     }
+     char digits[24];
+     if (cmd->payload.len == 0 || cmd->payload.len >= sizeof(digits)) return -1;
+     memcpy(digits, cmd->payload.data, cmd->payload.len);
+     digits[cmd->payload.len] = '\0';
+     char *end;
+     *from = strtoull(digits, &end, 10);
+     return *end == '\0' || *end == ' ' || *end == '\r' ? 0 : -1;
+ }
+
+ static int replaying(const Client *client) {
+     if (client->replay != NULL) return 1;
+     for (const RetainWait *w = client->waits; w != NULL; w = w->next)
+         if (w->replay) return 1;
+     return 0;
+ }
+
+ /*REPLAY: como un SUBSCRIBE por nombre, pero en vez de lo retenido el
+   cliente recibe todo lo guardado desde el offset. De a un REPLAY por
+   cliente, y solo a temas que todavía no recibe*/
+ void replay_topic(const Command *cmd, Client *client) {
+     Shard *shard = client->shard;
+     const Topic *named = cmd->has_topic_id ? directory_by_id(cmd->topic_id) : NULL;
+     const char *name = named ? named->name : cmd->topic.data;
+     size_t len = named ? named->len : cmd->topic.len;
+     uint64_t from;
+     if (len == 0 || replay_offset(cmd, &from) < 0) return;
+     if (config.store_dir == NULL || topic_is_pattern(name, len)) {
+         log_limited(LOG_LVL_WARN, 10, "REPLAY no disponible fd=%d tema=%.*s", client->fd, (int)len, name);
+         return;
+     }
+
+     uint32_t gid;
+     Topic *topic = directory_lookup(name, len, 1, &gid) ? local_topic(shard, name, len, gid) : NULL;
+     if (topic == NULL) {
+         log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %.*s", (int)len, name);
+         return;
+     }
+     if (has_topic(client, topic) || waiting_for(client, topic) || replaying(client)) {
+         log_limited(LOG_LVL_WARN, 10, "REPLAY rechazado fd=%d tema=%s", client->fd, topic->name);
+         return;
+     }
+
+     int r;
+     if (owner_of_id(gid) != (uint32_t)shard->index) {
+         r = request_retained(client, topic, 1, from);
+     } else {
+         TopicLog *log = owner_log(shard, gid);
+         r = add_subscription(client, topic);
+         if (r == 0) start_replay(client, topic, from, log ? tlog_end(log) : from);
+     }
+     if (r < 0) {
+         log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %.*s", (int)len, name);
+         return;
+     }
+     metrics_add(shard->metrics, MET_SUBSCRIBES, 1);
+ }
+
+ /*Binario: los registros del log ya son frames y van del archivo al socket*/
+ static int replay_send_binary(Client *client, TlogCursor *c) {
+     while (c->pos < c->stop) {
+         off_t off = c->pos;
+         ssize_t w = sendfile(client->fd, c->fd, &off, c->stop - c->pos);
+         if (w < 0) {
+             if (errno == EINTR) continue;
+             return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+         }
+         if (w == 0) return -1;
+         c->pos = (uint32_t)off;
+     }
+     return 0;
+ }
+
+ /*Texto: payload + '\n' de cada registro, desde el mapeo y de a varios*/
+ static int replay_send_text(Client *client, Replay *r) {
+     TlogCursor *c = &r->cursor;
+     while (c->pos < c->stop) {
+         struct iovec iov[REPLAY_IOV];
+         int n = 0;
+         for (uint32_t pos = c->pos; pos < c->stop && n + 2 <= REPLAY_IOV;) {
+             BinHeader h;
+             proto_read_bin_header(c->map + pos, &h);
+             iov[n++] = (struct iovec){ (void *)(c->map + pos + PROTO_BIN_HEADER), h.length };
+             iov[n++] = (struct iovec){ "\n", 1 };
+             pos += PROTO_BIN_HEADER + h.length;
+         }
+         /*El primer registro puede haber salido a medias*/
+         size_t skip = r->partial;
+         int first = 0;
+         while (skip >= iov[first].iov_len && skip > 0) skip -= iov[first++].iov_len;
+         iov[first].iov_base = (char *)iov[first].iov_base + skip;
+         iov[first].iov_len -= skip;
+
+         ssize_t w = writev(client->fd, iov + first, n - first);
+         if (w < 0) {
+             if (errno == EINTR) continue;
+             return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+         }
+         size_t done = r->partial + (size_t)w;
+         for (;;) {
+             BinHeader h;
+             proto_read_bin_header(c->map + c->pos, &h);
+             if (done < (size_t)h.length + 1) break;
+             done -= (size_t)h.length + 1;
+             c->pos += PROTO_BIN_HEADER + h.length;
+             if (c->pos >= c->stop) break;
+         }
+         r->partial = (uint32_t)done;
+     }
+     return 0;
+ }
+
+ /*Avanza el REPLAY del cliente. 0 si terminó, 1 si el socket se llenó, -1 si falló*/
+ static int replay_flush(Client *client) {
+     Replay *r = client->replay;
+     Metrics *m = client->shard->metrics;
+     if (!wq_empty(&r->before)) {
+         size_t bytes = r->before.bytes;
+         uint32_t count = r->before.count;
+         int f = wq_flush(&r->before, client->fd);
+         metrics_gauge(m, MET_QUEUED_BYTES, (int64_t)r->before.bytes - (int64_t)bytes);
+         metrics_gauge(m, MET_QUEUED_MSGS, (int64_t)r->before.count - (int64_t)count);
+         if (f != 0) return f;
+     }
+     while (r->pre_off < r->pre_len) {
+         ssize_t w = write(client->fd, r->preamble + r->pre_off, r->pre_len - r->pre_off);
+         if (w < 0) {
+             if (errno == EINTR) continue;
+             return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+         }
+         r->pre_off += (uint32_t)w;
+     }
+     for (;;) {
+         int s = client->binary ? replay_send_binary(client, &r->cursor) : replay_send_text(client, r);
+         if (s != 0) return s;
+         int next = tlog_cursor_next(&r->cursor);
+         if (next < 0) {
+             log_limited(LOG_LVL_ERROR, 10, "Log incompleto en el REPLAY de fd=%d", client->fd);
+             return -1;
+         }
+         if (next == 1) break;
+     }
+     replay_free(client);
+     return 0;
+ }
+
+ static void replay_free(Client *client) {
+     Replay *r = client->replay;
+     metrics_gauge(client->shard->metrics, MET_QUEUED_BYTES, -(int64_t)r->before.bytes);
+     metrics_gauge(client->shard->metrics, MET_QUEUED_MSGS, -(int64_t)r->before.count);
+     wq_free(&r->before);
+     tlog_cursor_close(&r->cursor);
+     free(r);
+     client->replay = NULL;
+ }
+
+ /*Fan-out a los subscribers de este shard*/
+ static void fanout_local(Shard *shard, uint32_t gid, Outgoing *out) {
+     Topic *t = gid < shard->by_gid_cap ? shard->by_gid[gid] : NULL;
+     if (t == NULL && shard->patterns.patterns > 0) {
+         /*Nos lo mandan por un patrón y el shard todavía no conocía el tema*/
+         const Topic *named = directory_by_id(gid);
+         if (named != NULL) t = local_topic(shard, named->name, named->len, gid);
+     }
+     if (t == NULL || t->num_subs == 0) return;
+     if (out->packed != NULL) announce_dict(t);
+     uint64_t start = metrics_now_ns();
+     uint32_t n = t->num_subs;
+     for (uint32_t j = 0; j < n; j++)
+         deliver(t->subs[j], out);
+
+     Metrics *m = shard->metrics;
+     hist_record(&m->fanout_ns, metrics_now_ns() - start);
+     metrics_add(m, MET_MSGS_OUT, n);
+     metrics_add(m, MET_BYTES_OUT, (uint64_t)n * out->payload.len);
+     metrics_topic(m, t->name, n, (uint64_t)n * out->payload.len);
+ }
+
+ static void add_shard_bit(void *owner, void *arg) {
+     *(uint64_t *)arg |= 1ull << ((Shard *)owner)->index;
+ }
+
+ /*Shards con patrones que calzan con el tema. Se recalcula solo si los
+   patrones cambiaron desde la última vez*/
+ static uint64_t wildcard_mask(Shard *shard, uint32_t gid) {
+     if (atomic_load_explicit(&wildcards.active, memory_order_relaxed) == 0) return 0;
+     uint32_t slot = gid / (uint32_t)config.threads;
+     const Topic *t = NULL;
+     if (slot >= shard->wild_cap) {
+         /*Solo un tema del directorio agranda el caché*/
+         if ((t = directory_by_id(gid)) == NULL ||
+             grow_array((void **)&shard->wild, &shard->wild_cap, slot, sizeof(WildCache)) < 0)
+             return 0;
+     }
+     WildCache *cache = &shard->wild[slot];
+     if (cache->gen != atomic_load_explicit(&wildcards.gen, memory_order_acquire)) {
+         if (t == NULL) t = directory_by_id(gid);
+         cache->mask = 0;
+         pthread_mutex_lock(&wildcards.lock);
+         if (t != NULL) trie_match(&wildcards.trie, t->name, t->len, add_shard_bit, &cache->mask);
+         cache->gen = atomic_load_explicit(&wildcards.gen, memory_order_relaxed);
+         pthread_mutex_unlock(&wildcards.lock);
+     }
+     return cache->mask;
+ }
+
+ static void count_match(void *owner, void *arg) {
+     (void)owner;
+     (*(int *)arg)++;
+ }
+
+ /*Un PUBLISH a un tema que nadie nombró todavía solo importa si calza con
+   algún patrón*/
+ static int wildcards_match(const char *name, size_t len) {
+     if (atomic_load_explicit(&wildcards.active, memory_order_relaxed) == 0 || topic_is_pattern(name, len))
+         return 0;
+     int matches = 0;
+     pthread_mutex_lock(&wildcards.lock);
+     trie_match(&wildcards.trie, name, len, count_match, &matches);
+     pthread_mutex_unlock(&wildcards.lock);
+     return matches > 0;
+ }
+
+ /*En el shard dueño: este es el punto que ordena las publicaciones del tema.
+   Se reparte a cada shard con subscribers, en el mismo orden para todos*/
+ static void owner_publish(Shard *shard, uint32_t gid, Outgoing *out) {
+     uint32_t slot = gid / (uint32_t)config.threads;
+     if (config.compress) owner_pack(shard, gid, out);
+     if (config.retain > 0) {
+         /*El anillo se queda con su propia referencia al mensaje compartido*/
+         Retained *r = owner_retained(shard, gid, 1);
+         MsgBuffer *msg = r ? outgoing_share(out) : NULL;
+         if (msg != NULL) {
+             msg_ref(msg);
+             MsgBuffer *old = retained_store(r, msg);
+             if (old != NULL) msg_release(old);
+         }
+     }
+     if (config.store_dir != NULL) {
+         TopicLog *log = owner_log(shard, gid);
+         if (log == NULL || tlog_append(log, out->payload.data, (uint32_t)out->payload.len) < 0)
+             log_limited(LOG_LVL_ERROR, 10, "No se pudo guardar en el log el mensaje del tema id=%u", gid);
+     }
+     uint64_t mask = slot < shard->interest_cap ? shard->interest[slot] : 0;
+     mask |= wildcard_mask(shard, gid);
+     if (mask == 0) {
+         metrics_add(shard->metrics, MET_NO_SUBS, 1);
+         return;
+     }
+
+     while (mask) {
+         uint32_t to = (uint32_t)__builtin_ctzll(mask);
+         mask &= mask - 1;
+         if (to == (uint32_t)shard->index) {
+             fanout_local(shard, gid, out);
+             continue;
+         }
+         MsgBuffer *msg = outgoing_share(out);
+         if (msg == NULL) continue;
+         msg_ref(msg);
+         shard_send(shard, to, SHARD_DELIVER, gid, msg);
+     }
+ }
+
+ /*Mensajes de otros shards: se procesan en el orden en que llegaron por
+   cada cola*/
+ static void shard_drain(Shard *shard) {
+     uint64_t count;
+     if (read(shard->waker.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+         log_limited(LOG_LVL_ERROR, 10, "eventfd: %s", strerror(errno));
+
+     for (int from = 0; from < config.threads; from++) {
+         SpscQueue *q = &queues[from * config.threads + shard->index];
+         SpscItem item;
+         while (spsc_pop(q, &item)) {
+             Outgoing out;
+             switch (item.op) {
+             case SHARD_SUB_ADD:
+             case SHARD_SUB_DEL:
+                 set_interest(shard, item.arg, (uint32_t)from, item.op == SHARD_SUB_ADD);
+                 break;
+             case SHARD_PUBLISH:
+                 outgoing_adopt(&out, item.ptr);
+                 owner_publish(shard, item.arg, &out);
+                 outgoing_done(&out);
+                 break;
+             case SHARD_DELIVER:
+                 outgoing_adopt(&out, item.ptr);
+                 fanout_local(shard, item.arg, &out);
+                 outgoing_done(&out);
+                 break;
+             case SHARD_RETAIN_REQ: {
+                 /*Desde ahora el origen recibe las publicaciones, y lo retenido
+                   (o el log) hasta este punto va antes en la misma cola*/
+                 RetainWait *w = item.ptr;
+                 set_interest(shard, item.arg, (uint32_t)from, 1);
+                 if (w->replay) {
+                     TopicLog *log = owner_log(shard, item.arg);
+                     if (log != NULL) w->replay_end = tlog_end(log);
+                 } else {
+                     w->count = retained_refs(shard, item.arg, w->msgs);
+                 }
+                 shard_send(shard, (uint32_t)from, SHARD_RETAIN_REPLY, item.arg, w);
+                 break;
+             }
+             case SHARD_RETAIN_REPLY:
+                 retain_reply(shard, item.ptr);
+                 break;
              }
-             printf("Mensaje enviado a %d suscriptores del tema %s\n",
-                    topics[i].num_subscribers, topic);
+         }
+     }
+     close_pending_clients(shard);
+ }
+
+ /*Un PUBLISH crea el tema si hay que retenerlo, guardarlo o calza con un
+   patrón, pero solo mientras el directorio no llegue a --max-topics: si no,
+   un cliente lo haría crecer sin límite publicando a nombres inventados*/
+ static int publish_may_create(const Command *cmd) {
+     if (config.max_topics > 0 &&
+         atomic_load_explicit(&directory_topics, memory_order_relaxed) >= config.max_topics)
+         return 0;
+     return config.retain > 0 || config.store_dir != NULL ||
+            wildcards_match(cmd->topic.data, cmd->topic.len);
+ }
+
+ /* --- Publicar mensaje a un tema --- */
+ void publish_to_topic(Shard *shard, const Command *cmd) {
+     uint32_t gid;
+     metrics_add(shard->metrics, MET_MSGS_IN, 1);
+     metrics_add(shard->metrics, MET_BYTES_IN, cmd->payload.len);
+     log_sampled(LOG_LVL_DEBUG, 1000, "PUBLISH tema=%.*s id=%d bytes=%zu (1 de cada 1000)",
+                 (int)cmd->topic.len, cmd->topic.data, cmd->has_topic_id ? (int)cmd->topic_id : -1,
+                 cmd->payload.len);
+     if (cmd->has_topic_id) {
+         /*El id lo elige el cliente: uno que el directorio no conoce no puede
+           llegar a los arreglos por id (retenidos, patrones, compresión)*/
+         gid = cmd->topic_id;
+         if ((gid >= shard->by_gid_cap || shard->by_gid[gid] == NULL) && directory_by_id(gid) == NULL) {
+             metrics_add(shard->metrics, MET_NO_SUBS, 1);
+             return;
+         }
+     } else {
+         /*Por nombre: primero la caché local del shard, después el directorio.
+           Un nombre vacío no es un tema: no se crea ni se busca*/
+         Topic *t = cmd->topic.len ? registry_find(&shard->local, cmd->topic.data, cmd->topic.len) : NULL;
+         if (t != NULL) {
+             gid = topic_gid(t);
+         } else if (cmd->topic.len &&
+                    directory_lookup(cmd->topic.data, cmd->topic.len, publish_may_create(cmd), &gid) != NULL) {
+             local_topic(shard, cmd->topic.data, cmd->topic.len, gid);
+         } else {
+             metrics_add(shard->metrics, MET_NO_SUBS, 1);
              return;
          }
      }
- 
-     printf("Tema no encontrado: %s\n", topic);
+
+     /*Un solo mensaje para todo el fan-out: nadie copia el payload salvo el
+       MsgBuffer compartido, y solo si algún subscriber tiene que encolarlo,
+       el tema es de otro shard o hay que retenerlo (el log copia aparte)*/
+     Outgoing out;
+     outgoing_init(&out, BIN_OP_MESSAGE, BIN_FLAG_TOPIC_ID, gid,
+                   cmd->payload.data, cmd->payload.len);
+     uint32_t owner = owner_of_id(gid);
+     if (owner == (uint32_t)shard->index) {
+         owner_publish(shard, gid, &out);
+     } else {
+         MsgBuffer *msg = outgoing_share(&out);
+         if (msg != NULL) {
+             msg_ref(msg);
+             shard_send(shard, owner, SHARD_PUBLISH, gid, msg);
+         }
+     }
+     outgoing_done(&out);
  }
- 
\ No newline at end of file
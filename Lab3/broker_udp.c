@@ -3,78 +3,1063 @@ broker_udp.c
 
 Broker UDP para Linux (POSIX).
 - Recibe mensajes UDP de publishers y los reenvía a todos los subscribers.
-- Formato de mensaje: "PUB|TOPIC|mensaje\n"
+- Formato de mensaje: "PUBLISH <TOPIC> mensaje" o un frame binario (ver protocol.h);
+  cada datagrama es un comando.
+- Un subscriber que se suscribe con un frame binario recibe los mensajes en binario.
+- Los temas viven en el registro compartido (topic_registry.c).
+- E/S por lotes: recvmmsg trae hasta N datagramas por syscall y el fan-out de
+  todo el lote sale en uno o pocos sendmmsg. Con --batch 1 se usa el bucle
+  clásico de un recvfrom y un sendmsg por datagrama.
+- Multi-núcleo: con --workers N cada hilo tiene su propio socket en el mismo
+  puerto (SO_REUSEPORT, el kernel reparte por dirección de origen) y queda
+  fijado a una CPU. Los temas se reparten en N registros por hash, cada uno
+  con su rwlock, así que cualquier worker puede hacer el fan-out de cualquier
+  tema y los PUBLISH de distintos temas no compiten por el mismo lock.
+- Métricas (metrics.h): cada worker cuenta mensajes, bytes, descartes y el
+  tiempo de cada fan-out sin printf por mensaje.
+- Temas jerárquicos con comodines (topic_trie.h): SUBSCRIBE liga/+/goles o
+  liga/#. Los patrones viven en un trie global con su propio rwlock; cuando
+  aparece un tema que calza (o un patrón nuevo), su subscriber se agrega al
+  vector del tema, así que publicar no recorre patrones.
+- Mensajes retenidos (retained.h, --retain N): cada tema guarda sus últimos
+  N mensajes y un SUBSCRIBE por nombre o id los recibe enseguida, así que un
+  subscriber que llega tarde no espera a la próxima publicación. Un PUBLISH
+  a un tema desconocido lo crea solo mientras haya menos de --max-topics.
+- Entregas confiables (--rtx N): el subscriber que lo pide recibe cada
+  mensaje con el número de secuencia de su tema, detecta los huecos y pide
+  lo que le falta con un NACK. Cada tema guarda sus últimos N mensajes para
+  reenviarlos; los huecos de un tema no frenan a los demás. --loss descarta
+  a propósito una parte de las entregas para probarlo en loopback.
+- Un subscriber por dirección: repetir el SUBSCRIBE no duplica la entrega.
+  Quien pasa --sub-ttl segundos sin mandar nada (SUBSCRIBE, HEARTBEAT o
+  NACK) se da de baja de todos sus temas; los vencimientos los revisa una
+  rueda de tiempo, un slot por segundo. UNSUBSCRIBE deja un tema o patrón.
+- Multicast (--mcast GRUPO[:PUERTO]): cada tema tiene un grupo (GRUPO + id
+  del tema módulo --mcast-groups). Los subscribers que se suscriben con
+  BIN_FLAG_MCAST se unen al grupo y el broker manda cada mensaje una sola
+  vez ahí, en lugar de un datagrama por subscriber; el resto sigue por
+  unicast.
+- Log asíncrono (log.h) con --log-level; los datagramas inválidos y los
+  errores de envío se registran con un límite de líneas por segundo.
 
+Compilar:
+  gcc broker_udp.c topic_registry.c protocol.c msg_buffer.c metrics.c histogram.c log.c topic_trie.c retained.c epoch.c -o broker_udp -lpthread
+Ejecutar:
+  ./broker_udp [--batch N] [--workers N] [--stats-port PORT] [--stats-interval SEGUNDOS]
+               [--log-level error|warn|info|debug] [--retain N] [--max-topics N] [--rtx N] [--loss FRACCION]
+               [--sub-ttl SEGUNDOS] [--mcast GRUPO[:PUERTO]] [--mcast-groups N] [--mcast-if IP]
+      --batch           datagramas por recvmmsg, entre 1 y 64 (por defecto 32)
+      --workers         hilos con su propio socket, entre 1 y 64 (por defecto 1)
+      --stats-port      puerto local (127.0.0.1) que responde las métricas en JSON
+      --stats-interval  vuelca las métricas en stderr cada tantos segundos
+      --log-level       nivel mínimo del log (por defecto info)
+      --retain          mensajes retenidos por tema, entre 0 y 1024 (por defecto 1)
+      --max-topics      temas que un PUBLISH puede llegar a crear (por defecto 65536, 0 = sin límite)
+      --rtx             mensajes por tema para retransmitir, entre 0 y 65536 (por defecto 0: sin entregas confiables)
+      --loss            fracción de entregas que se descartan a propósito, para pruebas (por defecto 0)
+      --sub-ttl         segundos sin señales hasta dar de baja a un subscriber (por defecto 30; 0 = nunca)
+      --mcast           primer grupo multicast para los temas (puerto por defecto 8082)
+      --mcast-groups    cuántos grupos se usan a partir del primero (por defecto 256)
+      --mcast-if        dirección de la interfaz por la que sale el multicast (127.0.0.1 para probar en loopback)
 */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "topic_registry.h"
+#include "protocol.h"
+#include "metrics.h"
+#include "log.h"
+#include "topic_trie.h"
+#include "msg_buffer.h"
+#include "retained.h"
+#include "epoch.h"
 
 #define PORT 8081
-#define BUFFER_SIZE 1024
-#define MAX_TOPICS 20
-#define MAX_SUBS 50
+#define BUFFER_SIZE PROTO_MAX_FRAME
+#define MAX_BATCH 64
+#define DEFAULT_BATCH 32
+#define OUT_BATCH 1024     /* datagramas salientes acumulados antes de un sendmmsg */
+#define OUT_HEADER (PROTO_BIN_HEADER + 2 * PROTO_SEQ_LEN)  /* lo más largo que se copia: la respuesta a un NACK */
+#define MAX_WORKERS 64
+#define DEFAULT_MAX_TOPICS 65536
+#define RTX_MAX 65536
+#define NACK_MAX 256       /* mensajes que se reenvían como mucho por NACK */
 
-/*Creamos una estructura para los topics*/
+#define WHEEL_SLOTS 64     /* rueda de vencimientos, un slot por segundo */
+#define DEFAULT_SUB_TTL 30
+#define MCAST_PORT 8082
+#define DEFAULT_MCAST_GROUPS 256
+
+typedef struct UdpSubscriber UdpSubscriber;
+
+/* Últimos mensajes numerados de un tema, en el slot seq % cap. Guardar es
+   un exchange con el lock de lectura del shard, y el mensaje pisado se
+   suelta con epoch_retire. Un NACK también lee con el lock de lectura:
+   dentro de epoch_enter/epoch_exit el mensaje sigue vivo mientras se le
+   suma una referencia, y reenviar no frena a los publishers. */
 typedef struct {
-    char topic[50];
-    struct sockaddr_in subscribers[MAX_SUBS];
-    int sub_count;
-} Topic;
+    uint32_t cap;
+    _Atomic(MsgBuffer *) slots[];
+} RtxRing;
 
-Topic topics[MAX_TOPICS];
-int topic_count = 0;
+/* Lo que el broker cuelga de cada tema (topic->user) */
+typedef struct {
+    Retained *retained;            /* NULL con --retain 0 */
+    RtxRing *rtx;                  /* NULL hasta el primer subscriber numerado */
+    _Atomic uint32_t next_seq;
+    uint32_t reliable;             /* subscribers numerados; se cambia con el lock de escritura */
+    uint32_t mcast;                /* subscribers que lo reciben por el grupo; ídem */
+} TopicState;
 
-/* agregamos función para agregar un suscriptor a un topic*/
-void add_subscriber(char *topic, struct sockaddr_in addr) {
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].topic, topic) == 0) {
-            topics[i].subscribers[topics[i].sub_count++] = addr;
-            printf("Nuevo suscriptor agregado al tema %s\n", topic);
-            return;
+/* Una parte de los temas. Publicar toma el lock de lectura; suscribir, el de
+   escritura (puede mover el vector de suscriptores del tema). */
+typedef struct {
+    pthread_rwlock_t lock;
+    TopicRegistry registry;
+} Shard;
+
+/* Tema al que está suscrito un subscriber */
+typedef struct SubLink {
+    Subscription *sub;
+    Shard *shard;
+    int exact;             /* lo pidió por nombre o id; si no, vino por un patrón */
+    struct SubLink *next;
+} SubLink;
+
+typedef struct PatternSub {
+    struct PatternSub *next;
+    uint32_t len;
+    char name[];
+} PatternSub;
+
+/* Un subscriber por dirección: otro SUBSCRIBE desde la misma dirección no
+   lo duplica. Los vectores de los temas apuntan acá y el fan-out solo lee
+   addr, binary y reliable, que no cambian. El resto se toca con el lock de
+   clients. */
+struct UdpSubscriber {
+    struct sockaddr_in addr;
+    int binary;
+    int reliable;          /* pidió entregas numeradas (BIN_FLAG_SEQ) */
+    int mcast;             /* recibe por el grupo del tema (BIN_FLAG_MCAST con --mcast) */
+    SubLink *links;
+    PatternSub *patterns;
+    uint64_t last_seen;    /* segundo del último SUBSCRIBE, HEARTBEAT o NACK */
+    uint64_t deadline;     /* segundo en que la rueda lo vuelve a mirar */
+    UdpSubscriber *next_hash;
+    UdpSubscriber *wheel_next;
+    UdpSubscriber **wheel_pprev;
+};
+
+/* Datagramas salientes pendientes. La cabecera binaria y la dirección se
+   copian (son chicas); el payload apunta al buffer de recepción o al nombre
+   del tema, que siguen vivos hasta que se vacía el lote. */
+typedef struct {
+    struct mmsghdr msgs[OUT_BATCH];
+    struct iovec iov[OUT_BATCH][2];
+    struct sockaddr_in addr[OUT_BATCH];
+    char header[OUT_BATCH][OUT_HEADER];
+    unsigned count;
+} OutBatch;
+_Static_assert(PROTO_BIN_HEADER + PROTO_MCAST_LEN <= OUT_HEADER, "la cabecera de BIN_OP_MCAST no entra");
+
+/* Estado propio de cada hilo: nada de esto se comparte */
+typedef struct {
+    int index;
+    int sockfd;
+    pthread_t thread;
+    Metrics *metrics;      /* contadores de este worker */
+    uint64_t rng;          /* para --loss */
+    OutBatch out;
+    char buffers[MAX_BATCH][BUFFER_SIZE];
+    struct mmsghdr msgs[MAX_BATCH];
+    struct iovec iov[MAX_BATCH];
+    struct sockaddr_in addrs[MAX_BATCH];
+} Worker;
+
+static int batch_size = DEFAULT_BATCH;
+static int num_workers = 1;
+static int stats_port;
+static double stats_interval;
+static int log_level_arg = LOG_LVL_INFO;
+static uint32_t retain = 1;   /* mensajes retenidos por tema; 0 = ninguno */
+static uint32_t max_topics = DEFAULT_MAX_TOPICS;   /* 0 = sin límite */
+static _Atomic uint32_t num_topics;                /* temas en todos los shards */
+static uint32_t rtx_cap;      /* mensajes por tema para retransmitir; 0 = sin entregas confiables */
+static double loss_rate;      /* fracción de entregas descartadas a propósito */
+static uint32_t sub_ttl = DEFAULT_SUB_TTL;   /* segundos sin señales hasta dar de baja; 0 = nunca */
+static struct sockaddr_in mcast_base;        /* primer grupo; sin --mcast, sin multicast */
+static uint32_t mcast_groups = DEFAULT_MCAST_GROUPS;
+static struct in_addr mcast_if;              /* INADDR_ANY: la interfaz que elija el kernel */
+static Shard shards[MAX_WORKERS];
+
+/* Subscribers por dirección, con la rueda de vencimientos. Se toma antes
+   que patterns y que los shards, y lo tienen todos los que cambian las
+   suscripciones (SUBSCRIBE, UNSUBSCRIBE, la rueda y la creación de temas,
+   que suscribe a los patrones que calzan). */
+static struct {
+    pthread_mutex_t lock;
+    UdpSubscriber **buckets;
+    uint32_t cap;          /* potencia de 2 */
+    uint32_t count;
+    UdpSubscriber *wheel[WHEEL_SLOTS];
+    uint64_t now;          /* último segundo procesado por la rueda */
+} clients = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Patrones con comodines (owner: UdpSubscriber, una vez por patrón). Si hacen
+   falta los dos locks, primero se toma este y después el del shard. */
+static struct {
+    pthread_rwlock_t lock;
+    TopicTrie trie;
+    _Atomic uint32_t active;   /* patrones en el trie; 0 = no hay que mirar */
+} patterns = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/* El tema vive en el shard que indica su hash. Se vuelve a mezclar porque
+   los bits bajos ya los usa la tabla de cada registro y nombres parecidos
+   ("sensor1", "sensor2") difieren en pocos bits */
+static Shard *shard_for_name(const char *name, size_t len) {
+    uint32_t h = registry_hash(name, len);
+    h = (h ^ (h >> 16)) * 0x9E3779B1u;
+    return &shards[(h >> 16) % (uint32_t)num_workers];
+}
+
+/* Los ids locales de cada registro se intercalan para que sean únicos:
+   id global = id local * shards + shard. Con un solo worker no cambian. */
+static uint32_t global_id(const Shard *shard, const Topic *t) {
+    return t->id * (uint32_t)num_workers + (uint32_t)(shard - shards);
+}
+
+static Shard *shard_for_id(uint32_t id, uint32_t *local) {
+    *local = id / (uint32_t)num_workers;
+    return &shards[id % (uint32_t)num_workers];
+}
+
+/* Manda todo lo acumulado; si un datagrama falla se descarta y se sigue */
+static void flush_out(Worker *w) {
+    OutBatch *out = &w->out;
+    unsigned done = 0;
+    while (done < out->count) {
+        int n = sendmmsg(w->sockfd, out->msgs + done, out->count - done, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            log_limited(LOG_LVL_WARN, 10, "sendmmsg: %s", strerror(errno));
+            metrics_add(w->metrics, MET_DROPS, 1);
+            done++;
+            continue;
+        }
+        done += (unsigned)n;
+    }
+    out->count = 0;
+}
+
+/* Encola un datagrama (cabecera opcional de header_len bytes + payload) para
+   el próximo sendmmsg. Con --batch 1 se manda en el momento con un solo sendmsg. */
+static void send_parts(Worker *w, const struct sockaddr_in *addr, const char *header,
+                       size_t header_len, const char *payload, size_t len) {
+    OutBatch *out = &w->out;
+    unsigned i = out->count;
+    struct iovec *iov = out->iov[i];
+    int iovcnt = 0;
+
+    out->addr[i] = *addr;
+    if (header != NULL) {
+        memcpy(out->header[i], header, header_len);
+        iov[iovcnt++] = (struct iovec){ out->header[i], header_len };
+    }
+    iov[iovcnt++] = (struct iovec){ (void *)payload, len };
+
+    struct msghdr *msg = &out->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(*msg));
+    msg->msg_name = &out->addr[i];
+    msg->msg_namelen = sizeof(out->addr[i]);
+    msg->msg_iov = iov;
+    msg->msg_iovlen = iovcnt;
+
+    if (batch_size == 1) {
+        if (sendmsg(w->sockfd, msg, 0) < 0) {
+            log_limited(LOG_LVL_WARN, 10, "sendmsg: %s", strerror(errno));
+            metrics_add(w->metrics, MET_DROPS, 1);
+        }
+        return;
+    }
+    if (++out->count == OUT_BATCH) flush_out(w);
+}
+
+/* Al subscriber binario le contamos el id con el que le llegarán los mensajes */
+static void send_topic_id(Worker *w, const Shard *shard, const Topic *topic, const struct sockaddr_in *addr) {
+    char header[PROTO_BIN_HEADER];
+    proto_write_bin_header(header, BIN_OP_TOPIC_ID, BIN_FLAG_TOPIC_ID, global_id(shard, topic), topic->len);
+    send_parts(w, addr, header, PROTO_BIN_HEADER, topic->name, topic->len);
+}
+
+/* Grupo del tema: varios temas pueden caer en el mismo y el subscriber filtra por id */
+static struct sockaddr_in mcast_group(uint32_t id) {
+    struct sockaddr_in group = mcast_base;
+    group.sin_addr.s_addr = htonl(ntohl(mcast_base.sin_addr.s_addr) + id % mcast_groups);
+    return group;
+}
+
+/* Al subscriber multicast le contamos a qué grupo unirse para el tema */
+static void send_mcast_group(Worker *w, const Shard *shard, const Topic *topic, const struct sockaddr_in *addr) {
+    char frame[PROTO_BIN_HEADER + PROTO_MCAST_LEN];
+    uint32_t id = global_id(shard, topic);
+    struct sockaddr_in group = mcast_group(id);
+    proto_write_bin_header(frame, BIN_OP_MCAST, BIN_FLAG_TOPIC_ID, id, PROTO_MCAST_LEN);
+    memcpy(frame + PROTO_BIN_HEADER, &group.sin_addr.s_addr, 4);
+    memcpy(frame + PROTO_BIN_HEADER + 4, &group.sin_port, 2);
+    /* Se copia entera a la cabecera del lote: el payload no puede apuntar a la pila */
+    send_parts(w, addr, frame, sizeof(frame), frame, 0);
+}
+
+/* --loss: xorshift propio de cada worker, sin locks */
+static int injected_loss(Worker *w) {
+    if (loss_rate <= 0) return 0;
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return (double)(w->rng >> 11) / (double)(1ull << 53) < loss_rate;
+}
+
+static uint32_t read_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static void write_u32(char *p, uint32_t v) {
+    v = htonl(v);
+    memcpy(p, &v, sizeof(v));
+}
+
+static RtxRing *rtx_new(uint32_t cap) {
+    RtxRing *r = calloc(1, sizeof(RtxRing) + cap * sizeof(r->slots[0]));
+    if (r != NULL) r->cap = cap;
+    return r;
+}
+
+/* El anillo pisado suelta su referencia recién cuando ningún NACK puede
+   estar leyendo el slot */
+static void rtx_release(void *msg) {
+    msg_release(msg);
+}
+
+static SubLink *find_link(const UdpSubscriber *sub, const Topic *t) {
+    for (SubLink *l = sub->links; l != NULL; l = l->next)
+        if (l->sub->topic == t) return l;
+    return NULL;
+}
+
+/* Suma un subscriber al tema; los numerados también se cuentan aparte. El
+   anillo se reserva con el primero: un tema sin subscribers confiables no
+   paga --rtx slots. Con el lock de escritura del shard */
+static SubLink *subscribe_link(Shard *shard, Topic *t, UdpSubscriber *sub, int exact) {
+    SubLink *l = malloc(sizeof(SubLink));
+    if (l == NULL) return NULL;
+    l->sub = registry_subscribe(&shard->registry, t->name, t->len, sub);
+    if (l->sub == NULL) {
+        free(l);
+        return NULL;
+    }
+    l->shard = shard;
+    l->exact = exact;
+    l->next = sub->links;
+    sub->links = l;
+    TopicState *state = t->user;
+    if (sub->reliable && state != NULL && rtx_cap > 0) {
+        if (state->rtx == NULL) state->rtx = rtx_new(rtx_cap);
+        if (state->rtx != NULL) state->reliable++;
+    }
+    if (sub->mcast && state != NULL) state->mcast++;
+    return l;
+}
+
+/* Saca al subscriber del tema de *link y libera el enlace */
+static void unlink_topic(UdpSubscriber *sub, SubLink **link) {
+    SubLink *l = *link;
+    *link = l->next;
+    pthread_rwlock_wrlock(&l->shard->lock);
+    TopicState *state = l->sub->topic->user;
+    if (sub->reliable && state != NULL && state->rtx != NULL) state->reliable--;
+    if (sub->mcast && state != NULL) state->mcast--;
+    registry_unsubscribe(l->sub);
+    pthread_rwlock_unlock(&l->shard->lock);
+    free(l);
+}
+
+typedef struct {
+    Worker *w;
+    Shard *shard;
+    Topic *topic;
+} AttachCtx;
+
+/* Suscribe al dueño de un patrón que calza con el tema (una sola vez,
+   aunque calcen varios patrones suyos) */
+static void attach_match(void *owner, void *arg) {
+    AttachCtx *ctx = arg;
+    UdpSubscriber *sub = owner;
+    if (find_link(sub, ctx->topic) != NULL) return;
+    if (subscribe_link(ctx->shard, ctx->topic, sub, 0) == NULL) {
+        log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %s", ctx->topic->name);
+        return;
+    }
+    if (sub->binary) send_topic_id(ctx->w, ctx->shard, ctx->topic, &sub->addr);
+    if (sub->mcast) send_mcast_group(ctx->w, ctx->shard, ctx->topic, &sub->addr);
+}
+
+static void count_match(void *owner, void *arg) {
+    (void)owner;
+    (*(int *)arg)++;
+}
+
+/* Busca o crea el tema; si es nuevo se suscriben los patrones que calzan.
+   Con only_matched solo se crea si calza con alguno (sin retenidos, un
+   PUBLISH a un tema que nadie pidió no debe agrandar el registro). Hay que
+   tener tomados el lock de clients, el de lectura de patterns y el de
+   escritura del shard. */
+static Topic *intern_topic(Worker *w, Shard *shard, const char *name, size_t len, int only_matched) {
+    Topic *t = registry_find(&shard->registry, name, len);
+    if (t != NULL) return t;
+    if (only_matched) {
+        int matches = 0;
+        trie_match(&patterns.trie, name, len, count_match, &matches);
+        if (matches == 0) return NULL;
+    }
+    t = registry_intern(&shard->registry, name, len);
+    if (t == NULL) return NULL;
+    atomic_fetch_add_explicit(&num_topics, 1, memory_order_relaxed);
+    if ((retain > 0 || rtx_cap > 0 || mcast_base.sin_family != 0) && t->user == NULL) {
+        TopicState *state = calloc(1, sizeof(TopicState));
+        if (state == NULL) return NULL;
+        if (retain > 0 && (state->retained = retained_new(retain)) == NULL) {
+            free(state);
+            return NULL;
+        }
+        t->user = state;
+    }
+    AttachCtx ctx = { w, shard, t };
+    trie_match(&patterns.trie, name, len, attach_match, &ctx);
+    return t;
+}
+
+/* --- Subscribers por dirección --- */
+
+static uint64_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec;
+}
+
+static uint32_t addr_hash(const struct sockaddr_in *addr) {
+    uint64_t key = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+    key *= 0x9E3779B97F4A7C15ull;
+    return (uint32_t)(key >> 32);
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static UdpSubscriber *client_find(const struct sockaddr_in *addr) {
+    if (clients.cap == 0) return NULL;
+    UdpSubscriber *c = clients.buckets[addr_hash(addr) & (clients.cap - 1)];
+    while (c != NULL && !same_addr(&c->addr, addr)) c = c->next_hash;
+    return c;
+}
+
+static void wheel_insert(UdpSubscriber *c) {
+    UdpSubscriber **slot = &clients.wheel[c->deadline % WHEEL_SLOTS];
+    c->wheel_next = *slot;
+    if (*slot != NULL) (*slot)->wheel_pprev = &c->wheel_next;
+    c->wheel_pprev = slot;
+    *slot = c;
+}
+
+static void wheel_remove(UdpSubscriber *c) {
+    if (c->wheel_pprev == NULL) return;
+    *c->wheel_pprev = c->wheel_next;
+    if (c->wheel_next != NULL) c->wheel_next->wheel_pprev = c->wheel_pprev;
+    c->wheel_pprev = NULL;
+}
+
+/* La tabla se duplica cuando hay más subscribers que buckets */
+static int clients_grow(void) {
+    if (clients.count < clients.cap) return 0;
+    uint32_t cap = clients.cap ? clients.cap * 2 : 64;
+    UdpSubscriber **buckets = calloc(cap, sizeof(UdpSubscriber *));
+    if (buckets == NULL) return -1;
+    for (uint32_t i = 0; i < clients.cap; i++) {
+        while (clients.buckets[i] != NULL) {
+            UdpSubscriber *c = clients.buckets[i];
+            clients.buckets[i] = c->next_hash;
+            uint32_t b = addr_hash(&c->addr) & (cap - 1);
+            c->next_hash = buckets[b];
+            buckets[b] = c;
+        }
+    }
+    free(clients.buckets);
+    clients.buckets = buckets;
+    clients.cap = cap;
+    return 0;
+}
+
+/* Da de baja al subscriber: sale de todos sus temas y patrones y se libera.
+   Después de soltar el lock de cada shard ningún fan-out lo ve más */
+static void client_drop(UdpSubscriber *c, Worker *w, const char *why) {
+    while (c->links != NULL) unlink_topic(c, &c->links);
+    if (c->patterns != NULL) {
+        pthread_rwlock_wrlock(&patterns.lock);
+        while (c->patterns != NULL) {
+            PatternSub *p = c->patterns;
+            c->patterns = p->next;
+            trie_remove(&patterns.trie, p->name, p->len, c);
+            free(p);
+        }
+        atomic_store_explicit(&patterns.active, patterns.trie.patterns, memory_order_relaxed);
+        pthread_rwlock_unlock(&patterns.lock);
+    }
+    UdpSubscriber **link = &clients.buckets[addr_hash(&c->addr) & (clients.cap - 1)];
+    while (*link != c) link = &(*link)->next_hash;
+    *link = c->next_hash;
+    clients.count--;
+    wheel_remove(c);
+    if (w != NULL) metrics_add(w->metrics, MET_DISCONNECTS, 1);
+    log_limited(LOG_LVL_INFO, 100, "Suscriptor dado de baja ip=%s puerto=%d (%s)",
+                inet_ntoa(c->addr.sin_addr), ntohs(c->addr.sin_port), why);
+    free(c);
+}
+
+/* Subscriber de la dirección, creado si hace falta. Si cambió el formato
+   (otra instancia en la misma dirección), el anterior se da de baja */
+static UdpSubscriber *client_get(const struct sockaddr_in *addr, int binary, int reliable, int mcast,
+                                 Worker *w) {
+    UdpSubscriber *c = client_find(addr);
+    if (c != NULL && (c->binary != binary || c->reliable != reliable || c->mcast != mcast)) {
+        client_drop(c, w, "cambió de formato");
+        c = NULL;
+    }
+    if (c == NULL) {
+        if (clients_grow() < 0 || (c = calloc(1, sizeof(UdpSubscriber))) == NULL) return NULL;
+        c->addr = *addr;
+        c->binary = binary;
+        c->reliable = reliable;
+        c->mcast = mcast;
+        uint32_t b = addr_hash(addr) & (clients.cap - 1);
+        c->next_hash = clients.buckets[b];
+        clients.buckets[b] = c;
+        clients.count++;
+        c->last_seen = now_sec();
+        if (sub_ttl > 0) {
+            c->deadline = c->last_seen + sub_ttl;
+            wheel_insert(c);
+        }
+    }
+    c->last_seen = now_sec();
+    return c;
+}
+
+/* Sin temas ni patrones no hay nada que vigilar */
+static void client_idle_check(UdpSubscriber *c, Worker *w) {
+    if (c->links == NULL && c->patterns == NULL) client_drop(c, w, "sin suscripciones");
+}
+
+/* Rueda de vencimientos: cada segundo se revisa un slot. Un HEARTBEAT solo
+   actualiza last_seen; el subscriber se mueve de slot recién cuando la
+   rueda pasa por él, así que las señales no cuestan más que un lock */
+static void *reaper_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        sleep(1);
+        pthread_mutex_lock(&clients.lock);
+        uint64_t now = now_sec();
+        while (clients.now < now) {
+            clients.now++;
+            UdpSubscriber *c = clients.wheel[clients.now % WHEEL_SLOTS];
+            clients.wheel[clients.now % WHEEL_SLOTS] = NULL;
+            while (c != NULL) {
+                UdpSubscriber *next = c->wheel_next;
+                c->wheel_pprev = NULL;
+                if (c->last_seen + sub_ttl <= clients.now) {
+                    client_drop(c, NULL, "vencido");
+                } else {
+                    /* Con señales nuevas, o un vencimiento a más de una vuelta */
+                    c->deadline = c->deadline > clients.now ? c->deadline : c->last_seen + sub_ttl;
+                    wheel_insert(c);
+                }
+                c = next;
+            }
+        }
+        pthread_mutex_unlock(&clients.lock);
+    }
+    return NULL;
+}
+
+/* SUBSCRIBE con comodines: queda en el trie para los temas que aparezcan y
+   se suscribe ya a los que existen, shard por shard. Con el lock de clients */
+static void add_pattern_subscriber(const Command *cmd, UdpSubscriber *owner, Worker *w) {
+    const char *name = cmd->topic.data;
+    size_t len = cmd->topic.len;
+    if (!topic_pattern_valid(name, len)) {
+        log_limited(LOG_LVL_WARN, 10, "Patrón inválido de ip=%s: %.*s",
+                    inet_ntoa(owner->addr.sin_addr), (int)len, name);
+        return;
+    }
+    for (PatternSub *p = owner->patterns; p != NULL; p = p->next)
+        if (p->len == len && memcmp(p->name, name, len) == 0) return;
+    PatternSub *p = malloc(sizeof(PatternSub) + len);
+    if (p == NULL) return;
+    p->len = (uint32_t)len;
+    memcpy(p->name, name, len);
+
+    pthread_rwlock_wrlock(&patterns.lock);
+    if (trie_insert(&patterns.trie, name, len, owner) < 0) {
+        pthread_rwlock_unlock(&patterns.lock);
+        free(p);
+        log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al patrón %.*s", (int)len, name);
+        return;
+    }
+    p->next = owner->patterns;
+    owner->patterns = p;
+    atomic_store_explicit(&patterns.active, patterns.trie.patterns, memory_order_relaxed);
+    for (int i = 0; i < num_workers; i++) {
+        Shard *shard = &shards[i];
+        pthread_rwlock_wrlock(&shard->lock);
+        for (uint32_t id = 0; id < shard->registry.count; id++) {
+            Topic *t = registry_by_id(&shard->registry, id);
+            if (!topic_matches(name, len, t->name, t->len)) continue;
+            AttachCtx ctx = { w, shard, t };
+            attach_match(owner, &ctx);
         }
+        pthread_rwlock_unlock(&shard->lock);
     }
+    pthread_rwlock_unlock(&patterns.lock);
 
-    // Si el tema no existe, crearlo
-    strcpy(topics[topic_count].topic, topic);
-    topics[topic_count].subscribers[0] = addr;
-    topics[topic_count].sub_count = 1;
-    topic_count++;
-    printf("Tema creado y suscriptor agregado: %s\n", topic);
+    metrics_add(w->metrics, MET_SUBSCRIBES, 1);
+    log_limited(LOG_LVL_INFO, 100, "Nuevo patrón ip=%s puerto=%d patrón=%.*s",
+                inet_ntoa(owner->addr.sin_addr), ntohs(owner->addr.sin_port), (int)len, name);
+}
+
+/* agregamos función para agregar un suscriptor a un topic*/
+void add_subscriber(const Command *cmd, struct sockaddr_in addr, Worker *w) {
+    Shard *shard;
+    uint32_t local = 0;
+    int pattern = 0;
+    if (cmd->has_topic_id) {
+        shard = shard_for_id(cmd->topic_id, &local);
+    } else if (cmd->topic.len > 0) {
+        pattern = topic_is_pattern(cmd->topic.data, cmd->topic.len);
+        shard = shard_for_name(cmd->topic.data, cmd->topic.len);
+    } else {
+        return;
+    }
+
+    /* Los numerados siguen por unicast: el grupo no sabe de retransmisiones */
+    int reliable = cmd->binary && (cmd->flags & BIN_FLAG_SEQ) != 0;
+    int mcast = cmd->binary && !reliable && (cmd->flags & BIN_FLAG_MCAST) != 0 && mcast_base.sin_family != 0;
+    pthread_mutex_lock(&clients.lock);
+    UdpSubscriber *owner = client_get(&addr, cmd->binary, reliable, mcast, w);
+    if (owner == NULL) {
+        pthread_mutex_unlock(&clients.lock);
+        log_limited(LOG_LVL_ERROR, 10, "Sin memoria para el suscriptor ip=%s", inet_ntoa(addr.sin_addr));
+        return;
+    }
+    if (pattern) {
+        add_pattern_subscriber(cmd, owner, w);
+        client_idle_check(owner, w);
+        pthread_mutex_unlock(&clients.lock);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&patterns.lock);
+    pthread_rwlock_wrlock(&shard->lock);
+    Topic *topic = cmd->has_topic_id ? registry_by_id(&shard->registry, local)
+                                     : intern_topic(w, shard, cmd->topic.data, cmd->topic.len, 0);
+    /* Un SUBSCRIBE repetido (o a un tema que ya recibe por un patrón) no
+       duplica la entrega, pero vuelve a mandar el id y lo retenido: puede
+       ser el mismo subscriber reiniciado */
+    SubLink *link = topic ? find_link(owner, topic) : NULL;
+    if (link != NULL) link->exact = 1;
+    else if (topic != NULL) link = subscribe_link(shard, topic, owner, 1);
+    pthread_rwlock_unlock(&patterns.lock);
+    if (link == NULL) {
+        pthread_rwlock_unlock(&shard->lock);
+        client_idle_check(owner, w);
+        pthread_mutex_unlock(&clients.lock);
+        if (!cmd->has_topic_id)
+            log_limited(LOG_LVL_ERROR, 10, "Sin memoria para suscribir al tema %.*s",
+                        (int)cmd->topic.len, cmd->topic.data);
+        return;
+    }
+    /* Sin el lock de clients la rueda lo puede dar de baja: desde acá no se
+       vuelve a mirar owner */
+    int binary = owner->binary;
+    pthread_mutex_unlock(&clients.lock);
+    uint32_t num_subs = topic->num_subs;
+    metrics_add(w->metrics, MET_SUBSCRIBES, 1);
+    if (binary) send_topic_id(w, shard, topic, &addr);
+    if (mcast) send_mcast_group(w, shard, topic, &addr);
+
+    /* Lo retenido, del más viejo al más nuevo. Los datagramas apuntan a los
+       mensajes hasta el sendmmsg, así que se toma una referencia a cada uno
+       y se sueltan después de mandarlos (otro worker puede pisarlos apenas
+       se suelte el lock) */
+    MsgBuffer *kept[RETAIN_MAX];
+    TopicState *state = topic->user;
+    uint32_t num_kept = state && state->retained ? retained_snapshot(state->retained, (void **)kept) : 0;
+    for (uint32_t i = 0; i < num_kept; i++) {
+        msg_ref(kept[i]);
+        send_parts(w, &addr, binary ? kept[i]->data : NULL, PROTO_BIN_HEADER,
+                   kept[i]->data + MSG_TEXT_OFFSET, kept[i]->payload_len);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    if (num_kept > 0) {
+        if (batch_size > 1) flush_out(w);
+        for (uint32_t i = 0; i < num_kept; i++) msg_release(kept[i]);
+    }
+
+    /* El tema nunca se borra: su nombre sigue válido sin el lock */
+    log_limited(LOG_LVL_INFO, 100, "Nuevo suscriptor ip=%s puerto=%d tema=%s suscriptores=%u",
+                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port), topic->name, num_subs);
 }
 
 /* Funcion para publicar mensajes a todos los suscriptores de un topic*/
-void publish_message(char *topic, char *msg, int sockfd) {
-    for (int i = 0; i < topic_count; i++) {
-        if (strcmp(topics[i].topic, topic) == 0) {
-            for (int j = 0; j < topics[i].sub_count; j++) {
-                sendto(sockfd, msg, strlen(msg), 0,
-                       (struct sockaddr *)&topics[i].subscribers[j],
-                       sizeof(topics[i].subscribers[j]));
+void publish_message(const Command *cmd, Worker *w) {
+    Shard *shard;
+    uint32_t local = 0;
+    Metrics *m = w->metrics;
+    metrics_add(m, MET_MSGS_IN, 1);
+    metrics_add(m, MET_BYTES_IN, cmd->payload.len);
+    log_sampled(LOG_LVL_DEBUG, 1000, "PUBLISH tema=%.*s id=%d bytes=%zu (1 de cada 1000)",
+                (int)cmd->topic.len, cmd->topic.data, cmd->has_topic_id ? (int)cmd->topic_id : -1,
+                cmd->payload.len);
+    if (cmd->has_topic_id)
+        shard = shard_for_id(cmd->topic_id, &local);
+    else
+        shard = shard_for_name(cmd->topic.data, cmd->topic.len);
+
+    pthread_rwlock_rdlock(&shard->lock);
+    Topic *t = cmd->has_topic_id ? registry_by_id(&shard->registry, local)
+                                 : registry_find(&shard->registry, cmd->topic.data, cmd->topic.len);
+    if (t == NULL && !cmd->has_topic_id && cmd->topic.len > 0 &&
+        (retain > 0 || atomic_load_explicit(&patterns.active, memory_order_relaxed) > 0) &&
+        (max_topics == 0 || atomic_load_explicit(&num_topics, memory_order_relaxed) < max_topics) &&
+        !topic_is_pattern(cmd->topic.data, cmd->topic.len)) {
+        /* Tema que nadie nombró todavía: se crea para retener lo publicado o,
+           sin retenidos, solo si calza con algún patrón. Nunca con el nombre
+           vacío ni pasado --max-topics, para que un cliente no agrande el
+           registro sin límite. Se sigue con el lock de escritura, que también
+           sirve para el fan-out */
+        pthread_rwlock_unlock(&shard->lock);
+        pthread_mutex_lock(&clients.lock);
+        pthread_rwlock_rdlock(&patterns.lock);
+        pthread_rwlock_wrlock(&shard->lock);
+        t = intern_topic(w, shard, cmd->topic.data, cmd->topic.len, retain == 0);
+        pthread_rwlock_unlock(&patterns.lock);
+        pthread_mutex_unlock(&clients.lock);
+    }
+    TopicState *state = t ? t->user : NULL;
+    if (state != NULL && state->retained != NULL) {
+        /* Con el lock de lectura puede haber otros workers guardando en el
+           mismo anillo (retained_store es atómico); leerlo pide el de escritura */
+        MsgBuffer *msg = msg_new(BIN_OP_MESSAGE, BIN_FLAG_TOPIC_ID, global_id(shard, t),
+                                 cmd->payload.data, (uint32_t)cmd->payload.len);
+        MsgBuffer *old = msg ? retained_store(state->retained, msg) : NULL;
+        if (old != NULL) msg_release(old);
+    }
+    /* Solo se numera si alguien lo pidió: sin subscribers confiables el tema
+       no gasta una copia por mensaje */
+    char seq_header[PROTO_BIN_HEADER + PROTO_SEQ_LEN];
+    int sequenced = state != NULL && state->rtx != NULL && state->reliable > 0;
+    if (sequenced) {
+        uint32_t seq = atomic_fetch_add_explicit(&state->next_seq, 1, memory_order_relaxed);
+        proto_write_bin_header(seq_header, BIN_OP_MESSAGE, BIN_FLAG_TOPIC_ID | BIN_FLAG_SEQ, global_id(shard, t),
+                               (uint32_t)(PROTO_SEQ_LEN + cmd->payload.len));
+        write_u32(seq_header + PROTO_BIN_HEADER, seq);
+        MsgBuffer *msg = msg_new(BIN_OP_MESSAGE, BIN_FLAG_TOPIC_ID | BIN_FLAG_SEQ, global_id(shard, t),
+                                 NULL, (uint32_t)(PROTO_SEQ_LEN + cmd->payload.len));
+        if (msg != NULL) {
+            write_u32(msg->data + PROTO_BIN_HEADER, seq);
+            memcpy(msg->data + PROTO_BIN_HEADER + PROTO_SEQ_LEN, cmd->payload.data, cmd->payload.len);
+            MsgBuffer *old = atomic_exchange_explicit(&state->rtx->slots[seq % state->rtx->cap], msg,
+                                                      memory_order_acq_rel);
+            if (old != NULL) epoch_retire(old, rtx_release);
+        }
+    }
+    if (t == NULL || t->num_subs == 0) {
+        pthread_rwlock_unlock(&shard->lock);
+        metrics_add(m, MET_NO_SUBS, 1);
+        return;
+    }
+    uint64_t start = metrics_now_ns();
+
+    /* Con el lock tomado solo se arman los datagramas; las direcciones se
+       copian al lote, así que el envío no depende del registro */
+    char header[PROTO_BIN_HEADER];
+    proto_write_bin_header(header, BIN_OP_MESSAGE, BIN_FLAG_TOPIC_ID, global_id(shard, t), (uint32_t)cmd->payload.len);
+    uint32_t num_subs = t->num_subs;
+    uint32_t sent = 0;
+    int mcast = state != NULL && state->mcast > 0;
+    if (mcast) {
+        /* Un solo datagrama para todos los que están en el grupo */
+        struct sockaddr_in group = mcast_group(global_id(shard, t));
+        if (!injected_loss(w)) send_parts(w, &group, header, PROTO_BIN_HEADER, cmd->payload.data, cmd->payload.len);
+        sent++;
+    }
+    for (uint32_t j = 0; j < num_subs; j++) {
+        const UdpSubscriber *sub = t->subs[j];
+        if (mcast && sub->mcast) continue;
+        sent++;
+        if (injected_loss(w)) continue;
+        if (sequenced && sub->reliable)
+            send_parts(w, &sub->addr, seq_header, sizeof(seq_header), cmd->payload.data, cmd->payload.len);
+        else
+            send_parts(w, &sub->addr, sub->binary ? header : NULL, PROTO_BIN_HEADER,
+                       cmd->payload.data, cmd->payload.len);
+    }
+    metrics_topic(m, t->name, sent, (uint64_t)sent * cmd->payload.len);
+    pthread_rwlock_unlock(&shard->lock);
+
+    /* En modo por lotes esto mide armar los datagramas; el sendmmsg va aparte.
+       Los mensajes salientes son datagramas: el grupo cuenta uno solo */
+    hist_record(&m->fanout_ns, metrics_now_ns() - start);
+    metrics_add(m, MET_MSGS_OUT, sent);
+    metrics_add(m, MET_BYTES_OUT, (uint64_t)sent * cmd->payload.len);
+}
+
+/* NACK de un subscriber: se reenvía lo que siga en el anillo y se avisa lo
+   que ya se pisó, para que no lo vuelva a pedir */
+static void handle_nack(const Command *cmd, struct sockaddr_in addr, Worker *w) {
+    if (!cmd->has_topic_id || cmd->payload.len != 2 * PROTO_SEQ_LEN) return;
+    uint32_t first = read_u32(cmd->payload.data);
+    uint32_t count = read_u32(cmd->payload.data + PROTO_SEQ_LEN);
+    if (count > NACK_MAX) count = NACK_MAX;
+    metrics_add(w->metrics, MET_NACKS, 1);
+
+    uint32_t local;
+    Shard *shard = shard_for_id(cmd->topic_id, &local);
+    MsgBuffer *found[NACK_MAX];
+    uint32_t num_found = 0, lost = 0;
+    pthread_rwlock_rdlock(&shard->lock);
+    Topic *t = registry_by_id(&shard->registry, local);
+    TopicState *state = t ? t->user : NULL;
+    if (state == NULL || state->rtx == NULL) {
+        pthread_rwlock_unlock(&shard->lock);
+        return;
+    }
+    epoch_enter();
+    uint32_t next = atomic_load_explicit(&state->next_seq, memory_order_relaxed);
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t seq = first + i;
+        if ((int32_t)(next - seq) <= 0) break;   /* todavía no se publicó */
+        MsgBuffer *msg = atomic_load_explicit(&state->rtx->slots[seq % state->rtx->cap], memory_order_acquire);
+        if (msg == NULL || read_u32(msg->data + PROTO_BIN_HEADER) != seq) {
+            /* Se pisó: los más viejos se pisan primero */
+            if (num_found == 0) lost++;
+            continue;
+        }
+        msg_ref(msg);
+        found[num_found++] = msg;
+    }
+    epoch_exit();
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (lost > 0) {
+        char header[PROTO_BIN_HEADER + 2 * PROTO_SEQ_LEN];
+        proto_write_bin_header(header, BIN_OP_NACK, BIN_FLAG_TOPIC_ID, cmd->topic_id, 2 * PROTO_SEQ_LEN);
+        write_u32(header + PROTO_BIN_HEADER, first);
+        write_u32(header + PROTO_BIN_HEADER + PROTO_SEQ_LEN, lost);
+        /* Entera a la cabecera del lote: header muere antes del sendmmsg */
+        send_parts(w, &addr, header, sizeof(header), header, 0);
+    }
+    /* Los datagramas apuntan a los mensajes hasta el sendmmsg */
+    for (uint32_t i = 0; i < num_found; i++) {
+        if (!injected_loss(w))
+            send_parts(w, &addr, found[i]->data, PROTO_BIN_HEADER,
+                       found[i]->data + PROTO_BIN_HEADER, found[i]->payload_len);
+    }
+    if (batch_size > 1) flush_out(w);
+    for (uint32_t i = 0; i < num_found; i++) msg_release(found[i]);
+    metrics_add(w->metrics, MET_RETRANSMITS, num_found);
+    log_limited(LOG_LVL_DEBUG, 10, "NACK ip=%s tema=%u desde=%u cantidad=%u reenviados=%u perdidos=%u",
+                inet_ntoa(addr.sin_addr), cmd->topic_id, first, count, num_found, lost);
+}
+
+/* UNSUBSCRIBE de un tema (por nombre o id) o de un patrón. Un tema que
+   todavía calza con otro patrón del subscriber se sigue recibiendo */
+static void remove_subscriber(const Command *cmd, struct sockaddr_in addr, Worker *w) {
+    pthread_mutex_lock(&clients.lock);
+    UdpSubscriber *c = client_find(&addr);
+    if (c == NULL) {
+        pthread_mutex_unlock(&clients.lock);
+        return;
+    }
+    c->last_seen = now_sec();
+
+    if (!cmd->has_topic_id && topic_is_pattern(cmd->topic.data, cmd->topic.len)) {
+        const char *name = cmd->topic.data;
+        size_t len = cmd->topic.len;
+        PatternSub **pp = &c->patterns;
+        while (*pp != NULL && !((*pp)->len == len && memcmp((*pp)->name, name, len) == 0)) pp = &(*pp)->next;
+        if (*pp != NULL) {
+            PatternSub *gone = *pp;
+            *pp = gone->next;
+            pthread_rwlock_wrlock(&patterns.lock);
+            trie_remove(&patterns.trie, name, len, c);
+            atomic_store_explicit(&patterns.active, patterns.trie.patterns, memory_order_relaxed);
+            pthread_rwlock_unlock(&patterns.lock);
+            free(gone);
+            /* Los temas que llegaban solo por este patrón */
+            for (SubLink **link = &c->links; *link != NULL;) {
+                const Topic *t = (*link)->sub->topic;
+                int keep = (*link)->exact || !topic_matches(name, len, t->name, t->len);
+                for (PatternSub *p = c->patterns; p != NULL && !keep; p = p->next)
+                    keep = topic_matches(p->name, p->len, t->name, t->len);
+                if (keep) link = &(*link)->next;
+                else unlink_topic(c, link);
             }
-            printf("📤 Mensaje enviado a %d suscriptores del tema %s\n",
-                   topics[i].sub_count, topic);
-            return;
+        }
+    } else {
+        Shard *shard;
+        uint32_t local = 0;
+        if (cmd->has_topic_id) shard = shard_for_id(cmd->topic_id, &local);
+        else shard = shard_for_name(cmd->topic.data, cmd->topic.len);
+        pthread_rwlock_rdlock(&shard->lock);
+        const Topic *t = cmd->has_topic_id ? registry_by_id(&shard->registry, local)
+                                           : registry_find(&shard->registry, cmd->topic.data, cmd->topic.len);
+        pthread_rwlock_unlock(&shard->lock);
+        SubLink **link = &c->links;
+        while (*link != NULL && (*link)->sub->topic != t) link = &(*link)->next;
+        if (t != NULL && *link != NULL) {
+            int matched = 0;
+            for (PatternSub *p = c->patterns; p != NULL && !matched; p = p->next)
+                matched = topic_matches(p->name, p->len, t->name, t->len);
+            if (matched) (*link)->exact = 0;
+            else unlink_topic(c, link);
         }
     }
+    client_idle_check(c, w);
+    pthread_mutex_unlock(&clients.lock);
+}
 
-    printf("No hay suscriptores para el tema %s\n", topic);
+/* HEARTBEAT (o cualquier pedido de control): el subscriber sigue vivo */
+static void touch_subscriber(struct sockaddr_in addr) {
+    pthread_mutex_lock(&clients.lock);
+    UdpSubscriber *c = client_find(&addr);
+    if (c != NULL) c->last_seen = now_sec();
+    pthread_mutex_unlock(&clients.lock);
 }
 
-int main() {
-    int sockfd;
-    struct sockaddr_in server_addr, client_addr;
-    char buffer[BUFFER_SIZE];
-    socklen_t addr_len = sizeof(client_addr);
+/* Procesa un datagrama; los slices del comando apuntan dentro de buf */
+static void handle_datagram(const char *buf, size_t bytes, struct sockaddr_in client_addr, Worker *w) {
+    Frame frame;
+    Command cmd;
+    if (proto_datagram_frame(buf, bytes, &frame) < 0 ||
+        proto_parse_frame(&frame, &cmd) < 0) {
+        log_limited(LOG_LVL_WARN, 10, "Datagrama inválido de %zu bytes ip=%s",
+                    bytes, inet_ntoa(client_addr.sin_addr));
+        return;
+    }
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (cmd.op == BIN_OP_SUBSCRIBE) {
+        add_subscriber(&cmd, client_addr, w);
+    } else if (cmd.op == BIN_OP_PUBLISH) {
+        publish_message(&cmd, w);
+    } else if (cmd.op == BIN_OP_NACK) {
+        touch_subscriber(client_addr);
+        handle_nack(&cmd, client_addr, w);
+    } else if (cmd.op == BIN_OP_UNSUBSCRIBE) {
+        remove_subscriber(&cmd, client_addr, w);
+    } else if (cmd.op == BIN_OP_HEARTBEAT) {
+        touch_subscriber(client_addr);
+    } else {
+        log_limited(LOG_LVL_WARN, 10, "Comando desconocido: %.*s", (int)cmd.command.len, cmd.command.data);
+    }
+}
+
+/* Bucle clásico: un recvfrom por datagrama */
+static void run_single(Worker *w) {
+    char *buffer = w->buffers[0];
+    struct sockaddr_in client_addr;
+    socklen_t addr_len;
+
+    while (1) {
+        addr_len = sizeof(client_addr);
+        int bytes = recvfrom(w->sockfd, buffer, BUFFER_SIZE, 0,
+                             (struct sockaddr *)&client_addr, &addr_len);
+        if (bytes < 0) {
+            if (errno != EINTR) log_limited(LOG_LVL_ERROR, 10, "Error al recibir: %s", strerror(errno));
+            continue;
+        }
+        handle_datagram(buffer, (size_t)bytes, client_addr, w);
+    }
+}
+
+/* Bucle por lotes: recvmmsg bloquea hasta el primer datagrama y se lleva todos
+   los que ya estén en cola (MSG_WAITFORONE); el fan-out del lote sale junto */
+static void run_batched(Worker *w) {
+    while (1) {
+        for (int i = 0; i < batch_size; i++) {
+            w->iov[i].iov_base = w->buffers[i];
+            w->iov[i].iov_len = BUFFER_SIZE;
+            memset(&w->msgs[i].msg_hdr, 0, sizeof(w->msgs[i].msg_hdr));
+            w->msgs[i].msg_hdr.msg_name = &w->addrs[i];
+            w->msgs[i].msg_hdr.msg_namelen = sizeof(w->addrs[i]);
+            w->msgs[i].msg_hdr.msg_iov = &w->iov[i];
+            w->msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        int n = recvmmsg(w->sockfd, w->msgs, (unsigned)batch_size, MSG_WAITFORONE, NULL);
+        if (n < 0) {
+            if (errno != EINTR) log_limited(LOG_LVL_ERROR, 10, "Error al recibir: %s", strerror(errno));
+            continue;
+        }
+        for (int i = 0; i < n; i++)
+            handle_datagram(w->buffers[i], w->msgs[i].msg_len, w->addrs[i], w);
+
+        /* Los payloads encolados apuntan a buffers: hay que mandarlos antes
+           de volver a recibir encima */
+        flush_out(w);
+    }
+}
+
+/* Socket propio del worker; con varios workers todos comparten el puerto */
+static int open_socket(void) {
+    struct sockaddr_in server_addr;
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("Error al crear socket UDP");
         exit(1);
     }
 
+    if (num_workers > 1) {
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("SO_REUSEPORT");
+            exit(1);
+        }
+    }
+
+    /* El multicast sale por el mismo socket; con IP_MULTICAST_LOOP lo reciben
+       también los subscribers de esta máquina */
+    if (mcast_base.sin_family != 0) {
+        unsigned char loop = 1;
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+        if (mcast_if.s_addr != INADDR_ANY &&
+            setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF, &mcast_if, sizeof(mcast_if)) < 0) {
+            perror("IP_MULTICAST_IF");
+            exit(1);
+        }
+    }
+
+    memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
     server_addr.sin_port = htons(PORT);
@@ -84,33 +1069,167 @@ int main() {
         close(sockfd);
         exit(1);
     }
+    return sockfd;
+}
 
-    printf("Broker UDP escuchando en el puerto %d...\n", PORT);
+static void *worker_main(void *arg) {
+    Worker *w = arg;
+    w->metrics = metrics_local();
 
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes = recvfrom(sockfd, buffer, BUFFER_SIZE - 1, 0,
-                             (struct sockaddr *)&client_addr, &addr_len);
-        if (bytes < 0) {
-            perror("Error al recibir");
-            continue;
-        }
+    /* Cada worker en su CPU: el socket, el lote y los buffers quedan en su caché */
+    if (num_workers > 1) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->index % (cpus > 0 ? cpus : 1), &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
 
-        buffer[bytes] = '\0';
-        printf("Mensaje recibido: %s\n", buffer);
+    if (batch_size == 1)
+        run_single(w);
+    else
+        run_batched(w);
+    return NULL;
+}
 
-        char command[20], topic[50], msg[BUFFER_SIZE];
-        sscanf(buffer, "%s %s %[^\n]", command, topic, msg);
+static void usage(const char *prog) {
+    fprintf(stderr, "Uso: %s [--batch N] [--workers N] [--stats-port PORT] [--stats-interval SEGUNDOS] "
+                    "[--log-level error|warn|info|debug] [--retain N] [--max-topics N] [--rtx N] [--loss FRACCION] "
+                    "[--sub-ttl SEGUNDOS] [--mcast GRUPO[:PUERTO]] [--mcast-groups N] [--mcast-if IP]\n", prog);
+    exit(1);
+}
 
-        if (strcmp(command, "SUBSCRIBE") == 0) {
-            add_subscriber(topic, client_addr);
-        } else if (strcmp(command, "PUBLISH") == 0) {
-            publish_message(topic, msg, sockfd);
+static void parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_size = atoi(argv[++i]);
+            if (batch_size < 1 || batch_size > MAX_BATCH) {
+                fprintf(stderr, "--batch debe estar entre 1 y %d\n", MAX_BATCH);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            num_workers = atoi(argv[++i]);
+            if (num_workers < 1 || num_workers > MAX_WORKERS) {
+                fprintf(stderr, "--workers debe estar entre 1 y %d\n", MAX_WORKERS);
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+            stats_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats_interval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            log_level_arg = log_level_parse(argv[++i]);
+            if (log_level_arg < 0) usage(argv[0]);
+        } else if (strcmp(argv[i], "--retain") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0 || n > RETAIN_MAX) {
+                fprintf(stderr, "--retain debe estar entre 0 y %d\n", RETAIN_MAX);
+                exit(1);
+            }
+            retain = (uint32_t)n;
+        } else if (strcmp(argv[i], "--max-topics") == 0 && i + 1 < argc) {
+            max_topics = (uint32_t)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--rtx") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0 || n > RTX_MAX) {
+                fprintf(stderr, "--rtx debe estar entre 0 y %d\n", RTX_MAX);
+                exit(1);
+            }
+            rtx_cap = (uint32_t)n;
+        } else if (strcmp(argv[i], "--loss") == 0 && i + 1 < argc) {
+            loss_rate = atof(argv[++i]);
+            if (loss_rate < 0 || loss_rate >= 1) {
+                fprintf(stderr, "--loss debe estar entre 0 y 1\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--sub-ttl") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 0) usage(argv[0]);
+            sub_ttl = (uint32_t)n;
+        } else if (strcmp(argv[i], "--mcast") == 0 && i + 1 < argc) {
+            char group[INET_ADDRSTRLEN];
+            const char *arg = argv[++i];
+            const char *colon = strchr(arg, ':');
+            size_t len = colon ? (size_t)(colon - arg) : strlen(arg);
+            int port = colon ? atoi(colon + 1) : MCAST_PORT;
+            if (len >= sizeof(group) || port < 1 || port > 65535) usage(argv[0]);
+            memcpy(group, arg, len);
+            group[len] = '\0';
+            mcast_base.sin_port = htons((uint16_t)port);
+            if (inet_pton(AF_INET, group, &mcast_base.sin_addr) != 1 ||
+                !IN_MULTICAST(ntohl(mcast_base.sin_addr.s_addr))) {
+                fprintf(stderr, "--mcast necesita un grupo IPv4 multicast (224.0.0.0 a 239.255.255.255)\n");
+                exit(1);
+            }
+            mcast_base.sin_family = AF_INET;
+        } else if (strcmp(argv[i], "--mcast-groups") == 0 && i + 1 < argc) {
+            int n = atoi(argv[++i]);
+            if (n < 1) usage(argv[0]);
+            mcast_groups = (uint32_t)n;
+        } else if (strcmp(argv[i], "--mcast-if") == 0 && i + 1 < argc) {
+            if (inet_pton(AF_INET, argv[++i], &mcast_if) != 1) usage(argv[0]);
         } else {
-            printf("Comando desconocido: %s\n", command);
+            usage(argv[0]);
+        }
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_args(argc, argv);
+    if (log_start(log_level_arg) < 0) {
+        fprintf(stderr, "No se pudo iniciar el log\n");
+        exit(1);
+    }
+
+    if (mcast_base.sin_family != 0 &&
+        !IN_MULTICAST(ntohl(mcast_base.sin_addr.s_addr) + mcast_groups - 1)) {
+        fprintf(stderr, "--mcast-groups se pasa del rango multicast\n");
+        exit(1);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+        registry_init(&shards[i].registry);
+    }
+
+    /* Todos los sockets se abren antes de arrancar los hilos para que un
+       error de bind se vea enseguida */
+    Worker *workers[MAX_WORKERS];
+    for (int i = 0; i < num_workers; i++) {
+        workers[i] = calloc(1, sizeof(Worker));
+        if (workers[i] == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        workers[i]->index = i;
+        workers[i]->rng = 0x9E3779B97F4A7C15ull * (uint64_t)(i + 1);
+        workers[i]->sockfd = open_socket();
+    }
+
+    log_info("Broker UDP escuchando en el puerto %d (%d worker%s, lotes de %d)",
+             PORT, num_workers, num_workers == 1 ? "" : "s", batch_size);
+    if (mcast_base.sin_family != 0)
+        log_info("Multicast: %u grupo%s desde %s, puerto %d", mcast_groups, mcast_groups == 1 ? "" : "s",
+                 inet_ntoa(mcast_base.sin_addr), ntohs(mcast_base.sin_port));
+    if (metrics_start("broker_udp", stats_port, stats_interval) < 0) exit(1);
+
+    clients.now = now_sec();
+    pthread_t reaper;
+    if (sub_ttl > 0) {
+        if (pthread_create(&reaper, NULL, reaper_main, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        pthread_detach(reaper);
+    }
+
+    for (int i = 1; i < num_workers; i++) {
+        if (pthread_create(&workers[i]->thread, NULL, worker_main, workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
         }
     }
+    worker_main(workers[0]);
 
-    close(sockfd);
+    for (int i = 0; i < num_workers; i++) close(workers[i]->sockfd);
     return 0;
 }
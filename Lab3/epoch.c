@@ -0,0 +1,144 @@
+/*
+ * epoch.c
+ *
+ * Implementación de la reclamación por épocas (ver epoch.h).
+ *
+ * Invariante: un objeto retirado en la época E se libera cuando la época
+ * global llega a E + 2. La época solo avanza si todos los hilos que están
+ * dentro de una sección anunciaron la época actual, así que cualquier
+ * lector que haya visto el objeto antes de retirarlo ya salió.
+ *
+ * Cualquier hilo libera lo vencido de todos los registros, no solo de los
+ * suyos: un worker de MsQuic que retiró un contexto y después no vuelve a
+ * retirar nada no lo deja vivo para siempre. Cota: con algún retiro
+ * pendiente, cada hilo que lee intenta avanzar la época y liberar lo
+ * vencido cada RECLAIM_PERIOD salidas, así que un objeto retirado se libera
+ * a más tardar unas 3 * RECLAIM_PERIOD secciones de lectura de cualquier
+ * hilo que siga leyendo (salvo que un lector se quede adentro). Si todos
+ * los hilos dejan de leer, lo pendiente espera a la próxima lectura, pero
+ * no crece: retirar solo pasa con actividad.
+ */
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "epoch.h"
+
+/* Se intenta liberar cuando el proceso junta esta cantidad de retiros, o
+   cada RECLAIM_PERIOD salidas de un hilo si hay alguno pendiente */
+#define RECLAIM_THRESHOLD 64
+#define RECLAIM_PERIOD 32
+
+typedef struct Retired {
+    void *ptr;
+    void (*free_fn)(void *);
+    uint64_t epoch;
+    struct Retired *next;
+} Retired;
+
+typedef struct EpochRecord {
+    _Atomic uint64_t epoch;    /* época anunciada al entrar */
+    _Atomic int active;
+    int nesting;               /* solo lo toca su hilo */
+    pthread_mutex_t lock;      /* la lista la agrega su hilo y la vacía cualquiera */
+    Retired *head;             /* retirados por este hilo, del más viejo al más nuevo */
+    Retired *tail;
+    unsigned exits;            /* solo lo toca su hilo */
+    struct EpochRecord *next;
+} EpochRecord;
+
+static _Atomic uint64_t global_epoch = 1;
+static _Atomic(EpochRecord *) records = NULL;
+static _Atomic unsigned long pending_total = 0;   /* retirados sin liberar en todos los registros */
+static __thread EpochRecord *self = NULL;
+
+/* Los registros nunca se liberan: la lista solo crece */
+static EpochRecord *record_get(void) {
+    if (self != NULL) return self;
+    EpochRecord *r = calloc(1, sizeof(EpochRecord));
+    if (r == NULL) abort();
+    pthread_mutex_init(&r->lock, NULL);
+    EpochRecord *head = atomic_load(&records);
+    do {
+        r->next = head;
+    } while (!atomic_compare_exchange_weak(&records, &head, r));
+    self = r;
+    return r;
+}
+
+void epoch_enter(void) {
+    EpochRecord *r = record_get();
+    if (r->nesting++ > 0) return;
+    atomic_store_explicit(&r->active, 1, memory_order_relaxed);
+    atomic_store_explicit(&r->epoch, atomic_load(&global_epoch), memory_order_relaxed);
+    /* El anuncio tiene que verse antes que cualquier lectura de la estructura */
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+/* Avanza la época si todos los hilos activos ya están en la actual */
+static uint64_t try_advance(void) {
+    uint64_t e = atomic_load(&global_epoch);
+    for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+        if (atomic_load(&r->active) && atomic_load(&r->epoch) != e) return e;
+    }
+    atomic_compare_exchange_strong(&global_epoch, &e, e + 1);
+    return atomic_load(&global_epoch);
+}
+
+/* Libera lo vencido de todos los registros. Un registro ocupado por otro
+   hilo se saltea: lo toma la próxima pasada. Los free_fn corren sin el lock,
+   por si alguno retira otra cosa */
+static void reclaim(void) {
+    uint64_t e = try_advance();
+    for (EpochRecord *r = atomic_load(&records); r != NULL; r = r->next) {
+        if (pthread_mutex_trylock(&r->lock) != 0) continue;
+        Retired *done = r->head, *last = NULL;
+        unsigned n = 0;
+        for (Retired *item = r->head; item != NULL && item->epoch + 2 <= e; item = item->next) {
+            last = item;
+            n++;
+        }
+        if (last != NULL) {
+            r->head = last->next;
+            if (r->head == NULL) r->tail = NULL;
+            last->next = NULL;
+        }
+        pthread_mutex_unlock(&r->lock);
+        if (last == NULL) continue;
+        atomic_fetch_sub(&pending_total, n);
+        while (done != NULL) {
+            Retired *item = done;
+            done = item->next;
+            item->free_fn(item->ptr);
+            free(item);
+        }
+    }
+}
+
+void epoch_exit(void) {
+    EpochRecord *r = self;
+    if (--r->nesting > 0) return;
+    atomic_store_explicit(&r->active, 0, memory_order_release);
+    unsigned long pending = atomic_load_explicit(&pending_total, memory_order_relaxed);
+    if (pending > 0 && (pending >= RECLAIM_THRESHOLD || ++r->exits % RECLAIM_PERIOD == 0))
+        reclaim();
+}
+
+void epoch_retire(void *ptr, void (*free_fn)(void *)) {
+    EpochRecord *r = record_get();
+    Retired *item = malloc(sizeof(Retired));
+    if (item == NULL) abort();
+    item->ptr = ptr;
+    item->free_fn = free_fn;
+    /* El objeto ya se desenganchó: esa escritura va antes de leer la época */
+    atomic_thread_fence(memory_order_seq_cst);
+    item->epoch = atomic_load(&global_epoch);
+    item->next = NULL;
+    pthread_mutex_lock(&r->lock);
+    if (r->tail) r->tail->next = item;
+    else r->head = item;
+    r->tail = item;
+    pthread_mutex_unlock(&r->lock);
+    unsigned long pending = atomic_fetch_add(&pending_total, 1) + 1;
+    if (r->nesting == 0 && pending >= RECLAIM_THRESHOLD) reclaim();
+}
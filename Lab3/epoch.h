@@ -0,0 +1,29 @@
+/*
+ * epoch.h
+ *
+ * Reclamación de memoria por épocas (EBR) para estructuras que se leen
+ * sin locks desde varios hilos.
+ * - Un lector rodea sus accesos con epoch_enter()/epoch_exit(): no toma
+ *   ningún lock ni escribe memoria compartida con otros lectores, solo
+ *   anuncia en su propio registro en qué época entró.
+ * - Un escritor que saca un objeto de la estructura (por ejemplo una lista
+ *   de suscriptores vieja) no lo libera: lo pasa a epoch_retire(). Se
+ *   libera recién cuando la época global avanzó dos veces, porque para
+ *   entonces ningún lector que pudiera verlo sigue adentro. Lo libera
+ *   cualquier hilo que siga leyendo, no solo el que lo retiró (ver la cota
+ *   en epoch.c).
+ * - Cada hilo se registra solo la primera vez que entra; pensado para hilos
+ *   de larga vida como los workers de MsQuic.
+ */
+#ifndef EPOCH_H
+#define EPOCH_H
+
+/* Secciones de lectura; se pueden anidar. */
+void epoch_enter(void);
+void epoch_exit(void);
+
+/* Difiere free_fn(ptr) hasta que ningún lector pueda estar usándolo.
+   Se puede llamar dentro o fuera de una sección de lectura. */
+void epoch_retire(void *ptr, void (*free_fn)(void *));
+
+#endif
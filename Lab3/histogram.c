@@ -0,0 +1,72 @@
+/*
+ * histogram.c
+ *
+ * Implementación del histograma log-lineal (ver histogram.h).
+ */
+#include <string.h>
+#include "histogram.h"
+
+/* Los valores menores que HIST_SUB_BUCKETS van cada uno en su bucket; el
+   resto se ubica por su bit más alto (e) y los HIST_SUB_BITS siguientes. */
+static unsigned bucket_of(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) return (unsigned)v;
+    unsigned e = 63 - (unsigned)__builtin_clzll(v);
+    unsigned sub = (unsigned)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/* Punto medio del rango de valores que caen en el bucket */
+static uint64_t bucket_value(unsigned b) {
+    if (b < HIST_SUB_BUCKETS) return b;
+    unsigned e = b / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    uint64_t sub = b % HIST_SUB_BUCKETS;
+    uint64_t width = 1ull << (e - HIST_SUB_BITS);
+    return ((HIST_SUB_BUCKETS + sub) << (e - HIST_SUB_BITS)) + width / 2;
+}
+
+void hist_init(Histogram *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+/* Escritor único: leer-sumar-guardar sin instrucciones con lock */
+#define STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+void hist_record(Histogram *h, uint64_t value) {
+    unsigned b = bucket_of(value);
+    STORE(h->buckets[b], h->buckets[b] + 1);
+    STORE(h->count, h->count + 1);
+    STORE(h->sum, h->sum + value);
+    if (value < h->min) STORE(h->min, value);
+    if (value > h->max) STORE(h->max, value);
+}
+
+void hist_merge(Histogram *dst, const Histogram *src) {
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) dst->buckets[i] += LOAD(src->buckets[i]);
+    dst->count += LOAD(src->count);
+    dst->sum += LOAD(src->sum);
+    uint64_t min = LOAD(src->min), max = LOAD(src->max);
+    if (min < dst->min) dst->min = min;
+    if (max > dst->max) dst->max = max;
+}
+
+uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p / 100.0 * (double)h->count + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->count) rank = h->count;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            /* El punto medio puede quedar fuera de lo observado */
+            uint64_t v = bucket_value(i);
+            if (v < h->min) v = h->min;
+            if (v > h->max) v = h->max;
+            return v;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,38 @@
+/*
+ * histogram.h
+ *
+ * Histograma log-lineal de latencias (o cualquier valor uint64).
+ * - Cada potencia de 2 se divide en HIST_SUB_BUCKETS partes iguales, así el
+ *   error relativo de un percentil queda por debajo de 1/HIST_SUB_BUCKETS
+ *   (~6%) en todo el rango, de nanosegundos a horas, con un arreglo fijo.
+ * - Registrar es O(1) y no reserva memoria: pensado para que cada hilo tenga
+ *   el suyo y se combinen con hist_merge() al momento de reportar.
+ * - Un solo hilo escribe cada histograma, pero otro puede leerlo mientras
+ *   tanto (hist_merge desde el hilo de métricas): los campos se escriben y
+ *   leen con accesos atómicos relajados, que en x86/ARM son movs comunes.
+ */
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+void hist_init(Histogram *h);
+void hist_record(Histogram *h, uint64_t value);
+/* Suma los conteos de src en dst. */
+void hist_merge(Histogram *dst, const Histogram *src);
+/* Valor del percentil p (0-100); 0 si el histograma está vacío. */
+uint64_t hist_percentile(const Histogram *h, double p);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * io_ring.c
+ *
+ * Implementación del io_uring mínimo del broker TCP (ver io_ring.h).
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "io_ring.h"
+
+#define CQ_FACTOR 8            /* completaciones por SQE: accept y recv multishot */
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                     const void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned op, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+int ioring_probe(void) {
+    IoRing r;
+    IoBufRing b;
+    if (ioring_init(&r, 8) < 0) return -1;
+    /* Los recv multishot (6.0) sin anillo de buffers no sirven de nada */
+    int ok = ioring_bufs_init(&r, &b, 0, 1, 64);
+    int saved = errno;
+    ioring_free(&r);
+    if (ok < 0) {
+        errno = saved;
+        return -1;
+    }
+    munmap(b.br, b.map_len);
+    free(b.bufs);
+    return 0;
+}
+
+int ioring_init(IoRing *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    /* DEFER_TASKRUN es de 6.1: sin él tampoco hay multishot recv */
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+              IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * CQ_FACTOR;
+    r->fd = sys_setup(entries, &p);
+    if (r->fd < 0) return -1;
+
+    unsigned need = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((p.features & need) != need) {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    r->features = p.features;
+
+    /* SQ y CQ comparten un solo mapeo (IORING_FEAT_SINGLE_MMAP) */
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sq_map_len = sq_len > cq_len ? sq_len : cq_len;
+    r->sq_map = mmap(NULL, r->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED) goto fail;
+    r->cq_map = r->sq_map;
+    r->cq_map_len = 0;
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(r->sq_map, r->sq_map_len);
+        goto fail;
+    }
+
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    /* Sin IORING_SETUP_NO_SQARRAY (6.6) el índice de cada SQE es fijo */
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail: {
+        int saved = errno;
+        close(r->fd);
+        errno = saved;
+        return -1;
+    }
+}
+
+void ioring_free(IoRing *r) {
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->sq_map, r->sq_map_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+struct io_uring_sqe *ioring_sqe(IoRing *r) {
+    unsigned tail = *r->sq_tail;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        /* SQ lleno: lo preparado sale ya, sin esperar completaciones */
+        if (ioring_enter(r, 0, 0) < 0 ||
+            tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+            return NULL;
+    }
+    struct io_uring_sqe *sqe = &r->sqes[tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    /* El kernel solo mira el tail dentro de io_uring_enter, que llama este
+       mismo hilo después de terminar de llenar la SQE */
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->sq_local++;
+    return sqe;
+}
+
+int ioring_enter(IoRing *r, unsigned wait_nr, int timeout_ms) {
+    /* Con DEFER_TASKRUN los reintentos de los envíos cortos corren acá
+       adentro, así que siempre se pasa GETEVENTS aunque no se espere nada */
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    const void *argp = NULL;
+    size_t argsz = 0;
+    if (wait_nr > 0 && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+        argp = &arg;
+        argsz = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    int ret = sys_enter(r->fd, r->sq_local, wait_nr, flags, argp, argsz);
+    /* Con un error en la espera igual puede haber salido parte del SQ */
+    r->sq_local = *r->sq_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    return ret < 0 ? -errno : ret;
+}
+
+int ioring_bufs_init(IoRing *r, IoBufRing *b, uint16_t bgid, unsigned entries, unsigned size) {
+    memset(b, 0, sizeof(*b));
+    b->map_len = entries * sizeof(struct io_uring_buf);
+    /* El anillo tiene que estar alineado a página: mmap ya lo da */
+    b->br = mmap(NULL, b->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b->br == MAP_FAILED) return -1;
+    b->bufs = malloc((size_t)entries * size);
+    if (b->bufs == NULL) {
+        munmap(b->br, b->map_len);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)b->br;
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        int saved = errno;
+        munmap(b->br, b->map_len);
+        free(b->bufs);
+        errno = saved;
+        return -1;
+    }
+
+    b->entries = entries;
+    b->size = size;
+    b->bgid = bgid;
+    for (unsigned i = 0; i < entries; i++) ioring_buf_recycle(b, i);
+    return 0;
+}
+
+void ioring_buf_recycle(IoBufRing *b, unsigned bid) {
+    struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->entries - 1)];
+    buf->addr = (uint64_t)(uintptr_t)ioring_buf(b, bid);
+    buf->len = b->size;
+    buf->bid = (uint16_t)bid;
+    b->tail++;
+    __atomic_store_n(&b->br->tail, b->tail, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,94 @@
+/*
+ * io_ring.h
+ *
+ * io_uring mínimo para el broker TCP (--io uring), con las syscalls
+ * directas y sin liburing.
+ * - Un anillo por shard, creado y usado siempre por el mismo hilo
+ *   (IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN): las
+ *   completaciones se procesan solo cuando el shard entra a esperar.
+ * - Las SQE se preparan durante toda la vuelta del event loop y salen
+ *   todas juntas en el único io_uring_enter que además espera las
+ *   siguientes completaciones.
+ * - Anillo de buffers (IORING_REGISTER_PBUF_RING): los recv multishot
+ *   eligen buffer solos, así que un cliente sin datos no ocupa memoria.
+ * - Hace falta Linux 6.1 o más nuevo; ioring_probe dice si el kernel
+ *   sirve antes de elegir el backend.
+ */
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+typedef struct {
+    int fd;
+    unsigned features;
+    /* SQ */
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local;     /* SQE preparadas que el kernel todavía no vio */
+    /* CQ */
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} IoRing;
+
+/* Buffers provistos: entries (potencia de 2) buffers de size bytes. */
+typedef struct {
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    size_t map_len;
+    unsigned entries;
+    unsigned size;
+    uint16_t bgid;
+    uint16_t tail;
+} IoBufRing;
+
+/* 0 si el kernel tiene todo lo que usa el broker, -1 (con errno) si no. */
+int ioring_probe(void);
+
+/* Crea un anillo con entries SQE (el CQ es más grande: los multishot
+   generan muchas completaciones por SQE). -1 con errno si falla. */
+int ioring_init(IoRing *r, unsigned entries);
+void ioring_free(IoRing *r);
+
+/* Próxima SQE, en cero. Si el SQ está lleno manda lo preparado primero.
+   NULL solo si el kernel no acepta nada. */
+struct io_uring_sqe *ioring_sqe(IoRing *r);
+
+/* Manda lo preparado, avanza lo que el kernel tenía pendiente y espera al
+   menos wait_nr completaciones o timeout_ms (-1 = sin límite). Retorna las
+   SQE enviadas o -errno. */
+int ioring_enter(IoRing *r, unsigned wait_nr, int timeout_ms);
+
+/* Completaciones: se miran con ioring_cqe y se liberan con ioring_cqe_seen. */
+static inline struct io_uring_cqe *ioring_cqe(IoRing *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+static inline void ioring_cqe_seen(IoRing *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int ioring_bufs_init(IoRing *r, IoBufRing *b, uint16_t bgid, unsigned entries, unsigned size);
+
+static inline char *ioring_buf(const IoBufRing *b, unsigned bid) {
+    return b->bufs + (size_t)bid * b->size;
+}
+
+/* Devuelve un buffer al anillo para el próximo recv. */
+void ioring_buf_recycle(IoBufRing *b, unsigned bid);
+
+#endif
@@ -0,0 +1,214 @@
+/*
+ * log.c
+ *
+ * Implementación del log asíncrono (ver log.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log.h"
+
+#define LOG_SLOTS 4096          /* potencia de 2 */
+#define LOG_LINE_MAX 232        /* con la cabecera y el \0, el slot ocupa 256 bytes */
+#define LOG_OUT_BUFFER 65536
+#define LOG_IDLE_NS 2000000     /* espera del escritor con el anillo vacío */
+
+int log_level = LOG_LVL_INFO;
+
+static const char *level_names[] = { "ERROR", "WARN ", "INFO ", "DEBUG" };
+
+/*
+ * Anillo acotado al estilo de Vyukov: cada slot tiene un número de secuencia
+ * que dice de quién es el turno. El productor reserva una posición con un
+ * CAS sobre tail, formatea en el slot y lo publica con seq = pos + 1; el
+ * escritor lo consume y lo devuelve con seq = pos + LOG_SLOTS.
+ */
+typedef struct {
+    _Atomic uint64_t seq;
+    uint64_t ns;
+    uint32_t suppressed;
+    uint16_t len;
+    uint8_t level;
+    char text[LOG_LINE_MAX + 1];
+} LogSlot;
+
+static LogSlot *ring;
+static _Alignas(64) _Atomic uint64_t tail;
+static _Alignas(64) uint64_t head;              /* solo el escritor */
+static _Atomic uint64_t dropped;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *names[] = { "error", "warn", "info", "debug" };
+
+int log_level_parse(const char *name) {
+    for (int i = 0; i <= LOG_LVL_DEBUG; i++)
+        if (strcmp(name, names[i]) == 0) return i;
+    return -1;
+}
+
+static uint64_t realtime_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* "2024-05-01 12:00:00.123456 INFO  texto (+N suprimidas)\n".
+   out debe tener lugar para LOG_FORMATTED_MAX bytes. */
+#define LOG_FORMATTED_MAX (LOG_LINE_MAX + 96)
+
+static size_t format_line(char *out, uint64_t ns, int level, uint32_t suppressed,
+                          const char *text, size_t len) {
+    time_t secs = (time_t)(ns / 1000000000ull);
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    int n = snprintf(out, LOG_FORMATTED_MAX, "%04d-%02d-%02d %02d:%02d:%02d.%06u %s %.*s",
+                     tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                     (unsigned)(ns % 1000000000ull / 1000), level_names[level], (int)len, text);
+    if (n < 0) return 0;
+    if (suppressed > 0)
+        n += snprintf(out + n, LOG_FORMATTED_MAX - (size_t)n, " (+%u suprimidas)", suppressed);
+    out[n++] = '\n';
+    return (size_t)n;
+}
+
+static void write_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t w = write(STDOUT_FILENO, data, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return;
+        data += w;
+        len -= (size_t)w;
+    }
+}
+
+/* Vacía el anillo; retorna cuántas líneas escribió */
+static size_t drain(void) {
+    static char out[LOG_OUT_BUFFER];
+    size_t used = 0, lines = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    uint64_t lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+    if (lost > 0) {
+        char text[64];
+        int n = snprintf(text, sizeof(text), "log lleno: %llu líneas descartadas", (unsigned long long)lost);
+        used += format_line(out, realtime_ns(), LOG_LVL_WARN, 0, text, (size_t)n);
+    }
+
+    for (;;) {
+        LogSlot *slot = &ring[head & (LOG_SLOTS - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != head + 1) break;
+        if (sizeof(out) - used < LOG_FORMATTED_MAX) {
+            write_all(out, used);
+            used = 0;
+        }
+        used += format_line(out + used, slot->ns, slot->level, slot->suppressed,
+                            slot->text, slot->len);
+        atomic_store_explicit(&slot->seq, head + LOG_SLOTS, memory_order_release);
+        head++;
+        lines++;
+    }
+    if (used > 0) write_all(out, used);
+    pthread_mutex_unlock(&drain_lock);
+    return lines + (lost > 0);
+}
+
+void log_flush(void) {
+    if (ring != NULL) drain();
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        if (drain() == 0) {
+            struct timespec ts = { 0, LOG_IDLE_NS };
+            nanosleep(&ts, NULL);
+        }
+    }
+    return NULL;
+}
+
+int log_start(int level) {
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+    LogSlot *slots = aligned_alloc(64, sizeof(LogSlot) * LOG_SLOTS);
+    if (slots == NULL) return -1;
+    for (uint64_t i = 0; i < LOG_SLOTS; i++) atomic_init(&slots[i].seq, i);
+
+    ring = slots;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, writer_main, NULL) != 0) {
+        ring = NULL;
+        free(slots);
+        return -1;
+    }
+    pthread_detach(thread);
+    atexit(log_flush);
+    return 0;
+}
+
+void log_emit(int level, uint32_t suppressed, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+
+    /* Sin hilo escritor: directo a stdout */
+    if (ring == NULL) {
+        char text[LOG_LINE_MAX + 1], line[LOG_FORMATTED_MAX];
+        int n = vsnprintf(text, sizeof(text), fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        size_t len = n > LOG_LINE_MAX ? LOG_LINE_MAX : (size_t)n;
+        write_all(line, format_line(line, realtime_ns(), level, suppressed, text, len));
+        return;
+    }
+
+    uint64_t pos = atomic_load_explicit(&tail, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &ring[pos & (LOG_SLOTS - 1)];
+        int64_t diff = (int64_t)atomic_load_explicit(&slot->seq, memory_order_acquire) - (int64_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&tail, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* Lleno: el escritor no da abasto y no lo vamos a esperar */
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            va_end(ap);
+            return;
+        } else {
+            pos = atomic_load_explicit(&tail, memory_order_relaxed);
+        }
+    }
+
+    int n = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+    va_end(ap);
+    slot->len = n < 0 ? 0 : n > LOG_LINE_MAX ? LOG_LINE_MAX : (uint16_t)n;
+    slot->ns = realtime_ns();
+    slot->level = (uint8_t)level;
+    slot->suppressed = suppressed;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+int log_limit_pass(LogLimit *limit, uint32_t per_second, uint32_t *suppressed) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    uint64_t second = (uint64_t)ts.tv_sec;
+    if (second != limit->second) {
+        limit->second = second;
+        limit->count = 0;
+    }
+    if (limit->count >= per_second) {
+        limit->suppressed++;
+        return 0;
+    }
+    limit->count++;
+    *suppressed = limit->suppressed;
+    limit->suppressed = 0;
+    return 1;
+}
@@ -0,0 +1,84 @@
+/*
+ * log.h
+ *
+ * Log asíncrono de los brokers.
+ * - Niveles error/warn/info/debug; lo que está por debajo del nivel activo
+ *   cuesta una comparación y no formatea nada.
+ * - Cada línea se formatea directo en un slot de un anillo sin locks de
+ *   varios productores y un consumidor. Un hilo aparte lo vacía y escribe en
+ *   stdout por bloques, así que una terminal lenta nunca frena a los hilos
+ *   de E/S: si el anillo se llena, la línea se descarta y se cuenta.
+ * - Para eventos por mensaje hay dos frenos por lugar de llamada (y por
+ *   hilo, sin compartir nada): log_limited deja pasar a lo sumo N líneas por
+ *   segundo y avisa cuántas suprimió; log_sampled deja pasar una de cada N.
+ * - Antes de log_start las líneas se escriben directo (arranque, errores de
+ *   configuración).
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdint.h>
+
+typedef enum {
+    LOG_LVL_ERROR,
+    LOG_LVL_WARN,
+    LOG_LVL_INFO,
+    LOG_LVL_DEBUG
+} LogLevel;
+
+extern int log_level;
+
+static inline int log_enabled(int level) {
+    return level <= __atomic_load_n(&log_level, __ATOMIC_RELAXED);
+}
+
+/* "error", "warn", "info" o "debug"; -1 si no es ninguno. */
+int log_level_parse(const char *name);
+
+/* Fija el nivel y arranca el hilo escritor. Retorna -1 si no pudo. */
+int log_start(int level);
+
+/* Escribe lo que quede en el anillo (se registra con atexit). */
+void log_flush(void);
+
+/* suppressed > 0 agrega cuántas líneas se suprimieron antes de esta. */
+void log_emit(int level, uint32_t suppressed, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+#define log_at(level, ...) \
+    do { if (log_enabled(level)) log_emit((level), 0, __VA_ARGS__); } while (0)
+
+#define log_error(...) log_at(LOG_LVL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_at(LOG_LVL_WARN, __VA_ARGS__)
+#define log_info(...)  log_at(LOG_LVL_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LVL_DEBUG, __VA_ARGS__)
+
+/* Ventana de un segundo por lugar de llamada */
+typedef struct {
+    uint64_t second;
+    uint32_t count;
+    uint32_t suppressed;
+} LogLimit;
+
+/* Retorna 1 si la línea pasa; en *suppressed deja las suprimidas hasta ahora. */
+int log_limit_pass(LogLimit *limit, uint32_t per_second, uint32_t *suppressed);
+
+#define log_limited(level, per_second, ...)                                  \
+    do {                                                                     \
+        if (log_enabled(level)) {                                            \
+            static __thread LogLimit log_limit_;                             \
+            uint32_t log_suppressed_;                                        \
+            if (log_limit_pass(&log_limit_, (per_second), &log_suppressed_)) \
+                log_emit((level), log_suppressed_, __VA_ARGS__);             \
+        }                                                                    \
+    } while (0)
+
+#define log_sampled(level, every, ...)                                       \
+    do {                                                                     \
+        if (log_enabled(level)) {                                            \
+            static __thread uint32_t log_seen_;                              \
+            if (log_seen_++ % (every) == 0) log_emit((level), 0, __VA_ARGS__); \
+        }                                                                    \
+    } while (0)
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * lz_codec.c
+ *
+ * Implementación del códec de bloques LZ4 con diccionario (ver lz_codec.h).
+ *
+ * Las posiciones son "virtuales": [0, dict->len) es el diccionario y desde
+ * dict->len sigue el mensaje, así que un match puede empezar en el
+ * diccionario y seguir en el mensaje sin copiar nada a un buffer común.
+ */
+#include <string.h>
+#include "lz_codec.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5        /* los últimos 5 bytes van siempre como literales */
+#define MF_LIMIT 12            /* ningún match empieza en los últimos 12 bytes */
+#define MAX_OFFSET 65535
+#define MAX_INPUT (1u << 30)
+
+void lz_state_init(LzState *st) {
+    memset(st, 0, sizeof(*st));
+    st->base = 1;
+}
+
+void lz_dict_init(LzDict *d) {
+    d->len = 0;
+    memset(d->table, 0, sizeof(d->table));
+}
+
+static inline uint32_t read32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_LOG);
+}
+
+/* Bytes iguales al comienzo de a y b, hasta max */
+static size_t common(const char *a, const char *b, size_t max) {
+    size_t n = 0;
+    while (n + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        if (x != y) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            return n + ((size_t)__builtin_ctzll(x ^ y) >> 3);
+#else
+            return n + ((size_t)__builtin_clzll(x ^ y) >> 3);
+#endif
+        }
+        n += 8;
+    }
+    while (n < max && a[n] == b[n]) n++;
+    return n;
+}
+
+/* Largo del match entre la posición virtual ref e ip, sin pasar de limit */
+static size_t extend(const char *dict, uint32_t dict_len, const char *src, uint32_t ref,
+                     const char *ip, const char *limit) {
+    size_t n = 0;
+    if (ref < dict_len) {
+        size_t room = dict_len - ref, max = (size_t)(limit - ip);
+        n = common(dict + ref, ip, room < max ? room : max);
+        if (n < room) return n;
+        /* Se terminó el diccionario: sigue desde el principio del mensaje */
+        ip += n;
+        ref = dict_len;
+    }
+    return n + common(src + (ref - dict_len), ip, (size_t)(limit - ip));
+}
+
+static char *put_len(char *op, size_t n) {
+    while (n >= 255) {
+        *op++ = (char)255;
+        n -= 255;
+    }
+    *op++ = (char)n;
+    return op;
+}
+
+/* Una secuencia: token, literales y (salvo en la última) offset y largo del
+   match. NULL si no entra */
+static char *put_sequence(char *op, const char *oend, const char *lit, size_t lit_len,
+                          size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + (offset ? 2 + (match_len - MIN_MATCH) / 255 + 1 : 0);
+    if ((size_t)(oend - op) < need) return NULL;
+    unsigned char *token = (unsigned char *)op++;
+    if (lit_len >= 15) {
+        *token = 15 << 4;
+        op = put_len(op, lit_len - 15);
+    } else {
+        *token = (unsigned char)(lit_len << 4);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (offset == 0) return op;
+
+    *op++ = (char)(offset & 0xFF);
+    *op++ = (char)(offset >> 8);
+    size_t m = match_len - MIN_MATCH;
+    if (m >= 15) {
+        *token |= 15;
+        op = put_len(op, m - 15);
+    } else {
+        *token |= (unsigned char)m;
+    }
+    return op;
+}
+
+size_t lz_compress(LzState *st, const LzDict *dict, const char *src, size_t len, char *dst, size_t cap) {
+    const char *dd = dict ? dict->data : NULL;
+    uint32_t dict_len = dict ? dict->len : 0;
+    if (len >= MAX_INPUT) return 0;
+    if (st->base > UINT32_MAX - dict_len - (uint32_t)len) {
+        memset(st->table, 0, sizeof(st->table));
+        st->base = 1;
+    }
+    /* Lo que quedó en la tabla de bloques anteriores queda debajo de base */
+    uint32_t base = st->base;
+    st->base += dict_len + (uint32_t)len;
+
+    const char *ip = src, *anchor = src, *end = src + len;
+    char *op = dst;
+    const char *oend = dst + cap;
+    if (len > MF_LIMIT) {
+        const char *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+        while (ip <= mflimit) {
+            uint32_t v = dict_len + (uint32_t)(ip - src);
+            uint32_t seq = read32(ip), h = hash4(seq);
+            uint32_t seen = st->table[h], ref;
+            st->table[h] = base + v;
+
+            /* Primero lo visto en este mensaje (más cerca), después el diccionario */
+            if (seen >= base && v - (seen - base) <= MAX_OFFSET &&
+                read32(src + (seen - base - dict_len)) == seq) {
+                ref = seen - base;
+            } else if (dict != NULL && dict->table[h] != 0 && v - (dict->table[h] - 1) <= MAX_OFFSET &&
+                       read32(dd + dict->table[h] - 1) == seq) {
+                ref = dict->table[h] - 1;
+            } else {
+                /* Sin match: en zonas que no comprimen se avanza cada vez más rápido */
+                ip += 1 + ((size_t)(ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > 0 &&
+                   (ref <= dict_len ? dd[ref - 1] : src[ref - 1 - dict_len]) == ip[-1]) {
+                ip--;
+                ref--;
+                v--;
+            }
+            size_t match_len = MIN_MATCH + extend(dd, dict_len, src, ref + MIN_MATCH, ip + MIN_MATCH, matchlimit);
+            op = put_sequence(op, oend, anchor, (size_t)(ip - anchor), v - ref, match_len);
+            if (op == NULL) return 0;
+            ip += match_len;
+            anchor = ip;
+            if (ip <= mflimit)
+                st->table[hash4(read32(ip - 2))] = base + dict_len + (uint32_t)(ip - 2 - src);
+        }
+    }
+    op = put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+static int get_len(const unsigned char **ip, const unsigned char *iend, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= iend || *len >= MAX_INPUT) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const char *dict, size_t dict_len, const char *src, size_t len, char *dst, size_t cap) {
+    const unsigned char *ip = (const unsigned char *)src, *iend = ip + len;
+    char *op = dst;
+    const char *oend = dst + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_len(&ip, iend, &lit) < 0) return -1;
+        if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;     /* la última secuencia no tiene match */
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && get_len(&ip, iend, &match_len) < 0) return -1;
+        match_len += MIN_MATCH;
+        size_t pos = (size_t)(op - dst);
+        if (offset == 0 || offset > pos + dict_len || (size_t)(oend - op) < match_len) return -1;
+
+        if (offset > pos) {
+            /* Empieza en el diccionario y puede seguir en lo ya descomprimido */
+            size_t from = dict_len - (offset - pos), n = dict_len - from;
+            if (n > match_len) n = match_len;
+            memcpy(op, dict + from, n);
+            op += n;
+            match_len -= n;
+        }
+        const char *ref = op - offset;
+        if (offset >= match_len) {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            /* Se solapa con lo que se está escribiendo (p.ej. una racha) */
+            while (match_len--) *op++ = *ref++;
+        }
+    }
+    return (int)(op - dst);
+}
+
+int lz_dict_train(LzDict *d, LzState *st, const char *sample, size_t len) {
+    if (len > LZ_SAMPLE_MAX) len = LZ_SAMPLE_MAX;
+    size_t room = LZ_DICT_SIZE - d->len;
+    if (len <= MF_LIMIT || room == 0) return 0;
+
+    /* Lo que el diccionario ya comprime a menos de un cuarto no aporta */
+    if (d->len > 0) {
+        char block[LZ_SAMPLE_MAX + LZ_SAMPLE_MAX / 255 + 16];
+        size_t n = lz_compress(st, d, sample, len, block, sizeof(block));
+        if (n > 0 && n < len / 4) return 0;
+    }
+    if (len > room) len = room;
+    uint32_t old = d->len;
+    memcpy(d->data + old, sample, len);
+    d->len += (uint32_t)len;
+    /* Las muestras nuevas quedan al final: a igual hash ganan las más recientes */
+    for (uint32_t p = old > 3 ? old - 3 : 0; p + 4 <= d->len; p++)
+        d->table[hash4(read32(d->data + p))] = p + 1;
+    return 1;
+}
@@ -0,0 +1,58 @@
+/*
+ * lz_codec.h
+ *
+ * Compresión de payloads para los subscribers que la negocian (ver
+ * protocol.h, BIN_FLAG_LZ4). Sin dependencias externas.
+ * - Formato de bloque LZ4: secuencias de literales + (offset de 16 bits,
+ *   largo) sin cabecera de frame. Un bloque de acá se puede abrir con
+ *   LZ4_decompress_safe_usingDict y viceversa.
+ * - Diccionario por tema: los mensajes cortos casi no se repiten por dentro,
+ *   pero sí entre ellos (los mismos campos, las mismas palabras). Cada
+ *   bloque puede copiar del diccionario como si estuviera justo antes del
+ *   mensaje, así que hasta un update de 200 bytes comprime.
+ * - El diccionario se entrena con las primeras publicaciones del tema: se
+ *   agregan las muestras que el diccionario todavía no cubre bien, hasta
+ *   llenarlo. Después queda fijo y se manda una vez a cada subscriber.
+ */
+#ifndef LZ_CODEC_H
+#define LZ_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_DICT_SIZE (16 * 1024)   /* el offset de LZ4 llega a 64 KiB contando el mensaje */
+#define LZ_SAMPLE_MAX 2048         /* lo que se mira de cada muestra al entrenar */
+#define LZ_HASH_LOG 12
+
+typedef struct {
+    uint32_t len;
+    uint32_t table[1 << LZ_HASH_LOG];  /* posición + 1 de cada hash de 4 bytes; 0 = vacío */
+    char data[LZ_DICT_SIZE];
+} LzDict;
+
+/* Estado de un hilo que comprime. Las posiciones llevan una base que crece
+   con cada bloque, así que la tabla no se limpia entre mensajes. */
+typedef struct {
+    uint32_t base;
+    uint32_t table[1 << LZ_HASH_LOG];
+} LzState;
+
+void lz_state_init(LzState *st);
+void lz_dict_init(LzDict *d);
+
+/* Peor caso de un bloque de len bytes. */
+static inline size_t lz_bound(size_t len) { return len + len / 255 + 16; }
+
+/* Comprime src con el diccionario (o NULL). Retorna el largo del bloque,
+   o 0 si no entra en cap: en ese caso conviene mandar el payload crudo. */
+size_t lz_compress(LzState *st, const LzDict *dict, const char *src, size_t len, char *dst, size_t cap);
+
+/* Abre un bloque con los bytes del diccionario. Retorna el largo
+   descomprimido, o -1 si el bloque es inválido o no entra en cap. */
+int lz_decompress(const char *dict, size_t dict_len, const char *src, size_t len, char *dst, size_t cap);
+
+/* Suma una muestra al diccionario si aporta algo que no cubre. Retorna 1 si
+   la agregó, 0 si no. Con el diccionario lleno ya no agrega nada. */
+int lz_dict_train(LzDict *d, LzState *st, const char *sample, size_t len);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * metrics.c
+ *
+ * Implementación de las métricas de los brokers (ver metrics.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "metrics.h"
+
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static const char *counter_names[MET_COUNTERS] = {
+    "msgs_in", "bytes_in", "msgs_out", "bytes_out", "drops",
+    "no_subscribers", "subscribes", "connects", "disconnects", "nacks", "retransmits",
+    "bytes_saved", "rejects"
+};
+static const char *gauge_names[MET_GAUGES] = { "queued_bytes", "queued_msgs" };
+
+/* Los bloques nunca se liberan: la lista solo crece */
+static Metrics *all_metrics;
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread Metrics *self;
+
+static const char *broker_name = "broker";
+static int stats_fd = -1;
+static double interval;
+static uint64_t start_ns;
+
+Metrics *metrics_local(void) {
+    if (self != NULL) return self;
+    Metrics *m = calloc(1, sizeof(Metrics));
+    if (m == NULL) abort();
+    hist_init(&m->fanout_ns);
+    pthread_mutex_lock(&list_lock);
+    m->next = all_metrics;
+    __atomic_store_n(&all_metrics, m, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&list_lock);
+    self = m;
+    return m;
+}
+
+void metrics_topic(Metrics *m, const char *name, uint64_t msgs, uint64_t bytes) {
+    /* Sondeo lineal por el puntero: los nombres interned son únicos */
+    uintptr_t h = ((uintptr_t)name >> 4) * 0x9E3779B97F4A7C15ull;
+    for (unsigned i = 0; i < METRICS_TOPICS; i++) {
+        TopicMetrics *t = &m->topics[(h + i) & (METRICS_TOPICS - 1)];
+        if (t->name == name) {
+            __atomic_store_n(&t->msgs, t->msgs + msgs, __ATOMIC_RELAXED);
+            __atomic_store_n(&t->bytes, t->bytes + bytes, __ATOMIC_RELAXED);
+            return;
+        }
+        if (t->name == NULL) {
+            t->msgs = msgs;
+            t->bytes = bytes;
+            __atomic_store_n(&t->name, name, __ATOMIC_RELEASE);
+            return;
+        }
+    }
+    __atomic_store_n(&m->topics_other, m->topics_other + msgs, __ATOMIC_RELAXED);
+}
+
+/* --- Hilo de reportes --- */
+
+/* Suma de todos los hilos en un instante */
+typedef struct {
+    uint64_t at_ns;
+    uint64_t counters[MET_COUNTERS];
+    int64_t gauges[MET_GAUGES];
+    Histogram fanout_ns;
+    TopicMetrics *topics;  /* combinados por nombre (varios hilos pueden tener el mismo tema) */
+    size_t num_topics;
+    uint64_t topics_other;
+} Snapshot;
+
+static void snapshot_add_topic(Snapshot *s, const char *name, uint64_t msgs, uint64_t bytes) {
+    for (size_t i = 0; i < s->num_topics; i++) {
+        if (strcmp(s->topics[i].name, name) == 0) {
+            s->topics[i].msgs += msgs;
+            s->topics[i].bytes += bytes;
+            return;
+        }
+    }
+    TopicMetrics *grown = realloc(s->topics, (s->num_topics + 1) * sizeof(TopicMetrics));
+    if (grown == NULL) {
+        s->topics_other += msgs;
+        return;
+    }
+    s->topics = grown;
+    s->topics[s->num_topics++] = (TopicMetrics){ name, msgs, bytes };
+}
+
+static void snapshot_take(Snapshot *s) {
+    memset(s, 0, sizeof(*s));
+    hist_init(&s->fanout_ns);
+    s->at_ns = metrics_now_ns();
+    for (Metrics *m = __atomic_load_n(&all_metrics, __ATOMIC_ACQUIRE); m != NULL; m = m->next) {
+        for (int c = 0; c < MET_COUNTERS; c++) s->counters[c] += LOAD(m->counters[c]);
+        for (int g = 0; g < MET_GAUGES; g++) s->gauges[g] += LOAD(m->gauges[g]);
+        hist_merge(&s->fanout_ns, &m->fanout_ns);
+        s->topics_other += LOAD(m->topics_other);
+        for (unsigned i = 0; i < METRICS_TOPICS; i++) {
+            const char *name = __atomic_load_n(&m->topics[i].name, __ATOMIC_ACQUIRE);
+            if (name != NULL)
+                snapshot_add_topic(s, name, LOAD(m->topics[i].msgs), LOAD(m->topics[i].bytes));
+        }
+    }
+}
+
+static void snapshot_free(Snapshot *s) {
+    free(s->topics);
+    s->topics = NULL;
+}
+
+static uint64_t topic_prev(const Snapshot *prev, const char *name) {
+    for (size_t i = 0; i < prev->num_topics; i++)
+        if (strcmp(prev->topics[i].name, name) == 0) return prev->topics[i].msgs;
+    return 0;
+}
+
+/* Texto para el volcado periódico: totales y ritmo desde el volcado anterior */
+static void write_text(FILE *out, const Snapshot *s, const Snapshot *prev) {
+    double secs = (double)(s->at_ns - prev->at_ns) / 1e9;
+    if (secs <= 0) secs = 1;
+    fprintf(out, "[%s stats] uptime %.1f s\n", broker_name, (double)(s->at_ns - start_ns) / 1e9);
+    for (int c = 0; c < MET_COUNTERS; c++)
+        fprintf(out, "  %-16s %12llu  (%.0f/s)\n", counter_names[c], (unsigned long long)s->counters[c],
+                (double)(s->counters[c] - prev->counters[c]) / secs);
+    for (int g = 0; g < MET_GAUGES; g++)
+        fprintf(out, "  %-16s %12lld\n", gauge_names[g], (long long)s->gauges[g]);
+    if (s->fanout_ns.count > 0)
+        fprintf(out, "  fanout_us        p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+                hist_percentile(&s->fanout_ns, 50) / 1e3, hist_percentile(&s->fanout_ns, 99) / 1e3,
+                hist_percentile(&s->fanout_ns, 99.9) / 1e3, s->fanout_ns.max / 1e3);
+    for (size_t i = 0; i < s->num_topics; i++)
+        fprintf(out, "  topic %-20s %12llu entregas  (%.0f/s)\n", s->topics[i].name,
+                (unsigned long long)s->topics[i].msgs,
+                (double)(s->topics[i].msgs - topic_prev(prev, s->topics[i].name)) / secs);
+    fflush(out);
+}
+
+static void json_string(FILE *out, const char *str) {
+    fputc('"', out);
+    for (; *str; str++) {
+        unsigned char ch = (unsigned char)*str;
+        if (ch == '"' || ch == '\\') fprintf(out, "\\%c", ch);
+        else if (ch < 0x20) fprintf(out, "\\u%04x", ch);
+        else fputc(ch, out);
+    }
+    fputc('"', out);
+}
+
+/* JSON para el socket de stats (totales desde el arranque) */
+static void write_json(FILE *out, const Snapshot *s) {
+    fprintf(out, "{\"broker\":\"%s\",\"uptime_s\":%.3f", broker_name, (double)(s->at_ns - start_ns) / 1e9);
+    for (int c = 0; c < MET_COUNTERS; c++)
+        fprintf(out, ",\"%s\":%llu", counter_names[c], (unsigned long long)s->counters[c]);
+    for (int g = 0; g < MET_GAUGES; g++)
+        fprintf(out, ",\"%s\":%lld", gauge_names[g], (long long)s->gauges[g]);
+    fprintf(out, ",\"fanout_ns\":{\"count\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+            (unsigned long long)s->fanout_ns.count,
+            (unsigned long long)hist_percentile(&s->fanout_ns, 50),
+            (unsigned long long)hist_percentile(&s->fanout_ns, 99),
+            (unsigned long long)hist_percentile(&s->fanout_ns, 99.9),
+            (unsigned long long)(s->fanout_ns.count ? s->fanout_ns.max : 0));
+    fprintf(out, ",\"topics\":[");
+    for (size_t i = 0; i < s->num_topics; i++) {
+        fprintf(out, "%s{\"name\":", i ? "," : "");
+        json_string(out, s->topics[i].name);
+        fprintf(out, ",\"msgs_out\":%llu,\"bytes_out\":%llu}", (unsigned long long)s->topics[i].msgs,
+                (unsigned long long)s->topics[i].bytes);
+    }
+    fprintf(out, "],\"topics_other\":%llu}\n", (unsigned long long)s->topics_other);
+}
+
+static void serve_client(int fd) {
+    FILE *out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        return;
+    }
+    Snapshot s;
+    snapshot_take(&s);
+    write_json(out, &s);
+    snapshot_free(&s);
+    fclose(out);
+}
+
+static void *metrics_main(void *arg) {
+    (void)arg;
+    Snapshot prev;
+    snapshot_take(&prev);
+    uint64_t next_dump = prev.at_ns + (uint64_t)(interval * 1e9);
+
+    for (;;) {
+        int timeout = -1;
+        if (interval > 0) {
+            uint64_t now = metrics_now_ns();
+            timeout = next_dump > now ? (int)((next_dump - now) / 1000000) + 1 : 0;
+        }
+        struct pollfd pfd = { stats_fd, POLLIN, 0 };
+        int r = poll(&pfd, stats_fd >= 0 ? 1 : 0, timeout);
+        if (r < 0 && errno != EINTR) break;
+
+        if (r > 0 && (pfd.revents & POLLIN)) {
+            int fd = accept(stats_fd, NULL, NULL);
+            if (fd >= 0) serve_client(fd);
+        }
+        if (interval > 0 && metrics_now_ns() >= next_dump) {
+            Snapshot s;
+            snapshot_take(&s);
+            write_text(stderr, &s, &prev);
+            snapshot_free(&prev);
+            prev = s;
+            next_dump += (uint64_t)(interval * 1e9);
+        }
+    }
+    snapshot_free(&prev);
+    return NULL;
+}
+
+int metrics_start(const char *broker, int port, double interval_s) {
+    broker_name = broker;
+    interval = interval_s;
+    start_ns = metrics_now_ns();
+    if (port <= 0 && interval_s <= 0) return 0;
+
+    if (port > 0) {
+        stats_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int opt = 1;
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  /* solo local */
+        addr.sin_port = htons((uint16_t)port);
+        if (stats_fd < 0 || setsockopt(stats_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+            bind(stats_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(stats_fd, 16) < 0) {
+            perror("stats socket");
+            if (stats_fd >= 0) close(stats_fd);
+            stats_fd = -1;
+            return -1;
+        }
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_main, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * metrics.h
+ *
+ * Métricas de los brokers sin locks en el camino de los mensajes.
+ * - Cada hilo que procesa mensajes tiene su propio bloque de contadores
+ *   (metrics_local()). Solo ese hilo lo escribe, así que sumar es un
+ *   load + store relajado, sin instrucciones con lock ni líneas de caché
+ *   compartidas: unos pocos ns por evento.
+ * - Un hilo aparte (metrics_start) suma los bloques de todos los hilos y los
+ *   publica: cada --stats-interval segundos como texto en stderr, y/o como
+ *   JSON a quien se conecte a 127.0.0.1:--stats-port (p.ej. `nc`).
+ * - Además de los contadores hay gauges (pueden bajar; la suma entre hilos
+ *   es lo que vale), un histograma del tiempo de fan-out y una tabla chica
+ *   de mensajes entregados por tema.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "histogram.h"
+
+typedef enum {
+    MET_MSGS_IN,           /* PUBLISH recibidos */
+    MET_BYTES_IN,          /* bytes de payload recibidos */
+    MET_MSGS_OUT,          /* entregas a subscribers */
+    MET_BYTES_OUT,
+    MET_DROPS,             /* entregas descartadas (desborde, envío fallido) */
+    MET_NO_SUBS,           /* PUBLISH a temas sin subscribers */
+    MET_SUBSCRIBES,
+    MET_CONNECTS,
+    MET_DISCONNECTS,
+    MET_NACKS,             /* pedidos de retransmisión recibidos (UDP confiable) */
+    MET_RETRANSMITS,       /* mensajes reenviados por un NACK */
+    MET_BYTES_SAVED,       /* bytes de payload que no salieron gracias a la compresión */
+    MET_REJECTS,           /* conexiones rechazadas por falta de lugar */
+    MET_COUNTERS
+} MetricCounter;
+
+typedef enum {
+    MET_QUEUED_BYTES,      /* bytes esperando en colas de salida */
+    MET_QUEUED_MSGS,       /* mensajes esperando en colas de salida */
+    MET_GAUGES
+} MetricGauge;
+
+/* Tema por puntero al nombre interned: los registros nunca lo liberan */
+#define METRICS_TOPICS 256
+
+typedef struct {
+    const char *name;
+    uint64_t msgs;
+    uint64_t bytes;
+} TopicMetrics;
+
+typedef struct Metrics {
+    uint64_t counters[MET_COUNTERS];
+    int64_t gauges[MET_GAUGES];
+    Histogram fanout_ns;   /* duración de cada fan-out */
+    TopicMetrics topics[METRICS_TOPICS];
+    uint64_t topics_other; /* entregas de temas que no entraron en la tabla */
+    struct Metrics *next;
+} Metrics;
+
+/* Bloque del hilo actual; se crea y registra la primera vez. */
+Metrics *metrics_local(void);
+
+static inline void metrics_add(Metrics *m, MetricCounter c, uint64_t n) {
+    __atomic_store_n(&m->counters[c], m->counters[c] + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_gauge(Metrics *m, MetricGauge g, int64_t delta) {
+    __atomic_store_n(&m->gauges[g], m->gauges[g] + delta, __ATOMIC_RELAXED);
+}
+
+/* Suma entregas al tema (name debe seguir vivo mientras corra el broker). */
+void metrics_topic(Metrics *m, const char *name, uint64_t msgs, uint64_t bytes);
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Arranca el hilo de reportes. port = 0 no abre el socket; interval_s = 0
+ * no hace volcados periódicos. Retorna -1 si no pudo abrir el socket.
+ */
+int metrics_start(const char *broker, int port, double interval_s);
+
+#endif
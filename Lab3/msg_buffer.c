@@ -0,0 +1,28 @@
+/*
+ * msg_buffer.c
+ *
+ * Implementación del mensaje compartido (ver msg_buffer.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "msg_buffer.h"
+
+MsgBuffer *msg_new(uint8_t opcode, uint8_t flags, uint32_t topic,
+                   const char *payload, uint32_t len) {
+    MsgBuffer *msg = malloc(sizeof(MsgBuffer) + PROTO_BIN_HEADER + len + 1);
+    if (msg == NULL) return NULL;
+    msg->refs = 1;
+    msg->payload_len = len;
+    msg->packed = NULL;
+    proto_write_bin_header(msg->data, opcode, flags, topic, len);
+    if (len > 0 && payload != NULL) memcpy(msg->data + PROTO_BIN_HEADER, payload, len);
+    msg->data[PROTO_BIN_HEADER + len] = '\n';
+    return msg;
+}
+
+void msg_release(MsgBuffer *msg) {
+    if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        if (msg->packed != NULL) msg_release(msg->packed);
+        free(msg);
+    }
+}
@@ -0,0 +1,47 @@
+/*
+ * msg_buffer.h
+ *
+ * Mensaje inmutable con contador de referencias para el fan-out.
+ * - Se crea una sola vez por PUBLISH (y solo si algún subscriber necesita
+ *   encolarlo) y todas las colas de salida apuntan al mismo buffer.
+ * - Guarda las dos formas de entrega en una sola reserva:
+ *
+ *       data = [cabecera binaria (12 bytes)][payload]['\n']
+ *
+ *   los clientes binarios reciben desde el byte 0 y los de texto desde
+ *   MSG_TEXT_OFFSET, así que no hace falta ninguna copia por subscriber.
+ * - Con compresión (broker TCP con --compress) el dueño del tema le cuelga
+ *   la versión comprimida en packed antes de repartirlo: se comprime una
+ *   sola vez y la comparten todos los subscribers que la negociaron.
+ */
+#ifndef MSG_BUFFER_H
+#define MSG_BUFFER_H
+
+#include <stdint.h>
+#include "protocol.h"
+
+#define MSG_TEXT_OFFSET PROTO_BIN_HEADER
+
+typedef struct MsgBuffer {
+    int refs;
+    uint32_t payload_len;
+    struct MsgBuffer *packed;  /* versión comprimida (con su propia referencia) o NULL */
+    char data[];
+} MsgBuffer;
+
+/* Crea el mensaje con una referencia (la del creador). NULL si no hay memoria.
+   Con payload NULL el payload queda sin llenar, para que lo arme el llamador. */
+MsgBuffer *msg_new(uint8_t opcode, uint8_t flags, uint32_t topic,
+                   const char *payload, uint32_t len);
+
+static inline void msg_ref(MsgBuffer *msg) {
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+}
+
+void msg_release(MsgBuffer *msg);
+
+/* Largo de cada vista del mensaje */
+static inline uint32_t msg_bin_len(const MsgBuffer *msg) { return PROTO_BIN_HEADER + msg->payload_len; }
+static inline uint32_t msg_text_len(const MsgBuffer *msg) { return msg->payload_len + 1; }
+
+#endif
@@ -0,0 +1,145 @@
+/*
+ * protocol.c
+ *
+ * Implementación del framing y parseo de comandos (ver protocol.h).
+ */
+#include <string.h>
+#include "protocol.h"
+
+_Static_assert(sizeof(BinHeader) == PROTO_BIN_HEADER, "BinHeader debe medir 12 bytes");
+
+int proto_next_frame(const char *buf, size_t len, Frame *frame, size_t *consumed) {
+    if (len == 0) return 0;
+
+    if ((unsigned char)buf[0] == PROTO_BIN_MAGIC) {
+        if (len < PROTO_BIN_HEADER) return 0;
+        proto_read_bin_header(buf, &frame->header);
+        if (frame->header.version != PROTO_BIN_VERSION && frame->header.opcode != BIN_OP_HELLO)
+            return -1;
+
+        /* Con id o con offset en el campo topic, el nombre no viaja */
+        uint64_t topic_len = (frame->header.flags & (BIN_FLAG_TOPIC_ID | BIN_FLAG_OFFSET)) ? 0 : frame->header.topic;
+        uint64_t total = PROTO_BIN_HEADER + topic_len + frame->header.length;
+        if (total > PROTO_MAX_FRAME) return -1;
+        if (len < total) return 0;
+
+        frame->kind = FRAME_BINARY;
+        frame->body.data = buf + PROTO_BIN_HEADER;
+        frame->body.len = (size_t)(total - PROTO_BIN_HEADER);
+        *consumed = (size_t)total;
+        return 1;
+    }
+
+    if ((unsigned char)buf[0] == PROTO_LEN_MAGIC) {
+        if (len < PROTO_LEN_HEADER) return 0;
+        const unsigned char *h = (const unsigned char *)buf + 1;
+        uint32_t body_len = ((uint32_t)h[0] << 24) | ((uint32_t)h[1] << 16) |
+                            ((uint32_t)h[2] << 8) | (uint32_t)h[3];
+        if (body_len > PROTO_MAX_FRAME - PROTO_LEN_HEADER) return -1;
+        if (len < PROTO_LEN_HEADER + body_len) return 0;
+
+        frame->kind = FRAME_LENGTH;
+        frame->body.data = buf + PROTO_LEN_HEADER;
+        frame->body.len = body_len;
+        *consumed = PROTO_LEN_HEADER + body_len;
+        return 1;
+    }
+
+    const char *nl = memchr(buf, '\n', len);
+    if (nl == NULL) return len >= PROTO_MAX_FRAME ? -1 : 0;
+
+    size_t body_len = (size_t)(nl - buf);
+    if (body_len > 0 && buf[body_len - 1] == '\r') body_len--;
+    frame->kind = FRAME_TEXT;
+    frame->body.data = buf;
+    frame->body.len = body_len;
+    *consumed = (size_t)(nl - buf) + 1;
+    return 1;
+}
+
+int proto_datagram_frame(const char *buf, size_t len, Frame *frame) {
+    size_t consumed;
+
+    if (len > 0 && (unsigned char)buf[0] == PROTO_BIN_MAGIC)
+        return proto_next_frame(buf, len, frame, &consumed) == 1 && consumed == len ? 0 : -1;
+
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r')) len--;
+    frame->kind = FRAME_TEXT;
+    frame->body.data = buf;
+    frame->body.len = len;
+    return 0;
+}
+
+/* Avanza mientras haya espacios; equivale al ' ' del formato de sscanf */
+static size_t skip_spaces(Slice s, size_t i) {
+    while (i < s.len && (s.data[i] == ' ' || s.data[i] == '\t')) i++;
+    return i;
+}
+
+static size_t take_token(Slice s, size_t i, Slice *out) {
+    size_t start = i;
+    while (i < s.len && s.data[i] != ' ' && s.data[i] != '\t') i++;
+    out->data = s.data + start;
+    out->len = i - start;
+    return i;
+}
+
+int proto_parse_text(Slice body, TextCommand *cmd) {
+    size_t i = skip_spaces(body, 0);
+    i = take_token(body, i, &cmd->command);
+    i = skip_spaces(body, i);
+    i = take_token(body, i, &cmd->topic);
+    i = skip_spaces(body, i);
+    cmd->payload.data = body.data + i;
+    cmd->payload.len = body.len - i;
+    return cmd->command.len > 0 ? 0 : -1;
+}
+
+int proto_parse_frame(const Frame *frame, Command *cmd) {
+    memset(cmd, 0, sizeof(*cmd));
+
+    if (frame->kind == FRAME_BINARY) {
+        const BinHeader *h = &frame->header;
+        cmd->op = h->opcode;
+        cmd->binary = 1;
+        cmd->flags = h->flags;
+        if (h->flags & BIN_FLAG_TOPIC_ID) {
+            cmd->has_topic_id = 1;
+            cmd->topic_id = h->topic;
+        } else if (!(h->flags & BIN_FLAG_OFFSET)) {
+            cmd->topic.data = frame->body.data;
+            cmd->topic.len = h->topic;
+        }
+        cmd->payload.data = frame->body.data + cmd->topic.len;
+        cmd->payload.len = h->length;
+        cmd->command.data = "BIN";
+        cmd->command.len = 3;
+        return 0;
+    }
+
+    TextCommand text;
+    if (proto_parse_text(frame->body, &text) < 0) return -1;
+    cmd->command = text.command;
+    cmd->topic = text.topic;
+    cmd->payload = text.payload;
+    if (SLICE_IS(text.command, "SUBSCRIBE")) cmd->op = BIN_OP_SUBSCRIBE;
+    else if (SLICE_IS(text.command, "PUBLISH")) cmd->op = BIN_OP_PUBLISH;
+    else if (SLICE_IS(text.command, "REPLAY")) cmd->op = BIN_OP_REPLAY;
+    else if (SLICE_IS(text.command, "UNSUBSCRIBE")) cmd->op = BIN_OP_UNSUBSCRIBE;
+    else if (SLICE_IS(text.command, "HEARTBEAT")) cmd->op = BIN_OP_HEARTBEAT;
+    return 0;
+}
+
+void proto_write_bin_header(char *out, uint8_t opcode, uint8_t flags,
+                            uint32_t topic, uint32_t length) {
+    BinHeader h = { PROTO_BIN_MAGIC, PROTO_BIN_VERSION, opcode, flags, htonl(topic), htonl(length) };
+    memcpy(out, &h, PROTO_BIN_HEADER);
+}
+
+void proto_write_len_header(char *out, uint32_t body_len) {
+    out[0] = (char)PROTO_LEN_MAGIC;
+    out[1] = (char)(body_len >> 24);
+    out[2] = (char)(body_len >> 16);
+    out[3] = (char)(body_len >> 8);
+    out[4] = (char)body_len;
+}
@@ -0,0 +1,198 @@
+/*
+ * protocol.h
+ *
+ * Framing y parseo de comandos sin copias para el sistema pub/sub.
+ *
+ * Un stream TCP no respeta los límites de los send(): varios PUBLISH pueden
+ * llegar juntos en un read() o uno puede llegar partido en dos. Por eso cada
+ * comando viaja en un frame, y el frame se reconoce por su primer byte:
+ *
+ *   - Texto:    "PUBLISH <TOPIC> <mensaje>\n"   (termina en '\n', acepta "\r\n")
+ *   - Longitud: 0xFF <u32 big-endian> <cuerpo>  (el cuerpo es el mismo comando
+ *               de texto, pero el mensaje puede contener '\n' o bytes binarios)
+ *   - Binario:  0xB1 + cabecera fija de 12 bytes (BinHeader) + topic + payload
+ *
+ * El escáner devuelve Slices que apuntan dentro del buffer leído: no se copia
+ * nada a arreglos temporales de command/topic/content.
+ *
+ * Protocolo binario (versión 1), todos los enteros en big-endian:
+ *
+ *   byte 0     magic    0xB1
+ *   byte 1     version  PROTO_BIN_VERSION
+ *   byte 2     opcode   BIN_OP_*
+ *   byte 3     flags    BIN_FLAG_*
+ *   bytes 4-7  topic    id del tema si BIN_FLAG_TOPIC_ID, si no largo del nombre
+ *   bytes 8-11 length   largo del payload
+ *
+ * Después de la cabecera va el nombre del tema (si no se usa id) y el payload.
+ * En TCP y QUIC el cliente negocia con BIN_OP_HELLO al conectarse y desde ahí
+ * el broker le entrega los mensajes como BIN_OP_MESSAGE; en UDP cada
+ * datagrama se identifica solo, y un SUBSCRIBE binario pide entregas binarias.
+ *
+ * REPLAY (TCP con --store) es un SUBSCRIBE que antes manda lo guardado desde
+ * un offset: "REPLAY <TOPIC> <offset>" en texto, o el offset como u64 en el
+ * payload. Al cliente binario le llega un BIN_OP_REPLAY (id del tema; payload
+ * u64 desde, u64 hasta), los mensajes guardados con BIN_FLAG_OFFSET (topic =
+ * offset) y después los nuevos, que siguen desde "hasta" sin huecos.
+ *
+ * UDP confiable (broker con --rtx N): un SUBSCRIBE binario con BIN_FLAG_SEQ
+ * pide entregas numeradas. Cada MESSAGE trae BIN_FLAG_SEQ y los primeros
+ * PROTO_SEQ_LEN bytes del payload son el número de secuencia del tema (u32,
+ * contado en length). Ante un hueco el subscriber manda un BIN_OP_NACK (id
+ * del tema; payload u32 primero, u32 cantidad) y el broker reenvía lo que
+ * todavía tenga; lo que ya no tiene lo avisa con un BIN_OP_NACK de vuelta.
+ *
+ * En UDP no hay conexión: el broker da de baja al subscriber que pasa
+ * --sub-ttl segundos sin mandar nada, así que los subscribers mandan
+ * "HEARTBEAT" (o BIN_OP_HEARTBEAT) cada tanto. "UNSUBSCRIBE <TOPIC>" deja
+ * un tema o un patrón.
+ *
+ * Multicast (broker UDP con --mcast): un SUBSCRIBE binario con
+ * BIN_FLAG_MCAST avisa que el subscriber puede unirse a un grupo. El broker
+ * le contesta con un BIN_OP_MCAST (id del tema; payload: dirección IPv4 y
+ * puerto del grupo, en orden de red) y desde ahí le manda ese tema una sola
+ * vez al grupo, como BIN_OP_MESSAGE, en lugar de un datagrama por subscriber.
+ * Varios temas pueden compartir grupo: el subscriber filtra por id.
+ *
+ * Compresión (broker TCP con --compress): un SUBSCRIBE binario con
+ * BIN_FLAG_LZ4 pide los mensajes comprimidos en toda la conexión, y el
+ * BIN_OP_TOPIC_ID de respuesta trae el mismo flag si el broker aceptó.
+ * Antes del primer mensaje comprimido de cada tema llega un BIN_OP_DICT (id
+ * del tema; payload: el diccionario, ver lz_codec.h). Un MESSAGE con
+ * BIN_FLAG_LZ4 trae en el payload el largo original (u32) y el bloque LZ4;
+ * los que no ganan nada comprimidos siguen llegando crudos.
+ *
+ * Admisión (broker TCP con --max-conns / --max-per-ip): una conexión que no
+ * entra recibe una sola línea de texto "BUSY <motivo>" y se cierra. Es texto
+ * aunque el cliente pensara hablar binario, porque todavía no negoció nada;
+ * conviene reintentar más tarde y con algo de espera al azar.
+ * El modo texto sigue disponible para depurar con nc/telnet.
+ */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define PROTO_LEN_MAGIC 0xFF
+#define PROTO_LEN_HEADER 5
+#define PROTO_MAX_FRAME (64 * 1024)
+
+#define PROTO_BIN_MAGIC 0xB1
+#define PROTO_BIN_VERSION 1
+#define PROTO_BIN_HEADER 12
+
+/* Opcodes del protocolo binario */
+enum {
+    BIN_OP_HELLO = 1,      /* negociación: el broker responde con su versión */
+    BIN_OP_SUBSCRIBE = 2,
+    BIN_OP_PUBLISH = 3,
+    BIN_OP_MESSAGE = 4,    /* broker -> subscriber */
+    BIN_OP_TOPIC_ID = 5,   /* pedido (por nombre) y respuesta (id + nombre en el payload) */
+    BIN_OP_REPLAY = 6,     /* pedido (offset en el payload) y respuesta (rango que se reenvía) */
+    BIN_OP_NACK = 7,       /* pedido de retransmisión y aviso de lo que ya no se puede reenviar */
+    BIN_OP_UNSUBSCRIBE = 8,
+    BIN_OP_HEARTBEAT = 9,  /* UDP: el subscriber sigue vivo (sin tema ni payload) */
+    BIN_OP_MCAST = 10,     /* UDP: grupo multicast por el que llega un tema */
+    BIN_OP_DICT = 11       /* TCP: diccionario de compresión de un tema */
+};
+
+#define BIN_FLAG_TOPIC_ID 0x01
+#define BIN_FLAG_OFFSET 0x02   /* mensaje guardado: topic lleva el offset (32 bits bajos) */
+#define BIN_FLAG_SEQ 0x04      /* UDP confiable: el payload empieza con el número de secuencia */
+#define BIN_FLAG_MCAST 0x08    /* SUBSCRIBE UDP: el subscriber puede recibir por multicast */
+#define BIN_FLAG_LZ4 0x10     /* SUBSCRIBE: pide compresión; MESSAGE: payload comprimido */
+#define PROTO_SEQ_LEN 4
+#define PROTO_MCAST_LEN 6      /* payload de BIN_OP_MCAST: IPv4 + puerto */
+#define PROTO_LZ4_LEN 4        /* MESSAGE comprimido: largo original antes del bloque */
+#define PROTO_BUSY "BUSY"      /* primera línea de una conexión rechazada */
+
+typedef struct {
+    uint8_t magic;
+    uint8_t version;
+    uint8_t opcode;
+    uint8_t flags;
+    uint32_t topic;
+    uint32_t length;
+} BinHeader;
+
+typedef struct {
+    const char *data;
+    size_t len;
+} Slice;
+
+typedef enum {
+    FRAME_TEXT,
+    FRAME_LENGTH,
+    FRAME_BINARY
+} FrameKind;
+
+typedef struct {
+    FrameKind kind;
+    Slice body;            /* el comando, sin '\n' ni cabecera */
+    BinHeader header;      /* solo FRAME_BINARY */
+} Frame;
+
+typedef struct {
+    Slice command;
+    Slice topic;
+    Slice payload;
+} TextCommand;
+
+/* Comando ya decodificado, venga de texto o de binario */
+typedef struct {
+    int op;                /* BIN_OP_*, o 0 si el comando no se reconoce */
+    int binary;            /* 1 si vino en un frame binario */
+    uint8_t flags;         /* BIN_FLAG_* del frame binario */
+    int has_topic_id;
+    uint32_t topic_id;
+    Slice topic;           /* nombre, vacío si se usó topic_id */
+    Slice payload;
+    Slice command;         /* texto original del comando, para mensajes de error */
+} Command;
+
+/*
+ * Busca el siguiente frame completo en buf[0..len).
+ * Retorna 1 si encontró uno (y *consumed indica cuántos bytes ocupa),
+ * 0 si faltan bytes, o -1 si el frame es inválido o supera PROTO_MAX_FRAME.
+ */
+int proto_next_frame(const char *buf, size_t len, Frame *frame, size_t *consumed);
+
+/*
+ * Un datagrama UDP es exactamente un frame: binario si empieza con el magic,
+ * si no texto (sin necesidad de '\n' al final). Retorna -1 si es inválido.
+ */
+int proto_datagram_frame(const char *buf, size_t len, Frame *frame);
+
+/* Separa "<COMANDO> <TOPIC> <mensaje>" en slices. Retorna -1 si no hay comando. */
+int proto_parse_text(Slice body, TextCommand *cmd);
+
+/* Decodifica cualquier frame a un Command. Retorna -1 si está vacío o es inválido. */
+int proto_parse_frame(const Frame *frame, Command *cmd);
+
+/* Escribe la cabecera de un frame con longitud (PROTO_LEN_HEADER bytes). */
+void proto_write_len_header(char *out, uint32_t body_len);
+
+/* Escribe una cabecera binaria de PROTO_BIN_HEADER bytes. */
+void proto_write_bin_header(char *out, uint8_t opcode, uint8_t flags,
+                            uint32_t topic, uint32_t length);
+
+/* Decodifica la cabecera binaria con una sola carga de 12 bytes. */
+static inline void proto_read_bin_header(const char *in, BinHeader *h) {
+    memcpy(h, in, PROTO_BIN_HEADER);
+    h->topic = ntohl(h->topic);
+    h->length = ntohl(h->length);
+}
+
+static inline int slice_eq(Slice s, const char *lit, size_t lit_len) {
+    if (s.len != lit_len) return 0;
+    for (size_t i = 0; i < lit_len; i++)
+        if (s.data[i] != lit[i]) return 0;
+    return 1;
+}
+
+#define SLICE_IS(s, lit) slice_eq((s), (lit), sizeof(lit) - 1)
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * pub_stream.c
+ *
+ * Implementación del modo streaming de los publishers (ver pub_stream.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "protocol.h"
+#include "pub_stream.h"
+
+int tmpl_init(MsgTemplate *t, int binary, const char *topic, long topic_id,
+              const char *pub_id, size_t payload_bytes) {
+    size_t topic_len = strlen(topic);
+    char prefix[128];
+    int n = snprintf(prefix, sizeof(prefix), "[%s] ", pub_id);
+    if (n < 0 || (size_t)n >= sizeof(prefix)) return -1;
+    size_t prefix_len = (size_t)n;
+
+    size_t payload = prefix_len + PUB_SEQ_DIGITS;
+    if (payload_bytes > payload) payload = payload_bytes;
+
+    size_t head = binary ? PROTO_BIN_HEADER + (topic_id >= 0 ? 0 : topic_len)
+                         : sizeof("PUBLISH ") - 1 + topic_len + 1;
+    size_t len = head + payload + (binary ? 0 : 1);
+    if (len > PROTO_MAX_FRAME) return -1;
+
+    t->frame = malloc(len);
+    if (t->frame == NULL) return -1;
+    t->len = len;
+
+    char *p = t->frame;
+    if (binary) {
+        if (topic_id >= 0)
+            proto_write_bin_header(p, BIN_OP_PUBLISH, BIN_FLAG_TOPIC_ID, (uint32_t)topic_id, (uint32_t)payload);
+        else
+            proto_write_bin_header(p, BIN_OP_PUBLISH, 0, (uint32_t)topic_len, (uint32_t)payload);
+        p += PROTO_BIN_HEADER;
+        if (topic_id < 0) {
+            memcpy(p, topic, topic_len);
+            p += topic_len;
+        }
+    } else {
+        memcpy(p, "PUBLISH ", 8);
+        memcpy(p + 8, topic, topic_len);
+        p[8 + topic_len] = ' ';
+        p += 8 + topic_len + 1;
+    }
+
+    /* Payload: prefijo, secuencia y relleno ("x" para que se lea en texto) */
+    memcpy(p, prefix, prefix_len);
+    t->seq_off = (size_t)(p - t->frame) + prefix_len;
+    memset(p + prefix_len, '0', PUB_SEQ_DIGITS);
+    if (payload > prefix_len + PUB_SEQ_DIGITS) {
+        p[prefix_len + PUB_SEQ_DIGITS] = ' ';
+        memset(p + prefix_len + PUB_SEQ_DIGITS + 1, 'x', payload - prefix_len - PUB_SEQ_DIGITS - 1);
+    }
+    if (!binary) t->frame[len - 1] = '\n';
+    return 0;
+}
+
+void tmpl_free(MsgTemplate *t) {
+    free(t->frame);
+    t->frame = NULL;
+}
+
+void tmpl_write(const MsgTemplate *t, char *out, uint64_t seq) {
+    memcpy(out, t->frame, t->len);
+    char *d = out + t->seq_off + PUB_SEQ_DIGITS;
+    for (int i = 0; i < PUB_SEQ_DIGITS; i++) {
+        *--d = (char)('0' + seq % 10);
+        seq /= 10;
+    }
+}
+
+uint64_t pub_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void tb_init(TokenBucket *tb, double rate, double burst) {
+    tb->rate = rate;
+    tb->burst = burst < 1 ? 1 : burst;
+    tb->tokens = 0;
+    tb->last_ns = pub_now_ns();
+}
+
+uint64_t tb_take(TokenBucket *tb, uint64_t want) {
+    if (tb->rate <= 0) return want;
+    for (;;) {
+        uint64_t now = pub_now_ns();
+        tb->tokens += (double)(now - tb->last_ns) * tb->rate / 1e9;
+        if (tb->tokens > tb->burst) tb->tokens = tb->burst;
+        tb->last_ns = now;
+        if (tb->tokens >= 1) break;
+
+        /* Dormimos lo justo para que aparezca el próximo token */
+        uint64_t wait = (uint64_t)((1 - tb->tokens) * 1e9 / tb->rate) + 1;
+        struct timespec ts = { (time_t)(wait / 1000000000ull), (long)(wait % 1000000000ull) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {}
+    }
+    uint64_t n = (uint64_t)tb->tokens;
+    if (n > want) n = want;
+    tb->tokens -= (double)n;
+    return n;
+}
@@ -0,0 +1,56 @@
+/*
+ * pub_stream.h
+ *
+ * Piezas del modo streaming de publisher_tcp y publisher_quic.
+ * - MsgTemplate: el frame PUBLISH se arma una sola vez. Para cada mensaje se
+ *   copia la plantilla y se escribe el número de secuencia en un campo de
+ *   ancho fijo (sin snprintf por mensaje).
+ * - TokenBucket: limita el ritmo a N mensajes/s y deja salir ráfagas de
+ *   hasta `burst` mensajes, así se pueden juntar varios frames en una sola
+ *   escritura sin pasarse del promedio pedido.
+ */
+#ifndef PUB_STREAM_H
+#define PUB_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PUB_SEQ_DIGITS 10
+
+typedef struct {
+    char *frame;           /* frame completo con la secuencia en ceros */
+    size_t len;
+    size_t seq_off;        /* dónde van los PUB_SEQ_DIGITS dígitos */
+} MsgTemplate;
+
+/*
+ * Arma "PUBLISH <topic> [<pub_id>] <seq> xxx...\n" en texto, o el frame
+ * binario equivalente (por id si topic_id >= 0, si no con el nombre).
+ * El payload se rellena hasta payload_bytes (o lo mínimo para la secuencia).
+ * Retorna -1 si no hay memoria o el frame supera PROTO_MAX_FRAME.
+ */
+int tmpl_init(MsgTemplate *t, int binary, const char *topic, long topic_id,
+              const char *pub_id, size_t payload_bytes);
+void tmpl_free(MsgTemplate *t);
+
+/* Copia el frame a out (t->len bytes) con el número de secuencia seq. */
+void tmpl_write(const MsgTemplate *t, char *out, uint64_t seq);
+
+typedef struct {
+    double rate;           /* mensajes por segundo, 0 = sin límite */
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+} TokenBucket;
+
+void tb_init(TokenBucket *tb, double rate, double burst);
+
+/*
+ * Pide hasta `want` mensajes. Si no hay ninguno disponible duerme hasta que
+ * haya al menos uno. Retorna cuántos se pueden enviar ya (>= 1 si want >= 1).
+ */
+uint64_t tb_take(TokenBucket *tb, uint64_t want);
+
+uint64_t pub_now_ns(void);
+
+#endif
@@ -4,18 +4,39 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <msquic.h>
+#include "protocol.h"
+#include "pub_stream.h"
 
 #define BUF_SIZE 1024
 #define DEFAULT_MSGS 10
 
+/* Streaming mode: frames are packed into STREAM_CHUNK-byte buffers and up to
+   STREAM_BUFFERS of them go out in one StreamSend. MsQuic queues sends
+   without limit, so we stop producing while STREAM_MAX_INFLIGHT sends
+   (up to 16 MB) are still waiting for SEND_COMPLETE. */
+#define STREAM_CHUNK (64 * 1024)
+#define STREAM_BUFFERS 8
+#define STREAM_MAX_INFLIGHT 32
+
 static const QUIC_API_TABLE *MsQuic = NULL;
 static HQUIC Registration = NULL;
 static HQUIC Configuration = NULL;
 
+/* Un StreamSend del modo streaming: varios buffers en una sola reserva */
+typedef struct {
+    QUIC_BUFFER bufs[STREAM_BUFFERS];
+    char data[];
+} StreamBatch;
+
+static unsigned inflight;      /* StreamSend sin SEND_COMPLETE */
+
 static QUIC_STATUS QUIC_API StreamCallback(HQUIC Stream, void *Context, QUIC_STREAM_EVENT *Event) {
     (void)Context;
     switch (Event->Type) {
         case QUIC_STREAM_EVENT_SEND_COMPLETE:
+            /* MsQuic ya no usa el buffer del mensaje */
+            __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+            free(Event->SEND_COMPLETE.ClientContext);
             return QUIC_STATUS_SUCCESS;
         case QUIC_STREAM_EVENT_PEER_SEND_SHUTDOWN:
         case QUIC_STREAM_EVENT_PEER_SEND_ABORTED:
@@ -40,11 +61,78 @@ static QUIC_STATUS QUIC_API ConnectionCallback(HQUIC Connection, void *Context,
     }
 }
 
+/* Streaming mode: fill the chunks with as many frames as the token bucket
+   allows and hand them to MsQuic in a single multi-buffer StreamSend */
+static int stream_publish(HQUIC stream, const MsgTemplate *tmpl, unsigned long long count,
+                          double rate, const char *pub_id) {
+    uint64_t per_chunk = STREAM_CHUNK / tmpl->len;
+    if (per_chunk == 0) per_chunk = 1;
+    size_t chunk_bytes = per_chunk * tmpl->len;
+    uint64_t per_send = per_chunk * STREAM_BUFFERS;
+
+    TokenBucket tb;
+    tb_init(&tb, rate, rate / 1000 < (double)per_send ? rate / 1000 : (double)per_send);
+
+    uint64_t start = pub_now_ns();
+    unsigned long long seq = 0;
+    int r = 0;
+    while (seq < count) {
+        while (__atomic_load_n(&inflight, __ATOMIC_RELAXED) > STREAM_MAX_INFLIGHT) usleep(50);
+
+        uint64_t want = count - seq < per_send ? count - seq : per_send;
+        uint64_t n = tb_take(&tb, want);
+        uint32_t nbufs = (uint32_t)((n + per_chunk - 1) / per_chunk);
+        StreamBatch *batch = malloc(sizeof(StreamBatch) + nbufs * chunk_bytes);
+        if (batch == NULL) {
+            r = -1;
+            break;
+        }
+        for (uint32_t b = 0; b < nbufs; b++) {
+            char *chunk = batch->data + b * chunk_bytes;
+            uint64_t in_chunk = n - b * per_chunk < per_chunk ? n - b * per_chunk : per_chunk;
+            for (uint64_t i = 0; i < in_chunk; i++)
+                tmpl_write(tmpl, chunk + i * tmpl->len, ++seq);
+            batch->bufs[b].Buffer = (uint8_t *)chunk;
+            batch->bufs[b].Length = (uint32_t)(in_chunk * tmpl->len);
+        }
+
+        __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        if (QUIC_FAILED(MsQuic->StreamSend(stream, batch->bufs, nbufs, QUIC_SEND_FLAG_NONE, batch))) {
+            __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+            free(batch);
+            fprintf(stderr, "[publisher_quic] StreamSend failed\n");
+            r = -1;
+            break;
+        }
+    }
+
+    /* Wait for MsQuic to take everything before reporting */
+    while (__atomic_load_n(&inflight, __ATOMIC_RELAXED) > 0) usleep(100);
+    double secs = (double)(pub_now_ns() - start) / 1e9;
+    printf("[PUBLISHER %s] %llu messages in %.2f s (%.0f msg/s, %.1f MB/s)\n", pub_id, seq, secs,
+           secs > 0 ? seq / secs : 0.0, secs > 0 ? seq * (double)tmpl->len / secs / 1e6 : 0.0);
+    return r;
+}
+
 int main(int argc, char **argv) {
     const char *server;
     uint16_t port;
     const char *topic;
     const char *pub_id;
+    int binary = 0;
+    unsigned long long count = 0;     /* 0 = the classic 10 messages, one per second */
+    double rate = 0;
+    size_t bytes = 0;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) binary = 1;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) count = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--bytes") == 0 && i + 1 < argc) bytes = (size_t)atol(argv[++i]);
+        else {
+            fprintf(stderr, "[publisher_quic] Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
     if (argc < 5) {
         fprintf(stderr, "[publisher_quic] Using defaults: 127.0.0.1 8080 A_vs_B P1\n");
         server = "127.0.0.1";
@@ -82,15 +170,49 @@ int main(int argc, char **argv) {
     if (MsQuic->StreamOpen(Connection, QUIC_STREAM_OPEN_FLAG_NONE, StreamCallback, NULL, &Stream) != QUIC_STATUS_SUCCESS) return 1;
     if (MsQuic->StreamStart(Stream, QUIC_STREAM_START_FLAG_IMMEDIATE) != QUIC_STATUS_SUCCESS) return 1;
 
-    char out[BUF_SIZE];
-    for (int i = 1; i <= DEFAULT_MSGS; ++i) {
-        int n = snprintf(out, sizeof(out), "PUBLISH %s [%s] message %d\n", topic, pub_id, i);
-        if (n < 0) break;
-        QUIC_BUFFER buf;
-        buf.Length = (uint32_t)n;
-        buf.Buffer = (uint8_t *)out;
-        MsQuic->StreamSend(Stream, &buf, 1, QUIC_SEND_FLAG_ALLOW_0_RTT, NULL);
-        sleep(1);
+    /* Each message owns its buffer (QUIC_BUFFER header + data) until SEND_COMPLETE */
+    size_t topic_len = strlen(topic);
+    int last = count > 0 ? 0 : DEFAULT_MSGS;     /* streaming: only the HELLO */
+    for (int i = binary ? 0 : 1; i <= last; ++i) {
+        QUIC_BUFFER *buf = malloc(sizeof(QUIC_BUFFER) + BUF_SIZE);
+        if (buf == NULL) break;
+        char *out = (char *)(buf + 1);
+        int n;
+        if (i == 0) {
+            /* Binary mode: negotiate first; the broker answers with BIN_OP_HELLO */
+            proto_write_bin_header(out, BIN_OP_HELLO, 0, 0, 0);
+            n = PROTO_BIN_HEADER;
+        } else if (binary && topic_len < BUF_SIZE - PROTO_BIN_HEADER) {
+            n = snprintf(out + PROTO_BIN_HEADER + topic_len, BUF_SIZE - PROTO_BIN_HEADER - topic_len,
+                         "[%s] message %d", pub_id, i);
+            proto_write_bin_header(out, BIN_OP_PUBLISH, 0, (uint32_t)topic_len, (uint32_t)n);
+            memcpy(out + PROTO_BIN_HEADER, topic, topic_len);
+            n += PROTO_BIN_HEADER + (int)topic_len;
+        } else {
+            n = snprintf(out, BUF_SIZE, "PUBLISH %s [%s] message %d\n", topic, pub_id, i);
+        }
+        if (n < 0 || n > BUF_SIZE) {
+            free(buf);
+            break;
+        }
+        buf->Length = (uint32_t)n;
+        buf->Buffer = (uint8_t *)out;
+        __atomic_add_fetch(&inflight, 1, __ATOMIC_RELAXED);
+        if (QUIC_FAILED(MsQuic->StreamSend(Stream, buf, 1, QUIC_SEND_FLAG_ALLOW_0_RTT, buf))) {
+            __atomic_sub_fetch(&inflight, 1, __ATOMIC_RELAXED);
+            free(buf);
+        }
+        if (i > 0) sleep(1);
+    }
+
+    if (count > 0) {
+        MsgTemplate tmpl;
+        if (tmpl_init(&tmpl, binary, topic, -1, pub_id, bytes) < 0) {
+            fprintf(stderr, "[publisher_quic] Message too large\n");
+            return 1;
+        }
+        stream_publish(Stream, &tmpl, count, rate, pub_id);
+        tmpl_free(&tmpl);
     }
 
     MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
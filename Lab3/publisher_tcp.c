@@ -2,15 +2,23 @@
  *
  * Publisher TCP para Linux (POSIX).
  * - Envía 10 mensajes automáticamente por defecto (simula un periodista).
- * - Formato de mensaje: "PUB|TOPIC|mensaje\n"
+ * - Formato de mensaje: "PUBLISH <TOPIC> mensaje\n" (el '\n' separa los frames)
+ * - Con --binary negocia el protocolo binario (ver protocol.h), pide el id del
+ *   tema una sola vez y publica con la cabecera fija de 12 bytes.
+ * - Con --count N entra en modo streaming para estresar al broker: publica N
+ *   mensajes de --bytes bytes sin dormir, al ritmo de --rate mensajes/s
+ *   (token bucket; 0 = lo más rápido posible). Los frames se arman desde una
+ *   plantilla y se juntan en escrituras de hasta STREAM_BATCH bytes.
  *
  * Compilar:
- *   gcc -std=c11 publisher_tcp.c -o publisher_tcp
+ *   gcc -std=c11 publisher_tcp.c protocol.c pub_stream.c -o publisher_tcp
  *
  * Ejecutar:
- *   ./publisher_tcp <broker_ip> <broker_port> <TOPIC> <PUBLISHER_ID>
+ *   ./publisher_tcp <broker_ip> <broker_port> <TOPIC> <PUBLISHER_ID> [--binary]
+ *                   [--count N] [--rate N] [--bytes N]
  * Ejemplo:
  *   ./publisher_tcp 127.0.0.1 5000 "A_vs_B" P1
+ *   ./publisher_tcp 127.0.0.1 5000 "A_vs_B" P1 --binary --count 5000000 --bytes 64
  *
  * Para correr 2 publishers simultáneos: abrir 2 terminales y ejecutar con IDs distintos,
  * o ejecutar uno en background:
@@ -26,13 +34,102 @@
 #include <sys/socket.h>     // socket, connect, send
 #include <netinet/in.h>     // struct sockaddr_in, htons
 #include <arpa/inet.h>      // inet_pton
+#include <errno.h>
+#include "protocol.h"       // cabecera binaria
+#include "pub_stream.h"     // plantilla de frames y token bucket
 
 #define DEFAULT_MSGS 10
 #define BUF_SIZE 1024
+#define STREAM_BATCH (256 * 1024)
+
+/* recv() puede devolver menos bytes: leemos hasta completar len */
+static int recv_all(int fd, char *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(fd, buf + got, len - got, 0);
+        if (n <= 0) return -1;
+        got += (size_t)n;
+    }
+    return 0;
+}
+
+/* send() puede escribir menos bytes: enviamos hasta completar len */
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/* Negocia el protocolo binario y devuelve el id del tema (o -1 si falla) */
+static long negotiate_binary(int fd, const char *topic) {
+    char frame[BUF_SIZE];
+    BinHeader h;
+    size_t topic_len = strlen(topic);
+
+    proto_write_bin_header(frame, BIN_OP_HELLO, 0, 0, 0);
+    if (send(fd, frame, PROTO_BIN_HEADER, 0) < 0) return -1;
+    if (recv_all(fd, frame, PROTO_BIN_HEADER) < 0) return -1;
+    proto_read_bin_header(frame, &h);
+    if (h.magic != PROTO_BIN_MAGIC || h.opcode != BIN_OP_HELLO) return -1;
+
+    if (topic_len > BUF_SIZE - PROTO_BIN_HEADER) return -1;
+    proto_write_bin_header(frame, BIN_OP_TOPIC_ID, 0, (uint32_t)topic_len, 0);
+    memcpy(frame + PROTO_BIN_HEADER, topic, topic_len);
+    if (send(fd, frame, PROTO_BIN_HEADER + topic_len, 0) < 0) return -1;
+    if (recv_all(fd, frame, PROTO_BIN_HEADER) < 0) return -1;
+    proto_read_bin_header(frame, &h);
+    if (h.opcode != BIN_OP_TOPIC_ID || h.length > BUF_SIZE) return -1;
+    if (recv_all(fd, frame, h.length) < 0) return -1;
+    return (long)h.topic;
+}
+
+/* Modo streaming: llena el buffer con todos los frames que el token bucket
+   permita y los manda con un solo send() */
+static int stream_publish(int fd, const MsgTemplate *tmpl, unsigned long long count,
+                          double rate, const char *pub_id) {
+    char *batch = malloc(STREAM_BATCH);
+    if (batch == NULL) return -1;
+    uint64_t per_batch = STREAM_BATCH / tmpl->len;
+    if (per_batch == 0) per_batch = 1;
+
+    /* La ráfaga permitida es un lote, o 1 ms de mensajes si el ritmo es bajo */
+    TokenBucket tb;
+    tb_init(&tb, rate, rate / 1000 < (double)per_batch ? rate / 1000 : (double)per_batch);
+
+    uint64_t start = pub_now_ns();
+    unsigned long long seq = 0;
+    int r = 0;
+    while (seq < count) {
+        uint64_t want = count - seq < per_batch ? count - seq : per_batch;
+        uint64_t n = tb_take(&tb, want);
+        size_t len = 0;
+        for (uint64_t i = 0; i < n; i++, len += tmpl->len)
+            tmpl_write(tmpl, batch + len, ++seq);
+        if (send_all(fd, batch, len) < 0) {
+            perror("send()");
+            r = -1;
+            break;
+        }
+    }
+
+    double secs = (double)(pub_now_ns() - start) / 1e9;
+    printf("[PUBLISHER %s] %llu mensajes en %.2f s (%.0f msg/s, %.1f MB/s)\n", pub_id, seq, secs,
+           secs > 0 ? seq / secs : 0.0, secs > 0 ? seq * (double)tmpl->len / secs / 1e6 : 0.0);
+    free(batch);
+    return r;
+}
 
 int main(int argc, char *argv[]) {
     if (argc < 5) {
-        fprintf(stderr, "Uso: %s <broker_ip> <broker_port> <TOPIC> <PUBLISHER_ID>\n", argv[0]);
+        fprintf(stderr, "Uso: %s <broker_ip> <broker_port> <TOPIC> <PUBLISHER_ID> [--binary] "
+                        "[--count N] [--rate N] [--bytes N]\n", argv[0]);
         fprintf(stderr, "Ej: %s 127.0.0.1 5000 \"A_vs_B\" P1\n", argv[0]);
         return 1;
     }
@@ -41,6 +138,20 @@ int main(int argc, char *argv[]) {
     int broker_port = atoi(argv[2]);
     const char *topic = argv[3];
     const char *pub_id = argv[4];
+    int binary = 0;
+    unsigned long long count = 0;     /* 0 = modo interactivo de siempre */
+    double rate = 0;
+    size_t bytes = 0;
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) binary = 1;
+        else if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) count = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "--bytes") == 0 && i + 1 < argc) bytes = (size_t)atol(argv[++i]);
+        else {
+            fprintf(stderr, "Opción desconocida: %s\n", argv[i]);
+            return 1;
+        }
+    }
 
     int sockfd;
     struct sockaddr_in broker_addr;
@@ -83,6 +194,30 @@ int main(int argc, char *argv[]) {
 
     printf("[PUBLISHER %s] Conectado a %s:%d, topic=%s\n", pub_id, broker_ip, broker_port, topic);
 
+    long topic_id = -1;
+    if (binary) {
+        topic_id = negotiate_binary(sockfd, topic);
+        if (topic_id < 0) {
+            fprintf(stderr, "[PUBLISHER %s] El broker no aceptó el protocolo binario\n", pub_id);
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        printf("[PUBLISHER %s] Protocolo binario, id del tema=%ld\n", pub_id, topic_id);
+    }
+
+    if (count > 0) {
+        MsgTemplate tmpl;
+        if (tmpl_init(&tmpl, binary, topic, topic_id, pub_id, bytes) < 0) {
+            fprintf(stderr, "[PUBLISHER %s] Mensaje demasiado grande\n", pub_id);
+            close(sockfd);
+            exit(EXIT_FAILURE);
+        }
+        int r = stream_publish(sockfd, &tmpl, count, rate, pub_id);
+        tmpl_free(&tmpl);
+        close(sockfd);
+        return r < 0 ? 1 : 0;
+    }
+
     /* 4) Enviar N mensajes (DEFAULT_MSGS) con send()
        send(fd, buffer, len, flags):
        - retorna número de bytes enviados, o -1 en error.
@@ -91,8 +226,18 @@ int main(int argc, char *argv[]) {
     */
     char out[BUF_SIZE];
     for (int i = 1; i <= DEFAULT_MSGS; ++i) {
-        // Construimos el mensaje según formato: PUB|TOPIC|[ID] mensaje i\n
-        int n = snprintf(out, sizeof(out), "PUBLISH %s [%s] mensaje %d", topic, pub_id, i);
+        // Construimos el mensaje según formato: PUBLISH TOPIC [ID] mensaje i\n
+        int n;
+        if (binary) {
+            // Cabecera fija + payload; el tema va como id, sin nombre
+            n = snprintf(out + PROTO_BIN_HEADER, sizeof(out) - PROTO_BIN_HEADER, "[%s] mensaje %d", pub_id, i);
+            if (n >= 0) {
+                proto_write_bin_header(out, BIN_OP_PUBLISH, BIN_FLAG_TOPIC_ID, (uint32_t)topic_id, (uint32_t)n);
+                n += PROTO_BIN_HEADER;
+            }
+        } else {
+            n = snprintf(out, sizeof(out), "PUBLISH %s [%s] mensaje %d\n", topic, pub_id, i);
+        }
         if (n < 0) {
             fprintf(stderr, "Error al formar el mensaje\n");
             break;
@@ -104,7 +249,11 @@ int main(int argc, char *argv[]) {
             break;
         }
 
-        printf("[PUBLISHER %s] Enviado (%zd bytes): %s", pub_id, sent, out);
+        if (binary)
+            printf("[PUBLISHER %s] Enviado (%zd bytes): %.*s\n", pub_id, sent,
+                   (int)(sent - PROTO_BIN_HEADER), out + PROTO_BIN_HEADER);
+        else
+            printf("[PUBLISHER %s] Enviado (%zd bytes): %s", pub_id, sent, out);
         sleep(1); // simula tiempo entre eventos
     }
 
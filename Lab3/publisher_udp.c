@@ -1,17 +1,41 @@
+/*
+ * publisher_udp.c
+ * Publisher UDP interactivo: cada línea escrita ("PUBLISH <TOPIC> mensaje") es un datagrama.
+ * Compilar: gcc publisher_udp.c protocol.c -o publisher_udp
+ * Ejecutar: ./publisher_udp [--binary]
+ *
+ * Con --binary cada PUBLISH se codifica con la cabecera binaria de protocol.h.
+ */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "protocol.h"
 
 #define SERVER_IP "127.0.0.1"
 #define SERVER_PORT 8081
 #define BUFFER_SIZE 1024
 
-int main() {
+/* Convierte "PUBLISH <TOPIC> mensaje" a un frame binario; retorna su largo o -1 */
+static int encode_binary(const char *line, char *out, size_t out_size) {
+    Slice body = { line, strlen(line) };
+    TextCommand cmd;
+    if (proto_parse_text(body, &cmd) < 0 || !SLICE_IS(cmd.command, "PUBLISH")) return -1;
+    if (PROTO_BIN_HEADER + cmd.topic.len + cmd.payload.len > out_size) return -1;
+
+    proto_write_bin_header(out, BIN_OP_PUBLISH, 0, (uint32_t)cmd.topic.len, (uint32_t)cmd.payload.len);
+    memcpy(out + PROTO_BIN_HEADER, cmd.topic.data, cmd.topic.len);
+    memcpy(out + PROTO_BIN_HEADER + cmd.topic.len, cmd.payload.data, cmd.payload.len);
+    return (int)(PROTO_BIN_HEADER + cmd.topic.len + cmd.payload.len);
+}
+
+int main(int argc, char *argv[]) {
     int sock;
     struct sockaddr_in server_addr;
     char message[BUFFER_SIZE];
+    char frame[BUFFER_SIZE + PROTO_BIN_HEADER];
+    int binary = argc > 1 && strcmp(argv[1], "--binary") == 0;
     
     sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
@@ -27,13 +51,25 @@ int main() {
 
     while (1) {
         printf("> ");
-        fgets(message, BUFFER_SIZE, stdin);
+        if (fgets(message, BUFFER_SIZE, stdin) == NULL)
+            break;
         message[strcspn(message, "\n")] = 0;
 
         if (strcmp(message, "exit") == 0)
             break;
 
-        if (sendto(sock, message, strlen(message), 0,
+        const char *out = message;
+        int len = (int)strlen(message);
+        if (binary) {
+            len = encode_binary(message, frame, sizeof(frame));
+            if (len < 0) {
+                printf("Formato: PUBLISH <TOPIC> mensaje\n");
+                continue;
+            }
+            out = frame;
+        }
+
+        if (sendto(sock, out, (size_t)len, 0,
                    (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
             perror("Error al enviar mensaje UDP");
             break;
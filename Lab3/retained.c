@@ -0,0 +1,39 @@
+/*
+ * retained.c
+ *
+ * Implementación del anillo de mensajes retenidos (ver retained.h).
+ */
+#include <stdlib.h>
+#include "retained.h"
+
+Retained *retained_new(uint32_t cap) {
+    Retained *r = calloc(1, sizeof(Retained) + cap * sizeof(r->slots[0]));
+    if (r == NULL) return NULL;
+    r->cap = cap;
+    return r;
+}
+
+void retained_free(Retained *r, void (*free_fn)(void *)) {
+    if (r == NULL) return;
+    for (uint32_t i = 0; i < r->cap; i++) {
+        void *msg = atomic_load_explicit(&r->slots[i], memory_order_relaxed);
+        if (msg != NULL) free_fn(msg);
+    }
+    free(r);
+}
+
+void *retained_store(Retained *r, void *msg) {
+    uint64_t turn = atomic_fetch_add_explicit(&r->stored, 1, memory_order_relaxed);
+    return atomic_exchange_explicit(&r->slots[turn % r->cap], msg, memory_order_acq_rel);
+}
+
+uint32_t retained_snapshot(Retained *r, void **out) {
+    uint64_t stored = atomic_load_explicit(&r->stored, memory_order_acquire);
+    uint64_t first = stored > r->cap ? stored - r->cap : 0;
+    uint32_t n = 0;
+    for (uint64_t i = first; i < stored; i++) {
+        void *msg = atomic_load_explicit(&r->slots[i % r->cap], memory_order_acquire);
+        if (msg != NULL) out[n++] = msg;
+    }
+    return n;
+}
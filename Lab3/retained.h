@@ -0,0 +1,42 @@
+/*
+ * retained.h
+ *
+ * Últimos mensajes de un tema para los subscribers que llegan tarde.
+ * - Anillo de capacidad fija que se reserva entero al crear el tema: guardar
+ *   un mensaje es pisar un slot, sin reservas ni listas.
+ * - Con capacidad 1 es el "último valor" del tema; con N, los últimos N.
+ * - Igual que el registro, no sabe qué guarda: cada broker pone su propio
+ *   mensaje con contador de referencias y decide cuándo soltar el que se
+ *   pisa (en el momento o, si hay lectores sin lock, con epoch_retire).
+ * - Guardar es seguro desde varios hilos a la vez (un fetch_add para el
+ *   turno y un exchange para el slot); leer la foto requiere que nadie
+ *   suelte lo que se pisó mientras tanto.
+ */
+#ifndef RETAINED_H
+#define RETAINED_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define RETAIN_MAX 1024
+
+typedef struct {
+    uint32_t cap;
+    _Atomic uint64_t stored;   /* mensajes guardados desde que se creó */
+    _Atomic(void *) slots[];
+} Retained;
+
+/* NULL si no hay memoria. cap entre 1 y RETAIN_MAX. */
+Retained *retained_new(uint32_t cap);
+/* Libera el anillo; los mensajes que queden los suelta free_fn. */
+void retained_free(Retained *r, void (*free_fn)(void *));
+
+/* Guarda msg (la referencia pasa al anillo). Retorna el mensaje que se
+   pisó, o NULL, para que el llamador suelte esa referencia. */
+void *retained_store(Retained *r, void *msg);
+
+/* Copia en out (lugar para r->cap) los mensajes guardados, del más viejo al
+   más nuevo, sin tomar referencias. Retorna cuántos copió. */
+uint32_t retained_snapshot(Retained *r, void **out);
+
+#endif
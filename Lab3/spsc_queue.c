@@ -0,0 +1,26 @@
+/*
+ * spsc_queue.c
+ *
+ * Implementación de la cola SPSC (ver spsc_queue.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "spsc_queue.h"
+
+int spsc_init(SpscQueue *q, uint32_t capacity) {
+    uint32_t cap = 2;
+    while (cap < capacity) cap <<= 1;
+
+    memset(q, 0, sizeof(*q));
+    q->items = malloc(cap * sizeof(SpscItem));
+    if (q->items == NULL) return -1;
+    q->mask = cap - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    return 0;
+}
+
+void spsc_free(SpscQueue *q) {
+    free(q->items);
+    q->items = NULL;
+}
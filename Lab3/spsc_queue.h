@@ -0,0 +1,69 @@
+/*
+ * spsc_queue.h
+ *
+ * Cola sin locks de un solo productor y un solo consumidor.
+ * - La usan los shards del broker TCP para mandarse publicaciones y cambios
+ *   de suscripción: hay una cola por cada par (origen, destino), así que cada
+ *   extremo la toca siempre el mismo hilo y alcanza con dos índices atómicos.
+ * - Arreglo circular de capacidad fija (potencia de 2). Cada lado guarda una
+ *   copia del índice del otro y solo la refresca cuando parece llena o vacía,
+ *   para no rebotar la línea de caché en cada operación.
+ * - Si está llena spsc_push falla y el productor decide qué hacer (el broker
+ *   lo guarda aparte y reintenta en la próxima vuelta).
+ */
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SPSC_CACHE_LINE 64
+
+/* Elemento genérico: una operación, un entero y un puntero */
+typedef struct {
+    uint32_t op;
+    uint32_t arg;
+    void *ptr;
+} SpscItem;
+
+typedef struct {
+    /* Lado del productor */
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint32_t tail;
+    uint32_t head_cache;
+    /* Lado del consumidor */
+    _Alignas(SPSC_CACHE_LINE) _Atomic uint32_t head;
+    uint32_t tail_cache;
+    /* Solo lectura después de spsc_init */
+    _Alignas(SPSC_CACHE_LINE) uint32_t mask;
+    SpscItem *items;
+} SpscQueue;
+
+/* capacity se redondea a potencia de 2. Retorna -1 si no hay memoria. */
+int spsc_init(SpscQueue *q, uint32_t capacity);
+void spsc_free(SpscQueue *q);
+
+/* Productor: retorna 0 o -1 si la cola está llena. */
+static inline int spsc_push(SpscQueue *q, SpscItem item) {
+    uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail - q->head_cache > q->mask) {
+        q->head_cache = atomic_load_explicit(&q->head, memory_order_acquire);
+        if (tail - q->head_cache > q->mask) return -1;
+    }
+    q->items[tail & q->mask] = item;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+/* Consumidor: retorna 1 si sacó un elemento o 0 si la cola está vacía. */
+static inline int spsc_pop(SpscQueue *q, SpscItem *item) {
+    uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head == q->tail_cache) {
+        q->tail_cache = atomic_load_explicit(&q->tail, memory_order_acquire);
+        if (head == q->tail_cache) return 0;
+    }
+    *item = q->items[head & q->mask];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * sub_stream.c
+ *
+ * Implementación del lado receptor de los subscribers (ver sub_stream.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "sub_stream.h"
+
+int sub_reader_init(SubReader *r, size_t cap) {
+    if (cap < 2 * PROTO_MAX_FRAME) cap = 2 * PROTO_MAX_FRAME;
+    r->buf = malloc(cap);
+    if (r->buf == NULL) return -1;
+    r->cap = cap;
+    r->head = r->tail = 0;
+    return 0;
+}
+
+void sub_reader_free(SubReader *r) {
+    free(r->buf);
+    r->buf = NULL;
+}
+
+char *sub_reader_space(SubReader *r, size_t *room) {
+    if (r->head == r->tail) {
+        r->head = r->tail = 0;
+    } else if (r->cap - r->tail < PROTO_MAX_FRAME) {
+        /* Lo pendiente es un frame cortado (menos de PROTO_MAX_FRAME) */
+        memmove(r->buf, r->buf + r->head, r->tail - r->head);
+        r->tail -= r->head;
+        r->head = 0;
+    }
+    *room = r->cap - r->tail;
+    return r->buf + r->tail;
+}
+
+int sub_reader_commit(SubReader *r, size_t n, SubFrameFn fn, void *arg) {
+    r->tail += n;
+    int count = 0, res;
+    size_t used;
+    Frame frame;
+    while ((res = proto_next_frame(r->buf + r->head, r->tail - r->head, &frame, &used)) == 1) {
+        r->head += used;
+        fn(&frame, arg);
+        count++;
+    }
+    return res < 0 ? -1 : count;
+}
+
+int sub_reader_feed(SubReader *r, const char *data, size_t len, SubFrameFn fn, void *arg) {
+    int count = 0;
+    while (len > 0) {
+        size_t room;
+        char *space = sub_reader_space(r, &room);
+        size_t take = len < room ? len : room;
+        memcpy(space, data, take);
+        int n = sub_reader_commit(r, take, fn, arg);
+        if (n < 0) return -1;
+        count += n;
+        data += take;
+        len -= take;
+    }
+    return count;
+}
+
+int sub_out_init(SubOutput *o, int fd, size_t cap) {
+    o->buf = malloc(cap);
+    if (o->buf == NULL) return -1;
+    o->fd = fd;
+    o->cap = cap;
+    o->len = 0;
+    return 0;
+}
+
+void sub_out_free(SubOutput *o) {
+    sub_out_flush(o);
+    free(o->buf);
+    o->buf = NULL;
+}
+
+static void write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+void sub_out_flush(SubOutput *o) {
+    if (o->len == 0) return;
+    struct iovec iov = { o->buf, o->len };
+    write_all(o->fd, &iov, 1);
+    o->len = 0;
+}
+
+void sub_out_line(SubOutput *o, const char *prefix, size_t prefix_len, const char *data, size_t len) {
+    size_t need = prefix_len + len + 1;
+    if (need > o->cap - o->len) sub_out_flush(o);
+    if (need > o->cap) {
+        /* Más grande que el buffer: sale directo */
+        struct iovec iov[3] = { { (void *)prefix, prefix_len }, { (void *)data, len }, { "\n", 1 } };
+        write_all(o->fd, iov, 3);
+        return;
+    }
+    char *p = o->buf + o->len;
+    memcpy(p, prefix, prefix_len);
+    memcpy(p + prefix_len, data, len);
+    p[prefix_len + len] = '\n';
+    o->len += need;
+}
+
+void sub_out_printf(SubOutput *o, const char *fmt, ...) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) return;
+        if ((size_t)n < o->cap - o->len) {
+            o->len += (size_t)n;
+            return;
+        }
+        /* No entró: se vacía el buffer y se intenta de nuevo (truncado si ni así entra) */
+        if (o->len == 0) {
+            o->len = o->cap - 1;
+            return;
+        }
+        sub_out_flush(o);
+    }
+}
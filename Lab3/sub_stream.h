@@ -0,0 +1,68 @@
+/*
+ * sub_stream.h
+ *
+ * Lado receptor de subscriber_tcp, subscriber_udp y subscriber_quic.
+ * - SubReader: buffer de recepción que se reusa sin limpiarlo. Cada recv
+ *   escribe detrás de lo que quedó; los frames se parsean en el lugar (los
+ *   Slice apuntan al buffer) y se entregan a un callback. Solo el frame
+ *   cortado del final se mueve al principio, y recién cuando detrás ya no
+ *   entra un frame completo, así que un recv grande trae muchos mensajes.
+ * - SubOutput: salida por lotes. Cada línea se copia a un buffer que sale
+ *   con un write cuando se llena o cuando el subscriber se va a quedar
+ *   esperando, en lugar de un printf por mensaje.
+ */
+#ifndef SUB_STREAM_H
+#define SUB_STREAM_H
+
+#include <stddef.h>
+#include "protocol.h"
+
+#define SUB_READER_SIZE (4 * PROTO_MAX_FRAME)
+#define SUB_OUTPUT_SIZE (64 * 1024)
+
+/* Recibe cada frame completo. Los slices valen hasta que vuelve */
+typedef void (*SubFrameFn)(const Frame *frame, void *arg);
+
+typedef struct {
+    char *buf;
+    size_t cap;
+    size_t head;           /* primer byte sin parsear */
+    size_t tail;           /* fin de lo recibido */
+} SubReader;
+
+/* cap tiene que dar para al menos dos frames máximos. -1 sin memoria. */
+int sub_reader_init(SubReader *r, size_t cap);
+void sub_reader_free(SubReader *r);
+
+/* Dónde escribir el próximo recv y cuánto entra (siempre > 0). */
+char *sub_reader_space(SubReader *r, size_t *room);
+
+/* Llegaron n bytes en sub_reader_space: entrega los frames completos.
+   Retorna cuántos entregó, o -1 si hay un frame inválido. */
+int sub_reader_commit(SubReader *r, size_t n, SubFrameFn fn, void *arg);
+
+/* Igual, para bytes que ya están en otro buffer (los eventos de QUIC). */
+int sub_reader_feed(SubReader *r, const char *data, size_t len, SubFrameFn fn, void *arg);
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t cap;
+    size_t len;
+} SubOutput;
+
+int sub_out_init(SubOutput *o, int fd, size_t cap);
+void sub_out_free(SubOutput *o);
+
+/* Agrega prefix + data + '\n' sin formatear. */
+void sub_out_line(SubOutput *o, const char *prefix, size_t prefix_len, const char *data, size_t len);
+
+/* Para las líneas poco frecuentes (avisos, ids de temas). */
+void sub_out_printf(SubOutput *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Escribe lo acumulado; se llama antes de bloquear esperando más datos. */
+void sub_out_flush(SubOutput *o);
+
+#define SUB_OUT_LINE(o, lit, data, len) sub_out_line((o), (lit), sizeof(lit) - 1, (data), (len))
+
+#endif
@@ -4,26 +4,44 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <msquic.h>
-
-#define BUFFER_SIZE 2048
+#include "protocol.h"
+#include "sub_stream.h"
 
 static const QUIC_API_TABLE *MsQuic = NULL;
 static HQUIC Registration = NULL;
 static HQUIC Configuration = NULL;
-
-typedef struct {
-    char buffer[BUFFER_SIZE];
-    size_t length;
-} StreamCtx;
+static int Binary = 0;
+
+/* Frames can be split across receive events (and several can arrive in one):
+   the reader reassembles them and parses in place, and the output goes out
+   with one write per event instead of one printf per message */
+static SubReader Reader;
+static SubOutput Out;
+
+static void print_frame(const Frame *frame, void *arg) {
+    (void)arg;
+    if (frame->kind != FRAME_BINARY)
+        sub_out_line(&Out, "", 0, frame->body.data, frame->body.len);
+    else if (frame->header.opcode == BIN_OP_MESSAGE)
+        sub_out_line(&Out, "", 0, frame->body.data, frame->header.length);
+    else if (frame->header.opcode == BIN_OP_TOPIC_ID)
+        sub_out_printf(&Out, "Subscribed to %.*s (id=%u)\n", (int)frame->header.length, frame->body.data,
+                       frame->header.topic);
+}
 
 static QUIC_STATUS QUIC_API StreamCallback(HQUIC Stream, void *Context, QUIC_STREAM_EVENT *Event) {
     (void)Context;
     switch (Event->Type) {
         case QUIC_STREAM_EVENT_RECEIVE: {
             for (uint32_t i = 0; i < Event->RECEIVE.BufferCount; i++) {
-                fwrite(Event->RECEIVE.Buffers[i].Buffer, 1, Event->RECEIVE.Buffers[i].Length, stdout);
+                const QUIC_BUFFER *b = &Event->RECEIVE.Buffers[i];
+                if (sub_reader_feed(&Reader, (const char *)b->Buffer, b->Length, print_frame, NULL) < 0) {
+                    sub_out_printf(&Out, "Invalid frame from broker\n");
+                    MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_ABORT, 0);
+                    break;
+                }
             }
-            fflush(stdout);
+            sub_out_flush(&Out);
             return QUIC_STATUS_SUCCESS;
         }
         case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
@@ -51,7 +69,8 @@ int main(int argc, char **argv) {
     const char *server;
     uint16_t port;
     const char *topic;
-    if (argc != 4) {
+    Binary = argc == 5 && strcmp(argv[4], "--binary") == 0;
+    if (argc != 4 && argc != 5) {
         fprintf(stderr, "[subscriber_quic] Using defaults: 127.0.0.1 8080 A_vs_B\n");
         server = "127.0.0.1";
         port = 8080;
@@ -62,6 +81,8 @@ int main(int argc, char **argv) {
         topic = argv[3];
     }
 
+    if (sub_reader_init(&Reader, SUB_READER_SIZE) < 0 || sub_out_init(&Out, STDOUT_FILENO, SUB_OUTPUT_SIZE) < 0)
+        return 1;
     if (MsQuicOpen2(&MsQuic) != QUIC_STATUS_SUCCESS) return 1;
     QUIC_REGISTRATION_CONFIG regConfig = { "subscriber-quic", QUIC_EXECUTION_PROFILE_LOW_LATENCY };
     if (MsQuic->RegistrationOpen(&regConfig, &Registration) != QUIC_STATUS_SUCCESS) return 1;
@@ -84,12 +105,22 @@ int main(int argc, char **argv) {
     if (MsQuic->StreamOpen(Connection, QUIC_STREAM_OPEN_FLAG_NONE, StreamCallback, NULL, &Stream) != QUIC_STATUS_SUCCESS) return 1;
     if (MsQuic->StreamStart(Stream, QUIC_STREAM_START_FLAG_IMMEDIATE) != QUIC_STATUS_SUCCESS) return 1;
 
-    char msg[256];
-    int n = snprintf(msg, sizeof(msg), "SUBSCRIBE %s\n", topic);
+    static char msg[256];
+    int n;
+    size_t topic_len = strlen(topic);
+    if (Binary && topic_len <= sizeof(msg) - 2 * PROTO_BIN_HEADER) {
+        proto_write_bin_header(msg, BIN_OP_HELLO, 0, 0, 0);
+        proto_write_bin_header(msg + PROTO_BIN_HEADER, BIN_OP_SUBSCRIBE, 0, (uint32_t)topic_len, 0);
+        memcpy(msg + 2 * PROTO_BIN_HEADER, topic, topic_len);
+        n = (int)(2 * PROTO_BIN_HEADER + topic_len);
+    } else {
+        n = snprintf(msg, sizeof(msg), "SUBSCRIBE %s\n", topic);
+    }
     QUIC_BUFFER buf; buf.Length = (uint32_t)n; buf.Buffer = (uint8_t *)msg;
     MsQuic->StreamSend(Stream, &buf, 1, QUIC_SEND_FLAG_ALLOW_0_RTT, NULL);
 
     printf("Waiting for messages...\n");
+    fflush(stdout);
     getchar();
 
     MsQuic->StreamShutdown(Stream, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL, 0);
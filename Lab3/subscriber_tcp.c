@@ -1,8 +1,17 @@
 /*
  * subscriber_tcp.c
  * Suscriptor TCP para el modelo publicación-suscripción
- * Compilar: gcc subscriber_tcp.c -o subscriber_tcp
- * Ejecutar: ./subscriber_tcp 127.0.0.1 8080
+ * Compilar: gcc subscriber_tcp.c protocol.c sub_stream.c lz_codec.c -o subscriber_tcp
+ * Ejecutar: ./subscriber_tcp 127.0.0.1 8080 [--binary] [--from OFFSET] [--lz4]
+ *
+ * Con --binary negocia el protocolo binario y recibe frames con cabecera fija.
+ * Con --lz4 (implica --binary) pide los mensajes comprimidos (broker con
+ * --compress): guarda el diccionario de cada tema y descomprime al recibir.
+ * Con --from pide un REPLAY (broker con --store): primero llega lo guardado
+ * desde ese offset y después lo nuevo.
+ *
+ * La recepción usa sub_stream.h: cada recv llena un buffer grande que se
+ * parsea en el lugar, y las líneas salen por lotes con un write por recv.
  */
 
 #include <stdio.h>
@@ -10,21 +19,114 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "protocol.h"
+#include "sub_stream.h"
+#include "lz_codec.h"
 
-#define BUFFER_SIZE 1024
+/* Diccionario de compresión de un tema, tal como llegó en BIN_OP_DICT */
+typedef struct {
+    uint32_t topic;
+    uint32_t len;
+    char *data;
+} TopicDict;
+
+typedef struct {
+    SubOutput out;
+    TopicDict *dicts;
+    size_t num_dicts;
+    int started;                /* ya llegó algún frame: un BUSY solo puede ser el primero */
+    char raw[PROTO_MAX_FRAME];  /* mensaje descomprimido */
+} Receiver;
+
+static TopicDict *find_dict(Receiver *rx, uint32_t topic) {
+    for (size_t i = 0; i < rx->num_dicts; i++)
+        if (rx->dicts[i].topic == topic) return &rx->dicts[i];
+    return NULL;
+}
+
+static void store_dict(Receiver *rx, uint32_t topic, const char *data, uint32_t len) {
+    TopicDict *d = find_dict(rx, topic);
+    if (d == NULL) {
+        TopicDict *grown = realloc(rx->dicts, (rx->num_dicts + 1) * sizeof(TopicDict));
+        if (grown == NULL) return;
+        rx->dicts = grown;
+        d = &rx->dicts[rx->num_dicts++];
+        d->topic = topic;
+        d->data = NULL;
+    }
+    char *copy = malloc(len ? len : 1);
+    if (copy == NULL) return;
+    memcpy(copy, data, len);
+    free(d->data);
+    d->data = copy;
+    d->len = len;
+}
+
+/* Payload de un MESSAGE con BIN_FLAG_LZ4: largo original + bloque */
+static int unpack(Receiver *rx, const Frame *frame) {
+    const TopicDict *d = find_dict(rx, frame->header.topic);
+    if (d == NULL || frame->header.length < PROTO_LZ4_LEN) return -1;
+    uint32_t raw;
+    memcpy(&raw, frame->body.data, PROTO_LZ4_LEN);
+    raw = ntohl(raw);
+    if (raw > sizeof(rx->raw)) return -1;
+    int n = lz_decompress(d->data, d->len, frame->body.data + PROTO_LZ4_LEN,
+                          frame->header.length - PROTO_LZ4_LEN, rx->raw, raw);
+    return n == (int)raw ? n : -1;
+}
+
+static void print_frame(const Frame *frame, void *arg) {
+    Receiver *rx = arg;
+    SubOutput *out = &rx->out;
+    int first = !rx->started;
+    rx->started = 1;
+    if (first && frame->kind == FRAME_TEXT && frame->body.len > sizeof(PROTO_BUSY) &&
+        memcmp(frame->body.data, PROTO_BUSY " ", sizeof(PROTO_BUSY)) == 0) {
+        sub_out_printf(out, "Broker ocupado (%.*s), reintentar más tarde.\n",
+                       (int)(frame->body.len - sizeof(PROTO_BUSY)), frame->body.data + sizeof(PROTO_BUSY));
+    } else if (frame->kind != FRAME_BINARY) {
+        SUB_OUT_LINE(out, "Mensaje recibido: ", frame->body.data, frame->body.len);
+    } else if (frame->header.opcode == BIN_OP_MESSAGE && (frame->header.flags & BIN_FLAG_OFFSET)) {
+        sub_out_printf(out, "Mensaje recibido [%u]: ", frame->header.topic);
+        sub_out_line(out, "", 0, frame->body.data, frame->header.length);
+    } else if (frame->header.opcode == BIN_OP_MESSAGE && (frame->header.flags & BIN_FLAG_LZ4)) {
+        int n = unpack(rx, frame);
+        if (n < 0) sub_out_printf(out, "Mensaje comprimido inválido (tema id=%u)\n", frame->header.topic);
+        else SUB_OUT_LINE(out, "Mensaje recibido: ", rx->raw, (size_t)n);
+    } else if (frame->header.opcode == BIN_OP_MESSAGE) {
+        SUB_OUT_LINE(out, "Mensaje recibido: ", frame->body.data, frame->header.length);
+    } else if (frame->header.opcode == BIN_OP_DICT) {
+        store_dict(rx, frame->header.topic, frame->body.data, frame->header.length);
+    } else if (frame->header.opcode == BIN_OP_REPLAY && frame->header.length == 16) {
+        unsigned long long range[2] = { 0, 0 };
+        for (int i = 0; i < 16; i++)
+            range[i / 8] = (range[i / 8] << 8) | (unsigned char)frame->body.data[i];
+        sub_out_printf(out, "Reenviando del log: offsets %llu a %llu\n", range[0], range[1]);
+    } else if (frame->header.opcode == BIN_OP_TOPIC_ID) {
+        sub_out_printf(out, "Suscrito a %.*s (id=%u%s)\n", (int)frame->header.length, frame->body.data,
+                       frame->header.topic, (frame->header.flags & BIN_FLAG_LZ4) ? ", comprimido" : "");
+    }
+}
 
 int main(int argc, char *argv[]) {
     sleep(1);
-    if (argc != 3) {
-        printf("Uso: %s <IP_BROKER> <PUERTO>\n", argv[0]);
+    if (argc < 3) {
+        printf("Uso: %s <IP_BROKER> <PUERTO> [--binary] [--from OFFSET] [--lz4]\n", argv[0]);
         exit(1);
     }
 
     char *ip = argv[1];
     int port = atoi(argv[2]);
+    int binary = 0, lz4 = 0;
+    long long from = -1;
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) binary = 1;
+        else if (strcmp(argv[i], "--lz4") == 0) binary = lz4 = 1;
+        else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) from = atoll(argv[++i]);
+    }
     int sock;
     struct sockaddr_in broker_addr;
-    char topic[100], buffer[BUFFER_SIZE];
+    char topic[100];
 
     // Crear socket TCP
     sock = socket(AF_INET, SOCK_STREAM, 0);
@@ -50,21 +152,58 @@ int main(int argc, char *argv[]) {
     topic[strcspn(topic, "\n")] = '\0';
 
     // Enviar tema al broker
-    char msg[120];
-    snprintf(msg, sizeof(msg), "SUBSCRIBE %s", topic);
-    send(sock, msg, strlen(msg), 0);
+    char msg[PROTO_BIN_HEADER * 2 + sizeof(topic) + 32];
+    if (binary) {
+        // HELLO + SUBSCRIBE (o REPLAY con el offset en el payload) en un solo send
+        size_t len = strlen(topic);
+        uint32_t extra = from >= 0 ? 8 : 0;
+        proto_write_bin_header(msg, BIN_OP_HELLO, 0, 0, 0);
+        proto_write_bin_header(msg + PROTO_BIN_HEADER, from >= 0 ? BIN_OP_REPLAY : BIN_OP_SUBSCRIBE,
+                               lz4 ? BIN_FLAG_LZ4 : 0, (uint32_t)len, extra);
+        memcpy(msg + 2 * PROTO_BIN_HEADER, topic, len);
+        for (uint32_t i = 0; i < extra; i++)
+            msg[2 * PROTO_BIN_HEADER + len + i] = (char)((unsigned long long)from >> (56 - 8 * i));
+        send(sock, msg, 2 * PROTO_BIN_HEADER + len + extra, 0);
+    } else if (from >= 0) {
+        snprintf(msg, sizeof(msg), "REPLAY %s %lld\n", topic, from);
+        send(sock, msg, strlen(msg), 0);
+    } else {
+        snprintf(msg, sizeof(msg), "SUBSCRIBE %s\n", topic);
+        send(sock, msg, strlen(msg), 0);
+    }
 
     printf("Esperando mensajes...\n");
+    fflush(stdout);
+
+    // Desde acá todo sale por rx.out, sin pasar por stdio
+    SubReader reader;
+    static Receiver rx;
+    SubOutput *out = &rx.out;
+    if (sub_reader_init(&reader, SUB_READER_SIZE) < 0 || sub_out_init(out, STDOUT_FILENO, SUB_OUTPUT_SIZE) < 0) {
+        perror("malloc");
+        close(sock);
+        exit(1);
+    }
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
+        // Un recv puede traer varios mensajes o uno cortado: el reader los separa
+        size_t room;
+        char *space = sub_reader_space(&reader, &room);
+        ssize_t bytes = recv(sock, space, room, 0);
         if (bytes <= 0) {
-            printf("Conexión cerrada por el broker.\n");
+            sub_out_printf(out, "Conexión cerrada por el broker.\n");
+            break;
+        }
+        if (sub_reader_commit(&reader, (size_t)bytes, print_frame, &rx) < 0) {
+            sub_out_printf(out, "Frame inválido del broker.\n");
             break;
         }
-        printf("Mensaje recibido: %s\n", buffer);
+        sub_out_flush(out);
     }
 
+    sub_out_free(out);
+    for (size_t i = 0; i < rx.num_dicts; i++) free(rx.dicts[i].data);
+    free(rx.dicts);
+    sub_reader_free(&reader);
     close(sock);
     return 0;
 }
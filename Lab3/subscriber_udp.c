@@ -1,29 +1,331 @@
 /*
  * subscriber_udp.c
  * Suscriptor UDP para el modelo publicación-suscripción
- * Compilar: gcc subscriber_udp.c -o subscriber_udp
- * Ejecutar: ./subscriber_udp 127.0.0.1 8080
+ * Compilar: gcc subscriber_udp.c protocol.c sub_stream.c -o subscriber_udp
+ * Ejecutar: ./subscriber_udp 127.0.0.1 8081 [--binary | --reliable | --mcast]
+ *
+ * Con --binary se suscribe con un frame binario y el broker le entrega los
+ * mensajes con la cabecera fija de protocol.h.
+ * Con --reliable (broker con --rtx) pide entregas numeradas: detecta los
+ * huecos de cada tema, los pide con un NACK y los reintenta cada
+ * NACK_INTERVAL_MS hasta que llegan o el broker avisa que ya no los tiene.
+ * Con --mcast (broker con --mcast) se une al grupo multicast que el broker
+ * le indica para cada tema y recibe de ahí, con un segundo socket en el
+ * puerto del grupo; si el broker no tiene multicast, sigue por unicast.
+ *
+ * Cada vez que despierta trae hasta RECV_BATCH datagramas con un recvmmsg
+ * sobre buffers que se reusan, y las líneas salen por lotes (sub_stream.h).
+ *
+ * Manda un HEARTBEAT cada HEARTBEAT_S segundos para que el broker no lo dé
+ * de baja, y un UNSUBSCRIBE al salir con Ctrl+C.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
+#include <signal.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "protocol.h"
+#include "sub_stream.h"
 
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE PROTO_MAX_FRAME
+#define RECV_BATCH 16          /* datagramas por recvmmsg */
+#define MAX_TRACKED 64         /* temas numerados o multicast que se siguen (un patrón puede traer varios) */
+#define WINDOW 4096            /* huecos que se recuerdan por tema */
+#define NACK_MAX 256
+#define NACK_RUNS 16           /* tramos de huecos por ronda de NACKs */
+#define NACK_INTERVAL_MS 100
+#define NACK_RETRIES 10
+#define HEARTBEAT_S 5
+
+/* Secuencias de un tema: [low, next) es la ventana con huecos pendientes */
+typedef struct {
+    uint32_t topic;
+    uint32_t next;             /* próxima secuencia esperada */
+    uint32_t low;              /* hueco más viejo; == next si no falta nada */
+    uint32_t retries;          /* NACKs mandados sin que low avance */
+    uint64_t last_nack_ms;
+    uint64_t recovered;
+    uint64_t lost;
+    uint8_t missing[WINDOW / 8];
+} Track;
+
+static Track tracks[MAX_TRACKED];
+static int num_tracks;
+
+/* --mcast: temas que llegan por un grupo y grupos a los que ya nos unimos.
+   Otros temas pueden compartir grupo, así que se filtra por id */
+static int mcast_sock = -1;
+static uint16_t mcast_port;
+static struct in_addr mcast_iface;
+static uint32_t mcast_topics[MAX_TRACKED];
+static int num_mcast_topics;
+static struct in_addr joined[MAX_TRACKED];
+static int num_joined;
+static volatile sig_atomic_t stop;
+static SubOutput out;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static uint32_t read_u32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static int is_missing(const Track *t, uint32_t seq) {
+    return (t->missing[(seq % WINDOW) / 8] >> (seq % 8)) & 1;
+}
+
+static void set_missing(Track *t, uint32_t seq, int on) {
+    if (on) t->missing[(seq % WINDOW) / 8] |= (uint8_t)(1u << (seq % 8));
+    else t->missing[(seq % WINDOW) / 8] &= (uint8_t)~(1u << (seq % 8));
+}
+
+/* low sube hasta el próximo hueco que siga pendiente */
+static void advance_low(Track *t) {
+    uint32_t before = t->low;
+    while (t->low != t->next && !is_missing(t, t->low)) t->low++;
+    if (t->low != before) t->retries = 0;
+}
+
+static void nack_range(int sock, const struct sockaddr_in *broker, uint32_t topic, uint32_t first, uint32_t count) {
+    char msg[PROTO_BIN_HEADER + 8];
+    uint32_t f = htonl(first), n = htonl(count);
+    proto_write_bin_header(msg, BIN_OP_NACK, BIN_FLAG_TOPIC_ID, topic, 8);
+    memcpy(msg + PROTO_BIN_HEADER, &f, 4);
+    memcpy(msg + PROTO_BIN_HEADER + 4, &n, 4);
+    sendto(sock, msg, sizeof(msg), 0, (const struct sockaddr *)broker, sizeof(*broker));
+}
+
+/* Reintento: un NACK por cada tramo de huecos seguidos en [low, next), hasta NACK_RUNS */
+static void send_nacks(int sock, const struct sockaddr_in *broker, Track *t) {
+    uint32_t seq = t->low;
+    for (int runs = 0; runs < NACK_RUNS && seq != t->next; runs++) {
+        uint32_t count = 0;
+        while (seq + count != t->next && count < NACK_MAX && is_missing(t, seq + count)) count++;
+        nack_range(sock, broker, t->topic, seq, count);
+        seq += count;
+        while (seq != t->next && !is_missing(t, seq)) seq++;
+    }
+    t->last_nack_ms = now_ms();
+    t->retries++;
+}
+
+static Track *track_for(uint32_t topic) {
+    for (int i = 0; i < num_tracks; i++)
+        if (tracks[i].topic == topic) return &tracks[i];
+    return NULL;
+}
+
+/* Mensaje numerado. Retorna 1 si hay que mostrarlo (nuevo o recuperado), 0 si es repetido */
+static int on_sequenced(int sock, const struct sockaddr_in *broker, uint32_t topic, uint32_t seq, int *recovered) {
+    Track *t = track_for(topic);
+    *recovered = 0;
+    if (t == NULL) {
+        if (num_tracks == MAX_TRACKED) return 1;
+        t = &tracks[num_tracks++];
+        memset(t, 0, sizeof(*t));
+        t->topic = topic;
+        t->next = t->low = seq + 1;
+        return 1;
+    }
+    int32_t ahead = (int32_t)(seq - t->next);
+    if (ahead >= 0) {
+        if ((uint32_t)ahead + (t->next - t->low) >= WINDOW) {
+            /* Un hueco más grande que la ventana no se puede seguir */
+            sub_out_printf(&out, "Perdidos %u mensajes del tema id=%u\n", (unsigned)(seq - t->low), topic);
+            t->lost += seq - t->low;
+            memset(t->missing, 0, sizeof(t->missing));
+            t->low = seq + 1;
+        } else {
+            for (uint32_t s = t->next; s != seq; s++) set_missing(t, s, 1);
+        }
+        /* Hueco nuevo: se pide enseguida; los viejos quedan para retry_nacks */
+        uint32_t first = t->next;
+        t->next = seq + 1;
+        advance_low(t);
+        if (first != seq && (int32_t)(first - t->low) >= 0) {
+            nack_range(sock, broker, topic, first, seq - first < NACK_MAX ? seq - first : NACK_MAX);
+            if (t->low == first) t->last_nack_ms = now_ms();
+        }
+        return 1;
+    }
+    if ((int32_t)(seq - t->low) < 0 || !is_missing(t, seq)) return 0;
+    set_missing(t, seq, 0);
+    t->recovered++;
+    *recovered = 1;
+    advance_low(t);
+    return 1;
+}
+
+/* El broker avisa que [first, first+count) ya no está: se dan por perdidos */
+static void on_broker_nack(uint32_t topic, uint32_t first, uint32_t count) {
+    Track *t = track_for(topic);
+    if (t == NULL) return;
+    uint32_t lost = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t seq = first + i;
+        if ((int32_t)(seq - t->low) >= 0 && (int32_t)(seq - t->next) < 0 && is_missing(t, seq)) {
+            set_missing(t, seq, 0);
+            lost++;
+        }
+    }
+    t->lost += lost;
+    advance_low(t);
+    if (lost > 0) sub_out_printf(&out, "Perdidos %u mensajes del tema id=%u (ya no estaban en el broker)\n", lost, topic);
+}
+
+/* Reintenta los huecos que siguen abiertos; pasados NACK_RETRIES se abandonan */
+static void retry_nacks(int sock, const struct sockaddr_in *broker) {
+    uint64_t now = now_ms();
+    for (int i = 0; i < num_tracks; i++) {
+        Track *t = &tracks[i];
+        if (t->low == t->next || now - t->last_nack_ms < NACK_INTERVAL_MS) continue;
+        if (t->retries >= NACK_RETRIES) {
+            sub_out_printf(&out, "Perdido el mensaje %u del tema id=%u\n", t->low, t->topic);
+            set_missing(t, t->low, 0);
+            t->lost++;
+            advance_low(t);
+            if (t->low == t->next) continue;
+        }
+        send_nacks(sock, broker, t);
+    }
+}
+
+/* Dirección local con la que se llega al broker: por esa interfaz nos unimos a los grupos */
+static struct in_addr local_ip_towards(const struct sockaddr_in *broker) {
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    struct in_addr any = { htonl(INADDR_ANY) };
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0) return any;
+    if (connect(s, (const struct sockaddr *)broker, sizeof(*broker)) < 0 ||
+        getsockname(s, (struct sockaddr *)&local, &len) < 0) {
+        close(s);
+        return any;
+    }
+    close(s);
+    return local.sin_addr;
+}
+
+static int is_mcast_topic(uint32_t topic) {
+    for (int i = 0; i < num_mcast_topics; i++)
+        if (mcast_topics[i] == topic) return 1;
+    return 0;
+}
+
+/* BIN_OP_MCAST: el tema llega por este grupo. El socket del grupo se abre
+   con el primero; todos los grupos del broker usan el mismo puerto */
+static void join_group(uint32_t topic, const char *payload) {
+    struct in_addr group;
+    uint16_t port;
+    memcpy(&group.s_addr, payload, 4);
+    memcpy(&port, payload + 4, 2);
+    if (mcast_sock < 0) {
+        mcast_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mcast_sock < 0) {
+            perror("Error al crear socket multicast");
+            return;
+        }
+        // Varios subscribers en la misma máquina comparten el puerto del grupo
+        int opt = 1, all = 0;
+        setsockopt(mcast_sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(mcast_sock, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all));
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = INADDR_ANY;
+        addr.sin_port = port;
+        if (bind(mcast_sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            perror("Error en bind multicast");
+            close(mcast_sock);
+            mcast_sock = -1;
+            return;
+        }
+        mcast_port = port;
+    }
+    if (port != mcast_port) return;
+
+    int known = 0;
+    for (int i = 0; i < num_joined && !known; i++) known = joined[i].s_addr == group.s_addr;
+    if (!known && num_joined < MAX_TRACKED) {
+        struct ip_mreq mreq = { group, mcast_iface };
+        if (setsockopt(mcast_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            perror("IP_ADD_MEMBERSHIP");
+            return;
+        }
+        joined[num_joined++] = group;
+    }
+    if (!is_mcast_topic(topic) && num_mcast_topics < MAX_TRACKED) mcast_topics[num_mcast_topics++] = topic;
+    sub_out_printf(&out, "Tema id=%u por multicast %s:%u\n", topic, inet_ntoa(group), ntohs(port));
+}
+
+/* Un datagrama del broker (from_group = 0) o de un grupo multicast */
+static void on_datagram(int sock, const struct sockaddr_in *broker, const char *buffer, int bytes, int from_group) {
+    Frame frame;
+    if (proto_datagram_frame(buffer, (size_t)bytes, &frame) < 0)
+        return;
+    if (from_group) {
+        // Solo mensajes de nuestros temas: el grupo puede traer otros
+        if (frame.kind == FRAME_BINARY && frame.header.opcode == BIN_OP_MESSAGE &&
+            is_mcast_topic(frame.header.topic))
+            SUB_OUT_LINE(&out, "Mensaje recibido: ", frame.body.data, frame.header.length);
+        return;
+    }
+    if (frame.kind != FRAME_BINARY)
+        SUB_OUT_LINE(&out, "Mensaje recibido: ", frame.body.data, frame.body.len);
+    else if (frame.header.opcode == BIN_OP_MESSAGE && (frame.header.flags & BIN_FLAG_SEQ) &&
+             frame.header.length >= PROTO_SEQ_LEN) {
+        uint32_t seq = read_u32(frame.body.data);
+        int recovered;
+        if (on_sequenced(sock, broker, frame.header.topic, seq, &recovered)) {
+            sub_out_printf(&out, "Mensaje %s [%u]: ", recovered ? "recuperado" : "recibido", seq);
+            sub_out_line(&out, "", 0, frame.body.data + PROTO_SEQ_LEN, frame.header.length - PROTO_SEQ_LEN);
+        }
+    } else if (frame.header.opcode == BIN_OP_NACK && frame.header.length == 8)
+        on_broker_nack(frame.header.topic, read_u32(frame.body.data), read_u32(frame.body.data + 4));
+    else if (frame.header.opcode == BIN_OP_MESSAGE)
+        SUB_OUT_LINE(&out, "Mensaje recibido: ", frame.body.data, frame.header.length);
+    else if (frame.header.opcode == BIN_OP_TOPIC_ID)
+        sub_out_printf(&out, "Suscrito a %.*s (id=%u)\n", (int)frame.header.length, frame.body.data,
+                       frame.header.topic);
+    else if (frame.header.opcode == BIN_OP_MCAST && frame.header.length == PROTO_MCAST_LEN)
+        join_group(frame.header.topic, frame.body.data);
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        printf("Uso: %s <IP_BROKER> <PUERTO>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+        printf("Uso: %s <IP_BROKER> <PUERTO> [--binary | --reliable | --mcast]\n", argv[0]);
         exit(1);
     }
 
     char *ip = argv[1];
     int port = atoi(argv[2]);
+    int reliable = argc == 4 && strcmp(argv[3], "--reliable") == 0;
+    int mcast = argc == 4 && strcmp(argv[3], "--mcast") == 0;
+    int binary = reliable || mcast || (argc == 4 && strcmp(argv[3], "--binary") == 0);
     int sock;
     struct sockaddr_in broker_addr, local_addr;
-    char topic[100], buffer[BUFFER_SIZE];
+    char topic[100];
+    static char buffers[RECV_BATCH][BUFFER_SIZE];
+    struct mmsghdr msgs[RECV_BATCH];
+    struct iovec iov[RECV_BATCH];
     socklen_t addr_len = sizeof(broker_addr);
 
     // Crear socket UDP
@@ -50,26 +352,94 @@ int main(int argc, char *argv[]) {
     broker_addr.sin_family = AF_INET;
     broker_addr.sin_port = htons(port);
     broker_addr.sin_addr.s_addr = inet_addr(ip);
+    if (mcast) mcast_iface = local_ip_towards(&broker_addr);
 
     printf("Ingrese el partido o tema al que desea suscribirse: ");
     fgets(topic, sizeof(topic), stdin);
     topic[strcspn(topic, "\n")] = '\0';
 
     // Enviar suscripción al broker
-    char subscribe_msg[120];
-    sprintf(subscribe_msg, "SUBSCRIBE %s", topic);
-    sendto(sock, subscribe_msg, strlen(subscribe_msg), 0,
+    char subscribe_msg[PROTO_BIN_HEADER + sizeof(topic)];
+    size_t msg_len;
+    if (binary) {
+        size_t len = strlen(topic);
+        proto_write_bin_header(subscribe_msg, BIN_OP_SUBSCRIBE,
+                               reliable ? BIN_FLAG_SEQ : mcast ? BIN_FLAG_MCAST : 0, (uint32_t)len, 0);
+        memcpy(subscribe_msg + PROTO_BIN_HEADER, topic, len);
+        msg_len = PROTO_BIN_HEADER + len;
+    } else {
+        msg_len = (size_t)sprintf(subscribe_msg, "SUBSCRIBE %s", topic);
+    }
+    sendto(sock, subscribe_msg, msg_len, 0,
         (struct sockaddr *)&broker_addr, addr_len);
     printf("Suscripción enviada al broker UDP %s:%d\n", ip, port);
 
+    // poll vuelve cada tanto para los HEARTBEAT (y con --reliable, para reintentar los NACK)
+    int timeout_ms = reliable ? NACK_INTERVAL_MS / 2 : 1000;
+
+    // Ctrl+C corta el poll y se sale con UNSUBSCRIBE
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    char control[PROTO_BIN_HEADER + sizeof(topic)];
+    uint64_t next_heartbeat = now_ms() + HEARTBEAT_S * 1000;
     printf("Esperando mensajes...\n");
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes = recvfrom(sock, buffer, BUFFER_SIZE - 1, 0, NULL, NULL);
-        if (bytes > 0)
-            printf("Mensaje recibido: %s\n", buffer);
+    fflush(stdout);
+    if (sub_out_init(&out, STDOUT_FILENO, SUB_OUTPUT_SIZE) < 0) {
+        perror("malloc");
+        exit(1);
+    }
+    // Los buffers se reusan tal cual: recvmmsg solo pisa lo que recibe
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < RECV_BATCH; i++) {
+        iov[i] = (struct iovec){ buffers[i], BUFFER_SIZE };
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (!stop) {
+        sub_out_flush(&out);
+        struct pollfd pfds[2] = { { sock, POLLIN, 0 }, { mcast_sock, POLLIN, 0 } };
+        int ready = poll(pfds, mcast_sock >= 0 ? 2 : 1, timeout_ms);
+        if (reliable) retry_nacks(sock, &broker_addr);
+        if (now_ms() >= next_heartbeat) {
+            if (binary) {
+                proto_write_bin_header(control, BIN_OP_HEARTBEAT, 0, 0, 0);
+                msg_len = PROTO_BIN_HEADER;
+            } else {
+                msg_len = (size_t)sprintf(control, "HEARTBEAT");
+            }
+            sendto(sock, control, msg_len, 0, (struct sockaddr *)&broker_addr, addr_len);
+            next_heartbeat += HEARTBEAT_S * 1000;
+        }
+        if (ready <= 0)
+            continue;
+
+        for (int i = 0; i < 2; i++) {
+            if (!(pfds[i].revents & POLLIN) || pfds[i].fd < 0)
+                continue;
+            int n = recvmmsg(pfds[i].fd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+            for (int j = 0; j < n; j++)
+                on_datagram(sock, &broker_addr, buffers[j], (int)msgs[j].msg_len, i == 1);
+        }
+    }
+
+    // Nos vamos: el broker deja de mandarnos sin esperar al vencimiento
+    if (binary) {
+        size_t len = strlen(topic);
+        proto_write_bin_header(control, BIN_OP_UNSUBSCRIBE, 0, (uint32_t)len, 0);
+        memcpy(control + PROTO_BIN_HEADER, topic, len);
+        msg_len = PROTO_BIN_HEADER + len;
+    } else {
+        msg_len = (size_t)sprintf(control, "UNSUBSCRIBE %s", topic);
     }
+    sendto(sock, control, msg_len, 0, (struct sockaddr *)&broker_addr, addr_len);
+    sub_out_free(&out);
+    printf("\nDesuscrito de %s\n", topic);
 
     close(sock);
+    if (mcast_sock >= 0) close(mcast_sock);
     return 0;
 }
@@ -0,0 +1,335 @@
+/*
+ * topic_log.c
+ *
+ * Implementación del log persistente por tema (ver topic_log.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "topic_log.h"
+
+#define TLOG_PATH_MAX 4096
+
+typedef struct Segment {
+    int fd;
+    char *map;
+    uint64_t base;         /* offset del primer registro */
+    uint32_t synced;       /* bytes ya sincronizados (solo el hilo de sync) */
+    struct Segment *next;
+} Segment;
+
+struct TopicLog {
+    char *dir;
+    pthread_mutex_t lock;          /* con el hilo de sync: active y closing */
+    Segment *active;
+    Segment *closing;              /* segmentos llenos esperando su último msync */
+    uint64_t next;                 /* próximo offset (solo el escritor) */
+    _Atomic uint32_t written;      /* bytes escritos del segmento activo */
+    _Atomic uint64_t appended;     /* offsets ya escritos en algún mapeo */
+    _Atomic uint64_t durable;
+    TopicLog *next_log;
+};
+
+static struct {
+    char *dir;
+    int sync_ms;
+    pthread_mutex_t lock;          /* lista de logs abiertos */
+    TopicLog *logs;
+} tlogs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* --- Registros y nombres --- */
+
+/* Largo del registro que empieza en pos, o 0 si ahí no hay uno completo */
+static uint32_t record_len(const char *map, size_t size, size_t pos) {
+    if (pos + PROTO_BIN_HEADER > size || (unsigned char)map[pos] != PROTO_BIN_MAGIC) return 0;
+    BinHeader h;
+    proto_read_bin_header(map + pos, &h);
+    if (h.opcode != BIN_OP_MESSAGE || pos + PROTO_BIN_HEADER + h.length > size) return 0;
+    return PROTO_BIN_HEADER + h.length;
+}
+
+/* Avanza desde pos hasta count registros; retorna cuántos saltó */
+static uint64_t skip_records(const char *map, size_t size, uint32_t *pos, uint64_t count) {
+    uint64_t n = 0;
+    uint32_t len;
+    while (n < count && (len = record_len(map, size, *pos)) > 0) {
+        *pos += len;
+        n++;
+    }
+    return n;
+}
+
+/* La carpeta de cada tema es su nombre en hexadecimal: los '/' de los
+   temas jerárquicos y cualquier otro byte quedan fuera del camino */
+static char *topic_dir(const char *name, size_t len) {
+    if (tlogs.dir == NULL || 2 * len > 255) return NULL;
+    size_t base = strlen(tlogs.dir);
+    if (base + 2 * len + 2 > TLOG_PATH_MAX) return NULL;
+    char *dir = malloc(base + 2 * len + 2);
+    if (dir == NULL) return NULL;
+    memcpy(dir, tlogs.dir, base);
+    dir[base] = '/';
+    for (size_t i = 0; i < len; i++)
+        sprintf(dir + base + 1 + 2 * i, "%02x", (unsigned char)name[i]);
+    dir[base + 1 + 2 * len] = '\0';
+    return dir;
+}
+
+static void segment_path(char *out, const char *dir, uint64_t base) {
+    snprintf(out, TLOG_PATH_MAX, "%s/%020llu.seg", dir, (unsigned long long)base);
+}
+
+/* Mayor base de segmento que sea <= offset; -1 si no hay ninguno */
+static int64_t find_segment(const char *dir, uint64_t offset) {
+    DIR *d = opendir(dir);
+    if (d == NULL) return -1;
+    int64_t best = -1;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned long long base;
+        char tail;
+        if (sscanf(e->d_name, "%20llu.se%c", &base, &tail) == 2 && tail == 'g' &&
+            base <= offset && (int64_t)base > best)
+            best = (int64_t)base;
+    }
+    closedir(d);
+    return best;
+}
+
+/* --- Escritura --- */
+
+static Segment *segment_open(const char *dir, uint64_t base) {
+    char path[TLOG_PATH_MAX];
+    segment_path(path, dir, base);
+    Segment *s = calloc(1, sizeof(Segment));
+    if (s == NULL) return NULL;
+    s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (s->fd < 0) {
+        free(s);
+        return NULL;
+    }
+    /* Archivo disperso: los bloques se reservan recién al escribirlos */
+    if (ftruncate(s->fd, TLOG_SEGMENT_SIZE) < 0 ||
+        (s->map = mmap(NULL, TLOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0)) == MAP_FAILED) {
+        close(s->fd);
+        free(s);
+        return NULL;
+    }
+    s->base = base;
+    return s;
+}
+
+static void segment_close(Segment *s) {
+    munmap(s->map, TLOG_SEGMENT_SIZE);
+    close(s->fd);
+    free(s);
+}
+
+TopicLog *tlog_open(const char *name, size_t len) {
+    char *dir = topic_dir(name, len);
+    if (dir == NULL) return NULL;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        free(dir);
+        return NULL;
+    }
+
+    /* Después de un reinicio se sigue escribiendo en el último segmento */
+    int64_t base = find_segment(dir, UINT64_MAX);
+    Segment *s = segment_open(dir, base < 0 ? 0 : (uint64_t)base);
+    TopicLog *log = s ? calloc(1, sizeof(TopicLog)) : NULL;
+    if (log == NULL) {
+        if (s != NULL) segment_close(s);
+        free(dir);
+        return NULL;
+    }
+    uint32_t pos = 0;
+    uint64_t count = skip_records(s->map, TLOG_SEGMENT_SIZE, &pos, UINT64_MAX);
+    s->synced = pos;
+    log->dir = dir;
+    pthread_mutex_init(&log->lock, NULL);
+    log->active = s;
+    log->next = s->base + count;
+    atomic_init(&log->written, pos);
+    atomic_init(&log->appended, log->next);
+    atomic_init(&log->durable, log->next);
+
+    pthread_mutex_lock(&tlogs.lock);
+    log->next_log = tlogs.logs;
+    tlogs.logs = log;
+    pthread_mutex_unlock(&tlogs.lock);
+    return log;
+}
+
+int64_t tlog_append(TopicLog *log, const char *payload, uint32_t len) {
+    uint32_t need = PROTO_BIN_HEADER + len;
+    uint32_t pos = atomic_load_explicit(&log->written, memory_order_relaxed);
+    if (need > TLOG_SEGMENT_SIZE) return -1;
+
+    if (pos + need > TLOG_SEGMENT_SIZE) {
+        /* Segmento lleno: el hilo de sync le hace el último msync y lo cierra */
+        Segment *s = segment_open(log->dir, log->next);
+        if (s == NULL) return -1;
+        pthread_mutex_lock(&log->lock);
+        log->active->next = log->closing;
+        log->closing = log->active;
+        log->active = s;
+        atomic_store_explicit(&log->written, 0, memory_order_relaxed);
+        pthread_mutex_unlock(&log->lock);
+        pos = 0;
+    }
+
+    char *rec = log->active->map + pos;
+    proto_write_bin_header(rec, BIN_OP_MESSAGE, BIN_FLAG_OFFSET, (uint32_t)log->next, len);
+    if (len > 0) memcpy(rec + PROTO_BIN_HEADER, payload, len);
+    atomic_store_explicit(&log->written, pos + need, memory_order_release);
+    atomic_store_explicit(&log->appended, log->next + 1, memory_order_release);
+    return (int64_t)log->next++;
+}
+
+uint64_t tlog_end(const TopicLog *log) {
+    return log->next;
+}
+
+uint64_t tlog_durable(const TopicLog *log) {
+    return atomic_load_explicit(&log->durable, memory_order_acquire);
+}
+
+/* --- Group commit --- */
+
+/* msync de [from, to) con from alineado a página */
+static void sync_range(Segment *s, uint32_t to) {
+    if (to <= s->synced) return;
+    uint32_t page = (uint32_t)sysconf(_SC_PAGESIZE);
+    uint32_t from = s->synced & ~(page - 1);
+    if (msync(s->map + from, to - from, MS_SYNC) == 0) s->synced = to;
+}
+
+static void sync_log(TopicLog *log) {
+    pthread_mutex_lock(&log->lock);
+    Segment *closing = log->closing;
+    log->closing = NULL;
+    Segment *active = log->active;
+    /* appended antes que written: todo lo contado en appended ya está en
+       closing o antes de written */
+    uint64_t appended = atomic_load_explicit(&log->appended, memory_order_acquire);
+    uint32_t written = atomic_load_explicit(&log->written, memory_order_acquire);
+    pthread_mutex_unlock(&log->lock);
+
+    while (closing != NULL) {
+        Segment *s = closing;
+        closing = s->next;
+        msync(s->map, TLOG_SEGMENT_SIZE, MS_SYNC);
+        segment_close(s);
+    }
+    /* El activo solo lo cierra este hilo, así que sigue mapeado aunque el
+       escritor ya haya pasado a otro */
+    sync_range(active, written);
+    atomic_store_explicit(&log->durable, appended, memory_order_release);
+}
+
+static void *sync_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        struct timespec ts = { tlogs.sync_ms / 1000, (long)(tlogs.sync_ms % 1000) * 1000000L };
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&tlogs.lock);
+        TopicLog *logs = tlogs.logs;
+        pthread_mutex_unlock(&tlogs.lock);
+        /* Los logs no se cierran nunca y se agregan al principio: la lista
+           desde logs en adelante no cambia */
+        for (TopicLog *log = logs; log != NULL; log = log->next_log) {
+            if (atomic_load_explicit(&log->durable, memory_order_relaxed) !=
+                atomic_load_explicit(&log->appended, memory_order_relaxed))
+                sync_log(log);
+        }
+    }
+    return NULL;
+}
+
+int tlog_start(const char *dir, int sync_ms) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) return -1;
+    tlogs.dir = strdup(dir);
+    tlogs.sync_ms = sync_ms > 0 ? sync_ms : 1;
+    if (tlogs.dir == NULL) return -1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sync_main, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+/* --- Lectura --- */
+
+/* Mapea el segmento que empieza en base y ubica pos en el registro from */
+static int cursor_map(TlogCursor *c, uint64_t base, uint64_t from) {
+    char path[TLOG_PATH_MAX];
+    segment_path(path, c->dir, base);
+    c->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (c->fd < 0) return -1;
+    struct stat st;
+    if (fstat(c->fd, &st) < 0 || st.st_size == 0 ||
+        (c->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, c->fd, 0)) == MAP_FAILED) {
+        close(c->fd);
+        c->fd = -1;
+        c->map = NULL;
+        return -1;
+    }
+    c->map_len = (size_t)st.st_size;
+
+    c->pos = 0;
+    uint64_t skipped = skip_records(c->map, c->map_len, &c->pos, from - base);
+    c->stop = c->pos;
+    uint64_t sent = skip_records(c->map, c->map_len, &c->stop, c->end - (base + skipped));
+    c->stop_offset = base + skipped + sent;
+    return 0;
+}
+
+static void cursor_unmap(TlogCursor *c) {
+    if (c->map != NULL) munmap((void *)c->map, c->map_len);
+    if (c->fd >= 0) close(c->fd);
+    c->map = NULL;
+    c->fd = -1;
+}
+
+int tlog_cursor_open(TlogCursor *c, const char *name, size_t len, uint64_t from, uint64_t end) {
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+    c->end = end;
+    c->stop_offset = from;
+    c->dir = topic_dir(name, len);
+    if (c->dir == NULL) return -1;
+    if (from >= end) return 0;
+    int64_t base = find_segment(c->dir, from);
+    if (base < 0 || cursor_map(c, (uint64_t)base, from) < 0) {
+        tlog_cursor_close(c);
+        return -1;
+    }
+    return 0;
+}
+
+int tlog_cursor_next(TlogCursor *c) {
+    if (c->stop_offset >= c->end) return 1;
+    /* Un segmento termina donde no entra el próximo registro, y el
+       siguiente se llama como el offset de ese registro */
+    uint64_t base = c->stop_offset;
+    cursor_unmap(c);
+    if (cursor_map(c, base, base) < 0) return -1;
+    /* Un segmento vacío acá es un log roto: no hay forma de avanzar */
+    return c->stop_offset == base ? -1 : 0;
+}
+
+void tlog_cursor_close(TlogCursor *c) {
+    cursor_unmap(c);
+    free(c->dir);
+    c->dir = NULL;
+}
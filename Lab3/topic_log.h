@@ -0,0 +1,62 @@
+/*
+ * topic_log.h
+ *
+ * Log persistente por tema: lo publicado sobrevive a un reinicio del broker
+ * y un subscriber puede pedir todo desde un offset (REPLAY).
+ * - Cada tema tiene una carpeta con segmentos de TLOG_SEGMENT_SIZE bytes,
+ *   "<offset base>.seg", que se reservan enteros y se mapean con mmap:
+ *   agregar un mensaje es un memcpy en el mapeo, sin syscalls.
+ * - Cada registro es un frame binario BIN_OP_MESSAGE con BIN_FLAG_OFFSET
+ *   (en el campo topic van los 32 bits bajos del offset), así que un rango
+ *   del archivo se puede mandar tal cual a un cliente binario con sendfile.
+ * - Durabilidad por group commit: un hilo aparte sincroniza cada
+ *   --store-sync-ms lo escrito por todos los temas (msync), nunca un fsync por
+ *   mensaje. tlog_durable dice hasta qué offset está en disco.
+ * - Escribe un solo hilo por tema (el dueño). Los lectores abren los
+ *   archivos por su cuenta con un TlogCursor y solo leen hasta un offset que
+ *   el escritor ya les informó, así que no comparten estado con él.
+ */
+#ifndef TOPIC_LOG_H
+#define TOPIC_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TLOG_SEGMENT_SIZE (64u * 1024 * 1024)
+
+typedef struct TopicLog TopicLog;
+
+/* Crea la carpeta base y arranca el hilo de group commit. -1 si falla. */
+int tlog_start(const char *dir, int sync_ms);
+
+/* Abre el log del tema (o lo crea) y se ubica al final. NULL si falla. */
+TopicLog *tlog_open(const char *name, size_t len);
+
+/* Agrega un mensaje. Retorna su offset, o -1 si no se pudo. */
+int64_t tlog_append(TopicLog *log, const char *payload, uint32_t len);
+
+/* Próximo offset (cantidad de mensajes del tema). */
+uint64_t tlog_end(const TopicLog *log);
+/* Los offsets menores a este ya están en disco. */
+uint64_t tlog_durable(const TopicLog *log);
+
+/* Lectura de [from, end) segmento por segmento. Los registros de un
+   segmento van de pos a stop: bytes contiguos en fd y en map. */
+typedef struct {
+    char *dir;
+    int fd;
+    const char *map;
+    size_t map_len;
+    uint64_t end;
+    uint32_t pos;          /* próximo byte a mandar (puede quedar a mitad de un registro) */
+    uint32_t stop;
+    uint64_t stop_offset;  /* offset del primer registro que no entra en [pos, stop) */
+} TlogCursor;
+
+/* -1 si el tema no tiene log o falta un segmento. */
+int tlog_cursor_open(TlogCursor *c, const char *name, size_t len, uint64_t from, uint64_t end);
+/* Con pos == stop, pasa al segmento siguiente. 0 si hay más, 1 si terminó, -1 si falla. */
+int tlog_cursor_next(TlogCursor *c);
+void tlog_cursor_close(TlogCursor *c);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ * topic_registry.c
+ *
+ * Implementación del registro de temas (ver topic_registry.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "topic_registry.h"
+
+#define INITIAL_SLOTS 64
+#define INITIAL_SUBS 4
+
+void registry_init(TopicRegistry *reg) {
+    memset(reg, 0, sizeof(*reg));
+}
+
+void registry_free(TopicRegistry *reg) {
+    for (uint32_t i = 0; i < reg->count; i++) {
+        Topic *t = reg->by_id[i];
+        for (uint32_t j = 0; j < t->num_subs; j++) free(t->refs[j]);
+        free(t->subs);
+        free(t->refs);
+        free(t->name);
+        free(t);
+    }
+    free(reg->slots);
+    free(reg->by_id);
+    memset(reg, 0, sizeof(*reg));
+}
+
+/* FNV-1a de 32 bits: simple y suficiente para nombres de temas cortos */
+uint32_t registry_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static Topic *lookup(const TopicRegistry *reg, const char *name, size_t len, uint32_t hash) {
+    if (reg->cap == 0) return NULL;
+    uint32_t mask = reg->cap - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        const TopicSlot *slot = &reg->slots[i];
+        if (slot->topic == NULL) return NULL;
+        if (slot->hash == hash && slot->topic->len == len &&
+            memcmp(slot->topic->name, name, len) == 0)
+            return slot->topic;
+    }
+}
+
+static void insert_slot(TopicSlot *slots, uint32_t cap, uint32_t hash, Topic *topic) {
+    uint32_t mask = cap - 1;
+    uint32_t i = hash & mask;
+    while (slots[i].topic != NULL) i = (i + 1) & mask;
+    slots[i].hash = hash;
+    slots[i].topic = topic;
+}
+
+/* Duplica la tabla cuando pasa el 70% de ocupación */
+static int grow_slots(TopicRegistry *reg) {
+    uint32_t cap = reg->cap ? reg->cap * 2 : INITIAL_SLOTS;
+    TopicSlot *slots = calloc(cap, sizeof(TopicSlot));
+    if (slots == NULL) return -1;
+    for (uint32_t i = 0; i < reg->cap; i++) {
+        if (reg->slots[i].topic != NULL)
+            insert_slot(slots, cap, reg->slots[i].hash, reg->slots[i].topic);
+    }
+    free(reg->slots);
+    reg->slots = slots;
+    reg->cap = cap;
+    return 0;
+}
+
+Topic *registry_find(const TopicRegistry *reg, const char *name, size_t len) {
+    return lookup(reg, name, len, registry_hash(name, len));
+}
+
+Topic *registry_by_id(const TopicRegistry *reg, uint32_t id) {
+    return id < reg->count ? reg->by_id[id] : NULL;
+}
+
+Topic *registry_intern(TopicRegistry *reg, const char *name, size_t len) {
+    uint32_t hash = registry_hash(name, len);
+    Topic *topic = lookup(reg, name, len, hash);
+    if (topic != NULL) return topic;
+
+    if ((reg->count + 1) * 10 > reg->cap * 7 && grow_slots(reg) < 0) return NULL;
+    if (reg->count == reg->id_cap) {
+        uint32_t id_cap = reg->id_cap ? reg->id_cap * 2 : INITIAL_SLOTS;
+        Topic **by_id = realloc(reg->by_id, id_cap * sizeof(Topic *));
+        if (by_id == NULL) return NULL;
+        reg->by_id = by_id;
+        reg->id_cap = id_cap;
+    }
+
+    topic = calloc(1, sizeof(Topic));
+    if (topic == NULL) return NULL;
+    topic->name = malloc(len + 1);
+    if (topic->name == NULL) {
+        free(topic);
+        return NULL;
+    }
+    memcpy(topic->name, name, len);
+    topic->name[len] = '\0';
+    topic->len = (uint32_t)len;
+    topic->hash = hash;
+    topic->id = reg->count;
+
+    insert_slot(reg->slots, reg->cap, hash, topic);
+    reg->by_id[reg->count++] = topic;
+    return topic;
+}
+
+Subscription *registry_subscribe(TopicRegistry *reg, const char *name, size_t len, void *owner) {
+    Topic *topic = registry_intern(reg, name, len);
+    if (topic == NULL) return NULL;
+
+    if (topic->num_subs == topic->cap_subs) {
+        uint32_t cap = topic->cap_subs ? topic->cap_subs * 2 : INITIAL_SUBS;
+        void **subs = realloc(topic->subs, cap * sizeof(void *));
+        if (subs == NULL) return NULL;
+        topic->subs = subs;
+        Subscription **refs = realloc(topic->refs, cap * sizeof(Subscription *));
+        if (refs == NULL) return NULL;
+        topic->refs = refs;
+        topic->cap_subs = cap;
+    }
+
+    Subscription *sub = malloc(sizeof(Subscription));
+    if (sub == NULL) return NULL;
+    sub->topic = topic;
+    sub->index = topic->num_subs;
+    sub->owner = owner;
+    sub->next = NULL;
+
+    topic->subs[topic->num_subs] = owner;
+    topic->refs[topic->num_subs] = sub;
+    topic->num_subs++;
+    return sub;
+}
+
+void registry_unsubscribe(Subscription *sub) {
+    Topic *topic = sub->topic;
+    uint32_t last = topic->num_subs - 1;
+
+    /* El último ocupa el hueco: el orden no importa para el fan-out */
+    if (sub->index != last) {
+        topic->subs[sub->index] = topic->subs[last];
+        topic->refs[sub->index] = topic->refs[last];
+        topic->refs[sub->index]->index = sub->index;
+    }
+    topic->num_subs = last;
+    free(sub);
+}
@@ -0,0 +1,73 @@
+/*
+ * topic_registry.h
+ *
+ * Registro de temas compartido por los brokers TCP, UDP y QUIC.
+ * - Tabla hash de direccionamiento abierto (sondeo lineal) indexada por el
+ *   nombre del tema, que se guarda una sola vez (string "interned").
+ * - Cada tema tiene un vector creciente de suscriptores: los owners van
+ *   contiguos en memoria para que el fan-out recorra un solo arreglo.
+ * - Desuscribir es O(1): la Subscription recuerda su posición en el vector
+ *   y se hace swap con el último.
+ *
+ * El registro no sabe qué es un suscriptor: cada broker guarda en `owner`
+ * lo que necesite (cliente TCP, dirección UDP, stream QUIC).
+ */
+#ifndef TOPIC_REGISTRY_H
+#define TOPIC_REGISTRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Topic Topic;
+typedef struct Subscription Subscription;
+
+struct Subscription {
+    Topic *topic;
+    uint32_t index;        /* posición actual en topic->subs */
+    void *owner;
+    Subscription *next;    /* lista libre para el dueño (p.ej. subs de un cliente) */
+};
+
+struct Topic {
+    char *name;            /* nombre interned, terminado en '\0' */
+    uint32_t len;
+    uint32_t hash;
+    uint32_t id;           /* identificador estable, ver registry_by_id */
+    uint32_t num_subs;
+    uint32_t cap_subs;
+    void **subs;           /* owners, contiguos para el fan-out */
+    Subscription **refs;   /* refs[i] es la Subscription de subs[i] */
+    void *user;            /* datos propios del broker para este tema */
+};
+
+typedef struct {
+    uint32_t hash;
+    Topic *topic;
+} TopicSlot;
+
+typedef struct {
+    TopicSlot *slots;
+    uint32_t cap;          /* potencia de 2 */
+    uint32_t count;
+    Topic **by_id;
+    uint32_t id_cap;
+} TopicRegistry;
+
+void registry_init(TopicRegistry *reg);
+void registry_free(TopicRegistry *reg);
+
+uint32_t registry_hash(const char *name, size_t len);
+
+/* Busca un tema existente; NULL si no existe. */
+Topic *registry_find(const TopicRegistry *reg, const char *name, size_t len);
+/* Busca o crea el tema. NULL solo si no hay memoria. */
+Topic *registry_intern(TopicRegistry *reg, const char *name, size_t len);
+/* Tema por id (los ids van de 0 a count-1); NULL si no existe. */
+Topic *registry_by_id(const TopicRegistry *reg, uint32_t id);
+
+/* Agrega owner como suscriptor del tema (lo crea si hace falta). NULL si no hay memoria. */
+Subscription *registry_subscribe(TopicRegistry *reg, const char *name, size_t len, void *owner);
+/* Quita la suscripción en O(1) y la libera. */
+void registry_unsubscribe(Subscription *sub);
+
+#endif
@@ -0,0 +1,217 @@
+/*
+ * topic_trie.c
+ *
+ * Implementación del trie de patrones (ver topic_trie.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "topic_registry.h"
+#include "topic_trie.h"
+
+#define INITIAL_CHILDREN 4
+#define INITIAL_OWNERS 2
+
+struct TrieNode {
+    char *level;           /* texto del nivel (sin '/'); vacío en la raíz */
+    uint32_t len;
+    uint32_t hash;
+    TrieNode **children;   /* hijos literales, sondeo lineal por hash */
+    uint32_t child_cap;    /* potencia de 2 */
+    uint32_t child_count;
+    TrieNode *plus;        /* hijo '+' */
+    TrieNode *rest;        /* hijo '#' */
+    void **owners;
+    uint32_t num_owners;
+    uint32_t cap_owners;
+};
+
+void trie_init(TopicTrie *trie) {
+    memset(trie, 0, sizeof(*trie));
+}
+
+static void node_free(TrieNode *n) {
+    if (n == NULL) return;
+    for (uint32_t i = 0; i < n->child_cap; i++) node_free(n->children[i]);
+    node_free(n->plus);
+    node_free(n->rest);
+    free(n->children);
+    free(n->owners);
+    free(n->level);
+    free(n);
+}
+
+void trie_free(TopicTrie *trie) {
+    node_free(trie->root);
+    memset(trie, 0, sizeof(*trie));
+}
+
+/* Largo del nivel que empieza en pos */
+static size_t level_len(const char *s, size_t len, size_t pos) {
+    const char *slash = memchr(s + pos, '/', len - pos);
+    return slash ? (size_t)(slash - (s + pos)) : len - pos;
+}
+
+int topic_is_pattern(const char *name, size_t len) {
+    return memchr(name, '+', len) != NULL || memchr(name, '#', len) != NULL;
+}
+
+int topic_pattern_valid(const char *pattern, size_t len) {
+    for (size_t pos = 0; pos <= len;) {
+        size_t n = level_len(pattern, len, pos);
+        int is_rest = n == 1 && pattern[pos] == '#';
+        if (is_rest && pos + n != len) return 0;
+        if (!(n == 1 && (pattern[pos] == '+' || is_rest)) &&
+            (memchr(pattern + pos, '+', n) != NULL || memchr(pattern + pos, '#', n) != NULL))
+            return 0;
+        pos += n + 1;
+    }
+    return 1;
+}
+
+int topic_matches(const char *pattern, size_t plen, const char *topic, size_t tlen) {
+    size_t p = 0, t = 0;
+    for (;;) {
+        /* p > plen: se terminó el patrón; t > tlen: se terminó el tema */
+        if (p > plen) return t > tlen;
+        size_t pn = level_len(pattern, plen, p);
+        if (pn == 1 && pattern[p] == '#') return 1;
+        if (t > tlen) return 0;
+        size_t tn = level_len(topic, tlen, t);
+        if (!(pn == 1 && pattern[p] == '+') && (pn != tn || memcmp(pattern + p, topic + t, pn) != 0))
+            return 0;
+        p += pn + 1;
+        t += tn + 1;
+    }
+}
+
+static TrieNode *node_new(const char *level, size_t len, uint32_t hash) {
+    TrieNode *n = calloc(1, sizeof(TrieNode));
+    if (n == NULL) return NULL;
+    n->level = malloc(len + 1);
+    if (n->level == NULL) {
+        free(n);
+        return NULL;
+    }
+    memcpy(n->level, level, len);
+    n->level[len] = '\0';
+    n->len = (uint32_t)len;
+    n->hash = hash;
+    return n;
+}
+
+static TrieNode *child_find(const TrieNode *n, const char *level, size_t len, uint32_t hash) {
+    if (n->child_cap == 0) return NULL;
+    uint32_t mask = n->child_cap - 1;
+    for (uint32_t i = hash & mask;; i = (i + 1) & mask) {
+        TrieNode *c = n->children[i];
+        if (c == NULL) return NULL;
+        if (c->hash == hash && c->len == len && memcmp(c->level, level, len) == 0) return c;
+    }
+}
+
+static void child_put(TrieNode **slots, uint32_t cap, TrieNode *c) {
+    uint32_t i = c->hash & (cap - 1);
+    while (slots[i] != NULL) i = (i + 1) & (cap - 1);
+    slots[i] = c;
+}
+
+/* Hijo literal, creado si hace falta; la tabla se duplica pasado el 70% */
+static TrieNode *child_intern(TrieNode *n, const char *level, size_t len) {
+    uint32_t hash = registry_hash(level, len);
+    TrieNode *c = child_find(n, level, len, hash);
+    if (c != NULL) return c;
+
+    if ((n->child_count + 1) * 10 > n->child_cap * 7) {
+        uint32_t cap = n->child_cap ? n->child_cap * 2 : INITIAL_CHILDREN;
+        TrieNode **slots = calloc(cap, sizeof(TrieNode *));
+        if (slots == NULL) return NULL;
+        for (uint32_t i = 0; i < n->child_cap; i++)
+            if (n->children[i] != NULL) child_put(slots, cap, n->children[i]);
+        free(n->children);
+        n->children = slots;
+        n->child_cap = cap;
+    }
+    c = node_new(level, len, hash);
+    if (c == NULL) return NULL;
+    child_put(n->children, n->child_cap, c);
+    n->child_count++;
+    return c;
+}
+
+/* Nodo del patrón; con create = 0 retorna NULL si no existe */
+static TrieNode *walk(TopicTrie *trie, const char *pattern, size_t len, int create) {
+    if (trie->root == NULL) {
+        if (!create) return NULL;
+        trie->root = node_new("", 0, 0);
+        if (trie->root == NULL) return NULL;
+    }
+    TrieNode *n = trie->root;
+    for (size_t pos = 0; pos <= len && n != NULL;) {
+        size_t ln = level_len(pattern, len, pos);
+        TrieNode **special = NULL;
+        if (ln == 1 && pattern[pos] == '+') special = &n->plus;
+        else if (ln == 1 && pattern[pos] == '#') special = &n->rest;
+
+        if (special != NULL) {
+            if (*special == NULL && create) *special = node_new(pattern + pos, 1, 0);
+            n = *special;
+        } else if (create) {
+            n = child_intern(n, pattern + pos, ln);
+        } else {
+            n = child_find(n, pattern + pos, ln, registry_hash(pattern + pos, ln));
+        }
+        pos += ln + 1;
+    }
+    return n;
+}
+
+int trie_insert(TopicTrie *trie, const char *pattern, size_t len, void *owner) {
+    TrieNode *n = walk(trie, pattern, len, 1);
+    if (n == NULL) return -1;
+    if (n->num_owners == n->cap_owners) {
+        uint32_t cap = n->cap_owners ? n->cap_owners * 2 : INITIAL_OWNERS;
+        void **owners = realloc(n->owners, cap * sizeof(void *));
+        if (owners == NULL) return -1;
+        n->owners = owners;
+        n->cap_owners = cap;
+    }
+    n->owners[n->num_owners++] = owner;
+    trie->patterns++;
+    return (int)n->num_owners;
+}
+
+int trie_remove(TopicTrie *trie, const char *pattern, size_t len, void *owner) {
+    TrieNode *n = walk(trie, pattern, len, 0);
+    if (n == NULL) return -1;
+    for (uint32_t i = 0; i < n->num_owners; i++) {
+        if (n->owners[i] == owner) {
+            n->owners[i] = n->owners[--n->num_owners];
+            trie->patterns--;
+            return (int)n->num_owners;
+        }
+    }
+    return -1;
+}
+
+static void report(const TrieNode *n, TrieMatchFn fn, void *arg) {
+    for (uint32_t i = 0; i < n->num_owners; i++) fn(n->owners[i], arg);
+}
+
+/* pos > len: ya no quedan niveles del tema */
+static void match_node(const TrieNode *n, const char *topic, size_t len, size_t pos,
+                       TrieMatchFn fn, void *arg) {
+    if (n->rest != NULL) report(n->rest, fn, arg);
+    if (pos > len) {
+        report(n, fn, arg);
+        return;
+    }
+    size_t ln = level_len(topic, len, pos);
+    const TrieNode *c = child_find(n, topic + pos, ln, registry_hash(topic + pos, ln));
+    if (c != NULL) match_node(c, topic, len, pos + ln + 1, fn, arg);
+    if (n->plus != NULL) match_node(n->plus, topic, len, pos + ln + 1, fn, arg);
+}
+
+void trie_match(const TopicTrie *trie, const char *topic, size_t len, TrieMatchFn fn, void *arg) {
+    if (trie->root == NULL || trie->patterns == 0) return;
+    match_node(trie->root, topic, len, 0, fn, arg);
+}
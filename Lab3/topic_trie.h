@@ -0,0 +1,54 @@
+/*
+ * topic_trie.h
+ *
+ * Suscripciones con comodines sobre temas jerárquicos ("liga/partido/A_vs_B/goles").
+ * - Los niveles se separan con '/'. En un patrón, '+' ocupa un nivel entero
+ *   y calza con exactamente un nivel; '#' va al final y calza con cero o más
+ *   niveles ("liga/#" también recibe "liga").
+ * - Los patrones se guardan en un trie por nivel: cada nodo tiene sus hijos
+ *   literales en una tabla hash, más un hijo '+' y uno '#' aparte. Buscar
+ *   los patrones que calzan con un tema concreto recorre a lo sumo un camino
+ *   literal y los '+' por nivel, así que el costo depende de la profundidad
+ *   del tema y no de cuántos patrones o subscribers haya.
+ * - Igual que en el registro, el trie no sabe qué es un owner. Los nodos no
+ *   se liberan al quedar vacíos (como los temas, que tampoco se borran).
+ * - No es thread-safe: cada broker lo protege igual que su registro.
+ *
+ * Los brokers usan el trie solo cuando aparece un tema o un patrón: el
+ * resultado queda en el vector de subscribers del tema, que hace de caché
+ * de lo que calza y se actualiza de a un subscriber.
+ */
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct TrieNode TrieNode;
+
+typedef struct {
+    TrieNode *root;
+    uint32_t patterns;     /* owners en todo el trie; 0 = no hay nada que buscar */
+} TopicTrie;
+
+void trie_init(TopicTrie *trie);
+void trie_free(TopicTrie *trie);
+
+/* 1 si el nombre tiene '+' o '#': es un patrón (válido o no) y no un tema. */
+int topic_is_pattern(const char *name, size_t len);
+/* 1 si el patrón está bien formado ('+'/'#' solos en su nivel, '#' al final). */
+int topic_pattern_valid(const char *pattern, size_t len);
+/* 1 si el tema concreto calza con el patrón, sin armar un trie. */
+int topic_matches(const char *pattern, size_t plen, const char *topic, size_t tlen);
+
+/* Agrega owner al patrón. Retorna cuántos owners tiene el patrón ahora, o -1 sin memoria. */
+int trie_insert(TopicTrie *trie, const char *pattern, size_t len, void *owner);
+/* Quita una vez owner del patrón. Retorna los que quedan, o -1 si no estaba. */
+int trie_remove(TopicTrie *trie, const char *pattern, size_t len, void *owner);
+
+/* Llama a fn con cada owner de cada patrón que calce con el tema. Un owner
+   suscrito con dos patrones que calzan aparece dos veces. */
+typedef void (*TrieMatchFn)(void *owner, void *arg);
+void trie_match(const TopicTrie *trie, const char *topic, size_t len, TrieMatchFn fn, void *arg);
+
+#endif
@@ -0,0 +1,132 @@
+/*
+ * write_queue.c
+ *
+ * Implementación de la cola de salida por suscriptor (ver write_queue.h).
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "write_queue.h"
+
+#define INITIAL_CAP 16
+#define FLUSH_IOV 256      /* con la ventana de coalescencia se juntan cientos de mensajes chicos */
+
+void wq_init(WriteQueue *q) {
+    memset(q, 0, sizeof(*q));
+}
+
+void wq_free(WriteQueue *q) {
+    for (uint32_t i = 0; i < q->count; i++)
+        msg_release(q->items[(q->head + i) & (q->cap - 1)].msg);
+    free(q->items);
+    memset(q, 0, sizeof(*q));
+}
+
+static int grow(WriteQueue *q) {
+    uint32_t cap = q->cap ? q->cap * 2 : INITIAL_CAP;
+    QueuedMsg *items = malloc(cap * sizeof(QueuedMsg));
+    if (items == NULL) return -1;
+    for (uint32_t i = 0; i < q->count; i++)
+        items[i] = q->items[(q->head + i) & (q->cap - 1)];
+    free(q->items);
+    q->items = items;
+    q->head = 0;
+    q->cap = cap;
+    return 0;
+}
+
+int wq_push(WriteQueue *q, MsgBuffer *msg, uint32_t off, uint32_t len, size_t skip) {
+    if (skip >= len) return 0;
+    if (q->count == q->cap && grow(q) < 0) return -1;
+
+    QueuedMsg *m = &q->items[(q->head + q->count) & (q->cap - 1)];
+    m->msg = msg;
+    m->off = off + (uint32_t)skip;
+    m->len = len - (uint32_t)skip;
+    msg_ref(msg);
+    q->count++;
+    q->bytes += m->len;
+    return 0;
+}
+
+static void pop_front(WriteQueue *q) {
+    QueuedMsg *m = &q->items[q->head];
+    q->bytes -= m->len - q->offset;
+    msg_release(m->msg);
+    q->head = (q->head + 1) & (q->cap - 1);
+    q->count--;
+    q->offset = 0;
+}
+
+size_t wq_drop_oldest(WriteQueue *q) {
+    /* La cabeza escrita a medias se queda: se descarta el siguiente */
+    uint32_t victim = q->offset > 0 ? 1 : 0;
+    if (victim >= q->count) return 0;
+    if (victim == 0) {
+        size_t len = q->items[q->head].len;
+        pop_front(q);
+        return len;
+    }
+
+    /* La cabeza escrita a medias ocupa el lugar de la víctima: O(1) */
+    uint32_t mask = q->cap - 1;
+    uint32_t pos = (q->head + 1) & mask;
+    size_t len = q->items[pos].len;
+    msg_release(q->items[pos].msg);
+    q->items[pos] = q->items[q->head];
+    q->head = pos;
+    q->count--;
+    q->bytes -= len;
+    return len;
+}
+
+int wq_flush(WriteQueue *q, int fd) {
+    struct iovec iov[FLUSH_IOV];
+
+    while (q->count > 0) {
+        int n = 0;
+        for (uint32_t i = 0; i < q->count && n < FLUSH_IOV; i++, n++) {
+            QueuedMsg *m = &q->items[(q->head + i) & (q->cap - 1)];
+            uint32_t skip = i == 0 ? q->offset : 0;
+            iov[n].iov_base = m->msg->data + m->off + skip;
+            iov[n].iov_len = m->len - skip;
+        }
+
+        ssize_t written = writev(fd, iov, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+
+        size_t left = (size_t)written;
+        while (left > 0) {
+            QueuedMsg *m = &q->items[q->head];
+            size_t rest = m->len - q->offset;
+            if (left < rest) {
+                q->offset += (uint32_t)left;
+                q->bytes -= left;
+                break;
+            }
+            left -= rest;
+            pop_front(q);
+        }
+    }
+    return 0;
+}
+
+int wq_take(WriteQueue *q, struct iovec *iov, MsgBuffer **msgs, int max) {
+    int n = 0;
+    while (q->count > 0 && n < max) {
+        QueuedMsg *m = &q->items[q->head];
+        iov[n].iov_base = m->msg->data + m->off + q->offset;
+        iov[n].iov_len = m->len - q->offset;
+        msgs[n++] = m->msg;
+        q->bytes -= m->len - q->offset;
+        q->head = (q->head + 1) & (q->cap - 1);
+        q->count--;
+        q->offset = 0;
+    }
+    return n;
+}
@@ -0,0 +1,59 @@
+/*
+ * write_queue.h
+ *
+ * Cola de salida por suscriptor para el broker TCP.
+ * - Si el socket del suscriptor está lleno, los mensajes esperan aquí en vez
+ *   de bloquear el broker; se vacía cuando epoll avisa EPOLLOUT.
+ * - Es un arreglo circular que crece solo; el límite lo pone el broker con el
+ *   high-water mark (bytes pendientes) y la política de desborde.
+ * - El mensaje de la cabeza puede estar escrito a medias (`offset`): ese
+ *   nunca se descarta para no cortar un frame en el medio.
+ * - Las entradas no copian el payload: apuntan a una vista de un MsgBuffer
+ *   compartido por todas las colas del fan-out y le suman una referencia.
+ */
+#ifndef WRITE_QUEUE_H
+#define WRITE_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "msg_buffer.h"
+
+typedef struct {
+    MsgBuffer *msg;
+    uint32_t off;          /* inicio de la vista dentro de msg->data */
+    uint32_t len;
+} QueuedMsg;
+
+typedef struct {
+    QueuedMsg *items;
+    uint32_t head;
+    uint32_t count;
+    uint32_t cap;          /* potencia de 2 */
+    uint32_t offset;       /* bytes ya escritos del mensaje de la cabeza */
+    size_t bytes;          /* bytes pendientes de escribir */
+} WriteQueue;
+
+void wq_init(WriteQueue *q);
+void wq_free(WriteQueue *q);
+
+static inline int wq_empty(const WriteQueue *q) { return q->count == 0; }
+
+/* Encola la vista msg->data[off, off+len) tomando una referencia; `skip`
+   bytes del principio ya se escribieron. Retorna -1 si no hay memoria. */
+int wq_push(WriteQueue *q, MsgBuffer *msg, uint32_t off, uint32_t len, size_t skip);
+
+/* Descarta el mensaje más viejo que no esté escrito a medias.
+   Retorna los bytes liberados o 0 si no había nada descartable. */
+size_t wq_drop_oldest(WriteQueue *q);
+
+/* Escribe todo lo posible con writev. Retorna 0 si la cola quedó vacía,
+   1 si el socket se llenó (esperar EPOLLOUT) o -1 si hubo error. */
+int wq_flush(WriteQueue *q, int fd);
+
+/* Para un envío asíncrono (io_uring): saca hasta max mensajes de la cabeza,
+   llena iov y le pasa la referencia de cada uno a msgs. Lo que ya salió de
+   la cola no se descarta por desborde. Retorna cuántos sacó. */
+int wq_take(WriteQueue *q, struct iovec *iov, MsgBuffer **msgs, int max);
+
+#endif